@@ -0,0 +1,341 @@
+#include "defs.h"
+
+#include "compiler.h"
+#include "scanner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define dup _dup
+#define dup2 _dup2
+#define close _close
+#define NULL_DEVICE "NUL"
+#else
+#include <unistd.h>
+#define NULL_DEVICE "/dev/null"
+#endif
+
+// Runs every `.kau` script in a directory a few times, in process, and reports how long
+// they took. Results can be written out and later passed back as a baseline to compare against.
+
+#define DEFAULT_WARMUP 2
+#define DEFAULT_ITERATIONS 10
+
+namespace {
+    struct BenchResult {
+        std::string name;
+        u64 iterations;
+        double median_ms;
+        double p95_ms;
+        u64 peak_arena_bytes;
+        double scan_ms;
+        double parse_ms;
+        double resolve_ms;
+        double execute_ms;
+        // VM instructions one run dispatched, zero for the tree walker.
+        u64 instructions;
+    };
+
+    // A benchmark's median from a previous results file.
+    struct BaselineResult {
+        std::string name;
+        std::string mode;
+        double median_ms;
+    };
+
+    struct Sample {
+        double total_ms;
+        u64 peak_arena_bytes;
+        Stats stats;
+    };
+
+    double ns_to_ms(u64 ns) {
+        return (double) ns / 1000000.0;
+    }
+
+    u64 now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count();
+    }
+
+    // Scripts print their results, which would drown out the report.
+    struct SilencedStdout {
+        SilencedStdout() {
+            fflush(stdout);
+            saved = dup(1);
+            const int null_fd = open(NULL_DEVICE, O_WRONLY);
+            dup2(null_fd, 1);
+            close(null_fd);
+        }
+        ~SilencedStdout() {
+            fflush(stdout);
+            dup2(saved, 1);
+            close(saved);
+        }
+
+        int saved;
+    };
+
+    bool run_once(const std::string& path, Backend backend, bool jit, bool trace_jit, Sample& sample) {
+        KauCompiler kau;
+        kau.backend = backend;
+        kau.vm.jit_enabled = jit;
+        kau.vm.trace_enabled = trace_jit;
+
+        const u64 start = now_ns();
+        int result;
+        {
+            SilencedStdout silenced;
+            result = kau.run_file(path.c_str());
+        }
+        const u64 end = now_ns();
+
+        sample.total_ms = ns_to_ms(end - start);
+        sample.peak_arena_bytes = kau.global_arena->peak_offset;
+        sample.stats = kau.stats;
+        return result == 0;
+    }
+
+    // Nearest-rank percentile over already sorted values.
+    double percentile(const std::vector<double>& sorted, double p) {
+        u64 rank = (u64) (p / 100.0 * sorted.size() + 0.5);
+        rank = std::clamp<u64>(rank, 1, sorted.size());
+        return sorted[rank - 1];
+    }
+
+    double median_of(std::vector<double> values) {
+        std::sort(values.begin(), values.end());
+        return percentile(values, 50.0);
+    }
+
+    bool run_benchmark(const std::filesystem::path& path, Backend backend, bool jit, bool trace_jit, int warmup, int iterations, BenchResult& result) {
+        const std::string path_str = path.string();
+
+        Sample sample = {};
+        for (int i = 0; i < warmup; ++i) {
+            if (!run_once(path_str, backend, jit, trace_jit, sample)) {
+                fprintf(stderr, "%s failed, skipping it.\n", path_str.c_str());
+                return false;
+            }
+        }
+
+        std::vector<double> totals, scans, parses, resolves, executes;
+        u64 peak_arena_bytes = 0;
+        u64 instructions = 0;
+        for (int i = 0; i < iterations; ++i) {
+            if (!run_once(path_str, backend, jit, trace_jit, sample)) {
+                fprintf(stderr, "%s failed, skipping it.\n", path_str.c_str());
+                return false;
+            }
+            totals.push_back(sample.total_ms);
+            scans.push_back(ns_to_ms(sample.stats.phase(Phase::SCAN).ns));
+            parses.push_back(ns_to_ms(sample.stats.phase(Phase::PARSE).ns));
+            resolves.push_back(ns_to_ms(sample.stats.phase(Phase::RESOLVE).ns));
+            executes.push_back(ns_to_ms(sample.stats.phase(Phase::EXECUTE).ns));
+            peak_arena_bytes = std::max(peak_arena_bytes, sample.peak_arena_bytes);
+            instructions = sample.stats.instructions_executed;
+        }
+
+        std::sort(totals.begin(), totals.end());
+        result = BenchResult {
+            .name = path.stem().string(),
+            .iterations = (u64) iterations,
+            .median_ms = percentile(totals, 50.0),
+            .p95_ms = percentile(totals, 95.0),
+            .peak_arena_bytes = peak_arena_bytes,
+            .scan_ms = median_of(scans),
+            .parse_ms = median_of(parses),
+            .resolve_ms = median_of(resolves),
+            .execute_ms = median_of(executes),
+            .instructions = instructions,
+        };
+        return true;
+    }
+
+    const char* backend_name(Backend backend) {
+        switch (backend) {
+            case Backend::BYTECODE_VM: {
+                return "vm";
+            }
+            case Backend::REGISTER_VM: {
+                return "vm-registers";
+            }
+            case Backend::CLOSURES: {
+                return "closures";
+            }
+            default: {
+                return "tree";
+            }
+        }
+    }
+
+    // The backend and the JIT flags it ran with, like `vm+jit`. Results are only comparable within a mode.
+    std::string mode_name(Backend backend, bool jit, bool trace_jit) {
+        std::string mode = backend_name(backend);
+        if (jit) {
+            mode += "+jit";
+        }
+        if (trace_jit) {
+            mode += "+trace-jit";
+        }
+        return mode;
+    }
+
+    bool write_results(const char* path, const std::string& mode, const std::vector<BenchResult>& results) {
+        FILE* file = fopen(path, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Failed to open results file at: %s\n", path);
+            return false;
+        }
+
+        fprintf(file, "benchmark,backend,iterations,median_ms,p95_ms,peak_arena_bytes,scan_ms,parse_ms,resolve_ms,execute_ms,instructions\n");
+        for (const BenchResult& r : results) {
+            fprintf(file, "%s,%s,%llu,%.4f,%.4f,%llu,%.4f,%.4f,%.4f,%.4f,%llu\n",
+                r.name.c_str(), mode.c_str(), (unsigned long long) r.iterations,
+                r.median_ms, r.p95_ms, (unsigned long long) r.peak_arena_bytes,
+                r.scan_ms, r.parse_ms, r.resolve_ms, r.execute_ms, (unsigned long long) r.instructions
+            );
+        }
+
+        fclose(file);
+        return true;
+    }
+
+    // Reads the benchmark name, mode and median back out of a results file.
+    std::vector<BaselineResult> read_baseline(const char* path) {
+        std::vector<BaselineResult> baseline;
+
+        FILE* file = fopen(path, "r");
+        if (file == NULL) {
+            fprintf(stderr, "Failed to open baseline file at: %s\n", path);
+            return baseline;
+        }
+
+        char line[1024];
+        bool header = true;
+        while (fgets(line, sizeof(line), file) != NULL) {
+            if (header) {
+                header = false;
+                continue;
+            }
+
+            char name[256];
+            char mode[64];
+            unsigned long long iterations;
+            double median_ms;
+            if (sscanf(line, "%255[^,],%63[^,],%llu,%lf", name, mode, &iterations, &median_ms) == 4) {
+                baseline.push_back({name, mode, median_ms});
+            }
+        }
+
+        fclose(file);
+        return baseline;
+    }
+
+    void print_results(const std::string& mode, const std::vector<BenchResult>& results, const std::vector<BaselineResult>& baseline) {
+        fprintf(stdout, "%-12s %10s %10s %12s %9s %9s %9s %10s %12s %10s\n",
+            "benchmark", "median ms", "p95 ms", "peak arena", "scan ms", "parse ms", "resolve ms", "exec ms", "vm instrs", "vs base");
+        for (const BenchResult& r : results) {
+            char change[32] = "-";
+            for (const BaselineResult& base : baseline) {
+                if (base.name == r.name && base.mode == mode && base.median_ms > 0.0) {
+                    snprintf(change, sizeof(change), "%+.1f%%", 100.0 * (r.median_ms - base.median_ms) / base.median_ms);
+                }
+            }
+
+            fprintf(stdout, "%-12s %10.3f %10.3f %10llu KB %9.3f %9.3f %10.3f %10.3f %12llu %10s\n",
+                r.name.c_str(), r.median_ms, r.p95_ms, (unsigned long long) (r.peak_arena_bytes / 1024),
+                r.scan_ms, r.parse_ms, r.resolve_ms, r.execute_ms, (unsigned long long) r.instructions, change
+            );
+        }
+    }
+
+    int usage() {
+        fprintf(stderr, "Usage: kau_bench_runner [--vm | --vm-registers | --closures] [--jit] [--trace-jit] [--warmup <n>] [--iterations <n>] [--output <results.csv>] [--baseline <results.csv>] <benchmark-dir-or-script>...\n");
+        return -1;
+    }
+};
+
+int main(int argc, char** argv) {
+    Backend backend = Backend::TREE_WALKER;
+    bool jit = false;
+    bool trace_jit = false;
+    int warmup = DEFAULT_WARMUP;
+    int iterations = DEFAULT_ITERATIONS;
+    const char* output_path = nullptr;
+    const char* baseline_path = nullptr;
+    std::vector<std::filesystem::path> scripts;
+
+    for (int i = 1; i < argc; ++i) {
+        const bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--vm") == 0) {
+            backend = Backend::BYTECODE_VM;
+        } else if (strcmp(argv[i], "--vm-registers") == 0) {
+            backend = Backend::REGISTER_VM;
+        } else if (strcmp(argv[i], "--closures") == 0) {
+            backend = Backend::CLOSURES;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            jit = true;
+        } else if (strcmp(argv[i], "--trace-jit") == 0) {
+            trace_jit = true;
+        } else if (strcmp(argv[i], "--warmup") == 0 && has_value) {
+            warmup = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--iterations") == 0 && has_value) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && has_value) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && has_value) {
+            baseline_path = argv[++i];
+        } else if (argv[i][0] == '-') {
+            return usage();
+        } else if (std::filesystem::is_directory(argv[i])) {
+            for (const auto& entry : std::filesystem::directory_iterator(argv[i])) {
+                if (entry.path().extension() == ".kau") {
+                    scripts.push_back(entry.path());
+                }
+            }
+        } else {
+            scripts.push_back(argv[i]);
+        }
+    }
+    if (scripts.empty() || iterations <= 0 || warmup < 0 || ((jit || trace_jit) && (backend == Backend::TREE_WALKER || backend == Backend::CLOSURES))) {
+        return usage();
+    }
+    std::sort(scripts.begin(), scripts.end());
+
+    // NOTE: The keywords table is global and outlives every compiler the runs create.
+    init_keywords_map(alloc_arena());
+
+    std::vector<BenchResult> results;
+    for (const std::filesystem::path& script : scripts) {
+        BenchResult result = {};
+        if (run_benchmark(script, backend, jit, trace_jit, warmup, iterations, result)) {
+            results.push_back(result);
+        }
+    }
+
+    const std::string mode = mode_name(backend, jit, trace_jit);
+    std::vector<BaselineResult> baseline;
+    if (baseline_path != nullptr) {
+        baseline = read_baseline(baseline_path);
+    }
+
+    fprintf(stdout, "%s backend%s%s, %d warmup runs, %d timed runs\n", backend_name(backend), jit ? " with the JIT" : "",
+        trace_jit ? " with traces" : "", warmup, iterations);
+    print_results(mode, results, baseline);
+
+    if (output_path != nullptr && !write_results(output_path, mode, results)) {
+        return -1;
+    }
+    return results.size() == scripts.size() ? 0 : -1;
+}
@@ -0,0 +1,1464 @@
+#include "bytecode.h"
+
+#include "compiler.h"
+#include "resolver.h"
+#include "vm.h"
+
+#define MAX_LOCALS 256
+#define MAX_UPVALUES 256
+
+struct Local {
+    String name;
+    // -1 while the variable is declared but its initializer hasn't been compiled yet.
+    int depth;
+    bool is_captured;
+};
+
+struct Upvalue {
+    u8 index;
+    bool is_local;
+};
+
+struct FunctionScope {
+    FunctionScope* enclosing;
+    FunctionObject* function;
+    FunctionType ty;
+
+    Local locals[MAX_LOCALS];
+    int local_count;
+    Upvalue upvalues[MAX_UPVALUES];
+    int scope_depth;
+    // Values in the call's stack window at this point in the code, locals included. The next
+    // temporary goes in the register right above them.
+    int stack_depth;
+};
+
+struct ClassScope {
+    ClassScope* enclosing;
+    bool has_superclass;
+};
+
+struct LoopScope {
+    LoopScope* enclosing;
+    int start;
+    int scope_depth;
+    Array<int> breaks;
+};
+
+void Chunk::init(Arena* arena) {
+    code.init(arena);
+    lines.init(arena);
+    constants.init(arena);
+    recoveries.init(arena);
+}
+
+void Chunk::write(u8 byte, int line) {
+    code.push(byte);
+    lines.push(line);
+}
+
+u16 Chunk::add_constant(Value value) {
+    constants.push(value);
+    return (u16) (constants.size() - 1);
+}
+
+FunctionObject* new_function(Arena* arena, String name) {
+    FunctionObject* function = (FunctionObject*) arena->push_struct<FunctionObject>();
+    function->ty = Object::Type::FUNCTION;
+    function->name = name;
+    function->chunk.init(arena);
+    return function;
+}
+
+u64 instruction_size(const Chunk& chunk, u64 offset) {
+    switch ((OpCode) chunk.code[offset]) {
+        case OpCode::NIL:
+        case OpCode::TRUE:
+        case OpCode::FALSE:
+        case OpCode::POP:
+        case OpCode::ECHO:
+        case OpCode::CLOSE_UPVALUE:
+        case OpCode::EQUAL:
+        case OpCode::NOT_EQUAL:
+        case OpCode::GREATER:
+        case OpCode::GREATER_EQUAL:
+        case OpCode::LESSER:
+        case OpCode::LESSER_EQUAL:
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+        case OpCode::NOT:
+        case OpCode::NEGATE:
+        case OpCode::RETURN:
+        case OpCode::INHERIT: {
+            return 1;
+        }
+        case OpCode::GET_LOCAL:
+        case OpCode::SET_LOCAL:
+        case OpCode::GET_UPVALUE:
+        case OpCode::SET_UPVALUE:
+        case OpCode::CALL: {
+            return 2;
+        }
+        case OpCode::CONSTANT:
+        case OpCode::DEFINE_GLOBAL:
+        case OpCode::GET_GLOBAL:
+        case OpCode::SET_GLOBAL:
+        case OpCode::GET_PROPERTY:
+        case OpCode::SET_PROPERTY:
+        case OpCode::GET_STATIC:
+        case OpCode::GET_SUPER:
+        case OpCode::JUMP:
+        case OpCode::JUMP_IF_FALSE:
+        case OpCode::LOOP:
+        case OpCode::CLASS:
+        case OpCode::METHOD:
+        case OpCode::STATIC_METHOD:
+        case OpCode::FIELD: {
+            return 3;
+        }
+        case OpCode::CLOSURE: {
+            const u16 constant = (u16) ((chunk.code[offset + 1] << 8) | chunk.code[offset + 2]);
+            const FunctionObject* function = (FunctionObject*) chunk.constants[constant].as_object();
+            return 3 + 2 * function->upvalue_count;
+        }
+        case OpCode::EQUAL_RR:
+        case OpCode::NOT_EQUAL_RR:
+        case OpCode::GREATER_RR:
+        case OpCode::GREATER_EQUAL_RR:
+        case OpCode::LESSER_RR:
+        case OpCode::LESSER_EQUAL_RR:
+        case OpCode::ADD_RR:
+        case OpCode::SUBTRACT_RR:
+        case OpCode::MULTIPLY_RR:
+        case OpCode::DIVIDE_RR: {
+            return 5;
+        }
+        case OpCode::EQUAL_RK:
+        case OpCode::NOT_EQUAL_RK:
+        case OpCode::GREATER_RK:
+        case OpCode::GREATER_EQUAL_RK:
+        case OpCode::LESSER_RK:
+        case OpCode::LESSER_EQUAL_RK:
+        case OpCode::ADD_RK:
+        case OpCode::SUBTRACT_RK:
+        case OpCode::MULTIPLY_RK:
+        case OpCode::DIVIDE_RK: {
+            return 6;
+        }
+        case OpCode::RECORD: {
+            break;
+        }
+    }
+
+    assert(false);
+    return 1;
+}
+
+bool is_register_op(OpCode op) {
+    return op >= OpCode::EQUAL_RR && op <= OpCode::DIVIDE_RK;
+}
+
+u64 instruction_words(const Chunk& chunk, u64 offset) {
+    const OpCode op = (OpCode) chunk.code[offset];
+    const u64 size = instruction_size(chunk, offset);
+    if (op == OpCode::CLOSURE) {
+        return size - 1;
+    }
+    if (is_register_op(op)) {
+        return 5;
+    }
+    return size > 1 ? 2 : 1;
+}
+
+namespace {
+    // Register form of stack operator `op`. The operators come in the same order in all three groups.
+    OpCode register_op(OpCode op, bool constant_right) {
+        const u64 index = (u64) op - (u64) OpCode::EQUAL;
+        return (OpCode) ((u64) (constant_right ? OpCode::EQUAL_RK : OpCode::EQUAL_RR) + index);
+    }
+
+    // How many values an instruction leaves on the stack, minus how many it takes off. Calls
+    // and register instructions depend on their operands, their emitters account for them.
+    int stack_effect(OpCode op) {
+        switch (op) {
+            case OpCode::CONSTANT:
+            case OpCode::NIL:
+            case OpCode::TRUE:
+            case OpCode::FALSE:
+            case OpCode::GET_LOCAL:
+            case OpCode::GET_UPVALUE:
+            case OpCode::GET_GLOBAL:
+            case OpCode::CLOSURE:
+            case OpCode::CLASS: {
+                return 1;
+            }
+            case OpCode::POP:
+            case OpCode::ECHO:
+            case OpCode::CLOSE_UPVALUE:
+            case OpCode::DEFINE_GLOBAL:
+            case OpCode::SET_PROPERTY:
+            case OpCode::GET_SUPER:
+            case OpCode::EQUAL:
+            case OpCode::NOT_EQUAL:
+            case OpCode::GREATER:
+            case OpCode::GREATER_EQUAL:
+            case OpCode::LESSER:
+            case OpCode::LESSER_EQUAL:
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE:
+            case OpCode::RETURN:
+            case OpCode::INHERIT:
+            case OpCode::METHOD:
+            case OpCode::STATIC_METHOD:
+            case OpCode::FIELD: {
+                return -1;
+            }
+            default: {
+                return 0;
+            }
+        }
+    }
+
+    // Literals a register instruction can take straight from the constant table.
+    bool is_constant_operand(const Expr* expr) {
+        if (expr->ty != Expr::Type::LITERAL) {
+            return false;
+        }
+        switch (expr->expr.literal->val->m_type) {
+            case TokenType::NUMBER_INT:
+            case TokenType::NUMBER_LONG:
+            case TokenType::NUMBER_FLOAT:
+            case TokenType::NUMBER_DOUBLE:
+            case TokenType::STRING: {
+                return true;
+            }
+            default: {
+                return false;
+            }
+        }
+    }
+
+    // Whether evaluating `expr` could run code that assigns a variable, conservatively.
+    bool has_side_effects(const Expr* expr) {
+        switch (expr->ty) {
+            case Expr::Type::LITERAL:
+            case Expr::Type::THIS:
+            case Expr::Type::SUPER: {
+                return false;
+            }
+            case Expr::Type::UNARY: {
+                return has_side_effects(expr->expr.unary->right);
+            }
+            case Expr::Type::BINARY:
+            case Expr::Type::INT_BINARY:
+            case Expr::Type::DOUBLE_BINARY: {
+                return has_side_effects(expr->expr.binary->left) || has_side_effects(expr->expr.binary->right);
+            }
+            case Expr::Type::GROUPING: {
+                return has_side_effects(expr->expr.grouping->expr);
+            }
+            case Expr::Type::AND:
+            case Expr::Type::OR: {
+                return has_side_effects(expr->expr.logical_binary->left) || has_side_effects(expr->expr.logical_binary->right);
+            }
+            case Expr::Type::GET: {
+                return has_side_effects(expr->expr.get->class_expr);
+            }
+            default: {
+                return true;
+            }
+        }
+    }
+
+    bool binary_opcode(TokenType type, OpCode* op) {
+        switch (type)
+        {
+            case TokenType::PLUS: {
+                *op = OpCode::ADD;
+                return true;
+            }
+            case TokenType::MINUS: {
+                *op = OpCode::SUBTRACT;
+                return true;
+            }
+            case TokenType::STAR: {
+                *op = OpCode::MULTIPLY;
+                return true;
+            }
+            case TokenType::SLASH: {
+                *op = OpCode::DIVIDE;
+                return true;
+            }
+            case TokenType::GREATER: {
+                *op = OpCode::GREATER;
+                return true;
+            }
+            case TokenType::GREATER_EQUAL: {
+                *op = OpCode::GREATER_EQUAL;
+                return true;
+            }
+            case TokenType::LESSER: {
+                *op = OpCode::LESSER;
+                return true;
+            }
+            case TokenType::LESSER_EQUAL: {
+                *op = OpCode::LESSER_EQUAL;
+                return true;
+            }
+            case TokenType::BANG_EQUAL: {
+                *op = OpCode::NOT_EQUAL;
+                return true;
+            }
+            case TokenType::EQUAL_EQUAL: {
+                *op = OpCode::EQUAL;
+                return true;
+            }
+            default: {
+                return false;
+            }
+        }
+    }
+};
+
+void thread_function(Arena* arena, FunctionObject* function, const void* const* handlers) {
+    const Chunk& chunk = function->chunk;
+
+    u64 word_count = 0;
+    for (u64 offset = 0; offset < chunk.code.size(); offset += instruction_size(chunk, offset)) {
+        word_count += instruction_words(chunk, offset);
+    }
+
+    ThreadedCode& threaded = function->threaded;
+    threaded.code.init(arena, word_count);
+    threaded.lines.init(arena, word_count);
+    threaded.recoveries.init(arena, chunk.recoveries.size());
+
+    // NOTE: Jumps are relative to the end of their instruction in the chunk. They hold their
+    // target's byte offset until every instruction has its words, then get patched.
+    const u64 scratch_mark = arena->get_pos();
+    u64* word_at = (u64*) arena->push_array_no_zero<u64>(chunk.code.size() + 1);
+
+    u64 word = 0;
+    auto push_word = [&](ThreadedWord value, int line) {
+        threaded.code[word] = value;
+        threaded.lines[word] = line;
+        word += 1;
+    };
+    for (u64 offset = 0; offset < chunk.code.size(); ) {
+        const OpCode op = (OpCode) chunk.code[offset];
+        const u64 size = instruction_size(chunk, offset);
+        const int line = chunk.lines[offset];
+        word_at[offset] = word;
+
+        ThreadedWord handler = {};
+        if (handlers != nullptr) {
+            handler.handler = handlers[(u64) op];
+        } else {
+            handler.op = op;
+        }
+        push_word(handler, line);
+
+        const u16 short_operand = size >= 3 ? (u16) ((chunk.code[offset + 1] << 8) | chunk.code[offset + 2]) : 0;
+        if (is_register_op(op)) {
+            push_word(ThreadedWord { .operand = chunk.code[offset + 1] }, line);
+            push_word(ThreadedWord { .operand = chunk.code[offset + 2] }, line);
+            if (size == 6) {
+                const u16 constant = (u16) ((chunk.code[offset + 3] << 8) | chunk.code[offset + 4]);
+                push_word(ThreadedWord { .constant = &chunk.constants[constant] }, line);
+            } else {
+                push_word(ThreadedWord { .operand = chunk.code[offset + 3] }, line);
+            }
+            push_word(ThreadedWord { .operand = chunk.code[offset + size - 1] }, line);
+            offset += size;
+            continue;
+        }
+        switch (op) {
+            case OpCode::GET_LOCAL:
+            case OpCode::SET_LOCAL:
+            case OpCode::GET_UPVALUE:
+            case OpCode::SET_UPVALUE:
+            case OpCode::CALL: {
+                push_word(ThreadedWord { .operand = chunk.code[offset + 1] }, line);
+                break;
+            }
+            case OpCode::DEFINE_GLOBAL:
+            case OpCode::GET_GLOBAL:
+            case OpCode::SET_GLOBAL: {
+                push_word(ThreadedWord { .operand = short_operand }, line);
+                break;
+            }
+            case OpCode::CONSTANT:
+            case OpCode::GET_PROPERTY:
+            case OpCode::SET_PROPERTY:
+            case OpCode::GET_STATIC:
+            case OpCode::GET_SUPER:
+            case OpCode::CLASS:
+            case OpCode::METHOD:
+            case OpCode::STATIC_METHOD:
+            case OpCode::FIELD: {
+                push_word(ThreadedWord { .constant = &chunk.constants[short_operand] }, line);
+                break;
+            }
+            case OpCode::JUMP:
+            case OpCode::JUMP_IF_FALSE: {
+                push_word(ThreadedWord { .operand = offset + size + short_operand }, line);
+                break;
+            }
+            case OpCode::LOOP: {
+                push_word(ThreadedWord { .operand = offset + size - short_operand }, line);
+                break;
+            }
+            case OpCode::CLOSURE: {
+                push_word(ThreadedWord { .constant = &chunk.constants[short_operand] }, line);
+                for (u64 i = 3; i < size; ++i) {
+                    push_word(ThreadedWord { .operand = chunk.code[offset + i] }, line);
+                }
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+        offset += size;
+    }
+    assert(word == word_count);
+    word_at[chunk.code.size()] = word_count;
+
+    for (u64 offset = 0; offset < chunk.code.size(); offset += instruction_size(chunk, offset)) {
+        const OpCode op = (OpCode) chunk.code[offset];
+        if (op == OpCode::JUMP || op == OpCode::JUMP_IF_FALSE || op == OpCode::LOOP) {
+            ThreadedWord& target = threaded.code[word_at[offset] + 1];
+            target.target = threaded.code.m_head + word_at[target.operand];
+        }
+    }
+
+    for (u64 i = 0; i < chunk.recoveries.size(); ++i) {
+        const Recovery& recovery = chunk.recoveries[i];
+        threaded.recoveries[i] = Recovery {
+            .start = (u32) word_at[recovery.start],
+            .end = (u32) word_at[recovery.end],
+            .resume = (u32) word_at[recovery.resume],
+            .depth = recovery.depth,
+            .push_nil = recovery.push_nil,
+        };
+    }
+
+    arena->pop_to(scratch_mark);
+}
+
+NativeObject* new_native(Arena* arena, String name, int arity, NativeFn function) {
+    NativeObject* native = (NativeObject*) arena->push_struct<NativeObject>();
+    native->ty = Object::Type::NATIVE;
+    native->name = name;
+    native->arity = arity;
+    native->function = function;
+    return native;
+}
+
+ClosureObject* new_closure(Heap* heap, FunctionObject* function) {
+    // NOTE: The upvalues go in the same block, right after the closure.
+    const u64 upvalues_size = sizeof(UpvalueObject*) * function->upvalue_count;
+    ClosureObject* closure = (ClosureObject*) heap->allocate(sizeof(ClosureObject) + upvalues_size, GcKind::OBJECT);
+    closure->ty = Object::Type::CLOSURE;
+    closure->function = function;
+    closure->upvalue_count = function->upvalue_count;
+    closure->upvalues = (UpvalueObject**) (closure + 1);
+    return closure;
+}
+
+UpvalueObject* new_upvalue(Heap* heap, Value* slot) {
+    UpvalueObject* upvalue = (UpvalueObject*) heap->allocate(sizeof(UpvalueObject), GcKind::OBJECT);
+    upvalue->ty = Object::Type::UPVALUE;
+    upvalue->location = slot;
+    upvalue->closed = Value{};
+    upvalue->next = nullptr;
+    return upvalue;
+}
+
+ClassObject* new_class(Heap* heap, Arena* arena, String name) {
+    ClassObject* klass = (ClassObject*) heap->allocate(sizeof(ClassObject), GcKind::OBJECT);
+    klass->ty = Object::Type::CLASS;
+    klass->name = name;
+    klass->methods.init(arena);
+    klass->statics.init(arena);
+    klass->field_slots.init(arena);
+    klass->field_defaults.init(arena);
+    return klass;
+}
+
+InstanceObject* new_instance(Heap* heap, ClassObject* klass) {
+    // NOTE: Like closures, the fields go in the same block.
+    const u64 field_count = klass->field_defaults.size();
+    InstanceObject* instance = (InstanceObject*) heap->allocate(sizeof(InstanceObject) + sizeof(Value) * field_count, GcKind::OBJECT);
+    instance->ty = Object::Type::INSTANCE;
+    instance->klass = klass;
+
+    instance->fields = (Value*) (instance + 1);
+    for (u64 i = 0; i < field_count; ++i) {
+        instance->fields[i] = klass->field_defaults[i];
+    }
+    return instance;
+}
+
+BoundMethodObject* new_bound_method(Heap* heap, Value receiver, ClosureObject* method) {
+    BoundMethodObject* bound = (BoundMethodObject*) heap->allocate(sizeof(BoundMethodObject), GcKind::OBJECT);
+    bound->ty = Object::Type::BOUND_METHOD;
+    bound->receiver = receiver;
+    bound->method = method;
+    return bound;
+}
+
+bool is_object(Value value, Object::Type ty) {
+    return value.type() == Value::Type::OBJECT && value.as_object()->ty == ty;
+}
+
+void print_object(const Object* object) {
+    switch (object->ty)
+    {
+        case Object::Type::FUNCTION: {
+            const String& name = ((const FunctionObject*) object)->name;
+            fprintf(stdout, "<fn %.*s>\n", (u32) name.len, name.chars);
+            break;
+        }
+        case Object::Type::NATIVE: {
+            const String& name = ((const NativeObject*) object)->name;
+            fprintf(stdout, "<native fn %.*s>\n", (u32) name.len, name.chars);
+            break;
+        }
+        case Object::Type::CLOSURE: {
+            print_object(((const ClosureObject*) object)->function);
+            break;
+        }
+        case Object::Type::UPVALUE: {
+            fprintf(stdout, "upvalue\n");
+            break;
+        }
+        case Object::Type::CLASS: {
+            const String& name = ((const ClassObject*) object)->name;
+            fprintf(stdout, "%.*s\n", (u32) name.len, name.chars);
+            break;
+        }
+        case Object::Type::INSTANCE: {
+            const String& name = ((const InstanceObject*) object)->klass->name;
+            fprintf(stdout, "%.*s instance\n", (u32) name.len, name.chars);
+            break;
+        }
+        case Object::Type::BOUND_METHOD: {
+            print_object(((const BoundMethodObject*) object)->method);
+            break;
+        }
+    }
+}
+
+FunctionObject* BytecodeCompiler::compile(KauCompiler* compiler, VM* vm, Array<Stmt> stmts, bool from_prompt, BytecodeForm form) {
+    m_compiler = compiler;
+    m_vm = vm;
+    m_arena = compiler->global_arena;
+    m_from_prompt = from_prompt;
+    m_form = form;
+    m_instruction_count = 0;
+
+    FunctionScope script_scope;
+    begin_function(&script_scope, new_function(m_arena, CREATE_STRING("script")), FunctionType::NONE);
+
+    for (u64 i = 0; i < stmts.size(); ++i) {
+        compile_stmt(&stmts[i]);
+    }
+
+    FunctionObject* script = end_function();
+    if (m_compiler->m_had_error) {
+        return nullptr;
+    }
+    return script;
+}
+
+void BytecodeCompiler::compile_stmt(Stmt* stmt) {
+    switch (stmt->ty) {
+        case Stmt::Type::EXPR: {
+            const bool is_top_level = m_function->enclosing == nullptr && m_function->scope_depth == 0;
+            const bool echo = m_from_prompt && is_top_level;
+            const int start = current_chunk()->code.size();
+            const int depth = m_function->stack_depth;
+            if (!echo && compile_local_assignment(stmt->s_expr.expr)) {
+                const int end = current_chunk()->code.size();
+                add_recovery(start, end, end, depth, false);
+                break;
+            }
+            compile_expr(stmt->s_expr.expr);
+            const int end = current_chunk()->code.size();
+            add_recovery(start, end, end, depth, true);
+            emit_op(echo ? OpCode::ECHO : OpCode::POP);
+            break;
+        }
+        case Stmt::Type::VAR_DECL: {
+            compile_var_decl(stmt);
+            break;
+        }
+        case Stmt::Type::BLOCK: {
+            compile_block(stmt);
+            break;
+        }
+        case Stmt::Type::IF: {
+            compile_if(stmt);
+            break;
+        }
+        case Stmt::Type::WHILE: {
+            compile_while(stmt);
+            break;
+        }
+        case Stmt::Type::BREAK:
+        case Stmt::Type::CONTINUE: {
+            compile_break_continue(stmt);
+            break;
+        }
+        case Stmt::Type::FN_DECLARATION: {
+            compile_fn_declaration(stmt);
+            break;
+        }
+        case Stmt::Type::CLASS_DECLARATION: {
+            compile_class_declaration(stmt);
+            break;
+        }
+        case Stmt::Type::RETURN: {
+            compile_return(stmt);
+            break;
+        }
+        case Stmt::Type::ERR: {
+            assert(false);
+            break;
+        }
+    }
+
+    // NOTE: Between statements, the only values in the window are the locals.
+    assert(m_compiler->m_had_error || m_function->stack_depth == m_function->local_count);
+}
+
+void BytecodeCompiler::compile_var_decl(Stmt* stmt) {
+    VarDeclPayload& var_decl = stmt->s_var_decl;
+    m_line = var_decl.name->m_line;
+
+    declare_variable(var_decl.name);
+    if (var_decl.initializer != nullptr) {
+        // NOTE: The variable is still defined if its initializer fails, as nil.
+        const int start = current_chunk()->code.size();
+        const int depth = m_function->stack_depth;
+        compile_expr(var_decl.initializer);
+        const int end = current_chunk()->code.size();
+        add_recovery(start, end, end, depth, true);
+    } else {
+        emit_op(OpCode::NIL);
+    }
+    define_variable(var_decl.name);
+}
+
+void BytecodeCompiler::compile_block(Stmt* stmt) {
+    begin_scope();
+    for (u64 i = 0; i < stmt->s_block.stmts.size(); ++i) {
+        compile_stmt(&stmt->s_block.stmts[i]);
+    }
+    end_scope();
+}
+
+void BytecodeCompiler::compile_if(Stmt* stmt) {
+    IfPayload& if_stmt = stmt->s_if;
+    m_line = if_stmt.token->m_line;
+
+    const int start = current_chunk()->code.size();
+    const int depth = m_function->stack_depth;
+    compile_expr(if_stmt.condition);
+    const int then_jump = emit_jump(OpCode::JUMP_IF_FALSE);
+    const int condition_end = current_chunk()->code.size();
+    const int condition_depth = m_function->stack_depth;
+    emit_op(OpCode::POP);
+    compile_stmt(if_stmt.if_stmt);
+
+    const int else_jump = emit_jump(OpCode::JUMP);
+    patch_jump(then_jump);
+    // NOTE: Like in the tree walker, a condition that fails is nil, which the jump reports as
+    // not being a bool and then counts as false.
+    add_recovery(start, then_jump - 1, then_jump - 1, depth, true);
+    add_recovery(then_jump - 1, condition_end, current_chunk()->code.size(), depth, true);
+    m_function->stack_depth = condition_depth;
+    emit_op(OpCode::POP);
+    if (if_stmt.else_stmt->ty != Stmt::Type::ERR) {
+        compile_stmt(if_stmt.else_stmt);
+    }
+    patch_jump(else_jump);
+}
+
+void BytecodeCompiler::compile_while(Stmt* stmt) {
+    WhilePayload& while_stmt = stmt->s_while;
+    m_line = while_stmt.token->m_line;
+
+    LoopScope loop = {};
+    loop.enclosing = m_loop;
+    loop.start = current_chunk()->code.size();
+    loop.scope_depth = m_function->scope_depth;
+    loop.breaks.init(m_arena);
+    m_loop = &loop;
+
+    const int depth = m_function->stack_depth;
+    compile_expr(while_stmt.condition);
+    const int exit_jump = emit_jump(OpCode::JUMP_IF_FALSE);
+    const int condition_end = current_chunk()->code.size();
+    const int condition_depth = m_function->stack_depth;
+    emit_op(OpCode::POP);
+    compile_stmt(while_stmt.body);
+    emit_loop(loop.start);
+
+    patch_jump(exit_jump);
+    add_recovery(loop.start, exit_jump - 1, exit_jump - 1, depth, true);
+    add_recovery(exit_jump - 1, condition_end, current_chunk()->code.size(), depth, true);
+    m_function->stack_depth = condition_depth;
+    emit_op(OpCode::POP);
+
+    for (u64 i = 0; i < loop.breaks.size(); ++i) {
+        patch_jump(loop.breaks[i]);
+    }
+    m_loop = loop.enclosing;
+}
+
+void BytecodeCompiler::compile_break_continue(Stmt* stmt) {
+    m_line = stmt->s_break_continue.token->m_line;
+
+    const bool is_break = stmt->ty == Stmt::Type::BREAK;
+    if (m_loop == nullptr) {
+        if (is_break) {
+            error(CREATE_STRING("'break' statement can only be used in a loop."));
+        } else {
+            error(CREATE_STRING("'continue' statement can only be used in a loop."));
+        }
+        return;
+    }
+
+    // NOTE: The locals are only discarded on the way out, the code after this still has them.
+    const int depth = m_function->stack_depth;
+    discard_locals(m_loop->scope_depth);
+    if (is_break) {
+        m_loop->breaks.push(emit_jump(OpCode::JUMP));
+    } else {
+        emit_loop(m_loop->start);
+    }
+    m_function->stack_depth = depth;
+}
+
+void BytecodeCompiler::compile_fn_declaration(Stmt* stmt) {
+    FnDeclarationPayload& fn = stmt->fn_declaration;
+    m_line = fn.name->m_line;
+
+    declare_variable(fn.name);
+    // NOTE: Marked as initialized before compiling the body so the function can call itself.
+    mark_initialized();
+    compile_function(&fn, FunctionType::FUNCTION);
+    define_variable(fn.name);
+}
+
+void BytecodeCompiler::compile_class_declaration(Stmt* stmt) {
+    ClassDeclarationPayload& class_decl = stmt->s_class;
+    const Token* class_name = class_decl.name;
+    m_line = class_name->m_line;
+
+    declare_variable(class_name);
+    emit_op_short(OpCode::CLASS, name_constant(class_name->m_lexeme));
+    define_variable(class_name);
+
+    ClassScope class_scope = {};
+    class_scope.enclosing = m_class;
+    m_class = &class_scope;
+
+    if (class_decl.superclass != nullptr) {
+        // NOTE: Like in the tree walker, the class is still declared if its superclass isn't one,
+        // it just doesn't get one.
+        const int start = current_chunk()->code.size();
+        const int depth = m_function->stack_depth;
+        named_variable(class_decl.superclass->expr.literal->val->m_lexeme, false);
+
+        begin_scope();
+        add_local(CREATE_STRING("super"));
+        mark_initialized();
+
+        named_variable(class_name->m_lexeme, false);
+        emit_op(OpCode::INHERIT);
+        const int end = current_chunk()->code.size();
+        add_recovery(start, end, end, depth, true);
+        class_scope.has_superclass = true;
+    }
+
+    named_variable(class_name->m_lexeme, false);
+    for (u64 i = 0; i < class_decl.members.size(); ++i) {
+        Stmt* member = &class_decl.members[i];
+        if (member->ty == Stmt::Type::FN_DECLARATION) {
+            FnDeclarationPayload& fn = member->fn_declaration;
+            const u16 name = name_constant(fn.name->m_lexeme);
+            if (fn.is_static) {
+                compile_function(&fn, FunctionType::FUNCTION);
+                emit_op_short(OpCode::STATIC_METHOD, name);
+            } else {
+                FunctionType fn_type = FunctionType::METHOD;
+                if (fn.name->m_lexeme == CREATE_STRING("init")) {
+                    fn_type = FunctionType::INITIALIZER;
+                }
+                compile_function(&fn, fn_type);
+                emit_op_short(OpCode::METHOD, name);
+            }
+        } else if (member->ty == Stmt::Type::VAR_DECL) {
+            VarDeclPayload& var_decl = member->s_var_decl;
+            if (var_decl.initializer != nullptr) {
+                const int start = current_chunk()->code.size();
+                const int depth = m_function->stack_depth;
+                compile_expr(var_decl.initializer);
+                const int end = current_chunk()->code.size();
+                add_recovery(start, end, end, depth, true);
+            } else {
+                emit_op(OpCode::NIL);
+            }
+            emit_op_short(OpCode::FIELD, name_constant(var_decl.name->m_lexeme));
+        } else {
+            assert(false);
+        }
+    }
+    emit_op(OpCode::POP);
+
+    if (class_scope.has_superclass) {
+        end_scope();
+    }
+    m_class = class_scope.enclosing;
+}
+
+void BytecodeCompiler::compile_return(Stmt* stmt) {
+    ReturnPayload& ret = stmt->s_return;
+    m_line = ret.keyword->m_line;
+
+    if (ret.expr == nullptr) {
+        emit_return();
+    } else {
+        // NOTE: Returns nil if the value fails.
+        const int start = current_chunk()->code.size();
+        const int depth = m_function->stack_depth;
+        compile_expr(ret.expr);
+        const int end = current_chunk()->code.size();
+        add_recovery(start, end, end, depth, true);
+        emit_op(OpCode::RETURN);
+    }
+}
+
+void BytecodeCompiler::compile_expr(Expr* expr) {
+    switch (expr->ty) {
+        case Expr::Type::LITERAL: {
+            compile_literal(expr);
+            break;
+        }
+        case Expr::Type::UNARY: {
+            UnaryExpr* unary = expr->expr.unary;
+            compile_expr(unary->right);
+            m_line = unary->op->m_line;
+            if (unary->op->m_type == TokenType::BANG) {
+                emit_op(OpCode::NOT);
+            } else {
+                emit_op(OpCode::NEGATE);
+            }
+            break;
+        }
+        // NOTE: Quickened binary nodes keep their `BinaryExpr`.
+        case Expr::Type::BINARY:
+        case Expr::Type::INT_BINARY:
+        case Expr::Type::DOUBLE_BINARY: {
+            compile_binary(expr);
+            break;
+        }
+        case Expr::Type::GROUPING: {
+            compile_expr(expr->expr.grouping->expr);
+            break;
+        }
+        case Expr::Type::TERNARY: {
+            compile_ternary(expr);
+            break;
+        }
+        case Expr::Type::ASSIGNMENT: {
+            AssignmentExpr* assignment = expr->expr.assignment;
+            compile_expr(assignment->right);
+            m_line = assignment->id->m_line;
+            named_variable(assignment->id->m_lexeme, true);
+            break;
+        }
+        case Expr::Type::AND:
+        case Expr::Type::OR: {
+            compile_logical(expr);
+            break;
+        }
+        case Expr::Type::FN_CALL: {
+            compile_call(expr);
+            break;
+        }
+        case Expr::Type::STATIC_FN_CALL: {
+            StaticFnCallExpr* static_fn = expr->expr.static_fn_call;
+            compile_expr(static_fn->class_expr);
+            m_line = static_fn->fn_name->m_line;
+            emit_op_short(OpCode::GET_STATIC, name_constant(static_fn->fn_name->m_lexeme));
+            break;
+        }
+        case Expr::Type::GET: {
+            GetExpr* get = expr->expr.get;
+            compile_expr(get->class_expr);
+            m_line = get->member->m_line;
+            emit_op_short(OpCode::GET_PROPERTY, name_constant(get->member->m_lexeme));
+            break;
+        }
+        case Expr::Type::SET: {
+            SetExpr* set = expr->expr.set;
+            GetExpr* get = set->get->expr.get;
+            compile_expr(get->class_expr);
+            compile_expr(set->right);
+            m_line = get->member->m_line;
+            emit_op_short(OpCode::SET_PROPERTY, name_constant(get->member->m_lexeme));
+            break;
+        }
+        case Expr::Type::THIS: {
+            m_line = expr->expr.this_expr->val->m_line;
+            named_variable(CREATE_STRING("this"), false);
+            break;
+        }
+        case Expr::Type::SUPER: {
+            compile_super(expr);
+            break;
+        }
+        case Expr::Type::ERR: {
+            assert(false);
+            break;
+        }
+    }
+}
+
+void BytecodeCompiler::compile_literal(Expr* expr) {
+    const Token* token = expr->expr.literal->val;
+    m_line = token->m_line;
+
+    switch (token->m_type)
+    {
+        case TokenType::FALSE: {
+            emit_op(OpCode::FALSE);
+            break;
+        }
+        case TokenType::TRUE: {
+            emit_op(OpCode::TRUE);
+            break;
+        }
+        case TokenType::NIL: {
+            emit_op(OpCode::NIL);
+            break;
+        }
+        case TokenType::NUMBER_INT: {
+            emit_op_short(OpCode::CONSTANT, current_chunk()->add_constant(int_value(token->data.data.i)));
+            break;
+        }
+        case TokenType::NUMBER_LONG: {
+            emit_op_short(OpCode::CONSTANT, current_chunk()->add_constant(long_value(token->data.data.l, m_arena)));
+            break;
+        }
+        case TokenType::NUMBER_FLOAT: {
+            emit_op_short(OpCode::CONSTANT, current_chunk()->add_constant(float_value(token->data.data.f)));
+            break;
+        }
+        case TokenType::NUMBER_DOUBLE: {
+            emit_op_short(OpCode::CONSTANT, current_chunk()->add_constant(double_value(token->data.data.d)));
+            break;
+        }
+        case TokenType::STRING: {
+            emit_op_short(OpCode::CONSTANT, name_constant(token->m_lexeme));
+            break;
+        }
+        case TokenType::IDENTIFIER: {
+            named_variable(token->m_lexeme, false);
+            break;
+        }
+        default: {
+            error(CREATE_STRING("Unsupported literal"));
+            break;
+        }
+    }
+}
+
+void BytecodeCompiler::compile_binary(Expr* expr) {
+    BinaryExpr* binary = expr->expr.binary;
+    const int dst = m_function->stack_depth;
+    if (compile_register_binary(binary, dst, dst + 1)) {
+        return;
+    }
+
+    compile_expr(binary->left);
+    compile_expr(binary->right);
+
+    m_line = binary->op->m_line;
+    OpCode op;
+    if (!binary_opcode(binary->op->m_type, &op)) {
+        error(CREATE_STRING("Unsupported binary operation"));
+        return;
+    }
+    emit_op(op);
+}
+
+// Compiles `binary` to a single register instruction that writes register `dst` and leaves
+// `top` values in the window. Returns false, having compiled nothing, if it can't.
+bool BytecodeCompiler::compile_register_binary(BinaryExpr* binary, int dst, int top) {
+    OpCode op;
+    if (m_form != BytecodeForm::REGISTER || !binary_opcode(binary->op->m_type, &op)) {
+        return false;
+    }
+    // NOTE: Operands that aren't already in a register get a temporary, allocated like the stack
+    // form would push them. Their live ranges nest, so scanning them in order and reusing the
+    // lowest free register always picks the top of the window, and the two forms agree on
+    // where every value is.
+    const int base = m_function->stack_depth;
+    if (base + 1 > UINT8_MAX) {
+        return false;
+    }
+
+    // NOTE: The left operand is read when the instruction runs, after the right one is
+    // evaluated, so it can only stay in its local's register if that can't change it.
+    int left = has_side_effects(binary->right) ? -1 : local_register(binary->left);
+    if (left == -1) {
+        left = m_function->stack_depth;
+        compile_expr(binary->left);
+    }
+
+    const bool constant_right = is_constant_operand(binary->right);
+    int right = -1;
+    if (constant_right) {
+        right = constant_index(binary->right);
+    } else {
+        right = local_register(binary->right);
+        if (right == -1) {
+            right = m_function->stack_depth;
+            compile_expr(binary->right);
+        }
+    }
+
+    m_line = binary->op->m_line;
+    emit_register_op(register_op(op, constant_right), dst, left, right, top);
+    m_function->stack_depth = top;
+    return true;
+}
+
+// Compiles an assignment to a local, whose value nothing uses, straight into the local's register.
+bool BytecodeCompiler::compile_local_assignment(Expr* expr) {
+    if (m_form != BytecodeForm::REGISTER || expr->ty != Expr::Type::ASSIGNMENT) {
+        return false;
+    }
+    AssignmentExpr* assignment = expr->expr.assignment;
+    const Expr::Type right_type = assignment->right->ty;
+    if (right_type != Expr::Type::BINARY && right_type != Expr::Type::INT_BINARY && right_type != Expr::Type::DOUBLE_BINARY) {
+        return false;
+    }
+    const int dst = local_slot(assignment->id->m_lexeme);
+    if (dst == -1) {
+        return false;
+    }
+    return compile_register_binary(assignment->right->expr.binary, dst, m_function->stack_depth);
+}
+
+// Register of the local `expr` reads, or -1 if it isn't a local.
+int BytecodeCompiler::local_register(Expr* expr) {
+    switch (expr->ty) {
+        case Expr::Type::LITERAL: {
+            const Token* token = expr->expr.literal->val;
+            return token->m_type == TokenType::IDENTIFIER ? local_slot(token->m_lexeme) : -1;
+        }
+        case Expr::Type::THIS: {
+            return local_slot(CREATE_STRING("this"));
+        }
+        case Expr::Type::GROUPING: {
+            return local_register(expr->expr.grouping->expr);
+        }
+        default: {
+            return -1;
+        }
+    }
+}
+
+// Like `resolve_local`, but leaves reporting locals read in their own initializer to it.
+int BytecodeCompiler::local_slot(String name) {
+    for (int i = m_function->local_count - 1; i >= 0; --i) {
+        const Local& local = m_function->locals[i];
+        if (local.name == name) {
+            return local.depth == -1 ? -1 : i;
+        }
+    }
+    return -1;
+}
+
+u16 BytecodeCompiler::constant_index(Expr* expr) {
+    const Token* token = expr->expr.literal->val;
+    switch (token->m_type) {
+        case TokenType::NUMBER_INT: {
+            return current_chunk()->add_constant(int_value(token->data.data.i));
+        }
+        case TokenType::NUMBER_LONG: {
+            return current_chunk()->add_constant(long_value(token->data.data.l, m_arena));
+        }
+        case TokenType::NUMBER_FLOAT: {
+            return current_chunk()->add_constant(float_value(token->data.data.f));
+        }
+        case TokenType::NUMBER_DOUBLE: {
+            return current_chunk()->add_constant(double_value(token->data.data.d));
+        }
+        default: {
+            return name_constant(token->m_lexeme);
+        }
+    }
+}
+
+void BytecodeCompiler::compile_logical(Expr* expr) {
+    LogicalBinaryExpr* logical = expr->expr.logical_binary;
+    compile_expr(logical->left);
+    m_line = logical->op->m_line;
+
+    if (expr->ty == Expr::Type::AND) {
+        const int end_jump = emit_jump(OpCode::JUMP_IF_FALSE);
+        emit_op(OpCode::POP);
+        compile_expr(logical->right);
+        patch_jump(end_jump);
+    } else {
+        const int else_jump = emit_jump(OpCode::JUMP_IF_FALSE);
+        const int end_jump = emit_jump(OpCode::JUMP);
+        patch_jump(else_jump);
+        emit_op(OpCode::POP);
+        compile_expr(logical->right);
+        patch_jump(end_jump);
+    }
+}
+
+void BytecodeCompiler::compile_ternary(Expr* expr) {
+    TernaryExpr* ternary = expr->expr.ternary;
+    compile_expr(ternary->left);
+    m_line = ternary->left_op->m_line;
+
+    const int else_jump = emit_jump(OpCode::JUMP_IF_FALSE);
+    emit_op(OpCode::POP);
+    compile_expr(ternary->middle);
+    const int end_jump = emit_jump(OpCode::JUMP);
+    patch_jump(else_jump);
+    emit_op(OpCode::POP);
+    compile_expr(ternary->right);
+    patch_jump(end_jump);
+}
+
+void BytecodeCompiler::compile_call(Expr* expr) {
+    FnCallExpr* fn_call = expr->expr.fn_call;
+    compile_expr(fn_call->callee);
+
+    const u64 arg_count = fn_call->arguments.size();
+    if (arg_count > 255) {
+        error(CREATE_STRING("Can't have more than 255 arguments"));
+    }
+    for (u64 i = 0; i < arg_count; ++i) {
+        compile_expr(fn_call->arguments[i]);
+    }
+
+    m_line = fn_call->paren->m_line;
+    emit_op(OpCode::CALL);
+    emit_byte((u8) arg_count);
+    m_function->stack_depth -= (int) arg_count;
+}
+
+void BytecodeCompiler::compile_super(Expr* expr) {
+    SuperExpr* super_expr = expr->expr.super_expr;
+    m_line = super_expr->keyword->m_line;
+
+    if (m_class == nullptr || !m_class->has_superclass) {
+        error(CREATE_STRING("Can't use `super` in a class with no superclass."));
+        return;
+    }
+
+    named_variable(CREATE_STRING("this"), false);
+    named_variable(CREATE_STRING("super"), false);
+    emit_op_short(OpCode::GET_SUPER, name_constant(super_expr->method->m_lexeme));
+}
+
+void BytecodeCompiler::compile_function(FnDeclarationPayload* fn, FunctionType fn_type) {
+    FunctionScope scope;
+    begin_function(&scope, new_function(m_arena, fn->name->m_lexeme), fn_type);
+
+    LoopScope* enclosing_loop = m_loop;
+    m_loop = nullptr;
+
+    begin_scope();
+    for (u64 i = 0; i < fn->params.size(); ++i) {
+        scope.function->arity += 1;
+        scope.stack_depth += 1;
+        declare_variable(fn->params[i]);
+        define_variable(fn->params[i]);
+    }
+    compile_stmt(fn->body);
+
+    FunctionObject* function = end_function();
+    m_loop = enclosing_loop;
+
+    emit_op_short(OpCode::CLOSURE, current_chunk()->add_constant(object_value(function)));
+    for (int i = 0; i < function->upvalue_count; ++i) {
+        emit_byte(scope.upvalues[i].is_local ? 1 : 0);
+        emit_byte(scope.upvalues[i].index);
+    }
+}
+
+void BytecodeCompiler::begin_function(FunctionScope* scope, FunctionObject* function, FunctionType fn_type) {
+    scope->enclosing = m_function;
+    scope->function = function;
+    scope->ty = fn_type;
+    scope->local_count = 0;
+    scope->scope_depth = 0;
+    scope->stack_depth = 1;
+    m_function = scope;
+
+    // NOTE: Slot zero holds the callee, which methods expose as `this`.
+    Local& local = scope->locals[scope->local_count++];
+    local.depth = 0;
+    local.is_captured = false;
+    if (fn_type == FunctionType::METHOD || fn_type == FunctionType::INITIALIZER) {
+        local.name = CREATE_STRING("this");
+    } else {
+        local.name = String{};
+    }
+}
+
+FunctionObject* BytecodeCompiler::end_function() {
+    emit_return();
+    FunctionObject* function = m_function->function;
+    m_function = m_function->enclosing;
+    return function;
+}
+
+void BytecodeCompiler::begin_scope() {
+    m_function->scope_depth += 1;
+}
+
+void BytecodeCompiler::end_scope() {
+    m_function->scope_depth -= 1;
+
+    discard_locals(m_function->scope_depth);
+    while (m_function->local_count > 0 &&
+        m_function->locals[m_function->local_count - 1].depth > m_function->scope_depth
+    ) {
+        m_function->local_count -= 1;
+    }
+}
+
+void BytecodeCompiler::discard_locals(int depth) {
+    for (int i = m_function->local_count - 1; i >= 0; --i) {
+        const Local& local = m_function->locals[i];
+        if (local.depth <= depth) {
+            break;
+        }
+        emit_op(local.is_captured ? OpCode::CLOSE_UPVALUE : OpCode::POP);
+    }
+}
+
+void BytecodeCompiler::add_local(String name) {
+    if (m_function->local_count == MAX_LOCALS) {
+        error(CREATE_STRING("Too many local variables in function"));
+        return;
+    }
+
+    Local& local = m_function->locals[m_function->local_count++];
+    local.name = name;
+    local.depth = -1;
+    local.is_captured = false;
+}
+
+void BytecodeCompiler::mark_initialized() {
+    if (m_function->scope_depth == 0) {
+        return;
+    }
+    m_function->locals[m_function->local_count - 1].depth = m_function->scope_depth;
+}
+
+void BytecodeCompiler::declare_variable(const Token* name) {
+    if (m_function->scope_depth == 0) {
+        return;
+    }
+
+    for (int i = m_function->local_count - 1; i >= 0; --i) {
+        const Local& local = m_function->locals[i];
+        if (local.depth != -1 && local.depth < m_function->scope_depth) {
+            break;
+        }
+        if (local.name == name->m_lexeme) {
+            error(CREATE_STRING("Already a variable with this name in this scope"));
+        }
+    }
+
+    add_local(name->m_lexeme);
+}
+
+void BytecodeCompiler::define_variable(const Token* name) {
+    if (m_function->scope_depth > 0) {
+        mark_initialized();
+        return;
+    }
+    emit_op_short(OpCode::DEFINE_GLOBAL, m_vm->global_slot(name->m_lexeme));
+}
+
+void BytecodeCompiler::named_variable(String name, bool assign) {
+    int arg = resolve_local(m_function, name);
+    if (arg != -1) {
+        emit_op(assign ? OpCode::SET_LOCAL : OpCode::GET_LOCAL);
+        emit_byte((u8) arg);
+        return;
+    }
+
+    arg = resolve_upvalue(m_function, name);
+    if (arg != -1) {
+        emit_op(assign ? OpCode::SET_UPVALUE : OpCode::GET_UPVALUE);
+        emit_byte((u8) arg);
+        return;
+    }
+
+    emit_op_short(assign ? OpCode::SET_GLOBAL : OpCode::GET_GLOBAL, m_vm->global_slot(name));
+}
+
+int BytecodeCompiler::resolve_local(FunctionScope* scope, String name) {
+    for (int i = scope->local_count - 1; i >= 0; --i) {
+        const Local& local = scope->locals[i];
+        if (local.name == name) {
+            if (local.depth == -1) {
+                error(CREATE_STRING("Can't read local varaible in its own initializer"));
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+int BytecodeCompiler::resolve_upvalue(FunctionScope* scope, String name) {
+    if (scope->enclosing == nullptr) {
+        return -1;
+    }
+
+    const int local = resolve_local(scope->enclosing, name);
+    if (local != -1) {
+        scope->enclosing->locals[local].is_captured = true;
+        return add_upvalue(scope, (u8) local, true);
+    }
+
+    const int upvalue = resolve_upvalue(scope->enclosing, name);
+    if (upvalue != -1) {
+        return add_upvalue(scope, (u8) upvalue, false);
+    }
+
+    return -1;
+}
+
+int BytecodeCompiler::add_upvalue(FunctionScope* scope, u8 index, bool is_local) {
+    FunctionObject* function = scope->function;
+    for (int i = 0; i < function->upvalue_count; ++i) {
+        const Upvalue& upvalue = scope->upvalues[i];
+        if (upvalue.index == index && upvalue.is_local == is_local) {
+            return i;
+        }
+    }
+
+    if (function->upvalue_count == MAX_UPVALUES) {
+        error(CREATE_STRING("Too many closure variables in function"));
+        return 0;
+    }
+
+    scope->upvalues[function->upvalue_count] = Upvalue{index, is_local};
+    return function->upvalue_count++;
+}
+
+Chunk* BytecodeCompiler::current_chunk() {
+    return &m_function->function->chunk;
+}
+
+void BytecodeCompiler::emit_byte(u8 byte) {
+    current_chunk()->write(byte, m_line);
+}
+
+void BytecodeCompiler::emit_op(OpCode op) {
+    emit_byte((u8) op);
+    m_instruction_count += 1;
+    m_function->stack_depth += stack_effect(op);
+}
+
+void BytecodeCompiler::emit_op_short(OpCode op, u16 operand) {
+    emit_op(op);
+    emit_byte((operand >> 8) & 0xff);
+    emit_byte(operand & 0xff);
+}
+
+void BytecodeCompiler::emit_register_op(OpCode op, int dst, int left, int right, int top) {
+    emit_op(op);
+    emit_byte((u8) dst);
+    emit_byte((u8) left);
+    if (op >= OpCode::EQUAL_RK) {
+        emit_byte((right >> 8) & 0xff);
+        emit_byte(right & 0xff);
+    } else {
+        emit_byte((u8) right);
+    }
+    emit_byte((u8) top);
+}
+
+void BytecodeCompiler::emit_return() {
+    if (m_function->ty == FunctionType::INITIALIZER) {
+        emit_op(OpCode::GET_LOCAL);
+        emit_byte(0);
+    } else {
+        emit_op(OpCode::NIL);
+    }
+    emit_op(OpCode::RETURN);
+}
+
+u16 BytecodeCompiler::name_constant(String name) {
+    if (current_chunk()->constants.size() > UINT16_MAX) {
+        error(CREATE_STRING("Too many constants in one function"));
+        return 0;
+    }
+    return current_chunk()->add_constant(string_value(box_of(m_compiler->interner.intern(name))));
+}
+
+int BytecodeCompiler::emit_jump(OpCode op) {
+    emit_op(op);
+    emit_byte(0xff);
+    emit_byte(0xff);
+    return current_chunk()->code.size() - 2;
+}
+
+void BytecodeCompiler::add_recovery(int start, int end, int resume, int depth, bool push_nil) {
+    current_chunk()->recoveries.push(Recovery {
+        .start = (u32) start,
+        .end = (u32) end,
+        .resume = (u32) resume,
+        .depth = (u32) depth,
+        .push_nil = push_nil,
+    });
+}
+
+void BytecodeCompiler::patch_jump(int offset) {
+    const int jump = current_chunk()->code.size() - offset - 2;
+    if (jump > UINT16_MAX) {
+        error(CREATE_STRING("Too much code to jump over"));
+    }
+
+    current_chunk()->code[offset] = (jump >> 8) & 0xff;
+    current_chunk()->code[offset + 1] = jump & 0xff;
+}
+
+void BytecodeCompiler::emit_loop(int loop_start) {
+    emit_op(OpCode::LOOP);
+
+    const int offset = current_chunk()->code.size() - loop_start + 2;
+    if (offset > UINT16_MAX) {
+        error(CREATE_STRING("Loop body too large"));
+    }
+
+    emit_byte((offset >> 8) & 0xff);
+    emit_byte(offset & 0xff);
+}
+
+void BytecodeCompiler::error(String message) {
+    m_compiler->error(m_line, message);
+}
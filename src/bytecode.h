@@ -0,0 +1,330 @@
+#pragma once
+
+#include "lib/arena.h"
+#include "lib/array.h"
+#include "lib/hash_map.h"
+#include "lib/string.h"
+
+#include "expr.h"
+#include "gc.h"
+
+enum class OpCode : u8 {
+    CONSTANT,
+    NIL,
+    TRUE,
+    FALSE,
+    POP,
+    ECHO,
+
+    GET_LOCAL,
+    SET_LOCAL,
+    GET_UPVALUE,
+    SET_UPVALUE,
+    CLOSE_UPVALUE,
+    DEFINE_GLOBAL,
+    GET_GLOBAL,
+    SET_GLOBAL,
+
+    GET_PROPERTY,
+    SET_PROPERTY,
+    GET_STATIC,
+    GET_SUPER,
+
+    EQUAL,
+    NOT_EQUAL,
+    GREATER,
+    GREATER_EQUAL,
+    LESSER,
+    LESSER_EQUAL,
+    ADD,
+    SUBTRACT,
+    MULTIPLY,
+    DIVIDE,
+    NOT,
+    NEGATE,
+
+    JUMP,
+    JUMP_IF_FALSE,
+    LOOP,
+
+    CALL,
+    CLOSURE,
+    RETURN,
+
+    CLASS,
+    INHERIT,
+    METHOD,
+    STATIC_METHOD,
+    FIELD,
+
+    // Register form of the binary operators, see `BytecodeForm::REGISTER`. Every one takes the
+    // register its result goes in, its left operand's register, then its right operand, which
+    // is a register for `_RR` and a constant for `_RK`, and last where the stack top ends up.
+    EQUAL_RR,
+    NOT_EQUAL_RR,
+    GREATER_RR,
+    GREATER_EQUAL_RR,
+    LESSER_RR,
+    LESSER_EQUAL_RR,
+    ADD_RR,
+    SUBTRACT_RR,
+    MULTIPLY_RR,
+    DIVIDE_RR,
+
+    EQUAL_RK,
+    NOT_EQUAL_RK,
+    GREATER_RK,
+    GREATER_EQUAL_RK,
+    LESSER_RK,
+    LESSER_EQUAL_RK,
+    ADD_RK,
+    SUBTRACT_RK,
+    MULTIPLY_RK,
+    DIVIDE_RK,
+
+    // Never in a chunk. Threaded words get it while `TraceRecorder` records their function,
+    // so the VM hands it every instruction before running it.
+    RECORD,
+};
+
+// Registers are the slots of a call's stack window: the callee in zero, then every local in
+// the order it was declared, then temporaries. Register instructions read and write those
+// slots directly instead of pushing copies of them, and stack instructions keep working on
+// the same window, so the two mix freely.
+enum class BytecodeForm {
+    STACK,
+    // Binary operators are three-address register instructions, the rest stays as it is.
+    REGISTER,
+};
+
+// Like in the tree walker, a runtime error only ends the statement it happened in. Every
+// statement's expressions get one of these, and an error in `[start, end)` drops the values
+// the statement pushed, pushes nil in place of the one it was computing if `push_nil` is set,
+// and carries on at `resume`. Offsets are in bytes in a chunk, and in words once threaded.
+struct Recovery {
+    u32 start;
+    u32 end;
+    u32 resume;
+    // Values in the call's stack window when the statement started.
+    u32 depth;
+    bool push_nil;
+};
+
+struct Chunk {
+    void init(Arena* arena);
+
+    void write(u8 byte, int line);
+    u16 add_constant(Value value);
+
+    Array<u8> code;
+    Array<int> lines;
+    Array<Value> constants;
+    // Never overlap, see `Recovery`.
+    Array<Recovery> recoveries;
+};
+
+// One word of threaded code, see `ThreadedCode`.
+union ThreadedWord {
+    // Where the instruction's handler starts, with computed goto dispatch.
+    const void* handler;
+    // The instruction itself, with switch dispatch.
+    OpCode op;
+    u64 operand;
+    const Value* constant;
+    ThreadedWord* target;
+};
+
+// A chunk decoded once, before it first runs: every instruction is one word for its handler, then
+// one word per operand. Constants point straight at the value, and jumps at the word they land on.
+struct ThreadedCode {
+    Array<ThreadedWord> code;
+    // Line of the instruction each word belongs to.
+    Array<int> lines;
+    Array<Recovery> recoveries;
+};
+
+struct Object {
+    enum class Type {
+        FUNCTION,
+        NATIVE,
+        CLOSURE,
+        UPVALUE,
+        CLASS,
+        INSTANCE,
+        BOUND_METHOD,
+    };
+
+    Type ty;
+};
+
+struct JitCode;
+struct TraceAnchor;
+struct FunctionObject : Object {
+    int arity;
+    int upvalue_count;
+    Chunk chunk;
+    String name;
+    // Empty until the function is first called, see `thread_function`.
+    ThreadedCode threaded;
+
+    // Only counted with the JIT on, it compiles the function once this gets to `JIT_CALL_THRESHOLD`.
+    u32 call_count;
+    // Null until then, and after if the function couldn't be compiled.
+    JitCode* jit;
+    // With `--trace-jit`, one per threaded word, for the loop headers among them. Null until
+    // one of its loops first jumps back.
+    TraceAnchor* trace_anchors;
+};
+
+// Natives get the heap so they can return values that need it, like big longs.
+using NativeFn = Value(*)(Heap* heap, int arg_count, Value* args);
+struct NativeObject : Object {
+    int arity;
+    NativeFn function;
+    String name;
+};
+
+struct UpvalueObject : Object {
+    Value* location;
+    Value closed;
+    UpvalueObject* next;
+};
+
+struct ClosureObject : Object {
+    FunctionObject* function;
+    UpvalueObject** upvalues;
+    int upvalue_count;
+};
+
+struct ClassObject : Object {
+    String name;
+    ClassObject* superclass;
+    ClosureObject* initializer;
+
+    // Field names map to an index into `field_defaults` and into every instance's fields.
+    HashMap<String, ClosureObject*, StringHasher> methods;
+    HashMap<String, ClosureObject*, StringHasher> statics;
+    HashMap<String, u64, StringHasher> field_slots;
+    Array<Value> field_defaults;
+};
+
+struct InstanceObject : Object {
+    ClassObject* klass;
+    Value* fields;
+};
+
+struct BoundMethodObject : Object {
+    Value receiver;
+    ClosureObject* method;
+};
+
+FunctionObject* new_function(Arena* arena, String name);
+NativeObject* new_native(Arena* arena, String name, int arity, NativeFn function);
+// Everything made while the program runs goes on the garbage collected heap.
+// Class member tables still come from `arena`.
+ClosureObject* new_closure(Heap* heap, FunctionObject* function);
+UpvalueObject* new_upvalue(Heap* heap, Value* slot);
+ClassObject* new_class(Heap* heap, Arena* arena, String name);
+InstanceObject* new_instance(Heap* heap, ClassObject* klass);
+BoundMethodObject* new_bound_method(Heap* heap, Value receiver, ClosureObject* method);
+
+bool is_object(Value value, Object::Type ty);
+
+// Bytes the instruction at `offset` takes in its chunk, operands included.
+u64 instruction_size(const Chunk& chunk, u64 offset);
+// Threaded words the same instruction takes, one for its handler and one per operand. Byte
+// operands get a word each, and so do shorts, which are all either a constant or a slot.
+u64 instruction_words(const Chunk& chunk, u64 offset);
+bool is_register_op(OpCode op);
+
+// Fills in `function->threaded` from its chunk. `handlers` has the address of every opcode's
+// handler, in opcode order, or is null to keep the opcodes themselves for switch dispatch.
+void thread_function(Arena* arena, FunctionObject* function, const void* const* handlers);
+
+struct VM;
+struct KauCompiler;
+enum class FunctionType;
+struct FunctionScope;
+struct ClassScope;
+struct LoopScope;
+
+// Compiles resolved statements into a script function the `VM` can run.
+struct BytecodeCompiler {
+    FunctionObject* compile(KauCompiler* compiler, VM* vm, Array<Stmt> stmts, bool from_prompt, BytecodeForm form);
+
+    // Instructions emitted, for every function compiled.
+    u64 instruction_count() const {
+        return m_instruction_count;
+    }
+
+private:
+    void compile_stmt(Stmt* stmt);
+    void compile_expr(Expr* expr);
+
+    void compile_var_decl(Stmt* stmt);
+    void compile_block(Stmt* stmt);
+    void compile_if(Stmt* stmt);
+    void compile_while(Stmt* stmt);
+    void compile_break_continue(Stmt* stmt);
+    void compile_fn_declaration(Stmt* stmt);
+    void compile_class_declaration(Stmt* stmt);
+    void compile_return(Stmt* stmt);
+
+    void compile_literal(Expr* expr);
+    void compile_binary(Expr* expr);
+    bool compile_register_binary(BinaryExpr* binary, int dst, int top);
+    bool compile_local_assignment(Expr* expr);
+    int local_register(Expr* expr);
+    int local_slot(String name);
+    u16 constant_index(Expr* expr);
+    void compile_logical(Expr* expr);
+    void compile_ternary(Expr* expr);
+    void compile_call(Expr* expr);
+    void compile_super(Expr* expr);
+
+    void compile_function(FnDeclarationPayload* fn, FunctionType fn_type);
+
+    void begin_function(FunctionScope* scope, FunctionObject* function, FunctionType fn_type);
+    FunctionObject* end_function();
+
+    void begin_scope();
+    void end_scope();
+    void discard_locals(int depth);
+
+    void add_local(String name);
+    void mark_initialized();
+    void declare_variable(const Token* name);
+    void define_variable(const Token* name);
+
+    void named_variable(String name, bool assign);
+    int resolve_local(FunctionScope* scope, String name);
+    int resolve_upvalue(FunctionScope* scope, String name);
+    int add_upvalue(FunctionScope* scope, u8 index, bool is_local);
+
+    Chunk* current_chunk();
+    void emit_byte(u8 byte);
+    void emit_op(OpCode op);
+    void emit_op_short(OpCode op, u16 operand);
+    void emit_register_op(OpCode op, int dst, int left, int right, int top);
+    void emit_return();
+    u16 name_constant(String name);
+    int emit_jump(OpCode op);
+    void add_recovery(int start, int end, int resume, int depth, bool push_nil);
+    void patch_jump(int offset);
+    void emit_loop(int loop_start);
+
+    void error(String message);
+
+    KauCompiler* m_compiler;
+    VM* m_vm;
+    Arena* m_arena;
+
+    FunctionScope* m_function = nullptr;
+    ClassScope* m_class = nullptr;
+    LoopScope* m_loop = nullptr;
+
+    bool m_from_prompt = false;
+    BytecodeForm m_form = BytecodeForm::STACK;
+    int m_line = 0;
+    u64 m_instruction_count = 0;
+};
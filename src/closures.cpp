@@ -0,0 +1,1276 @@
+#include "closures.h"
+#include "environment.h"
+
+namespace {
+    bool is_int(Value value) {
+        return (value.bits >> VALUE_PAYLOAD_BITS) == (u64) Value::Type::INT;
+    }
+
+    //
+    // Expressions
+    //
+
+    struct ConstantNode : ClosureExpr {
+        Value value;
+    };
+
+    // Fails the same way every time it runs, for what can't be evaluated at all.
+    struct FailNode : ClosureExpr {
+        RuntimeError err;
+    };
+
+    struct VariableNode : ClosureExpr {
+        const Token* name;
+        u64 depth;
+        u64 slot;
+    };
+
+    struct UnaryNode : ClosureExpr {
+        const Token* op;
+        ClosureExpr* right;
+    };
+
+    struct BinaryNode : ClosureExpr {
+        const Token* op;
+        ClosureExpr* left;
+        ClosureExpr* right;
+        // For the `_int_k` versions, whose right operand is this int literal.
+        int constant;
+    };
+
+    struct TernaryNode : ClosureExpr {
+        const Token* op;
+        ClosureExpr* condition;
+        ClosureExpr* then_expr;
+        ClosureExpr* else_expr;
+    };
+
+    struct AssignmentNode : ClosureExpr {
+        const Token* name;
+        u64 depth;
+        u64 slot;
+        ClosureExpr* right;
+    };
+
+    struct CallNode : ClosureExpr {
+        // What the callee is called, for errors and the profiler.
+        const Token* name;
+        ClosureExpr** arguments;
+        u64 argument_count;
+
+        // Method calls evaluate their receiver from `object`, and resolve the method through `cache`.
+        ClosureExpr* object;
+        InlineCache cache;
+        // What plain and static calls look up, static methods by their mangled name.
+        String callable_name;
+        // For `call_known`, the function the name is bound to once it was found.
+        Function* known;
+        // `super` calls find the superclass here, and the receiver right after it.
+        VariableLocation location;
+    };
+
+    struct PropertyNode : ClosureExpr {
+        const Token* member;
+        ClosureExpr* object;
+        // Only set for writes.
+        ClosureExpr* right;
+        InlineCache cache;
+    };
+
+    RuntimeError constant(ClosureExpr* node, KauCompiler*, Arena*, Environment*, Value& in_value) {
+        in_value = ((ConstantNode*) node)->value;
+        return RuntimeError::ok();
+    }
+
+    RuntimeError fail(ClosureExpr* node, KauCompiler*, Arena*, Environment*, Value&) {
+        return ((FailNode*) node)->err;
+    }
+
+    RuntimeError load_local0(ClosureExpr* node, KauCompiler*, Arena*, Environment* env, Value& in_value) {
+        VariableNode* variable = (VariableNode*) node;
+        const Value val = env->slots[variable->slot];
+        if (val.type() == Value::Type::NIL) {
+            return RuntimeError::undefined_variable(variable->name);
+        }
+        in_value = val;
+        return RuntimeError::ok();
+    }
+
+    RuntimeError load_local(ClosureExpr* node, KauCompiler*, Arena*, Environment* env, Value& in_value) {
+        VariableNode* variable = (VariableNode*) node;
+        const Value val = *env->get_at(variable->depth, variable->slot);
+        if (val.type() == Value::Type::NIL) {
+            return RuntimeError::undefined_variable(variable->name);
+        }
+        in_value = val;
+        return RuntimeError::ok();
+    }
+
+    RuntimeError load_global(ClosureExpr* node, KauCompiler* compiler, Arena*, Environment*, Value& in_value) {
+        VariableNode* variable = (VariableNode*) node;
+        const Value* val = compiler->global_env.get(variable->name->m_lexeme);
+        if (val == nullptr || val->type() == Value::Type::NIL) {
+            return RuntimeError::undefined_variable(variable->name);
+        }
+        in_value = *val;
+        return RuntimeError::ok();
+    }
+
+    RuntimeError logical_not(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        UnaryNode* unary = (UnaryNode*) node;
+        Value right_val = {};
+        CHECK_ERR(unary->right->evaluate(compiler, arena, env, right_val));
+        if (right_val.type() != Value::Type::BOOL) {
+            return RuntimeError::operand_must_be_bool(unary->op);
+        }
+        in_value = bool_value(!right_val.as_bool());
+        return RuntimeError::ok();
+    }
+
+    RuntimeError negate(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        UnaryNode* unary = (UnaryNode*) node;
+        Value right_val = {};
+        CHECK_ERR(unary->right->evaluate(compiler, arena, env, right_val));
+
+        // NOTE: Same as the tree walker, floats can't be negated and anything else that isn't a number is left as is.
+        switch (right_val.type()) {
+            case Value::Type::FLOAT: {
+                return RuntimeError::operand_must_be_float(unary->op);
+            }
+            case Value::Type::INT: {
+                right_val = int_value(-right_val.as_int());
+                break;
+            }
+            case Value::Type::LONG: {
+                right_val = long_value(-right_val.as_long(), &compiler->heap);
+                break;
+            }
+            case Value::Type::DOUBLE: {
+                right_val = double_value(-right_val.as_double());
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+        in_value = right_val;
+        return RuntimeError::ok();
+    }
+
+    RuntimeError evaluate_operands(BinaryNode* binary, KauCompiler* compiler, Arena* arena, Environment* env, Value& left_val, Value& right_val) {
+        CHECK_ERR(binary->left->evaluate(compiler, arena, env, left_val));
+
+        // NOTE: The right side can call into code that collects, while only this holds on to the left.
+        compiler->heap.push_root(&left_val);
+        RuntimeError right_err = binary->right->evaluate(compiler, arena, env, right_val);
+        compiler->heap.pop_root();
+        return right_err;
+    }
+
+    // Every operator gets three nodes: one that works on anything and tries ints first, one for
+    // operands that are both known to be ints, which doesn't check, and one for int literals on the
+    // right, which doesn't evaluate them. Everything that isn't two ints goes through `binary_op`.
+#define INT_BINARY_NODES(NAME, OPERATOR, VALUE_OUT_CONSTRUCTOR) \
+    RuntimeError NAME(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {\
+        BinaryNode* binary = (BinaryNode*) node;\
+        Value left_val = {};\
+        Value right_val = {};\
+        CHECK_ERR(evaluate_operands(binary, compiler, arena, env, left_val, right_val));\
+        if (is_int(left_val) && is_int(right_val)) {\
+            in_value = VALUE_OUT_CONSTRUCTOR(left_val.as_int() OPERATOR right_val.as_int());\
+            return RuntimeError::ok();\
+        }\
+        return binary_op(compiler, arena, binary->op, left_val, right_val, in_value);\
+    }\
+    RuntimeError NAME##_int_int(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {\
+        BinaryNode* binary = (BinaryNode*) node;\
+        Value left_val = {};\
+        Value right_val = {};\
+        CHECK_ERR(evaluate_operands(binary, compiler, arena, env, left_val, right_val));\
+        in_value = VALUE_OUT_CONSTRUCTOR(left_val.as_int() OPERATOR right_val.as_int());\
+        return RuntimeError::ok();\
+    }\
+    RuntimeError NAME##_int_k(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {\
+        BinaryNode* binary = (BinaryNode*) node;\
+        Value left_val = {};\
+        CHECK_ERR(binary->left->evaluate(compiler, arena, env, left_val));\
+        if (is_int(left_val)) {\
+            in_value = VALUE_OUT_CONSTRUCTOR(left_val.as_int() OPERATOR binary->constant);\
+            return RuntimeError::ok();\
+        }\
+        return binary_op(compiler, arena, binary->op, left_val, int_value(binary->constant), in_value);\
+    }
+
+    INT_BINARY_NODES(add, +, int_value)
+    INT_BINARY_NODES(subtract, -, int_value)
+    INT_BINARY_NODES(multiply, *, int_value)
+    INT_BINARY_NODES(less, <, bool_value)
+    INT_BINARY_NODES(less_equal, <=, bool_value)
+    INT_BINARY_NODES(greater, >, bool_value)
+    INT_BINARY_NODES(greater_equal, >=, bool_value)
+    INT_BINARY_NODES(equal, ==, bool_value)
+    INT_BINARY_NODES(not_equal, !=, bool_value)
+
+#undef INT_BINARY_NODES
+
+    // Division checks for zero first, so it's only specialized on the operands' types.
+    RuntimeError divide(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        BinaryNode* binary = (BinaryNode*) node;
+        Value left_val = {};
+        Value right_val = {};
+        CHECK_ERR(evaluate_operands(binary, compiler, arena, env, left_val, right_val));
+        if (is_int(left_val) && is_int(right_val) && right_val.as_int() != 0) {
+            in_value = int_value(left_val.as_int() / right_val.as_int());
+            return RuntimeError::ok();
+        }
+        return binary_op(compiler, arena, binary->op, left_val, right_val, in_value);
+    }
+
+    RuntimeError divide_int_int(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        BinaryNode* binary = (BinaryNode*) node;
+        Value left_val = {};
+        Value right_val = {};
+        CHECK_ERR(evaluate_operands(binary, compiler, arena, env, left_val, right_val));
+        if (right_val.as_int() == 0) {
+            return RuntimeError::divide_by_zero(binary->op);
+        }
+        in_value = int_value(left_val.as_int() / right_val.as_int());
+        return RuntimeError::ok();
+    }
+
+    RuntimeError divide_int_k(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        BinaryNode* binary = (BinaryNode*) node;
+        Value left_val = {};
+        CHECK_ERR(binary->left->evaluate(compiler, arena, env, left_val));
+        if (is_int(left_val) && binary->constant != 0) {
+            in_value = int_value(left_val.as_int() / binary->constant);
+            return RuntimeError::ok();
+        }
+        return binary_op(compiler, arena, binary->op, left_val, int_value(binary->constant), in_value);
+    }
+
+    // Operators without int versions, like string comparisons that didn't parse as one of the above.
+    RuntimeError binary(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        BinaryNode* binary = (BinaryNode*) node;
+        Value left_val = {};
+        Value right_val = {};
+        CHECK_ERR(evaluate_operands(binary, compiler, arena, env, left_val, right_val));
+        return binary_op(compiler, arena, binary->op, left_val, right_val, in_value);
+    }
+
+    RuntimeError ternary(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        TernaryNode* ternary = (TernaryNode*) node;
+        Value condition_val = {};
+        CHECK_ERR(ternary->condition->evaluate(compiler, arena, env, condition_val));
+        if (condition_val.type() != Value::Type::BOOL) {
+            return RuntimeError::operand_must_be_bool(ternary->op);
+        }
+        ClosureExpr* branch = condition_val.as_bool() ? ternary->then_expr : ternary->else_expr;
+        return branch->evaluate(compiler, arena, env, in_value);
+    }
+
+    RuntimeError assign_local(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        AssignmentNode* assignment = (AssignmentNode*) node;
+        Value right_val = {};
+        CHECK_ERR(assignment->right->evaluate(compiler, arena, env, right_val));
+
+        Value* target = env->get_at(assignment->depth, assignment->slot);
+        right_val = promoted_for_store(compiler, target, right_val);
+        *target = right_val;
+        in_value = right_val;
+        return RuntimeError::ok();
+    }
+
+    RuntimeError assign_global(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        AssignmentNode* assignment = (AssignmentNode*) node;
+        Value right_val = {};
+        CHECK_ERR(assignment->right->evaluate(compiler, arena, env, right_val));
+
+        if (!compiler->global_env.set(assignment->name->m_lexeme, promoted_for_store(compiler, nullptr, right_val))) {
+            return RuntimeError::undefined_variable(assignment->name);
+        }
+        in_value = right_val;
+        return RuntimeError::ok();
+    }
+
+    RuntimeError logical_and(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        BinaryNode* logical = (BinaryNode*) node;
+        Value left_val = {};
+        CHECK_ERR(logical->left->evaluate(compiler, arena, env, left_val));
+        if (left_val.type() != Value::Type::BOOL) {
+            return RuntimeError::operand_must_be_bool(logical->op);
+        }
+        in_value = left_val;
+
+        if (left_val.as_bool()) {
+            Value right_val = {};
+            CHECK_ERR(logical->right->evaluate(compiler, arena, env, right_val));
+            if (right_val.type() != Value::Type::BOOL) {
+                return RuntimeError::operand_must_be_bool(logical->op);
+            }
+            in_value = right_val;
+        }
+        return RuntimeError::ok();
+    }
+
+    // NOTE: Like in the tree walker, both sides always run.
+    RuntimeError logical_or(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        BinaryNode* logical = (BinaryNode*) node;
+        Value left_val = {};
+        CHECK_ERR(logical->left->evaluate(compiler, arena, env, left_val));
+        if (left_val.type() != Value::Type::BOOL) {
+            return RuntimeError::operand_must_be_bool(logical->op);
+        }
+
+        Value right_val = {};
+        CHECK_ERR(logical->right->evaluate(compiler, arena, env, right_val));
+        if (right_val.type() != Value::Type::BOOL) {
+            return RuntimeError::operand_must_be_bool(logical->op);
+        }
+
+        in_value = bool_value(left_val.as_bool() || right_val.as_bool());
+        return RuntimeError::ok();
+    }
+
+    // Everything after finding the callee, which is the same for every kind of call, see the tree walker's `FN_CALL`.
+    RuntimeError invoke(CallNode* call, KauCompiler* compiler, Arena* arena, Environment* env, Function* callable, Value receiver, bool has_receiver, Value& in_value) {
+        if ((u64) callable->m_arity != call->argument_count) {
+            return RuntimeError::wrong_number_arguments(call->name);
+        }
+
+        const u64 first_arg = has_receiver || callable->ty == Function::Type::CONSTRUCTOR ? 1 : 0;
+        Value* args = compiler->frame_stack.push_slots(first_arg + call->argument_count);
+        if (args == nullptr) {
+            return compiler->stack_overflow(call->name);
+        }
+        if (has_receiver) {
+            args[0] = receiver;
+        }
+
+        Arena* frame_arena = compiler->frame_arena;
+        const u64 frame_mark = frame_arena->get_pos();
+        const u64 caller_frame_start = compiler->frame_start;
+        compiler->frame_start = frame_mark;
+
+        for (u64 i = 0; i < call->argument_count; ++i) {
+            Value arg_val = {};
+            RuntimeError err = call->arguments[i]->evaluate(compiler, frame_arena, env, arg_val);
+            if (!err.is_ok()) {
+                compiler->frame_start = caller_frame_start;
+                frame_arena->pop_to(frame_mark);
+                compiler->frame_stack.pop_slots(args);
+                return err;
+            }
+            args[first_arg + i] = arg_val;
+        }
+
+        Value ret_value = {};
+        RuntimeError call_err = RuntimeError::ok();
+        if (!compiler->frame_stack.push_frame(args, env)) {
+            call_err = compiler->stack_overflow(call->name);
+        } else {
+            const bool profiling = compiler->profiler.is_running();
+            if (profiling) {
+                compiler->profiler.enter(call->name->m_lexeme, call->name->m_line);
+            }
+            call_err = call_function(compiler, callable, args, frame_arena, env, ret_value);
+            if (profiling) {
+                compiler->profiler.exit();
+            }
+            compiler->frame_stack.pop_frame();
+        }
+        compiler->frame_stack.pop_slots(args);
+        compiler->frame_start = caller_frame_start;
+        in_value = pop_frame(compiler, frame_mark, arena, ret_value);
+
+        compiler->hit_return = false;
+        CHECK_ERR(call_err);
+        // NOTE: Same as the tree walker, an overflow further down only unwinds the caller.
+        if (compiler->stack_overflowed) {
+            return RuntimeError::stack_overflow(call->name);
+        }
+        return RuntimeError::ok();
+    }
+
+    RuntimeError call_named(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        CallNode* call = (CallNode*) node;
+        Function* callable = env->get_callable(call->callable_name);
+        if (callable == nullptr) {
+            return RuntimeError::undeclared_function(call->name);
+        }
+        return invoke(call, compiler, arena, env, callable, Value{}, false, in_value);
+    }
+
+    // Calls to names only ever bound once, in the global scope, which only have to be found once.
+    RuntimeError call_known(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        CallNode* call = (CallNode*) node;
+        if (call->known == nullptr) {
+            call->known = compiler->global_env.get_callable(call->callable_name);
+            if (call->known == nullptr) {
+                return RuntimeError::undeclared_function(call->name);
+            }
+        }
+        return invoke(call, compiler, arena, env, call->known, Value{}, false, in_value);
+    }
+
+    RuntimeError call_method(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        CallNode* call = (CallNode*) node;
+        Value receiver = {};
+        CHECK_ERR(call->object->evaluate(compiler, arena, env, receiver));
+        if (receiver.type() != Value::Type::INSTANCE) {
+            return RuntimeError::object_must_be_struct(call->name);
+        }
+
+        Function* method = call->cache.lookup(receiver.as_instance()->klass, call->name->m_lexeme).method;
+        if (method == nullptr) {
+            return RuntimeError::class_does_not_have_field(call->name);
+        }
+        return invoke(call, compiler, arena, env, method, receiver, true, in_value);
+    }
+
+    RuntimeError call_static(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        CallNode* call = (CallNode*) node;
+        Function* callable = compiler->global_env.get_callable(call->callable_name);
+        if (callable == nullptr) {
+            return RuntimeError::undeclared_function(call->name);
+        }
+        return invoke(call, compiler, arena, env, callable, Value{}, false, in_value);
+    }
+
+    RuntimeError call_super(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        CallNode* call = (CallNode*) node;
+        Value* super_slot = env->get_at(call->location.depth, call->location.slot);
+        assert(super_slot->type() == Value::Type::CLASS);
+
+        Function* super_method = super_slot->as_class()->get_method(call->name->m_lexeme);
+        if (super_method == nullptr) {
+            return RuntimeError::undeclared_function(call->name);
+        }
+
+        // NOTE: `this` is declared right after `super`, see `call_function`.
+        return invoke(call, compiler, arena, env, super_method, super_slot[1], true, in_value);
+    }
+
+    RuntimeError get_property(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        PropertyNode* get = (PropertyNode*) node;
+        Value object_val = {};
+        CHECK_ERR(get->object->evaluate(compiler, arena, env, object_val));
+        if (object_val.type() != Value::Type::INSTANCE) {
+            return RuntimeError::object_must_be_struct(get->member);
+        }
+
+        Instance* instance = object_val.as_instance();
+        const InlineCache::Entry entry = get->cache.lookup(instance->klass, get->member->m_lexeme);
+        if (entry.slot != INLINE_CACHE_NO_SLOT) {
+            in_value = instance->fields()[entry.slot];
+            return RuntimeError::ok();
+        }
+        if (entry.method != nullptr) {
+            in_value = callable_value(entry.method);
+            return RuntimeError::ok();
+        }
+        return RuntimeError::class_does_not_have_field(get->member);
+    }
+
+    RuntimeError set_property(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value&) {
+        PropertyNode* set = (PropertyNode*) node;
+        Value instance_val = {};
+        CHECK_ERR(set->object->evaluate(compiler, arena, env, instance_val));
+        if (instance_val.type() != Value::Type::INSTANCE) {
+            return RuntimeError::object_must_be_struct(set->member);
+        }
+
+        const u32 slot = set->cache.lookup(instance_val.as_instance()->klass, set->member->m_lexeme).slot;
+        if (slot == INLINE_CACHE_NO_SLOT) {
+            return RuntimeError::class_does_not_have_field(set->member);
+        }
+
+        // NOTE: The right side can collect, which can move the instance.
+        Value right_val = {};
+        compiler->heap.push_root(&instance_val);
+        RuntimeError right_err = set->right->evaluate(compiler, arena, env, right_val);
+        compiler->heap.pop_root();
+        CHECK_ERR(right_err);
+
+        Instance* instance = instance_val.as_instance();
+        right_val = promoted_for_store(compiler, nullptr, right_val);
+        compiler->heap.write_barrier(instance, instance->fields()[slot], right_val);
+        instance->fields()[slot] = right_val;
+        return RuntimeError::ok();
+    }
+
+    //
+    // Statements
+    //
+
+    struct ExprNode : ClosureStmt {
+        ClosureExpr* expr;
+    };
+
+    struct VarDeclNode : ClosureStmt {
+        const Token* name;
+        // Null without an initializer.
+        ClosureExpr* initializer;
+        u64 slot;
+    };
+
+    struct BlockNode : ClosureStmt {
+        const Token* start;
+        ClosureStmt** stmts;
+        u64 stmt_count;
+        u64 slot_count;
+    };
+
+    struct IfNode : ClosureStmt {
+        const Token* token;
+        ClosureExpr* condition;
+        ClosureStmt* then_stmt;
+        // Null without an `else`.
+        ClosureStmt* else_stmt;
+    };
+
+    struct WhileNode : ClosureStmt {
+        const Token* token;
+        ClosureExpr* condition;
+        ClosureStmt* body;
+    };
+
+    // `break` and `continue`, which evaluate to `value`.
+    struct JumpNode : ClosureStmt {
+        const Token* token;
+        Value value;
+        // What's reported when the statement isn't in a loop.
+        String message;
+    };
+
+    struct FnDeclarationNode : ClosureStmt {
+        const FnDeclarationPayload* declaration;
+        ClosureStmt* body;
+    };
+
+    struct ClassDeclarationNode : ClosureStmt {
+        Stmt* stmt;
+        // One per member, null for fields.
+        ClosureStmt** bodies;
+        // Static methods' mangled names, by member.
+        String* static_names;
+    };
+
+    struct ReturnNode : ClosureStmt {
+        ClosureExpr* expr;
+    };
+
+    struct EchoNode : ClosureStmt {
+        ClosureStmt* stmt;
+    };
+
+    void report(KauCompiler* compiler, const RuntimeError& err) {
+        if (!err.is_ok()) {
+            compiler->runtime_error(err.token->m_line, err.message);
+        }
+    }
+
+    // What `if` and `while` branch on. Reports it if it isn't a bool, which then counts as false.
+    bool test_condition(ClosureExpr* condition, const Token* token, String message, KauCompiler* compiler, Arena* arena, Environment* env) {
+        Value test_val = {};
+        RuntimeError err = condition->evaluate(compiler, arena, env, test_val);
+        report(compiler, err);
+        if (test_val.type() != Value::Type::BOOL) {
+            compiler->runtime_error(err.is_ok() ? token->m_line : err.token->m_line, message);
+        }
+        return test_val.as_bool();
+    }
+
+    Value expr_stmt(ClosureStmt* node, KauCompiler* compiler, Arena* arena, Environment* env) {
+        Value expr_val = {};
+        report(compiler, ((ExprNode*) node)->expr->evaluate(compiler, arena, env, expr_val));
+        return expr_val;
+    }
+
+    Value var_decl_local(ClosureStmt* node, KauCompiler* compiler, Arena* arena, Environment* env) {
+        VarDeclNode* var_decl = (VarDeclNode*) node;
+        Value expr_val = {};
+        if (var_decl->initializer != nullptr) {
+            report(compiler, var_decl->initializer->evaluate(compiler, arena, env, expr_val));
+        }
+        env->slots[var_decl->slot] = expr_val;
+        return expr_val;
+    }
+
+    Value var_decl_global(ClosureStmt* node, KauCompiler* compiler, Arena* arena, Environment* env) {
+        VarDeclNode* var_decl = (VarDeclNode*) node;
+        Value expr_val = {};
+        if (var_decl->initializer != nullptr) {
+            report(compiler, var_decl->initializer->evaluate(compiler, arena, env, expr_val));
+        }
+        env->define(arena, var_decl->name->m_lexeme, expr_val);
+        return expr_val;
+    }
+
+    Value block(ClosureStmt* node, KauCompiler* compiler, Arena* arena, Environment* env) {
+        BlockNode* block = (BlockNode*) node;
+
+        // NOTE: Same frames as the tree walker's blocks, see `Stmt::evaluate`.
+        Arena* frame_arena = compiler->frame_arena;
+        const bool own_frame = arena != frame_arena;
+        const u64 frame_mark = frame_arena->get_pos();
+
+        Value* block_slots = compiler->frame_stack.push_slots(block->slot_count);
+        if (block_slots == nullptr) {
+            compiler->stack_overflow(block->start);
+            return Value{};
+        }
+
+        Environment new_env = {};
+        new_env.init_local(own_frame ? frame_arena : arena, block_slots, block->slot_count);
+        new_env.enclosing = env;
+
+        Value expr_val = {};
+        for (u64 i = 0; i < block->stmt_count; ++i) {
+            expr_val = block->stmts[i]->execute(compiler, arena, &new_env);
+            if (expr_val.type() == Value::Type::BREAK ||
+                expr_val.type() == Value::Type::CONTINUE ||
+                compiler->hit_return
+            ) {
+                break;
+            }
+        }
+        compiler->frame_stack.pop_slots(block_slots);
+        if (own_frame) {
+            frame_arena->pop_to(frame_mark);
+        }
+        return expr_val;
+    }
+
+    Value if_stmt(ClosureStmt* node, KauCompiler* compiler, Arena* arena, Environment* env) {
+        IfNode* if_node = (IfNode*) node;
+        if (test_condition(if_node->condition, if_node->token, CREATE_STRING("if test expression must evaluate to bool"), compiler, arena, env)) {
+            return if_node->then_stmt->execute(compiler, arena, env);
+        }
+        if (if_node->else_stmt != nullptr) {
+            return if_node->else_stmt->execute(compiler, arena, env);
+        }
+        return Value{};
+    }
+
+    Value while_stmt(ClosureStmt* node, KauCompiler* compiler, Arena* arena, Environment* env) {
+        WhileNode* while_node = (WhileNode*) node;
+        Value expr_val = {};
+        while (test_condition(while_node->condition, while_node->token, CREATE_STRING("while test expression must evaluate to bool"), compiler, arena, env)) {
+            expr_val = while_node->body->execute(compiler, arena, env);
+            if (expr_val.type() == Value::Type::BREAK || compiler->hit_return || compiler->stack_overflowed) {
+                break;
+            }
+        }
+        return expr_val;
+    }
+
+    Value jump(ClosureStmt* node, KauCompiler*, Arena*, Environment*) {
+        return ((JumpNode*) node)->value;
+    }
+
+    Value stray_jump(ClosureStmt* node, KauCompiler* compiler, Arena*, Environment*) {
+        JumpNode* jump = (JumpNode*) node;
+        compiler->runtime_error(jump->token->m_line, jump->message);
+        return jump->value;
+    }
+
+    Value fn_declaration(ClosureStmt* node, KauCompiler*, Arena*, Environment* env) {
+        FnDeclarationNode* fn = (FnDeclarationNode*) node;
+        Function function = script_function(fn->declaration, env);
+        function.script.compiled_body = fn->body;
+        env->define_callable(fn->declaration->name->m_lexeme, function);
+        return Value{};
+    }
+
+    // NOTE: Declaring a class only runs once per declaration, so the tree walker does it, and its
+    // methods get their compiled bodies afterwards.
+    Value class_declaration(ClosureStmt* node, KauCompiler* compiler, Arena* arena, Environment* env) {
+        ClassDeclarationNode* class_node = (ClassDeclarationNode*) node;
+        const ClassDeclarationPayload& s_class = class_node->stmt->s_class;
+        const Value expr_val = class_node->stmt->evaluate(compiler, arena, env, false, false);
+
+        Class* klass = env->get_class(s_class.name->m_lexeme);
+        assert(klass != nullptr);
+        for (u64 i = 0; i < s_class.members.size(); ++i) {
+            if (class_node->bodies[i] == nullptr) {
+                continue;
+            }
+            Function* function = nullptr;
+            if (s_class.members[i].fn_declaration.is_static) {
+                function = compiler->global_env.get_callable(class_node->static_names[i]);
+            } else {
+                function = *klass->m_methods.get(s_class.members[i].fn_declaration.name->m_lexeme);
+            }
+            assert(function != nullptr);
+            function->script.compiled_body = class_node->bodies[i];
+        }
+        return expr_val;
+    }
+
+    Value return_stmt(ClosureStmt* node, KauCompiler* compiler, Arena* arena, Environment* env) {
+        Value expr_val = {};
+        report(compiler, ((ReturnNode*) node)->expr->evaluate(compiler, arena, env, expr_val));
+        compiler->hit_return = true;
+        return expr_val;
+    }
+
+    // What statements that failed to parse are left as.
+    Value skip(ClosureStmt*, KauCompiler*, Arena*, Environment*) {
+        return Value{};
+    }
+
+    // Statements run from the prompt print what they evaluate to.
+    Value echo(ClosureStmt* node, KauCompiler* compiler, Arena* arena, Environment* env) {
+        ClosureStmt* stmt = ((EchoNode*) node)->stmt;
+        const Value expr_val = stmt->fn(stmt, compiler, arena, env);
+        expr_val.print();
+        return expr_val;
+    }
+
+    struct BinaryNodeFns {
+        ClosureExprFn any;
+        ClosureExprFn int_int;
+        ClosureExprFn int_k;
+        bool comparison;
+    };
+
+    BinaryNodeFns binary_node_fns(TokenType op) {
+        switch (op) {
+            case TokenType::PLUS: {
+                return BinaryNodeFns{ add, add_int_int, add_int_k, false };
+            }
+            case TokenType::MINUS: {
+                return BinaryNodeFns{ subtract, subtract_int_int, subtract_int_k, false };
+            }
+            case TokenType::STAR: {
+                return BinaryNodeFns{ multiply, multiply_int_int, multiply_int_k, false };
+            }
+            case TokenType::SLASH: {
+                return BinaryNodeFns{ divide, divide_int_int, divide_int_k, false };
+            }
+            case TokenType::LESSER: {
+                return BinaryNodeFns{ less, less_int_int, less_int_k, true };
+            }
+            case TokenType::LESSER_EQUAL: {
+                return BinaryNodeFns{ less_equal, less_equal_int_int, less_equal_int_k, true };
+            }
+            case TokenType::GREATER: {
+                return BinaryNodeFns{ greater, greater_int_int, greater_int_k, true };
+            }
+            case TokenType::GREATER_EQUAL: {
+                return BinaryNodeFns{ greater_equal, greater_equal_int_int, greater_equal_int_k, true };
+            }
+            case TokenType::EQUAL_EQUAL: {
+                return BinaryNodeFns{ equal, equal_int_int, equal_int_k, true };
+            }
+            case TokenType::BANG_EQUAL: {
+                return BinaryNodeFns{ not_equal, not_equal_int_int, not_equal_int_k, true };
+            }
+            default: {
+                return BinaryNodeFns{ binary, nullptr, nullptr, false };
+            }
+        }
+    }
+
+    bool has_type(const ClosureExpr* expr, Value::Type type) {
+        return expr->typed && expr->type == type;
+    }
+};
+
+Array<ClosureStmt*> ClosureCompiler::compile(KauCompiler* compiler, Arena* arena, Array<Stmt>& stmts, bool from_prompt) {
+    m_compiler = compiler;
+    m_arena = arena;
+    m_from_prompt = from_prompt;
+    m_in_loop = false;
+    m_nodes = 0;
+    m_specialized = 0;
+
+    m_declarations.init(arena);
+    count_declarations(stmts, true);
+
+    Array<ClosureStmt*> program;
+    program.init(arena);
+    for (u64 i = 0; i < stmts.size(); ++i) {
+        program.push(compile_stmt(&stmts[i]));
+    }
+
+    compiler->stats.closure_nodes += m_nodes;
+    compiler->stats.closure_specialized_nodes += m_specialized;
+    return program;
+}
+
+void ClosureCompiler::count_declarations(Array<Stmt>& stmts, bool top_level) {
+    for (u64 i = 0; i < stmts.size(); ++i) {
+        count_declarations(&stmts[i], top_level);
+    }
+}
+
+void ClosureCompiler::count_declarations(Stmt* stmt, bool top_level) {
+    String name = {};
+    switch (stmt->ty) {
+        case Stmt::Type::BLOCK: {
+            count_declarations(stmt->s_block.stmts, false);
+            return;
+        }
+        case Stmt::Type::IF: {
+            count_declarations(stmt->s_if.if_stmt, false);
+            if (stmt->s_if.else_stmt->ty != Stmt::Type::ERR) {
+                count_declarations(stmt->s_if.else_stmt, false);
+            }
+            return;
+        }
+        case Stmt::Type::WHILE: {
+            count_declarations(stmt->s_while.body, false);
+            return;
+        }
+        case Stmt::Type::FN_DECLARATION: {
+            name = stmt->fn_declaration.name->m_lexeme;
+            count_declarations(stmt->fn_declaration.body, false);
+            break;
+        }
+        case Stmt::Type::CLASS_DECLARATION: {
+            name = stmt->s_class.name->m_lexeme;
+            for (u64 i = 0; i < stmt->s_class.members.size(); ++i) {
+                Stmt* member = &stmt->s_class.members[i];
+                if (member->ty == Stmt::Type::FN_DECLARATION) {
+                    count_declarations(member->fn_declaration.body, false);
+                }
+            }
+            break;
+        }
+        default: {
+            return;
+        }
+    }
+
+    Declarations* declarations = m_declarations.get(name);
+    if (declarations == nullptr) {
+        m_declarations.insert(name, Declarations{ 1, top_level });
+    } else {
+        declarations->count += 1;
+        declarations->top_level = declarations->top_level && top_level;
+    }
+}
+
+// Whether `name` is only ever bound to one function, in the global environment, so calls to it
+// only have to look it up until they find it. That's the case for names the program never
+// declares, like natives, and ones it declares once, at the top level, that aren't bound yet.
+// From the prompt, later lines can declare anything again.
+bool ClosureCompiler::is_fixed_callable(String name) {
+    if (m_from_prompt) {
+        return false;
+    }
+    const Declarations* declarations = m_declarations.get(name);
+    if (declarations == nullptr) {
+        return true;
+    }
+    return declarations->count == 1 && declarations->top_level && m_compiler->global_env.get_callable(name) == nullptr;
+}
+
+ClosureStmt* ClosureCompiler::compile_stmt(Stmt* stmt) {
+    ClosureStmt* node = nullptr;
+    switch (stmt->ty) {
+        case Stmt::Type::EXPR: {
+            ExprNode* expr_node = new_stmt<ExprNode>(expr_stmt);
+            expr_node->expr = compile_expr(stmt->s_expr.expr);
+            node = expr_node;
+            break;
+        }
+        case Stmt::Type::VAR_DECL: {
+            const VarDeclPayload& s_var_decl = stmt->s_var_decl;
+            VarDeclNode* var_decl = new_stmt<VarDeclNode>(s_var_decl.is_local ? var_decl_local : var_decl_global);
+            var_decl->name = s_var_decl.name;
+            var_decl->initializer = s_var_decl.initializer != nullptr ? compile_expr(s_var_decl.initializer) : nullptr;
+            var_decl->slot = s_var_decl.slot;
+            node = var_decl;
+            break;
+        }
+        case Stmt::Type::BLOCK: {
+            node = compile_block(stmt);
+            break;
+        }
+        case Stmt::Type::IF: {
+            IfNode* if_node = new_stmt<IfNode>(if_stmt);
+            if_node->token = stmt->s_if.token;
+            if_node->condition = compile_expr(stmt->s_if.condition);
+            if_node->then_stmt = compile_stmt(stmt->s_if.if_stmt);
+            if_node->else_stmt = stmt->s_if.else_stmt->ty != Stmt::Type::ERR ? compile_stmt(stmt->s_if.else_stmt) : nullptr;
+            node = if_node;
+            break;
+        }
+        case Stmt::Type::WHILE: {
+            WhileNode* while_node = new_stmt<WhileNode>(while_stmt);
+            while_node->token = stmt->s_while.token;
+            while_node->condition = compile_expr(stmt->s_while.condition);
+
+            const bool was_in_loop = m_in_loop;
+            m_in_loop = true;
+            while_node->body = compile_stmt(stmt->s_while.body);
+            m_in_loop = was_in_loop;
+            node = while_node;
+            break;
+        }
+        case Stmt::Type::BREAK:
+        case Stmt::Type::CONTINUE: {
+            const bool is_break = stmt->ty == Stmt::Type::BREAK;
+            JumpNode* jump_node = new_stmt<JumpNode>(m_in_loop ? jump : stray_jump);
+            jump_node->token = stmt->s_break_continue.token;
+            jump_node->value = is_break ? break_value() : continue_value();
+            jump_node->message = is_break
+                ? CREATE_STRING("'break' statement can only be used in a loop.")
+                : CREATE_STRING("'continue' statement can only be used in a loop.");
+            node = jump_node;
+            break;
+        }
+        case Stmt::Type::FN_DECLARATION: {
+            FnDeclarationNode* fn = new_stmt<FnDeclarationNode>(fn_declaration);
+            fn->declaration = &stmt->fn_declaration;
+            fn->body = compile_body(stmt->fn_declaration.body);
+            node = fn;
+            break;
+        }
+        case Stmt::Type::CLASS_DECLARATION: {
+            node = compile_class_declaration(stmt);
+            break;
+        }
+        case Stmt::Type::RETURN: {
+            ReturnNode* return_node = new_stmt<ReturnNode>(return_stmt);
+            return_node->expr = compile_expr(stmt->s_return.expr);
+            node = return_node;
+            break;
+        }
+        case Stmt::Type::ERR: {
+            node = new_stmt<ClosureStmt>(skip);
+            break;
+        }
+    }
+
+    if (m_from_prompt) {
+        EchoNode* echo_node = new_stmt<EchoNode>(echo);
+        echo_node->stmt = node;
+        node = echo_node;
+    }
+    return node;
+}
+
+// Function bodies run outside of any loop, and don't echo, wherever they are declared.
+ClosureStmt* ClosureCompiler::compile_body(Stmt* stmt) {
+    const bool was_from_prompt = m_from_prompt;
+    const bool was_in_loop = m_in_loop;
+    m_from_prompt = false;
+    m_in_loop = false;
+    ClosureStmt* body = compile_stmt(stmt);
+    m_from_prompt = was_from_prompt;
+    m_in_loop = was_in_loop;
+    return body;
+}
+
+ClosureStmt* ClosureCompiler::compile_block(Stmt* stmt) {
+    BlockPayload& s_block = stmt->s_block;
+    BlockNode* block_node = new_stmt<BlockNode>(block);
+    block_node->start = s_block.start;
+    block_node->slot_count = s_block.slot_count;
+    block_node->stmt_count = s_block.stmts.size();
+    block_node->stmts = (ClosureStmt**) m_arena->push_array<ClosureStmt*>(s_block.stmts.size());
+    for (u64 i = 0; i < s_block.stmts.size(); ++i) {
+        block_node->stmts[i] = compile_stmt(&s_block.stmts[i]);
+    }
+    return block_node;
+}
+
+ClosureStmt* ClosureCompiler::compile_class_declaration(Stmt* stmt) {
+    ClassDeclarationPayload& s_class = stmt->s_class;
+    ClassDeclarationNode* class_node = new_stmt<ClassDeclarationNode>(class_declaration);
+    class_node->stmt = stmt;
+    class_node->bodies = (ClosureStmt**) m_arena->push_array<ClosureStmt*>(s_class.members.size());
+    class_node->static_names = (String*) m_arena->push_array<String>(s_class.members.size());
+    for (u64 i = 0; i < s_class.members.size(); ++i) {
+        Stmt* member = &s_class.members[i];
+        if (member->ty != Stmt::Type::FN_DECLARATION) {
+            continue;
+        }
+        class_node->bodies[i] = compile_body(member->fn_declaration.body);
+        if (member->fn_declaration.is_static) {
+            class_node->static_names[i] = m_compiler->interner.intern(mangled_name(m_arena, s_class.name->m_lexeme, member->fn_declaration.name->m_lexeme));
+        }
+    }
+    return class_node;
+}
+
+ClosureExpr* ClosureCompiler::compile_expr(Expr* expr) {
+    switch (expr->ty) {
+        case Expr::Type::LITERAL: {
+            return compile_literal(expr->expr.literal->val, expr->expr.literal->location);
+        }
+        case Expr::Type::THIS: {
+            return compile_variable(expr->expr.this_expr->val, expr->expr.this_expr->location);
+        }
+        case Expr::Type::UNARY: {
+            return compile_unary(expr);
+        }
+        // NOTE: Quickened binary nodes keep their `BinaryExpr`.
+        case Expr::Type::BINARY:
+        case Expr::Type::INT_BINARY:
+        case Expr::Type::DOUBLE_BINARY: {
+            return compile_binary(expr);
+        }
+        // NOTE: Unlike in the tree walker, which drops it, a grouping evaluates to what's inside it, like in the VM.
+        case Expr::Type::GROUPING: {
+            return compile_expr(expr->expr.grouping->expr);
+        }
+        case Expr::Type::TERNARY: {
+            TernaryExpr* ternary_expr = expr->expr.ternary;
+            TernaryNode* ternary_node = new_expr<TernaryNode>(ternary);
+            ternary_node->op = ternary_expr->left_op;
+            ternary_node->condition = compile_expr(ternary_expr->left);
+            ternary_node->then_expr = compile_expr(ternary_expr->middle);
+            ternary_node->else_expr = compile_expr(ternary_expr->right);
+            ternary_node->typed = ternary_node->then_expr->typed && has_type(ternary_node->else_expr, ternary_node->then_expr->type);
+            ternary_node->type = ternary_node->then_expr->type;
+            return ternary_node;
+        }
+        case Expr::Type::ASSIGNMENT: {
+            AssignmentExpr* assignment = expr->expr.assignment;
+            AssignmentNode* assignment_node = new_expr<AssignmentNode>(assignment->location.is_local ? assign_local : assign_global);
+            assignment_node->name = assignment->id;
+            assignment_node->depth = assignment->location.depth;
+            assignment_node->slot = assignment->location.slot;
+            assignment_node->right = compile_expr(assignment->right);
+            assignment_node->typed = assignment_node->right->typed;
+            assignment_node->type = assignment_node->right->type;
+            return assignment_node;
+        }
+        case Expr::Type::AND:
+        case Expr::Type::OR: {
+            LogicalBinaryExpr* logical = expr->expr.logical_binary;
+            BinaryNode* logical_node = new_expr<BinaryNode>(expr->ty == Expr::Type::AND ? logical_and : logical_or);
+            logical_node->op = logical->op;
+            logical_node->left = compile_expr(logical->left);
+            logical_node->right = compile_expr(logical->right);
+            logical_node->typed = true;
+            logical_node->type = Value::Type::BOOL;
+            return logical_node;
+        }
+        case Expr::Type::FN_CALL: {
+            return compile_call(expr);
+        }
+        case Expr::Type::GET: {
+            GetExpr* get = expr->expr.get;
+            PropertyNode* get_node = new_expr<PropertyNode>(get_property);
+            get_node->member = get->member;
+            get_node->object = compile_expr(get->class_expr);
+            return get_node;
+        }
+        case Expr::Type::SET: {
+            SetExpr* set = expr->expr.set;
+            GetExpr* get = set->get->expr.get;
+            PropertyNode* set_node = new_expr<PropertyNode>(set_property);
+            set_node->member = get->member;
+            set_node->object = compile_expr(get->class_expr);
+            set_node->right = compile_expr(set->right);
+            return set_node;
+        }
+        case Expr::Type::STATIC_FN_CALL:
+        case Expr::Type::SUPER:
+        case Expr::Type::ERR: {
+            // NOTE: Only ever callees, see `compile_call`.
+            assert(false);
+            return nullptr;
+        }
+    }
+
+    assert(false);
+    return nullptr;
+}
+
+ClosureExpr* ClosureCompiler::compile_literal(const Token* token, const VariableLocation& location) {
+    Value value = {};
+    switch (token->m_type) {
+        case TokenType::FALSE: {
+            value = bool_value(false);
+            break;
+        }
+        case TokenType::TRUE: {
+            value = bool_value(true);
+            break;
+        }
+        case TokenType::NIL: {
+            value = Value{};
+            break;
+        }
+        case TokenType::NUMBER_INT: {
+            value = int_value(token->data.data.i);
+            break;
+        }
+        case TokenType::NUMBER_LONG: {
+            value = long_value(token->data.data.l, m_arena);
+            break;
+        }
+        case TokenType::NUMBER_FLOAT: {
+            value = float_value(token->data.data.f);
+            break;
+        }
+        case TokenType::NUMBER_DOUBLE: {
+            value = double_value(token->data.data.d);
+            break;
+        }
+        case TokenType::STRING: {
+            value = string_value(box_of(token->m_lexeme));
+            break;
+        }
+        case TokenType::IDENTIFIER: {
+            return compile_variable(token, location);
+        }
+        default: {
+            FailNode* fail_node = new_expr<FailNode>(fail);
+            fail_node->err = RuntimeError::unsupported_literal(token);
+            return fail_node;
+        }
+    }
+
+    ConstantNode* constant_node = new_expr<ConstantNode>(constant);
+    constant_node->value = value;
+    constant_node->typed = true;
+    constant_node->type = value.type();
+    return constant_node;
+}
+
+ClosureExpr* ClosureCompiler::compile_variable(const Token* token, const VariableLocation& location) {
+    ClosureExprFn fn = load_global;
+    if (location.is_local) {
+        fn = location.depth == 0 ? load_local0 : load_local;
+    }
+    VariableNode* variable = new_expr<VariableNode>(fn);
+    variable->name = token;
+    variable->depth = location.depth;
+    variable->slot = location.slot;
+    return variable;
+}
+
+ClosureExpr* ClosureCompiler::compile_unary(Expr* expr) {
+    UnaryExpr* unary = expr->expr.unary;
+    ClosureExpr* right = compile_expr(unary->right);
+    switch (unary->op->m_type) {
+        case TokenType::BANG: {
+            UnaryNode* not_node = new_expr<UnaryNode>(logical_not);
+            not_node->op = unary->op;
+            not_node->right = right;
+            not_node->typed = true;
+            not_node->type = Value::Type::BOOL;
+            return not_node;
+        }
+        case TokenType::MINUS: {
+            UnaryNode* negate_node = new_expr<UnaryNode>(negate);
+            negate_node->op = unary->op;
+            negate_node->right = right;
+            negate_node->typed = has_type(right, Value::Type::INT) || has_type(right, Value::Type::DOUBLE);
+            negate_node->type = right->type;
+            return negate_node;
+        }
+        default: {
+            FailNode* fail_node = new_expr<FailNode>(fail);
+            fail_node->err = RuntimeError::unsupported_unary_op(unary->op);
+            return fail_node;
+        }
+    }
+}
+
+// NOTE: Both operands of every operator have to have the same type, so if either of them is
+// known to be an int, a result can only come from two ints.
+ClosureExpr* ClosureCompiler::compile_binary(Expr* expr) {
+    BinaryExpr* binary = expr->expr.binary;
+    const BinaryNodeFns fns = binary_node_fns(binary->op->m_type);
+
+    BinaryNode* binary_node = new_expr<BinaryNode>(fns.any);
+    binary_node->op = binary->op;
+    binary_node->left = compile_expr(binary->left);
+    binary_node->right = compile_expr(binary->right);
+
+    ClosureExpr* left = binary_node->left;
+    ClosureExpr* right = binary_node->right;
+    if (fns.int_int != nullptr) {
+        if (has_type(left, Value::Type::INT) && has_type(right, Value::Type::INT)) {
+            binary_node->fn = fns.int_int;
+            m_specialized += 1;
+        } else if (right->fn == constant && has_type(right, Value::Type::INT)) {
+            binary_node->fn = fns.int_k;
+            binary_node->constant = ((ConstantNode*) right)->value.as_int();
+            m_specialized += 1;
+        }
+    }
+
+    if (fns.comparison) {
+        binary_node->typed = true;
+        binary_node->type = Value::Type::BOOL;
+    } else if (fns.int_int != nullptr) {
+        const bool is_int = has_type(left, Value::Type::INT) || has_type(right, Value::Type::INT);
+        const bool is_double = has_type(left, Value::Type::DOUBLE) || has_type(right, Value::Type::DOUBLE);
+        binary_node->typed = is_int || is_double;
+        binary_node->type = is_int ? Value::Type::INT : Value::Type::DOUBLE;
+    }
+    return binary_node;
+}
+
+ClosureExpr* ClosureCompiler::compile_call(Expr* expr) {
+    FnCallExpr* fn_call = expr->expr.fn_call;
+    Expr* callee = fn_call->callee;
+
+    CallNode* call = new_expr<CallNode>(call_named);
+    call->argument_count = fn_call->arguments.size();
+    call->arguments = (ClosureExpr**) m_arena->push_array<ClosureExpr*>(fn_call->arguments.size());
+
+    switch (callee->ty) {
+        case Expr::Type::LITERAL: {
+            const Token* token = callee->expr.literal->val;
+            if (token->m_type != TokenType::IDENTIFIER) {
+                FailNode* fail_node = new_expr<FailNode>(fail);
+                fail_node->err = RuntimeError::invalid_function_identifier(token);
+                return fail_node;
+            }
+            call->name = token;
+            call->callable_name = token->m_lexeme;
+            if (is_fixed_callable(token->m_lexeme)) {
+                call->fn = call_known;
+                m_specialized += 1;
+            }
+            break;
+        }
+        case Expr::Type::GET: {
+            GetExpr* get = callee->expr.get;
+            call->fn = call_method;
+            call->name = get->member;
+            call->object = compile_expr(get->class_expr);
+            break;
+        }
+        case Expr::Type::STATIC_FN_CALL: {
+            StaticFnCallExpr* static_fn = callee->expr.static_fn_call;
+            assert(static_fn->class_expr->ty == Expr::Type::LITERAL);
+            const String class_name = static_fn->class_expr->expr.literal->val->m_lexeme;
+            call->name = static_fn->fn_name;
+            call->callable_name = static_fn->callable_name;
+            call->fn = call_static;
+            if (is_fixed_callable(class_name) && m_compiler->global_env.get_callable(call->callable_name) == nullptr) {
+                call->fn = call_known;
+                m_specialized += 1;
+            }
+            break;
+        }
+        case Expr::Type::SUPER: {
+            SuperExpr* super_expr = callee->expr.super_expr;
+            call->fn = call_super;
+            call->name = super_expr->method;
+            call->location = super_expr->location;
+            break;
+        }
+        default: {
+            assert(false);
+            break;
+        }
+    }
+
+    for (u64 i = 0; i < fn_call->arguments.size(); ++i) {
+        call->arguments[i] = compile_expr(fn_call->arguments[i]);
+    }
+    return call;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "lib/arena.h"
+#include "lib/array.h"
+#include "lib/hash_map.h"
+#include "defs.h"
+
+#include "expr.h"
+#include "compiler.h"
+
+// The closure backend runs the same resolved AST the tree walker does, compiled once into a tree
+// of nodes that each know the one function that evaluates them, like `load_local(slot)` or an
+// int add. Everything the tree walker works out again every time it gets to a node, like what
+// kind of literal it is, how a variable was resolved, which operator a binary node has or what
+// a call's callee is, is decided by the compiler instead, and the node only does what's left.
+//
+// NOTE: Nodes otherwise run the tree walker's code and share its runtime, environments, frame
+// stack, frame arena and heap, so they behave the same, and functions declared by either can
+// be called from the other.
+
+struct ClosureExpr;
+struct ClosureStmt;
+
+using ClosureExprFn = RuntimeError(*)(ClosureExpr* node, KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value);
+using ClosureStmtFn = Value(*)(ClosureStmt* node, KauCompiler* compiler, Arena* arena, Environment* env);
+
+// Every kind of node extends one of these with what its function needs.
+struct ClosureExpr {
+    ClosureExprFn fn;
+    // Set when every value the node can evaluate to is known to have `type`, which lets the
+    // nodes using it pick versions of themselves that don't check.
+    bool typed;
+    Value::Type type;
+
+    RuntimeError evaluate(KauCompiler* compiler, Arena* arena, Environment* env, Value& in_value) {
+        return fn(this, compiler, arena, env, in_value);
+    }
+};
+
+struct ClosureStmt {
+    ClosureStmtFn fn;
+
+    Value execute(KauCompiler* compiler, Arena* arena, Environment* env) {
+        if (compiler->stack_overflowed) {
+            return Value{};
+        }
+        // NOTE: Same safe points as the tree walker, see `Stmt::evaluate`.
+        if (compiler->heap.should_collect()) {
+            compiler->collect_garbage(env);
+        }
+        return fn(this, compiler, arena, env);
+    }
+};
+
+// Turns resolved statements into closure nodes, allocated from `arena`.
+struct ClosureCompiler {
+    Array<ClosureStmt*> compile(KauCompiler* compiler, Arena* arena, Array<Stmt>& stmts, bool from_prompt);
+
+private:
+    // How often every function or class name is declared in the program, see `is_fixed_callable`.
+    struct Declarations {
+        u32 count;
+        bool top_level;
+    };
+
+    void count_declarations(Array<Stmt>& stmts, bool top_level);
+    void count_declarations(Stmt* stmt, bool top_level);
+    bool is_fixed_callable(String name);
+
+    ClosureStmt* compile_stmt(Stmt* stmt);
+    ClosureStmt* compile_body(Stmt* stmt);
+    ClosureStmt* compile_block(Stmt* stmt);
+    ClosureStmt* compile_class_declaration(Stmt* stmt);
+
+    ClosureExpr* compile_expr(Expr* expr);
+    ClosureExpr* compile_literal(const Token* token, const VariableLocation& location);
+    ClosureExpr* compile_variable(const Token* token, const VariableLocation& location);
+    ClosureExpr* compile_unary(Expr* expr);
+    ClosureExpr* compile_binary(Expr* expr);
+    ClosureExpr* compile_call(Expr* expr);
+
+    template<class T>
+    T* new_expr(ClosureExprFn fn) {
+        T* node = (T*) m_arena->push_struct<T>();
+        node->fn = fn;
+        m_nodes += 1;
+        return node;
+    }
+    template<class T>
+    T* new_stmt(ClosureStmtFn fn) {
+        T* node = (T*) m_arena->push_struct<T>();
+        node->fn = fn;
+        m_nodes += 1;
+        return node;
+    }
+
+    KauCompiler* m_compiler = nullptr;
+    Arena* m_arena = nullptr;
+    HashMap<String, Declarations, StringHasher> m_declarations;
+    // Statements from the prompt echo their values, but not the ones in function bodies.
+    bool m_from_prompt = false;
+    bool m_in_loop = false;
+
+    u64 m_nodes = 0;
+    u64 m_specialized = 0;
+};
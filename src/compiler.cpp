@@ -3,11 +3,19 @@
 #include "scanner.h"
 #include "parser.h"
 #include "resolver.h"
+#include "closures.h"
 
 #include <iostream>
 #include <ctime>
+#include <chrono>
 
 namespace {
+u64 now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
 long get_file_size(FILE* file) {
     const long prev = ftell(file);
 
@@ -21,26 +29,61 @@ long get_file_size(FILE* file) {
 };
 
 KauCompiler::KauCompiler() {
-    global_arena = alloc_arena();
+    global_arena = alloc_arena(ARENA_DEFAULT_RESERVE_SIZE, true);
+    frame_arena = alloc_arena();
+    frame_stack.init();
+    heap.init(GcConfig{});
+
+    interner.init(global_arena);
 
     global_env.init(global_arena);
+    global_env.heap = &heap;
     
     String clock_str = CREATE_STRING("clock");
-    global_env.define_callable(global_arena, clock_str, Callable(0, [](Array<Value> args, KauCompiler* compiler, Arena*, Environment* env) {
-        return Value{
-            .ty = Value::Type::LONG,
-            .l = clock()
-        };
+    global_env.define_callable(clock_str, native_function(0, [](KauCompiler* compiler, Value*) {
+        return long_value(clock(), &compiler->heap);
     }));
 
     String print_str = CREATE_STRING("print");
-    global_env.define_callable(global_arena, print_str, Callable(1, [](Array<Value> args, KauCompiler* compiler, Arena*, Environment* env) {
+    global_env.define_callable(print_str, native_function(1, [](KauCompiler*, Value* args) {
         const Value& val = args[0];
         val.print();
         return val;
     }));
 
-    locals.allocate(global_arena);
+    vm.init(global_arena);
+}
+
+KauCompiler::~KauCompiler() {
+    vm.release();
+    heap.release();
+    frame_stack.release();
+    frame_arena->release();
+    free(frame_arena);
+    global_arena->release();
+    free(global_arena);
+}
+
+void KauCompiler::collect_garbage(Environment* env) {
+    heap.collect([&]() {
+        heap.visit_environment(&global_env);
+        frame_stack.for_each_slot([this](Value& value) {
+            heap.visit(value);
+        });
+        visit_scopes(env);
+        frame_stack.for_each_frame([this](const Frame& frame) {
+            visit_scopes(frame.caller);
+        });
+        vm.visit_roots(&heap);
+    });
+}
+
+void KauCompiler::visit_scopes(Environment* env) {
+    // NOTE: Calls made at the same depth share most of their scopes, which are only visited
+    // again up to the globals, visited once on their own.
+    for (Environment* it = env; it != nullptr && it != &global_env; it = it->enclosing) {
+        heap.visit_environment(it);
+    }
 }
 
 void KauCompiler::error(int line, String message) {
@@ -49,33 +92,110 @@ void KauCompiler::error(int line, String message) {
 }
 
 void KauCompiler::runtime_error(int line, String message) {
+    if (stack_overflowed) {
+        return;
+    }
     fprintf(stderr, "[Line %d] Runtime Error: %.*s\n", line, (u32) message.len, message.chars);
     m_had_runtime_error = true;
 }
 
+RuntimeError KauCompiler::stack_overflow(const Token* token) {
+    const RuntimeError err = RuntimeError::stack_overflow(token);
+    runtime_error(token->m_line, err.message);
+    stack_overflowed = true;
+    return err;
+}
+
 int KauCompiler::run(char* program, int size, bool from_prompt) {
+    stack_overflowed = false;
+    const u64 environments_start = environments_created;
+    const HashMapCounters map_counters_start = hash_map_counters;
+    const InlineCacheCounters cache_counters_start = inline_cache_counters;
+    const QuickeningCounters quickening_counters_start = quickening_counters;
+
+    u64 phase_start = now_ns();
+    u64 arena_start = global_arena->get_pos();
+    auto end_phase = [&](Phase phase) {
+        const u64 phase_end = now_ns();
+        const u64 arena_end = global_arena->get_pos();
+        stats.phases[(u64) phase].ns += phase_end - phase_start;
+        stats.phases[(u64) phase].arena_bytes += arena_end - arena_start;
+        phase_start = phase_end;
+        arena_start = arena_end;
+    };
+    auto end_run = [&]() {
+        if (!collect_stats) {
+            return;
+        }
+        stats.environments += environments_created - environments_start;
+        stats.map_lookups += hash_map_counters.lookups - map_counters_start.lookups;
+        stats.map_probes += hash_map_counters.probes - map_counters_start.probes;
+        stats.inline_cache_hits += inline_cache_counters.hits - cache_counters_start.hits;
+        stats.inline_cache_misses += inline_cache_counters.misses - cache_counters_start.misses;
+        stats.inline_cache_megamorphic += inline_cache_counters.megamorphic - cache_counters_start.megamorphic;
+        stats.quickened_nodes += quickening_counters.rewrites - quickening_counters_start.rewrites;
+        stats.despecialized_nodes += quickening_counters.despecializations - quickening_counters_start.despecializations;
+        stats.quickened_evaluations += quickening_counters.hits - quickening_counters_start.hits;
+        if (global_arena->peak_offset > stats.peak_arena_bytes) {
+            stats.peak_arena_bytes = global_arena->peak_offset;
+        }
+        if (frame_stack.peak_slots() > stats.peak_frame_stack_slots) {
+            stats.peak_frame_stack_slots = frame_stack.peak_slots();
+        }
+        if (frame_arena->peak_offset > stats.peak_frame_arena_bytes) {
+            stats.peak_frame_arena_bytes = frame_arena->peak_offset;
+        }
+        stats.gc = heap.stats;
+    };
+
     Scanner scanner = Scanner(global_arena, program, size);
     scanner.scan_tokens(*this, global_arena);
+    stats.tokens += scanner.m_tokens.size();
+    end_phase(Phase::SCAN);
 
     Parser parser(scanner.m_tokens);
     Array<Stmt> stmts = parser.parse(global_arena);
+    end_phase(Phase::PARSE);
+    if (collect_stats) {
+        stats.count_nodes(stmts);
+        phase_start = now_ns();
+    }
     
-    u64 pre_resolve_pos = global_arena->get_pos();
+    // NOTE: Scopes only live while resolving, the results are stored on the AST,
+    // so the resolver gets its own scratch arena.
+    Arena* resolver_arena = alloc_arena();
     Resolver resolver = {};
-    resolver.init(global_arena);
+    resolver.init(resolver_arena);
     resolver.resolve(this, stmts);
+    stats.phases[(u64) Phase::RESOLVE].arena_bytes += resolver_arena->peak_offset;
+    resolver_arena->release();
+    free(resolver_arena);
+    end_phase(Phase::RESOLVE);
+
     if (m_had_error) {
+        end_run();
         return -1;
     }
-    global_arena->pop_to(pre_resolve_pos);
-    
-    for (u64 i = 0; i < stmts.size(); ++i) {
-        Stmt& stmt = stmts[i];
 
-        Value val = stmt.evaluate(this, this->global_arena, &global_env, from_prompt, false);
+    int result = 0;
+    if (backend == Backend::BYTECODE_VM || backend == Backend::REGISTER_VM) {
+        const BytecodeForm form = backend == Backend::REGISTER_VM ? BytecodeForm::REGISTER : BytecodeForm::STACK;
+        result = vm.interpret(this, stmts, from_prompt, form) == InterpretResult::OK ? 0 : -1;
+    } else if (backend == Backend::CLOSURES) {
+        ClosureCompiler closure_compiler = {};
+        Array<ClosureStmt*> program = closure_compiler.compile(this, global_arena, stmts, from_prompt);
+        for (u64 i = 0; i < program.size(); ++i) {
+            program[i]->execute(this, global_arena, &global_env);
+        }
+    } else {
+        for (u64 i = 0; i < stmts.size(); ++i) {
+            stmts[i].evaluate(this, this->global_arena, &global_env, from_prompt, false);
+        }
     }
+    end_phase(Phase::EXECUTE);
+    end_run();
 
-    return 0;
+    return result;
 }
 
 int KauCompiler::run_prompt() {
@@ -149,11 +269,10 @@ int KauCompiler::run_file(const char* file_path) {
     return 0;
 }
 
-RuntimeError KauCompiler::lookup_variable(Environment* env, const Token* name, Expr* expr, Value& in_value) {
-    u64* dist = (u64*) locals.get((u64) expr);
+RuntimeError KauCompiler::lookup_variable(Environment* env, const Token* name, const VariableLocation& location, Value& in_value) {
     Value* val;
-    if (dist != nullptr) {
-        val = env->get_at(name->m_lexeme, *dist);
+    if (location.is_local) {
+        val = env->get_at(location.depth, location.slot);
     } else {
         val = global_env.get(name->m_lexeme);
     }
@@ -161,7 +280,7 @@ RuntimeError KauCompiler::lookup_variable(Environment* env, const Token* name, E
     if (val == nullptr) {
         return RuntimeError::undefined_variable(name);
     }
-    if (val->ty == Value::Type::NIL) {
+    if (val->type() == Value::Type::NIL) {
         return RuntimeError::undefined_variable(name);
     }
 
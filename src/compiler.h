@@ -1,24 +1,61 @@
 #pragma once
 
 #include "lib/arena.h"
-#include "lib/map.h"
+#include "lib/hash_map.h"
+#include "lib/interner.h"
 #include "defs.h"
 
 #include "environment.h"
+#include "vm.h"
+#include "profiler.h"
+#include "stats.h"
+#include "gc.h"
+
+enum class Backend {
+    TREE_WALKER,
+    BYTECODE_VM,
+    // The bytecode VM, running the register form, see `BytecodeForm`.
+    REGISTER_VM,
+    // The tree walker's AST, compiled to closure nodes first, see closures.h.
+    CLOSURES,
+};
 
 struct KauCompiler {
     KauCompiler();
+    ~KauCompiler();
     
     bool m_had_error = false;
     bool m_had_runtime_error = false;
 
+    Backend backend = Backend::TREE_WALKER;
+
     Environment global_env = {};
-    Map locals;
 
-    RuntimeError lookup_variable(Environment* env, const Token* name, Expr* expr, Value& in_value);
+    // Identifiers and string literals are interned by the scanner.
+    StringInterner interner = {};
+
+    VM vm = {};
+
+    // Only samples anything once started, see `--profile`.
+    Profiler profiler = {};
+
+    // Strings and objects made while running, see `collect_garbage`.
+    Heap heap = {};
+
+    // Collects the nursery, and the whole heap if it is due, with the globals, the frame stack,
+    // the classes declared in `env` and the environments enclosing it, and in the ones every
+    // call in progress was made from, and the VM as roots.
+    void collect_garbage(Environment* env);
+    // Visits `env` and the environments enclosing it, short of the globals.
+    void visit_scopes(Environment* env);
+
+    RuntimeError lookup_variable(Environment* env, const Token* name, const VariableLocation& location, Value& in_value);
 
     void error(int line, String message);
     void runtime_error(int line, String message);
+    // Reports the frame stack overflowing and returns the error for the call to unwind with.
+    // NOTE: Nothing else runs or is reported after it, see `stack_overflowed`.
+    RuntimeError stack_overflow(const Token* token);
 
     int run(char* program, int size, bool from_prompt);
 
@@ -27,6 +64,22 @@ struct KauCompiler {
     int run_file(const char* file_path);
 
     bool hit_return = false;
+    // Set once the frame stack overflows, until the next run. Statements stop running and
+    // calls in progress unwind, without reporting an error for every frame they leave.
+    bool stack_overflowed = false;
+
+    Stats stats = {};
+    // Set by `--stats`. Whatever only `--stats` shows and costs something to count is only counted then.
+    bool collect_stats = false;
 
     Arena* global_arena;
+
+    // Tree walker calls allocate from here and pop it back when they return, so anything
+    // that outlives a call has to be copied out of it first.
+    Arena* frame_arena;
+    // Where the innermost call's memory starts in `frame_arena`.
+    u64 frame_start = 0;
+
+    // Tree walker locals and calls.
+    FrameStack frame_stack = {};
 };
\ No newline at end of file
@@ -1,52 +1,145 @@
 #include "environment.h"
+#include "stats.h"
+#include "gc.h"
+
+#include <new>
+
+Function native_function(int arity, NativeCallback callback) {
+    Function function = {};
+    function.ty = Function::Type::NATIVE;
+    function.m_arity = arity;
+    function.native = callback;
+    return function;
+}
+
+Function script_function(const FnDeclarationPayload* declaration, Environment* closure) {
+    Function function = {};
+    function.ty = Function::Type::SCRIPT;
+    function.m_arity = (int) declaration->params.size();
+    function.script = Function::ScriptPayload {
+        .declaration = declaration,
+        .closure = closure,
+        .frame_size = declaration->params.size(),
+        .klass = nullptr,
+        .is_initializer = false,
+        .compiled_body = nullptr,
+    };
+    return function;
+}
+
+Function method_function(const FnDeclarationPayload* declaration, Environment* closure, Class* klass) {
+    Function function = script_function(declaration, closure);
+    function.ty = Function::Type::METHOD;
+    function.script.klass = klass;
+    function.script.is_initializer = declaration->name->m_lexeme == CREATE_STRING("init");
+    return function;
+}
+
+Function constructor_function(Class* klass, Function* init) {
+    Function function = {};
+    function.ty = Function::Type::CONSTRUCTOR;
+    function.m_arity = init != nullptr ? init->m_arity : 0;
+    function.constructor = Function::ConstructorPayload {
+        .klass = klass,
+        .init = init,
+    };
+    return function;
+}
+
+Function* new_function(Arena* arena, Function function) {
+    Function* ptr = (Function*) arena->push_struct_no_zero<Function>();
+    *ptr = function;
+    return ptr;
+}
 
 void Environment::init(Arena* arena) {
-    values.allocate(arena);
-    callables.allocate(arena);
-    classes.allocate(arena);
+    environments_created += 1;
+    this->arena = arena;
+    values.init(arena);
+    callables.init(arena);
+    classes.init(arena);
 }
 
-void Environment::define(Arena* arena, const String str, Value in_value) {
-    values.insert(arena, str, HASH_STR(str), in_value);
+void FrameStack::init() {
+    m_slots = (Value*) calloc(FRAME_STACK_SLOTS_MAX, sizeof(Value));
+    m_top = m_slots;
+    m_end = m_slots + FRAME_STACK_SLOTS_MAX;
+    m_frames = (Frame*) malloc(FRAME_STACK_FRAMES_MAX * sizeof(Frame));
+    m_frame_count = 0;
 }
 
-bool Environment::contains(const String name) const {
-    const Value* val = (const Value*) values.get_const(HASH_STR(name));
-    if(val != nullptr) {
-        return true;
-    } else {
-        if (enclosing != nullptr) {
-            return enclosing->contains(name);
-        }
+void FrameStack::release() {
+    free(m_slots);
+    free(m_frames);
+    m_slots = m_top = m_end = nullptr;
+    m_frames = nullptr;
+    m_frame_count = 0;
+}
 
+Value* FrameStack::push_slots(u64 count) {
+    if (count > (u64) (m_end - m_top)) {
+        return nullptr;
+    }
+    Value* slots = m_top;
+    for (u64 i = 0; i < count; ++i) {
+        slots[i] = Value{};
+    }
+    m_top += count;
+    if ((u64) (m_top - m_slots) > m_peak_slots) {
+        m_peak_slots = m_top - m_slots;
+    }
+    return slots;
+}
+
+bool FrameStack::push_frame(Value* base, Environment* caller) {
+    if (m_frame_count == FRAME_STACK_FRAMES_MAX) {
         return false;
     }
+    m_frames[m_frame_count++] = Frame {
+        .base = base,
+        .caller = caller,
+    };
+    return true;
+}
+
+void Environment::init_local(Arena* arena, Value* slots, u64 slot_count) {
+    environments_created += 1;
+    this->arena = arena;
+    this->slots = slots;
+    this->slot_count = slot_count;
+    // NOTE: Most scopes never declare a function or class, and the ones that do declare a few,
+    // so these only allocate once they outgrow their inline bindings.
+    callables.init(arena);
+    classes.init(arena);
+}
+
+void Environment::define(Arena* arena, const String str, Value in_value) {
+    if (heap != nullptr) {
+        const Value* old_value = values.get(str);
+        heap->write_barrier(this, old_value != nullptr ? *old_value : Value{}, in_value);
+    }
+    values.insert(str, in_value);
+}
+
+// NOTE: Named values only live in the global scope, so these don't walk `enclosing`.
+bool Environment::contains(const String name) const {
+    return values.contains(name);
 }
 
 bool Environment::set(const String name, Value value) {
-    Value* val = (Value*) values.get(HASH_STR(name));
+    Value* val = values.get(name);
     if (val != nullptr) {
+        if (heap != nullptr) {
+            heap->write_barrier(this, *val, value);
+        }
         *val = value;
         return true;
-    } else {
-        if (enclosing != nullptr) {
-            return enclosing->set(name, value);
-        }
-
-        return false;
     }
+    return false;
 }
 
 Value* Environment::get(String name) {
-    Value* val = (Value*) values.get(HASH_STR(name));
-    if (val != nullptr) {
-        return val;
-    } else {
-        if (enclosing != nullptr) {
-            return enclosing->get(name);
-        }
-        return nullptr;
-    }
+    return values.get(name);
 }
 
 Environment* Environment::ancestor(u64 distance) {
@@ -57,18 +150,20 @@ Environment* Environment::ancestor(u64 distance) {
     return env;
 }
 
-Value* Environment::get_at(String name, u64 distance) {
-    return ancestor(distance)->get(name);
+Value* Environment::get_at(u64 distance, u64 slot) {
+    Environment* env = ancestor(distance);
+    assert(slot < env->slot_count);
+    return &env->slots[slot];
 }
 
-void Environment::define_callable(Arena* arena, const String str, Callable in_callable) {
-    callables.insert(arena, str, HASH_STR(str), in_callable);
+void Environment::define_callable(const String str, Function in_function) {
+    callables.insert(str, new_function(arena, in_function));
 }
 
-Callable* Environment::get_callable(String name) {
-    Callable* callable = (Callable*) callables.get(HASH_STR(name));
+Function* Environment::get_callable(String name) {
+    Function** callable = callables.get(name);
     if (callable != nullptr) {
-        return callable;
+        return *callable;
     } else {
         if (enclosing != nullptr) {
             return enclosing->get_callable(name);
@@ -79,13 +174,14 @@ Callable* Environment::get_callable(String name) {
 }
 
 void Environment::define_class(Arena* arena, const String str, Class in_class) {
-    classes.insert(arena, str, HASH_STR(str), in_class);
+    Class* class_ptr = new (arena->push_struct<Class>()) Class(in_class);
+    classes.insert(str, class_ptr);
 }
 
 Class* Environment::get_class(String name) {
-    Class* clss = (Class*) classes.get(HASH_STR(name));
+    Class** clss = classes.get(name);
     if (clss != nullptr) {
-        return clss;
+        return *clss;
     } else {
         if (enclosing != nullptr) {
             return enclosing->get_class(name);
@@ -2,43 +2,168 @@
 
 #include "lib/string.h"
 #include "lib/array.h"
+#include "lib/hash_map.h"
+#include "lib/small_map.h"
 
 #include "expr.h"
 
-#include <functional>
+#define FRAME_STACK_FRAMES_MAX 2048
+#define FRAME_STACK_SLOTS_MAX (FRAME_STACK_FRAMES_MAX * 64)
+// Functions and classes a scope can declare before its bindings for them move into a hash map.
+#define ENVIRONMENT_INLINE_BINDINGS 4
 
-using CallableCallback = std::function<Value(Array<Value>, KauCompiler*, Arena*, Environment*)>;
-struct Callable {
-    Callable() {}
-    Callable(int arity, CallableCallback callback) 
-        : m_arity(arity)
-        , m_callback(callback)
-    {}
+struct ClosureStmt;
 
-    int m_arity = 0;
-    CallableCallback m_callback;
+// Natives get their arguments already evaluated, as many as their arity, and can't fail.
+using NativeCallback = Value(*)(KauCompiler* compiler, Value* args);
+
+// Everything the tree walker can call, see `call_function`.
+struct Function {
+    enum class Type : u8 {
+        NATIVE,
+        // A `fn` declaration, or a static method.
+        SCRIPT,
+        // Gets its receiver as the first argument, ahead of the ones it declares.
+        METHOD,
+        // What a class's name calls, makes an instance and runs `init` on it.
+        CONSTRUCTOR,
+    };
+
+    struct ScriptPayload {
+        const FnDeclarationPayload* declaration;
+        // The environment the function was declared in, which encloses its body. Null for class
+        // members declared inside a call, since the class can outlive it, which are enclosed by
+        // whatever environment they are called from instead.
+        Environment* closure;
+        // Slots the call's own environment needs, one per parameter.
+        u64 frame_size;
+        // The class a method was declared in.
+        Class* klass;
+        bool is_initializer;
+        // Set when the closure backend declared the function, which then runs this instead of its body.
+        ClosureStmt* compiled_body;
+    };
+
+    struct ConstructorPayload {
+        Class* klass;
+        // The class's `init`, if it has one.
+        Function* init;
+    };
+
+    Type ty;
+    int m_arity;
+    union {
+        NativeCallback native;
+        ScriptPayload script;
+        ConstructorPayload constructor;
+    };
+};
+
+Function native_function(int arity, NativeCallback callback);
+Function script_function(const FnDeclarationPayload* declaration, Environment* closure);
+Function method_function(const FnDeclarationPayload* declaration, Environment* closure, Class* klass);
+Function constructor_function(Class* klass, Function* init);
+
+// Functions are kept behind a pointer so they don't move when the maps holding them grow.
+Function* new_function(Arena* arena, Function function);
+
+// A tree walker call in progress.
+struct Frame {
+    // First of the call's slots, its receiver or first argument, followed by the rest of them.
+    Value* base;
+    // Where the call was made from. The callee's environment only encloses where it was
+    // declared, so collections find the caller's through here.
+    Environment* caller;
+};
+
+// Slots of every tree walker scope that is running, calls and blocks alike, which are pushed
+// and popped in order. It is allocated up front, so slots never move and pushing a scope
+// doesn't touch any arena. Running out of it is a stack overflow.
+struct FrameStack {
+    void init();
+    void release();
+
+    // Returns `count` nil slots, or null if they don't fit.
+    Value* push_slots(u64 count);
+    // Pops `slots` and everything pushed after it.
+    void pop_slots(Value* slots) {
+        assert(slots >= m_slots && slots <= m_top);
+        m_top = slots;
+    }
+
+    // Returns false if there are too many calls in progress already.
+    bool push_frame(Value* base, Environment* caller);
+    void pop_frame() {
+        assert(m_frame_count > 0);
+        m_frame_count -= 1;
+    }
+
+    template<class F>
+    void for_each_slot(F fn) {
+        for (Value* it = m_slots; it < m_top; ++it) {
+            fn(*it);
+        }
+    }
+    template<class F>
+    void for_each_frame(F fn) {
+        for (u64 i = 0; i < m_frame_count; ++i) {
+            fn(m_frames[i]);
+        }
+    }
+
+    u64 peak_slots() const {
+        return m_peak_slots;
+    }
+
+private:
+    Value* m_slots = nullptr;
+    Value* m_top = nullptr;
+    Value* m_end = nullptr;
+    u64 m_peak_slots = 0;
+
+    Frame* m_frames = nullptr;
+    u64 m_frame_count = 0;
 };
 
 struct Environment {
+    // The global scope keeps its values in a map, since the resolver never sees
+    // globals and they have to be looked up by name.
     void init(Arena* arena);
+    // Local scopes get one value slot per variable the resolver declared in them, which live
+    // on the frame stack. `arena` is only for the functions and classes they declare.
+    void init_local(Arena* arena, Value* slots, u64 slot_count);
     
     void define(Arena* arena, const String str, Value in_value);
     bool contains(const String name) const;
     bool set(const String name, Value value);
     Value* get(const String name);
-    Value* get_at(const String name, u64 distance);
 
-    void define_callable(Arena* arena, const String str, Callable in_callable);
-    Callable* get_callable(const String name);
+    Value* get_at(u64 distance, u64 slot);
+
+    // The function goes in the scope's own arena, and goes away with it.
+    void define_callable(const String str, Function in_function);
+    Function* get_callable(const String name);
 
     void define_class(Arena* arena, const String str, Class in_class);
     Class* get_class(const String name);
 
-    Map values;
-    Map callables;
-    Map classes;
+    HashMap<String, Value, StringHasher> values;
+    Value* slots = nullptr;
+    u64 slot_count = 0;
+
+    // Where the scope's bindings, and the functions it declares, are allocated.
+    Arena* arena = nullptr;
+
+    // NOTE: Locals are resolved to slots, so these are the only bindings most scopes look up by name.
+    SmallMap<String, Function*, StringHasher, ENVIRONMENT_INLINE_BINDINGS> callables;
+    SmallMap<String, Class*, StringHasher, ENVIRONMENT_INLINE_BINDINGS> classes;
 
     Environment* ancestor(u64 distance);
     
     Environment* enclosing = nullptr;
+
+    // Set on environments that outlive every call, like the global one, which then have
+    // their writes go through the heap's write barrier instead of being scanned every minor collection.
+    Heap* heap = nullptr;
+    bool gc_remembered = false;
 };
\ No newline at end of file
@@ -4,118 +4,438 @@
 #include "defs.h"
 #include "environment.h"
 #include "compiler.h"
+#include "gc.h"
+#include "closures.h"
 
-#define TEST_BINARY_OP(VALUE_IN_TYPE, VALUE_IN_FIELD, VALUE_OUT_TYPE, VALUE_OUT_FIELD, OPERATOR) do {\
-    if (left_val.ty == Value::Type::VALUE_IN_TYPE) {\
-        in_value = Value {\
-            .ty = Value::Type::VALUE_OUT_TYPE,\
-            .VALUE_OUT_FIELD = left_val.VALUE_IN_FIELD OPERATOR right_val.VALUE_IN_FIELD\
-        };\
-        return RuntimeError::ok();\
-    }\
-} while(0)
+#include <string.h>
 
-#define CHECK_ERR(err) do {\
-    RuntimeError err_binding = err;\
-    if (!err_binding.is_ok()) {\
-        return err_binding;\
+#define TEST_BINARY_OP(VALUE_IN_TYPE, VALUE_IN_GETTER, VALUE_OUT_CONSTRUCTOR, OPERATOR) do {\
+    if (left_val.type() == Value::Type::VALUE_IN_TYPE) {\
+        in_value = VALUE_OUT_CONSTRUCTOR(left_val.VALUE_IN_GETTER() OPERATOR right_val.VALUE_IN_GETTER());\
+        return RuntimeError::ok();\
     }\
 } while(0)
 
 namespace {
-    bool is_numeric(Value::Type ty) {
-        return ty == Value::Type::DOUBLE ||
-            ty == Value::Type::FLOAT ||
-            ty == Value::Type::LONG ||
-            ty == Value::Type::INT;
+    bool in_frame_arena(KauCompiler* compiler, const void* ptr, u64 from) {
+        const u8* mem = (const u8*) compiler->frame_arena->mem;
+        return ptr >= mem + from && ptr < mem + compiler->frame_arena->offset;
     }
 
-    Value::Type highest_precision_type(Value::Type a, Value::Type b) {
-        assert(is_numeric(a) && is_numeric(b));
+    Value copied_string_value(Arena* arena, Value value) {
+        return string_value(boxed_string(arena, value.as_string()));
+    }
 
-        if (a == Value::Type::DOUBLE || b == Value::Type::DOUBLE) {
-            return Value::Type::DOUBLE;
+    Value heap_string_value(KauCompiler* compiler, Value value) {
+        return string_value(compiler->heap.copied_string(value.as_string()));
+    }
+
+    // Functions declared while running the closure backend carry their compiled body.
+    Value run_body(KauCompiler* compiler, const Function::ScriptPayload& script, Arena* arena, Environment* env) {
+        if (script.compiled_body != nullptr) {
+            return script.compiled_body->execute(compiler, arena, env);
         }
-        if (a == Value::Type::FLOAT || b == Value::Type::FLOAT) {
-            return Value::Type::FLOAT;
+        return script.declaration->body->evaluate(compiler, arena, env, false, false);
+    }
+
+    RuntimeError evaluate_operands(KauCompiler* compiler, Arena* arena, Environment* env, BinaryExpr* binary, Value& left_val, Value& right_val) {
+        CHECK_ERR(binary->left->evaluate(compiler, arena, env, left_val));
+
+        // NOTE: The right side can call into code that collects, while only this holds on to the left.
+        compiler->heap.push_root(&left_val);
+        RuntimeError right_err = binary->right->evaluate(compiler, arena, env, right_val);
+        compiler->heap.pop_root();
+        return right_err;
+    }
+
+    // What a quickened binary node does once its guard passed. Every binary operator works on
+    // ints and doubles, so these only have to pick the operation.
+    RuntimeError int_binary_op(const Token* op, int left, int right, Value& in_value) {
+        switch (op->m_type) {
+            case TokenType::PLUS: {
+                in_value = int_value(left + right);
+                break;
+            }
+            case TokenType::MINUS: {
+                in_value = int_value(left - right);
+                break;
+            }
+            case TokenType::STAR: {
+                in_value = int_value(left * right);
+                break;
+            }
+            case TokenType::SLASH: {
+                if (right == 0) {
+                    return RuntimeError::divide_by_zero(op);
+                }
+                in_value = int_value(left / right);
+                break;
+            }
+            case TokenType::GREATER: {
+                in_value = bool_value(left > right);
+                break;
+            }
+            case TokenType::GREATER_EQUAL: {
+                in_value = bool_value(left >= right);
+                break;
+            }
+            case TokenType::LESSER: {
+                in_value = bool_value(left < right);
+                break;
+            }
+            case TokenType::LESSER_EQUAL: {
+                in_value = bool_value(left <= right);
+                break;
+            }
+            case TokenType::BANG_EQUAL: {
+                in_value = bool_value(left != right);
+                break;
+            }
+            case TokenType::EQUAL_EQUAL: {
+                in_value = bool_value(left == right);
+                break;
+            }
+            default: {
+                return RuntimeError::unsupported_binary_op(op);
+            }
         }
-        if (a == Value::Type::LONG || b == Value::Type::LONG) {
-            return Value::Type::LONG;
+        return RuntimeError::ok();
+    }
+
+    RuntimeError double_binary_op(const Token* op, double left, double right, Value& in_value) {
+        switch (op->m_type) {
+            case TokenType::PLUS: {
+                in_value = double_value(left + right);
+                break;
+            }
+            case TokenType::MINUS: {
+                in_value = double_value(left - right);
+                break;
+            }
+            case TokenType::STAR: {
+                in_value = double_value(left * right);
+                break;
+            }
+            case TokenType::SLASH: {
+                if (right == 0.0) {
+                    return RuntimeError::divide_by_zero(op);
+                }
+                in_value = double_value(left / right);
+                break;
+            }
+            case TokenType::GREATER: {
+                in_value = bool_value(left > right);
+                break;
+            }
+            case TokenType::GREATER_EQUAL: {
+                in_value = bool_value(left >= right);
+                break;
+            }
+            case TokenType::LESSER: {
+                in_value = bool_value(left < right);
+                break;
+            }
+            case TokenType::LESSER_EQUAL: {
+                in_value = bool_value(left <= right);
+                break;
+            }
+            case TokenType::BANG_EQUAL: {
+                in_value = bool_value(left != right);
+                break;
+            }
+            case TokenType::EQUAL_EQUAL: {
+                in_value = bool_value(left == right);
+                break;
+            }
+            default: {
+                return RuntimeError::unsupported_binary_op(op);
+            }
         }
-        return Value::Type::INT;
+        return RuntimeError::ok();
+    }
+
+    // A quickened binary node whose guard failed goes back to being a plain one, and stays that way.
+    void despecialize(Expr* expr) {
+        expr->ty = Expr::Type::BINARY;
+        expr->expr.binary->generic = true;
+        quickening_counters.despecializations += 1;
+    }
+};
+
+// Pops every frame allocation made since `mark`, moving `value` out first if it lives there.
+// Outside of calls `arena` is the global one, and strings go on the heap instead.
+Value pop_frame(KauCompiler* compiler, u64 mark, Arena* arena, Value value) {
+    Arena* frame_arena = compiler->frame_arena;
+    const bool escapes = value.type() == Value::Type::STRING && in_frame_arena(compiler, value.as_boxed_string(), mark);
+    if (escapes && arena != frame_arena) {
+        value = heap_string_value(compiler, value);
+    }
+    frame_arena->pop_to(mark);
+    if (escapes && arena == frame_arena) {
+        value = copied_string_value(arena, value);
+    }
+    return value;
+}
+
+// A value stored somewhere that outlives the current call, like a global, a field or an
+// enclosing call's local, can't keep pointing into the call's frame.
+Value promoted_for_store(KauCompiler* compiler, const void* target, Value value) {
+    if (value.type() != Value::Type::STRING || !in_frame_arena(compiler, value.as_boxed_string(), 0)) {
+        return value;
+    }
+    if (in_frame_arena(compiler, target, compiler->frame_start)) {
+        return value;
     }
+    return heap_string_value(compiler, value);
+}
 
-    Callable construct_callable(FnDeclarationPayload fn_declaration) {
-        String fn_name = fn_declaration.name->m_lexeme;
+String mangled_name(Arena* arena, String left, String right) {
+    const String dot = CREATE_STRING(".");
+    const String* strings[3] = {
+        &left,
+        &dot,
+        &right
+    };
+    Span<const String*> strings_span = Span<const String*>(strings, 3);
+    return concatenated_strings(arena, strings_span);
+}
+
+// Runs `function` in `arena`. `args` are its slots on the frame stack, already evaluated,
+// the receiver first for methods and constructors. `caller` is the environment the call was made from.
+RuntimeError call_function(KauCompiler* compiler, Function* function, Value* args, Arena* arena, Environment* caller, Value& in_value) {
+    switch (function->ty) {
+        case Function::Type::NATIVE: {
+            in_value = function->native(compiler, args);
+            return RuntimeError::ok();
+        }
+        case Function::Type::SCRIPT: {
+            const Function::ScriptPayload& script = function->script;
 
-        return Callable(fn_declaration.params.size(), [fn_declaration](Array<Value> args, KauCompiler* compiler, Arena* arena, Environment* env) {
+            // NOTE: The resolver gives parameters the first slots, in declaration order,
+            // which is the order the caller pushed them in.
             Environment new_env = {};
-            new_env.init(arena);
-            new_env.enclosing = env;
+            new_env.init_local(arena, args, script.frame_size);
+            new_env.enclosing = script.closure != nullptr ? script.closure : caller;
 
-            for (size_t i = 0; i < fn_declaration.params.size(); ++i) {
-                new_env.define(arena, fn_declaration.params[i]->m_lexeme, args[i]);
+            in_value = run_body(compiler, script, arena, &new_env);
+            return RuntimeError::ok();
+        }
+        case Function::Type::METHOD: {
+            const Function::ScriptPayload& script = function->script;
+
+            // NOTE: Mirrors the class scope the resolver opens around methods, `super` first if there is one, then `this`.
+            // Without a superclass, the receiver's slot already is the whole class scope.
+            const bool has_super = script.klass->superclass != nullptr;
+            const u64 this_slot = has_super ? 1 : 0;
+            Value* class_slots = args;
+            if (has_super) {
+                class_slots = compiler->frame_stack.push_slots(2);
+                if (class_slots == nullptr) {
+                    return compiler->stack_overflow(script.declaration->name);
+                }
+                class_slots[0] = class_value(script.klass->superclass);
+                class_slots[1] = args[0];
             }
 
-            return fn_declaration.body->evaluate(compiler, arena, &new_env, false, false);
-        });
+            Environment class_env = {};
+            class_env.init_local(arena, class_slots, this_slot + 1);
+            class_env.enclosing = script.closure != nullptr ? script.closure : caller;
+
+            Environment new_env = {};
+            new_env.init_local(arena, args + 1, script.frame_size);
+            new_env.enclosing = &class_env;
+
+            const Value body_val = run_body(compiler, script, arena, &new_env);
+            in_value = script.is_initializer ? class_slots[this_slot] : body_val;
+            if (has_super) {
+                compiler->frame_stack.pop_slots(class_slots);
+            }
+            return RuntimeError::ok();
+        }
+        case Function::Type::CONSTRUCTOR: {
+            const Function::ConstructorPayload& constructor = function->constructor;
+
+            // NOTE: The caller left the first slot for the instance, the initializer's receiver.
+            // Collections update it in place if they move the instance.
+            args[0] = instance_value(new_instance(&compiler->heap, constructor.klass));
+            if (constructor.init != nullptr) {
+                Value init_val = {};
+                CHECK_ERR(call_function(compiler, constructor.init, args, arena, caller, init_val));
+            }
+            in_value = args[0];
+            return RuntimeError::ok();
+        }
     }
 
-    Callable construct_callable_class(FnDeclarationPayload fn_declaration, Class* class_ptr) {
-        String fn_name = fn_declaration.name->m_lexeme;
-        String this_str = CREATE_STRING("this");
-        bool is_initializer = fn_name == this_str;
-
-        return Callable(fn_declaration.params.size(), [fn_declaration, class_ptr, this_str, is_initializer](Array<Value> args, KauCompiler* compiler, Arena* arena, Environment* env) {
-            env->define(
-                arena,
-                this_str,
-                Value{
-                    .ty = Value::Type::CLASS,
-                    .m_class = class_ptr
-                }
-            );
-            if (class_ptr->superclass != nullptr) {
-                String super_str = CREATE_STRING("super");
-
-                env->define(
-                    arena,
-                    super_str,
-                    Value{
-                        .ty = Value::Type::CLASS,
-                        .m_class = class_ptr->superclass
-                    }
+    assert(false);
+    return RuntimeError::ok();
+}
+
+// Applies a binary operator to operands that were already evaluated.
+RuntimeError binary_op(KauCompiler* compiler, Arena* arena, const Token* op, Value left_val, Value right_val, Value& in_value) {
+    switch (op->m_type)
+    {
+        case TokenType::PLUS: {
+            if (left_val.type() != right_val.type()) {
+                    return RuntimeError::operands_must_be_equal(op);
+            }
+
+            TEST_BINARY_OP(FLOAT, as_float, float_value, +);
+            TEST_BINARY_OP(DOUBLE, as_double, double_value, +);
+            TEST_BINARY_OP(INT, as_int, int_value, +);
+
+            if (left_val.type() == Value::Type::STRING) {
+                in_value = string_value(arena == compiler->frame_arena
+                    ? boxed_concatenated_string(arena, left_val.as_string(), right_val.as_string())
+                    : compiler->heap.concatenated_string(left_val.as_string(), right_val.as_string())
                 );
+                return RuntimeError::ok();
             }
 
-            Environment new_env = {};
-            new_env.init(arena);
-            new_env.enclosing = env;
+            return RuntimeError::operands_do_not_support_operator(op);
+        }
+        case TokenType::MINUS: {
+            if (left_val.type() != right_val.type()) {
+                    return RuntimeError::operands_must_be_equal(op);
+            }
+
+            TEST_BINARY_OP(FLOAT, as_float, float_value, -);
+            TEST_BINARY_OP(DOUBLE, as_double, double_value, -);
+            TEST_BINARY_OP(INT, as_int, int_value, -);
 
-            for (size_t i = 0; i < fn_declaration.params.size(); ++i) {
-                new_env.define(arena, fn_declaration.params[i]->m_lexeme, args[i]);
+            return RuntimeError::operands_do_not_support_operator(op);
+        }
+        case TokenType::SLASH: {
+            if (left_val.type() != right_val.type()) {
+                    return RuntimeError::operands_must_be_equal(op);
             }
 
-            Value body_val = fn_declaration.body->evaluate(compiler, arena, &new_env, false, false);
-            if (is_initializer) {
-                return *env->get(this_str);
-            } else {
-                return body_val;
+            if (left_val.type() == Value::Type::FLOAT) {
+                if (right_val.as_float() == 0.0) {
+                    return RuntimeError::divide_by_zero(op);
+                }
+
+                in_value = float_value(left_val.as_float() / right_val.as_float());
+                return RuntimeError::ok();
             }
-        });
-    }
 
-    String mangled_name(Arena* arena, String left, String right) {
-        const String dot = CREATE_STRING(".");
-        const String* strings[3] = {
-            &left,
-            &dot,
-            &right
-        };
-        Span<const String*> strings_span = Span<const String*>(strings, 3);
-        return concatenated_strings(arena, strings_span);
+            if (left_val.type() == Value::Type::DOUBLE) {
+                if (right_val.as_double() == 0.0) {
+                    return RuntimeError::divide_by_zero(op);
+                }
+
+                in_value = double_value(left_val.as_double() / right_val.as_double());
+                return RuntimeError::ok();
+            }
+
+            if (left_val.type() == Value::Type::INT) {
+                if (right_val.as_int() == 0) {
+                    return RuntimeError::divide_by_zero(op);
+                }
+                
+                in_value = int_value(left_val.as_int() / right_val.as_int());
+                return RuntimeError::ok();
+            }
+
+            if (left_val.type() == Value::Type::LONG) {
+                if (right_val.as_long() == 0) {
+                    return RuntimeError::divide_by_zero(op);
+                }
+                
+                in_value = long_value(left_val.as_long() / right_val.as_long(), &compiler->heap);
+                return RuntimeError::ok();
+            }
+
+            return RuntimeError::operands_do_not_support_operator(op);
+        }
+        case TokenType::STAR: {
+            if (left_val.type() != right_val.type()) {
+                    return RuntimeError::operands_must_be_equal(op);
+            }
+
+            TEST_BINARY_OP(FLOAT, as_float, float_value, *);
+            TEST_BINARY_OP(DOUBLE, as_double, double_value, *);
+            TEST_BINARY_OP(INT, as_int, int_value, *);
+
+            return RuntimeError::operands_do_not_support_operator(op);
+        }
+        case TokenType::GREATER: {
+            if (left_val.type() != right_val.type()) {
+                    return RuntimeError::operands_must_be_equal(op);
+            }
+
+            TEST_BINARY_OP(FLOAT, as_float, bool_value, >);
+            TEST_BINARY_OP(DOUBLE, as_double, bool_value, >);
+            TEST_BINARY_OP(INT, as_int, bool_value, >);
+            TEST_BINARY_OP(STRING, as_string, bool_value, >);
+
+            return RuntimeError::operands_do_not_support_operator(op);
+        }
+        case TokenType::GREATER_EQUAL: {
+            if (left_val.type() != right_val.type()) {
+                    return RuntimeError::operands_must_be_equal(op);
+            }
+
+            TEST_BINARY_OP(FLOAT, as_float, bool_value, >=);
+            TEST_BINARY_OP(DOUBLE, as_double, bool_value, >=);
+            TEST_BINARY_OP(INT, as_int, bool_value, >=);
+            TEST_BINARY_OP(STRING, as_string, bool_value, >=);
+
+            return RuntimeError::operands_do_not_support_operator(op);
+        }
+        case TokenType::LESSER: {
+            if (left_val.type() != right_val.type()) {
+                    return RuntimeError::operands_must_be_equal(op);
+            }
+
+            TEST_BINARY_OP(FLOAT, as_float, bool_value, <);
+            TEST_BINARY_OP(DOUBLE, as_double, bool_value, <);
+            TEST_BINARY_OP(INT, as_int, bool_value, <);
+            TEST_BINARY_OP(STRING, as_string, bool_value, <);
+
+            return RuntimeError::operands_do_not_support_operator(op);
+        }
+        case TokenType::LESSER_EQUAL: {
+            if (left_val.type() != right_val.type()) {
+                    return RuntimeError::operands_must_be_equal(op);
+            }
+
+            TEST_BINARY_OP(FLOAT, as_float, bool_value, <=);
+            TEST_BINARY_OP(DOUBLE, as_double, bool_value, <=);
+            TEST_BINARY_OP(INT, as_int, bool_value, <=);
+            TEST_BINARY_OP(STRING, as_string, bool_value, <=);
+
+            return RuntimeError::operands_do_not_support_operator(op);
+        }
+        case TokenType::BANG_EQUAL: {
+            if (left_val.type() != right_val.type()) {
+                    return RuntimeError::operands_must_be_equal(op);
+            }
+
+            TEST_BINARY_OP(FLOAT, as_float, bool_value, !=);
+            TEST_BINARY_OP(DOUBLE, as_double, bool_value, !=);
+            TEST_BINARY_OP(INT, as_int, bool_value, !=);
+            TEST_BINARY_OP(STRING, as_string, bool_value, !=);
+
+            return RuntimeError::operands_do_not_support_operator(op);
+        }
+        case TokenType::EQUAL_EQUAL: {
+            if (left_val.type() != right_val.type()) {
+                    return RuntimeError::operands_must_be_equal(op);
+            }
+
+            TEST_BINARY_OP(FLOAT, as_float, bool_value, ==);
+            TEST_BINARY_OP(DOUBLE, as_double, bool_value, ==);
+            TEST_BINARY_OP(INT, as_int, bool_value, ==);
+            TEST_BINARY_OP(STRING, as_string, bool_value, ==);
+
+            return RuntimeError::operands_do_not_support_operator(op);
+        }
+        default: {
+            return RuntimeError::unsupported_binary_op(op);
+        }
     }
-};
+}
 
 RuntimeError RuntimeError::ok() {
     return RuntimeError {
@@ -267,6 +587,14 @@ RuntimeError RuntimeError::wrong_number_arguments(const Token* token) {
     };
 }
 
+RuntimeError RuntimeError::stack_overflow(const Token* token) {
+    return RuntimeError {
+        .ty = Type::STACK_OVERFLOW,
+        .token = token,
+        .message = CREATE_STRING("stack overflow")
+    };
+}
+
 bool RuntimeError::is_ok() const {
     return ty == Type::Ok;
 }
@@ -290,7 +618,9 @@ void Expr::print() const {
 
             break;
         }
-        case Type::BINARY: {
+        case Type::BINARY:
+        case Type::INT_BINARY:
+        case Type::DOUBLE_BINARY: {
             BinaryExpr* binary = expr.binary;
 
             binary->left->print();
@@ -400,62 +730,39 @@ RuntimeError Expr::evaluate(KauCompiler* compiler, Arena* arena, Environment* en
             switch (literal->val->m_type)
             {
                 case TokenType::FALSE: {
-                    in_value = Value {
-                        .ty = Value::Type::BOOL,
-                        .b = false
-                    };
+                    in_value = bool_value(false);
                     return RuntimeError::ok();
                 }
                 case TokenType::TRUE: {
-                    in_value = Value {
-                        .ty = Value::Type::BOOL,
-                        .b = true
-                    };
+                    in_value = bool_value(true);
                     return RuntimeError::ok();
                 }
                 case TokenType::NIL: {
-                    in_value = Value {
-                        .ty = Value::Type::NIL,
-                    };
+                    in_value = Value{};
                     return RuntimeError::ok();
                 }
                 case TokenType::NUMBER_INT: {
-                    in_value = Value {
-                        .ty = Value::Type::INT,
-                        .i = literal->val->data.data.i
-                    };
+                    in_value = int_value(literal->val->data.data.i);
                     return RuntimeError::ok();
                 }
                 case TokenType::NUMBER_LONG: {
-                    in_value = Value {
-                        .ty = Value::Type::LONG,
-                        .l = literal->val->data.data.l
-                    };
+                    in_value = long_value(literal->val->data.data.l, &compiler->heap);
                     return RuntimeError::ok();
                 }
                 case TokenType::NUMBER_FLOAT: {
-                    in_value = Value {
-                        .ty = Value::Type::FLOAT,
-                        .f = literal->val->data.data.f
-                    };
+                    in_value = float_value(literal->val->data.data.f);
                     return RuntimeError::ok();
                 }
                 case TokenType::NUMBER_DOUBLE: {
-                    in_value = Value {
-                        .ty = Value::Type::DOUBLE,
-                        .d = literal->val->data.data.d
-                    };
+                    in_value = double_value(literal->val->data.data.d);
                     return RuntimeError::ok();
                 }
                 case TokenType::STRING: {
-                    in_value = Value {
-                        .ty = Value::Type::STRING,
-                        .str = literal->val->m_lexeme
-                    };
+                    in_value = string_value(box_of(literal->val->m_lexeme));
                     return RuntimeError::ok();
                 }
                 case TokenType::IDENTIFIER: {
-                    return compiler->lookup_variable(env, literal->val, this, in_value);
+                    return compiler->lookup_variable(env, literal->val, literal->location, in_value);
                 }
                 default:  {
                     return RuntimeError::unsupported_literal(literal->val);
@@ -473,17 +780,33 @@ RuntimeError Expr::evaluate(KauCompiler* compiler, Arena* arena, Environment* en
             switch (unary->op->m_type)
             {
                 case TokenType::BANG: {
-                    if(right_val.ty != Value::Type::BOOL) {
+                    if(right_val.type() != Value::Type::BOOL) {
                         return RuntimeError::operand_must_be_bool(unary->op);
                     }
-                    right_val.b = !right_val.b;
+                    right_val = bool_value(!right_val.as_bool());
                     break;
                 }
                 case TokenType::MINUS: {
-                    if(right_val.ty == Value::Type::FLOAT) {
+                    if(right_val.type() == Value::Type::FLOAT) {
                         return RuntimeError::operand_must_be_float(unary->op);
                     }
-                    right_val.f = -right_val.f;
+                    switch (right_val.type()) {
+                        case Value::Type::INT: {
+                            right_val = int_value(-right_val.as_int());
+                            break;
+                        }
+                        case Value::Type::LONG: {
+                            right_val = long_value(-right_val.as_long(), &compiler->heap);
+                            break;
+                        }
+                        case Value::Type::DOUBLE: {
+                            right_val = double_value(-right_val.as_double());
+                            break;
+                        }
+                        default: {
+                            break;
+                        }
+                    }
                     break;
                 }
                 default: {
@@ -498,185 +821,52 @@ RuntimeError Expr::evaluate(KauCompiler* compiler, Arena* arena, Environment* en
             BinaryExpr* binary = expr.binary;
 
             Value left_val = {};
-            CHECK_ERR(binary->left->evaluate(compiler, arena, env, left_val));
-
             Value right_val = {};
-            CHECK_ERR(binary->right->evaluate(compiler, arena, env, right_val));
-
-            switch (binary->op->m_type)
-            {
-                case TokenType::PLUS: {
-                    if (left_val.ty != right_val.ty) {
-                            return RuntimeError::operands_must_be_equal(binary->op);
-                    }
-
-                    TEST_BINARY_OP(FLOAT, f, FLOAT, f, +);
-                    TEST_BINARY_OP(DOUBLE, d, DOUBLE, d, +);
-                    TEST_BINARY_OP(INT, i, INT, i, +);
-
-                    if (left_val.ty == Value::Type::STRING) {
-                        in_value = Value {
-                            .ty = Value::Type::STRING,
-                            .str = concatenated_string(arena, left_val.str, right_val.str)
-                        };
-                        return RuntimeError::ok();
-                    }
-
-                    return RuntimeError::operands_do_not_support_operator(binary->op);
-                }
-                case TokenType::MINUS: {
-                    if (left_val.ty != right_val.ty) {
-                            return RuntimeError::operands_must_be_equal(binary->op);
-                    }
-
-                    TEST_BINARY_OP(FLOAT, f, FLOAT, f, -);
-                    TEST_BINARY_OP(DOUBLE, d, DOUBLE, d, -);
-                    TEST_BINARY_OP(INT, i, INT, i, -);
-
-                    return RuntimeError::operands_do_not_support_operator(binary->op);
-                }
-                case TokenType::SLASH: {
-                    if (left_val.ty != right_val.ty) {
-                            return RuntimeError::operands_must_be_equal(binary->op);
-                    }
-
-                    if (left_val.ty == Value::Type::FLOAT) {
-                        if (right_val.f == 0.0) {
-                            return RuntimeError::divide_by_zero(binary->op);
-                        }
-
-                        in_value = Value {
-                            .ty = Value::Type::FLOAT,
-                            .f = left_val.f / right_val.f
-                        };
-                        return RuntimeError::ok();
-                    }
-
-                    if (left_val.ty == Value::Type::DOUBLE) {
-                        if (right_val.d == 0.0) {
-                            return RuntimeError::divide_by_zero(binary->op);
-                        }
-
-                        in_value = Value {
-                            .ty = Value::Type::DOUBLE,
-                            .d = left_val.d / right_val.d
-                        };
-                        return RuntimeError::ok();
-                    }
-
-                    if (left_val.ty == Value::Type::INT) {
-                        if (right_val.i == 0) {
-                            return RuntimeError::divide_by_zero(binary->op);
-                        }
-                        
-                        in_value = Value {
-                            .ty = Value::Type::INT,
-                            .i = left_val.i / right_val.i
-                        };
-                        return RuntimeError::ok();
-                    }
-
-                    if (left_val.ty == Value::Type::LONG) {
-                        if (right_val.l == 0) {
-                            return RuntimeError::divide_by_zero(binary->op);
-                        }
-                        
-                        in_value = Value {
-                            .ty = Value::Type::LONG,
-                            .l = left_val.l / right_val.l
-                        };
-                        return RuntimeError::ok();
-                    }
-
-                    return RuntimeError::operands_do_not_support_operator(binary->op);
-                }
-                case TokenType::STAR: {
-                    if (left_val.ty != right_val.ty) {
-                            return RuntimeError::operands_must_be_equal(binary->op);
-                    }
-
-                    TEST_BINARY_OP(FLOAT, f, FLOAT, f, *);
-                    TEST_BINARY_OP(DOUBLE, d, DOUBLE, d, *);
-                    TEST_BINARY_OP(INT, i, INT, i, *);
-
-                    return RuntimeError::operands_do_not_support_operator(binary->op);
-                }
-                case TokenType::GREATER: {
-                    if (left_val.ty != right_val.ty) {
-                            return RuntimeError::operands_must_be_equal(binary->op);
-                    }
-
-                    TEST_BINARY_OP(FLOAT, f, BOOL, b, >);
-                    TEST_BINARY_OP(DOUBLE, d, BOOL, b, >);
-                    TEST_BINARY_OP(INT, i, BOOL, b, >);
-                    TEST_BINARY_OP(STRING, str, BOOL, b, >);
-
-                    return RuntimeError::operands_do_not_support_operator(binary->op);
-                }
-                case TokenType::GREATER_EQUAL: {
-                    if (left_val.ty != right_val.ty) {
-                            return RuntimeError::operands_must_be_equal(binary->op);
-                    }
-
-                    TEST_BINARY_OP(FLOAT, f, BOOL, b, >=);
-                    TEST_BINARY_OP(DOUBLE, d, BOOL, b, >=);
-                    TEST_BINARY_OP(INT, i, BOOL, b, >=);
-                    TEST_BINARY_OP(STRING, str, BOOL, b, >=);
-
-                    return RuntimeError::operands_do_not_support_operator(binary->op);
-                }
-                case TokenType::LESSER: {
-                    if (left_val.ty != right_val.ty) {
-                            return RuntimeError::operands_must_be_equal(binary->op);
-                    }
-
-                    TEST_BINARY_OP(FLOAT, f, BOOL, b, <);
-                    TEST_BINARY_OP(DOUBLE, d, BOOL, b, <);
-                    TEST_BINARY_OP(INT, i, BOOL, b, <);
-                    TEST_BINARY_OP(STRING, str, BOOL, b, <);
-
-                    return RuntimeError::operands_do_not_support_operator(binary->op);
-                }
-                case TokenType::LESSER_EQUAL: {
-                    if (left_val.ty != right_val.ty) {
-                            return RuntimeError::operands_must_be_equal(binary->op);
-                    }
-
-                    TEST_BINARY_OP(FLOAT, f, BOOL, b, <=);
-                    TEST_BINARY_OP(DOUBLE, d, BOOL, b, <=);
-                    TEST_BINARY_OP(INT, i, BOOL, b, <=);
-                    TEST_BINARY_OP(STRING, str, BOOL, b, <=);
-
-                    return RuntimeError::operands_do_not_support_operator(binary->op);
+            CHECK_ERR(evaluate_operands(compiler, arena, env, binary, left_val, right_val));
+            CHECK_ERR(binary_op(compiler, arena, binary->op, left_val, right_val, in_value));
+
+            // NOTE: The node quickens on the operands it ran with first. Anything but two ints or two
+            // doubles, and anything after its guard failed once, keeps it generic for good.
+            if (!binary->generic) {
+                if (left_val.type() == Value::Type::INT && right_val.type() == Value::Type::INT) {
+                    ty = Type::INT_BINARY;
+                    quickening_counters.rewrites += 1;
+                } else if (left_val.is_double() && right_val.is_double()) {
+                    ty = Type::DOUBLE_BINARY;
+                    quickening_counters.rewrites += 1;
+                } else {
+                    binary->generic = true;
                 }
-                case TokenType::BANG_EQUAL: {
-                    if (left_val.ty != right_val.ty) {
-                            return RuntimeError::operands_must_be_equal(binary->op);
-                    }
-
-                    TEST_BINARY_OP(FLOAT, f, BOOL, b, !=);
-                    TEST_BINARY_OP(DOUBLE, d, BOOL, b, !=);
-                    TEST_BINARY_OP(INT, i, BOOL, b, !=);
-                    TEST_BINARY_OP(STRING, str, BOOL, b, !=);
+            }
+            return RuntimeError::ok();
+        }
+        case Type::INT_BINARY: {
+            BinaryExpr* binary = expr.binary;
 
-                    return RuntimeError::operands_do_not_support_operator(binary->op);
-                }
-                case TokenType::EQUAL_EQUAL: {
-                    if (left_val.ty != right_val.ty) {
-                            return RuntimeError::operands_must_be_equal(binary->op);
-                    }
+            Value left_val = {};
+            Value right_val = {};
+            CHECK_ERR(evaluate_operands(compiler, arena, env, binary, left_val, right_val));
+            if (left_val.type() == Value::Type::INT && right_val.type() == Value::Type::INT) {
+                quickening_counters.hits += 1;
+                return int_binary_op(binary->op, left_val.as_int(), right_val.as_int(), in_value);
+            }
 
-                    TEST_BINARY_OP(FLOAT, f, BOOL, b, ==);
-                    TEST_BINARY_OP(DOUBLE, d, BOOL, b, ==);
-                    TEST_BINARY_OP(INT, i, BOOL, b, ==);
-                    TEST_BINARY_OP(STRING, str, BOOL, b, ==);
+            despecialize(this);
+            return binary_op(compiler, arena, binary->op, left_val, right_val, in_value);
+        }
+        case Type::DOUBLE_BINARY: {
+            BinaryExpr* binary = expr.binary;
 
-                    return RuntimeError::operands_do_not_support_operator(binary->op);
-                }
-                default: {
-                    return RuntimeError::unsupported_binary_op(binary->op);
-                }
+            Value left_val = {};
+            Value right_val = {};
+            CHECK_ERR(evaluate_operands(compiler, arena, env, binary, left_val, right_val));
+            if (left_val.is_double() && right_val.is_double()) {
+                quickening_counters.hits += 1;
+                return double_binary_op(binary->op, left_val.as_double(), right_val.as_double(), in_value);
             }
+
+            despecialize(this);
+            return binary_op(compiler, arena, binary->op, left_val, right_val, in_value);
         }
         case Type::GROUPING: {
             GroupingExpr* grouping = expr.grouping;
@@ -695,11 +885,11 @@ RuntimeError Expr::evaluate(KauCompiler* compiler, Arena* arena, Environment* en
             Value left_val = {};
             CHECK_ERR(ternary->left->evaluate(compiler, arena, env, left_val));
 
-            if (left_val.ty != Value::Type::BOOL) {
+            if (left_val.type() != Value::Type::BOOL) {
                 return RuntimeError::operand_must_be_bool(ternary->left_op);
             }
 
-            if (left_val.b) {
+            if (left_val.as_bool()) {
                 Value middle_val = {};
                 CHECK_ERR(ternary->middle->evaluate(compiler, arena, env, middle_val));
 
@@ -723,15 +913,16 @@ RuntimeError Expr::evaluate(KauCompiler* compiler, Arena* arena, Environment* en
             Value right_val = {};
             CHECK_ERR(assignment->right->evaluate(compiler, arena, env, right_val));
 
-            in_value = right_val;
-
-            if (env->contains(assignment->id->m_lexeme)) {
-                const bool was_set = env->set(assignment->id->m_lexeme, right_val);
-                assert(was_set);
-            } else {
+            const VariableLocation& location = assignment->location;
+            if (location.is_local) {
+                Value* target = env->get_at(location.depth, location.slot);
+                right_val = promoted_for_store(compiler, target, right_val);
+                *target = right_val;
+            } else if (!compiler->global_env.set(assignment->id->m_lexeme, promoted_for_store(compiler, nullptr, right_val))) {
                 return RuntimeError::undefined_variable(assignment->id);
             }
-            
+
+            in_value = right_val;
 
             return RuntimeError::ok();
         }
@@ -740,16 +931,16 @@ RuntimeError Expr::evaluate(KauCompiler* compiler, Arena* arena, Environment* en
 
             Value left_val = {};
             CHECK_ERR(logical_and->left->evaluate(compiler, arena, env, left_val));
-            if (left_val.ty != Value::Type::BOOL) {
+            if (left_val.type() != Value::Type::BOOL) {
                 return RuntimeError::operand_must_be_bool(logical_and->op);
             }
 
             in_value = left_val;
 
-            if (left_val.b == true) {
+            if (left_val.as_bool() == true) {
                 Value right_val = {};
                 CHECK_ERR(logical_and->right->evaluate(compiler, arena, env, right_val));
-                if (right_val.ty != Value::Type::BOOL) {
+                if (right_val.type() != Value::Type::BOOL) {
                     return RuntimeError::operand_must_be_bool(logical_and->op);
                 }
 
@@ -763,21 +954,18 @@ RuntimeError Expr::evaluate(KauCompiler* compiler, Arena* arena, Environment* en
 
             Value left_val = {};
             CHECK_ERR(logical_or->left->evaluate(compiler, arena, env, left_val));
-            if (left_val.ty != Value::Type::BOOL) {
+            if (left_val.type() != Value::Type::BOOL) {
                 return RuntimeError::operand_must_be_bool(logical_or->op);
             }
 
             Value right_val = {};
             CHECK_ERR(logical_or->right->evaluate(compiler, arena, env, right_val));
 
-            if (right_val.ty != Value::Type::BOOL) {
+            if (right_val.type() != Value::Type::BOOL) {
                 return RuntimeError::operand_must_be_bool(logical_or->op);
             }
 
-            in_value = Value {
-                .ty = Value::Type::BOOL,
-                .b = left_val.b || right_val.b
-            };
+            in_value = bool_value(left_val.as_bool() || right_val.as_bool());
 
             return RuntimeError::ok();
         }
@@ -786,15 +974,18 @@ RuntimeError Expr::evaluate(KauCompiler* compiler, Arena* arena, Environment* en
             
             Expr* callee = fn_call->callee;
             
-            Callable* callable = nullptr;
+            Function* callable = nullptr;
             const Token* calllable_name = nullptr;
+            // Set for method calls, which get it as their first argument.
+            Value receiver = {};
+            bool has_receiver = false;
             if (callee->ty == Expr::Type::LITERAL) {
                 LiteralExpr* callee_literal = callee->expr.literal;
                 if (callee_literal->val->m_type != TokenType::IDENTIFIER) {
                     return RuntimeError::invalid_function_identifier(callee_literal->val);
                 }
 
-                Callable* literal_callable = env->get_callable(callee_literal->val->m_lexeme);
+                Function* literal_callable = env->get_callable(callee_literal->val->m_lexeme);
                 if (literal_callable == nullptr) {
                     return RuntimeError::undeclared_function(callee_literal->val);
                 }
@@ -802,21 +993,25 @@ RuntimeError Expr::evaluate(KauCompiler* compiler, Arena* arena, Environment* en
                 callable = literal_callable;
                 calllable_name = callee_literal->val;
             } else if (callee->ty == Expr::Type::GET) {
-                Value get_value = {};
-                CHECK_ERR(callee->evaluate(compiler, arena, env, get_value));
-                assert(get_value.ty == Value::Type::CALLABLE);
+                GetExpr* get = callee->expr.get;
+                CHECK_ERR(get->class_expr->evaluate(compiler, arena, env, receiver));
+                if (receiver.type() != Value::Type::INSTANCE) {
+                    return RuntimeError::object_must_be_struct(get->member);
+                }
+
+                Function* method = fn_call->cache.lookup(receiver.as_instance()->klass, get->member->m_lexeme).method;
+                if (method == nullptr) {
+                    return RuntimeError::class_does_not_have_field(get->member);
+                }
 
-                callable = get_value.callable;
-                calllable_name = callee->expr.get->member;
+                callable = method;
+                calllable_name = get->member;
+                has_receiver = true;
             }
             else if (callee->ty == Expr::Type::STATIC_FN_CALL) {
                 StaticFnCallExpr* static_fn = callee->expr.static_fn_call;
                 assert(static_fn->class_expr->ty == Expr::Type::LITERAL);
-                Expr* class_expr = static_fn->class_expr;
-                const Token* class_name = class_expr->expr.literal->val;
-
-                String static_fn_name = mangled_name(arena, class_name->m_lexeme, static_fn->fn_name->m_lexeme);
-                Callable* class_callable = compiler->global_env.get_callable(static_fn_name);
+                Function* class_callable = compiler->global_env.get_callable(static_fn->callable_name);
                 if (class_callable == nullptr) {
                     return RuntimeError::undeclared_function(static_fn->fn_name);
                 }
@@ -828,41 +1023,82 @@ RuntimeError Expr::evaluate(KauCompiler* compiler, Arena* arena, Environment* en
                 SuperExpr* super_expr = callee->expr.super_expr;
 
                 Value super_value = {};
-                CHECK_ERR(compiler->lookup_variable(env, super_expr->keyword, this, super_value));
-                assert(super_value.ty == Value::Type::CLASS);
-                Class* super_class = super_value.m_class;
+                CHECK_ERR(compiler->lookup_variable(env, super_expr->keyword, super_expr->location, super_value));
+                assert(super_value.type() == Value::Type::CLASS);
+                Class* super_class = super_value.as_class();
 
-                Callable* super_method = super_class->get_method(super_expr->method->m_lexeme);
+                Function* super_method = super_class->get_method(super_expr->method->m_lexeme);
                 if (super_method == nullptr) {
                     return RuntimeError::undeclared_function(super_expr->method);
                 }
 
+                // NOTE: `this` is declared right after `super`, see `call_function`.
+                receiver = *env->get_at(super_expr->location.depth, super_expr->location.slot + 1);
+                has_receiver = true;
                 callable = super_method;
                 calllable_name = super_expr->method;
             } else {
                 assert(false);
             }
 
-            if (callable->m_arity != fn_call->arguments.size()) {
+            if ((u64) callable->m_arity != fn_call->arguments.size()) {
                 return RuntimeError::wrong_number_arguments(calllable_name);
             }
 
-            Array<Value> values;
-            values.init(arena, fn_call->arguments.size());
+            // NOTE: The arguments go on the frame stack, where they become the callee's parameters.
+            // Everything the call allocates goes in a new frame of the frame arena, which is
+            // popped as soon as it returns. Only the return value is copied out of it.
+            const u64 first_arg = has_receiver || callable->ty == Function::Type::CONSTRUCTOR ? 1 : 0;
+            Value* args = compiler->frame_stack.push_slots(first_arg + fn_call->arguments.size());
+            if (args == nullptr) {
+                return compiler->stack_overflow(calllable_name);
+            }
+            if (has_receiver) {
+                args[0] = receiver;
+            }
+
+            Arena* frame_arena = compiler->frame_arena;
+            const u64 frame_mark = frame_arena->get_pos();
+            const u64 caller_frame_start = compiler->frame_start;
+            compiler->frame_start = frame_mark;
+
             for (size_t i = 0; i < fn_call->arguments.size(); ++i) {
                 Value arg_val = {};
-                RuntimeError err = fn_call->arguments[i]->evaluate(compiler, arena, env, arg_val);
+                RuntimeError err = fn_call->arguments[i]->evaluate(compiler, frame_arena, env, arg_val);
                 if (!err.is_ok()) {
+                    compiler->frame_start = caller_frame_start;
+                    frame_arena->pop_to(frame_mark);
+                    compiler->frame_stack.pop_slots(args);
                     return err;
                 }
-                values[i] = arg_val;
+                args[first_arg + i] = arg_val;
             }
 
-
-            const Value ret_value = callable->m_callback(values, compiler, arena, env);
-            in_value = ret_value;
+            Value ret_value = {};
+            RuntimeError call_err = RuntimeError::ok();
+            if (!compiler->frame_stack.push_frame(args, env)) {
+                call_err = compiler->stack_overflow(calllable_name);
+            } else {
+                const bool profiling = compiler->profiler.is_running();
+                if (profiling) {
+                    compiler->profiler.enter(calllable_name->m_lexeme, calllable_name->m_line);
+                }
+                call_err = call_function(compiler, callable, args, frame_arena, env, ret_value);
+                if (profiling) {
+                    compiler->profiler.exit();
+                }
+                compiler->frame_stack.pop_frame();
+            }
+            compiler->frame_stack.pop_slots(args);
+            compiler->frame_start = caller_frame_start;
+            in_value = pop_frame(compiler, frame_mark, arena, ret_value);
 
             compiler->hit_return = false;
+            CHECK_ERR(call_err);
+            // NOTE: An overflow further down was already reported, this only unwinds the caller.
+            if (compiler->stack_overflowed) {
+                return RuntimeError::stack_overflow(calllable_name);
+            }
 
             return RuntimeError::ok();
         }
@@ -871,84 +1107,127 @@ RuntimeError Expr::evaluate(KauCompiler* compiler, Arena* arena, Environment* en
 
             Value expr_val = {};
             CHECK_ERR(get->class_expr->evaluate(compiler, arena, env, expr_val));
-            if (expr_val.ty != Value::Type::CLASS) {
+            if (expr_val.type() != Value::Type::INSTANCE) {
                 return RuntimeError::object_must_be_struct(get->member);
             }
 
-            const bool has_field = expr_val.m_class->get(get->member->m_lexeme, in_value);
-            if (has_field) {
+            Instance* instance = expr_val.as_instance();
+            const InlineCache::Entry entry = get->cache.lookup(instance->klass, get->member->m_lexeme);
+            if (entry.slot != INLINE_CACHE_NO_SLOT) {
+                in_value = instance->fields()[entry.slot];
+                return RuntimeError::ok();
+            }
+            if (entry.method != nullptr) {
+                in_value = callable_value(entry.method);
                 return RuntimeError::ok();
-            } else {
-                return RuntimeError::class_does_not_have_field(get->member);
             }
+            return RuntimeError::class_does_not_have_field(get->member);
         }
         case Type::SET: {
             SetExpr* set = expr.set;
             GetExpr* get = set->get->expr.get;
 
-            Value class_val = {};
-            CHECK_ERR(get->class_expr->evaluate(compiler, arena, env, class_val));
-            if (class_val.ty != Value::Type::CLASS) {
+            Value instance_val = {};
+            CHECK_ERR(get->class_expr->evaluate(compiler, arena, env, instance_val));
+            if (instance_val.type() != Value::Type::INSTANCE) {
                 return RuntimeError::object_must_be_struct(get->member);
             }
 
-            const bool has_field = class_val.m_class->contains_field(get->member->m_lexeme);
-            if (has_field) {
-                Value right_val = {};
-                CHECK_ERR(set->right->evaluate(compiler, arena, env, right_val));
-
-                class_val.m_class->set_field(get->member->m_lexeme, right_val);
-
-                return RuntimeError::ok();
-            } else {
+            const u32 slot = set->cache.lookup(instance_val.as_instance()->klass, get->member->m_lexeme).slot;
+            if (slot == INLINE_CACHE_NO_SLOT) {
                 return RuntimeError::class_does_not_have_field(get->member);
             }
+
+            // NOTE: The right side can collect, which can move the instance.
+            Value right_val = {};
+            compiler->heap.push_root(&instance_val);
+            RuntimeError right_err = set->right->evaluate(compiler, arena, env, right_val);
+            compiler->heap.pop_root();
+            CHECK_ERR(right_err);
+
+            Instance* instance = instance_val.as_instance();
+            right_val = promoted_for_store(compiler, nullptr, right_val);
+            compiler->heap.write_barrier(instance, instance->fields()[slot], right_val);
+            instance->fields()[slot] = right_val;
+
+            return RuntimeError::ok();
         }
         case Type::THIS: {
             ThisExpr* this_expr = expr.this_expr;
-            return compiler->lookup_variable(env, this_expr->val, this, in_value);
+            return compiler->lookup_variable(env, this_expr->val, this_expr->location, in_value);
         }
     }
 }
 
 void Value::print() const {
-    switch (ty)
+    switch (type())
     {
         case Type::NIL: {
             fprintf(stdout, "nil\n");
             break;
         }
         case Type::BOOL: {
-            fprintf(stdout, "%s\n", b ? "true" : "false");
+            fprintf(stdout, "%s\n", as_bool() ? "true" : "false");
             break;
         }
         case Type::FLOAT: {
-            fprintf(stdout, "%f\n", f);
+            fprintf(stdout, "%f\n", as_float());
             break;
         }
         case Type::DOUBLE: {
-            fprintf(stdout, "%lf\n", d);
+            fprintf(stdout, "%lf\n", as_double());
             break;
         }
         case Type::INT: {
-            fprintf(stdout, "%d\n", i);
+            fprintf(stdout, "%d\n", as_int());
             break;
         }
         case Type::LONG: {
-            fprintf(stdout, "%ld\n", l);
+            fprintf(stdout, "%ld\n", as_long());
             break;
         }
         case Type::STRING: {
-            fprintf(stdout, "%.*s\n", (u32) str.len, str.chars);
+            const BoxedString* str = as_boxed_string();
+            fprintf(stdout, "%.*s\n", (u32) str->len, str->chars());
             break;
         }
         case Type::CLASS: {
-            m_class->print();
+            as_class()->print();
+            break;
+        }
+        case Type::OBJECT: {
+            print_object(as_object());
+            break;
+        }
+        case Type::INSTANCE: {
+            as_instance()->klass->print();
+            break;
         }
     }
 }
 
+Value boxed_long_value(Heap* heap, long l) {
+    long* boxed = (long*) heap->allocate(sizeof(long), GcKind::RAW);
+    *boxed = l;
+    return Value::tagged(VALUE_TAG_BOXED_LONG, (u64) boxed);
+}
+
+Value boxed_long_value(Arena* arena, long l) {
+    long* boxed = (long*) arena->push_struct_no_zero<long>();
+    *boxed = l;
+    return Value::tagged(VALUE_TAG_BOXED_LONG, (u64) boxed);
+}
+
 Value Stmt::evaluate(KauCompiler* compiler, Arena* arena, Environment* env, bool from_prompt, bool in_loop) {
+    if (compiler->stack_overflowed) {
+        return Value{};
+    }
+    // NOTE: Statements are the tree walker's safe points. Everything live is either reachable
+    // from `env` or the environments of the calls in progress, or was pushed as a heap root.
+    if (compiler->heap.should_collect()) {
+        compiler->collect_garbage(env);
+    }
+
     Value expr_val = {};
 
     switch (ty)
@@ -967,23 +1246,44 @@ Value Stmt::evaluate(KauCompiler* compiler, Arena* arena, Environment* env, bool
                     compiler->runtime_error(expr_err.token->m_line, expr_err.message);
                 }
             }
-            env->define(arena, s_var_decl.name->m_lexeme, expr_val);
+            if (s_var_decl.is_local) {
+                env->slots[s_var_decl.slot] = expr_val;
+            } else {
+                env->define(arena, s_var_decl.name->m_lexeme, expr_val);
+            }
             break;
         }
         case Stmt::Type::BLOCK: {
+            // NOTE: The block's slots go on the frame stack. Outside of calls, functions and classes
+            // it declares still go in the frame arena, so a loop body at the top level doesn't grow
+            // the global arena every iteration.
+            Arena* frame_arena = compiler->frame_arena;
+            const bool own_frame = arena != frame_arena;
+            const u64 frame_mark = frame_arena->get_pos();
+
+            Value* block_slots = compiler->frame_stack.push_slots(s_block.slot_count);
+            if (block_slots == nullptr) {
+                compiler->stack_overflow(s_block.start);
+                break;
+            }
+
             Environment new_env = {};
-            new_env.init(arena);
+            new_env.init_local(own_frame ? frame_arena : arena, block_slots, s_block.slot_count);
             new_env.enclosing = env;
-            for (int i = 0; i < s_block.stmts.size(); ++i) {
+            for (u64 i = 0; i < s_block.stmts.size(); ++i) {
                 expr_val = s_block.stmts[i].evaluate(compiler, arena, &new_env, from_prompt, in_loop);
                 // continue statement stops current block from exeuting further, like a break.
-                if (expr_val.ty == Value::Type::BREAK ||
-                    expr_val.ty == Value::Type::CONTINUE ||
+                if (expr_val.type() == Value::Type::BREAK ||
+                    expr_val.type() == Value::Type::CONTINUE ||
                     compiler->hit_return
                 ) {
                     break;
                 }
             }
+            compiler->frame_stack.pop_slots(block_slots);
+            if (own_frame) {
+                frame_arena->pop_to(frame_mark);
+            }
             break;
         }
         case Stmt::Type::IF: {
@@ -992,10 +1292,10 @@ Value Stmt::evaluate(KauCompiler* compiler, Arena* arena, Environment* env, bool
             if (!expr_err.is_ok()) {
                 compiler->runtime_error(expr_err.token->m_line, expr_err.message);
             }
-            if (test_expr_val.ty != Value::Type::BOOL) {
+            if (test_expr_val.type() != Value::Type::BOOL) {
                 compiler->runtime_error(expr_err.token->m_line, CREATE_STRING("if test expression must evaluate to bool"));
             }
-            bool if_result = test_expr_val.b;
+            bool if_result = test_expr_val.as_bool();
 
             if (if_result) {
                 expr_val = s_if.if_stmt->evaluate(compiler, arena, env, from_prompt, in_loop);
@@ -1012,15 +1312,15 @@ Value Stmt::evaluate(KauCompiler* compiler, Arena* arena, Environment* env, bool
                 if (!expr_err.is_ok()) {
                     compiler->runtime_error(expr_err.token->m_line, expr_err.message);
                 }
-                if (test_expr_val.ty != Value::Type::BOOL) {
+                if (test_expr_val.type() != Value::Type::BOOL) {
                     compiler->runtime_error(expr_err.token->m_line, CREATE_STRING("while test expression must evaluate to bool"));
                 }
-                if(!test_expr_val.b) {
+                if(!test_expr_val.as_bool()) {
                     break;
                 }
 
                 expr_val = s_while.body->evaluate(compiler, arena, env, from_prompt, true);
-                if (expr_val.ty == Value::Type::BREAK || compiler->hit_return) {
+                if (expr_val.type() == Value::Type::BREAK || compiler->hit_return || compiler->stack_overflowed) {
                     break;
                 }
             }
@@ -1030,25 +1330,20 @@ Value Stmt::evaluate(KauCompiler* compiler, Arena* arena, Environment* env, bool
             if (!in_loop) {
                 compiler->runtime_error(s_break_continue.token->m_line, CREATE_STRING("'break' statement can only be used in a loop."));
             }
-            expr_val = Value {
-                .ty = Value::Type::BREAK
-            };
+            expr_val = break_value();
             break;
         }
         case Stmt::Type::CONTINUE: {
             if (!in_loop) {
                 compiler->runtime_error(s_break_continue.token->m_line, CREATE_STRING("'continue' statement can only be used in a loop."));
             }
-            expr_val = Value {
-                .ty = Value::Type::CONTINUE
-            };
+            expr_val = continue_value();
             break;
         }
         case Stmt::Type::FN_DECLARATION: {
             String fn_name = fn_declaration.name->m_lexeme;
-            FnDeclarationPayload fn = fn_declaration;
 
-            env->define_callable(arena, fn_name, construct_callable(fn));
+            env->define_callable(fn_name, script_function(&fn_declaration, env));
 
             break;
         }
@@ -1058,7 +1353,6 @@ Value Stmt::evaluate(KauCompiler* compiler, Arena* arena, Environment* env, bool
             Class* superclass = nullptr;
 
             if (s_class.superclass != nullptr) {
-                Value superclass_val = {};
                 assert(s_class.superclass->ty == Expr::Type::LITERAL);
                 const Token* superclass_token = s_class.superclass->expr.literal->val;
                 superclass = env->get_class(superclass_token->m_lexeme);
@@ -1067,69 +1361,74 @@ Value Stmt::evaluate(KauCompiler* compiler, Arena* arena, Environment* env, bool
                 }
             }
 
-            env->define_class(arena, class_name_token->m_lexeme, Class());
+            // NOTE: A class declared inside a call can still be returned from it, so it never goes in the frame.
+            Arena* class_arena = compiler->global_arena;
+
+            env->define_class(class_arena, class_name_token->m_lexeme, Class());
             Class* new_class = nullptr;
             new_class = env->get_class(class_name_token->m_lexeme);
             assert(new_class != nullptr);
             new_class->m_name = class_name;
-            new_class->m_methods.allocate(arena);
-            new_class->m_fields.allocate(arena);
+            new_class->m_methods.init(class_arena);
+            new_class->m_shape.slots.init(class_arena);
+            new_class->m_field_defaults.init(class_arena);
             new_class->superclass = superclass;
 
+            if (superclass != nullptr) {
+                superclass->m_shape.slots.for_each([new_class](const String& name, const u32& slot) {
+                    new_class->m_shape.slots.insert(name, slot);
+                });
+                for (u64 i = 0; i < superclass->m_field_defaults.size(); ++i) {
+                    compiler->heap.write_barrier(new_class, Value{}, superclass->m_field_defaults[i]);
+                    new_class->m_field_defaults.push(superclass->m_field_defaults[i]);
+                }
+            }
+
+            // NOTE: Unlike plain functions, members can be called after the environment the class was
+            // declared in is gone, so only the global one is kept around as their closure.
+            Environment* member_closure = env == &compiler->global_env ? env : nullptr;
             for (u64 i = 0; i < s_class.members.size(); ++i) {
                 Stmt* stmt = &s_class.members[i];
                 if (stmt->ty == Stmt::Type::FN_DECLARATION) {
-                    FnDeclarationPayload fn = stmt->fn_declaration;
-                    if (fn.is_static) {
-                        String fn_name = mangled_name(arena, new_class->m_name, fn.name->m_lexeme);
-                        compiler->global_env.define_callable(arena, fn_name, construct_callable(fn));
+                    const FnDeclarationPayload* fn = &stmt->fn_declaration;
+                    if (fn->is_static) {
+                        String fn_name = compiler->interner.intern(mangled_name(arena, new_class->m_name, fn->name->m_lexeme));
+                        compiler->global_env.define_callable(fn_name, script_function(fn, member_closure));
                     } else {
-                        String str = fn.name->m_lexeme;
-                        Callable callable = construct_callable_class(fn, new_class);
-                        new_class->m_methods.insert(arena,str, HASH_STR(str), callable);
+                        String str = fn->name->m_lexeme;
+                        new_class->m_methods.insert(str, new_function(class_arena, method_function(fn, member_closure, new_class)));
                     }
                 } else if (stmt->ty == Stmt::Type::VAR_DECL) {
                     VarDeclPayload var_decl = stmt->s_var_decl;
 
                     Value value = {};
                     if (var_decl.initializer != nullptr) {
-                        RuntimeError var_err = var_decl.initializer->evaluate(compiler, arena, env, value);
+                        RuntimeError var_err = var_decl.initializer->evaluate(compiler, class_arena, env, value);
                         if (!var_err.is_ok()) {
                             compiler->runtime_error(var_err.token->m_line, var_err.message);
                         }
                     }
 
                     String str = var_decl.name->m_lexeme;
-                    new_class->m_fields.insert(arena, str, HASH_STR(str), value);
+                    value = promoted_for_store(compiler, nullptr, value);
+                    // NOTE: Redeclaring a superclass field only changes its default.
+                    const u32* slot = new_class->m_shape.slots.get(str);
+                    if (slot != nullptr) {
+                        compiler->heap.write_barrier(new_class, new_class->m_field_defaults[*slot], value);
+                        new_class->m_field_defaults[*slot] = value;
+                    } else {
+                        compiler->heap.write_barrier(new_class, Value{}, value);
+                        new_class->m_shape.slots.insert(str, (u32) new_class->m_field_defaults.size());
+                        new_class->m_field_defaults.push(value);
+                    }
                 } else {
                     assert(false);
                 }
             }
+            new_class->m_shape.field_count = (u32) new_class->m_field_defaults.size();
 
-            Callable* class_init = new_class->get_method(CREATE_STRING("init"));
-            if (class_init != nullptr) {
-                env->define_callable(arena, class_name, Callable(class_init->m_arity, [class_name_token, class_init](Array<Value> args, KauCompiler* compiler, Arena* arena, Environment* env) {
-                    Class* in_class = env->get_class(class_name_token->m_lexeme);
-                    assert(in_class != nullptr);
-
-                    const Value init_value = class_init->m_callback(args, compiler, arena, env);
-
-                    return Value{
-                        .ty = Value::Type::CLASS,
-                        .m_class = in_class,
-                    };
-                }));
-            } else {
-                env->define_callable(arena, class_name, Callable(0, [class_name_token](Array<Value> args, KauCompiler* compiler, Arena* arena, Environment* env) {
-                    Class* in_class = env->get_class(class_name_token->m_lexeme);
-                    assert(in_class != nullptr);
-
-                    return Value{
-                        .ty = Value::Type::CLASS,
-                        .m_class = in_class,
-                    };
-                }));
-            }
+            Function* class_init = new_class->get_method(CREATE_STRING("init"));
+            env->define_callable(class_name, constructor_function(new_class, class_init));
 
             break;
         }
@@ -1154,19 +1453,10 @@ Value Stmt::evaluate(KauCompiler* compiler, Arena* arena, Environment* env, bool
     return expr_val;
 }
 
-bool Class::contains_field(String field) {
-    return m_fields.get(HASH_STR(field)) != nullptr;
-}
-
-void Class::set_field(String field, Value in_value) {
-    Value* field_val = (Value*) m_fields.get(HASH_STR(field));
-    *field_val = in_value;
-}
-
-Callable* Class::get_method(String name) {
-    Callable* method = (Callable*) m_methods.get(HASH_STR(name));
+Function* Class::get_method(String name) {
+    Function** method = m_methods.get(name);
     if (method != nullptr) {
-        return method;
+        return *method;
     }
     if (superclass != nullptr) {
         return superclass->get_method(name);
@@ -1174,21 +1464,33 @@ Callable* Class::get_method(String name) {
     return nullptr;
 }
 
-bool Class::get(String field, Value& in_value) {
-    void* field_ret = m_fields.get(HASH_STR(field));
-    if (field_ret != nullptr) {
-        in_value = *((Value*) field_ret);
-        return true;
-    }
+InlineCache::Entry InlineCache::miss(Class* klass, String name) {
+    const u32* slot = klass->m_shape.slots.get(name);
+    const Entry entry = Entry {
+        .shape = &klass->m_shape,
+        .slot = slot != nullptr ? *slot : INLINE_CACHE_NO_SLOT,
+        .method = klass->get_method(name),
+    };
 
-    Callable* method_ret = (Callable*) get_method(field);
-    if (method_ret != nullptr) {
-        in_value = Value {
-            .ty = Value::Type::CALLABLE,
-            .callable = method_ret,
-        };
-        return true;
+    if (megamorphic) {
+        inline_cache_counters.megamorphic += 1;
+        return entry;
     }
+    inline_cache_counters.misses += 1;
+    if (count == INLINE_CACHE_ENTRIES) {
+        megamorphic = true;
+        return entry;
+    }
+    entries[count++] = entry;
+    return entry;
+}
 
-    return false;
-}
\ No newline at end of file
+Instance* new_instance(Heap* heap, Class* klass) {
+    const u32 field_count = klass->m_shape.field_count;
+    Instance* instance = (Instance*) heap->allocate(sizeof(Instance) + field_count * sizeof(Value), GcKind::INSTANCE);
+    instance->klass = klass;
+    if (field_count > 0) {
+        memcpy((void*) instance->fields(), klass->m_field_defaults.m_head, field_count * sizeof(Value));
+    }
+    return instance;
+}
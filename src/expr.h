@@ -1,12 +1,13 @@
 #pragma once
 
 #include "lib/string.h"
-#include "lib/map.h"
+#include "lib/hash_map.h"
 #include "lib/array.h"
 
 #include "tokens.h"
 
 #include <string>
+#include <string.h>
 
 struct Expr;
 struct LiteralExpr;
@@ -65,6 +66,7 @@ struct RuntimeError {
     static RuntimeError wrong_number_arguments(const Token* token);
     static RuntimeError object_must_be_struct(const Token* token);
     static RuntimeError class_does_not_have_field(const Token* token);
+    static RuntimeError stack_overflow(const Token* token);
 
     bool is_ok() const;
 
@@ -79,6 +81,7 @@ struct RuntimeError {
         INVALID_IDENTIFIER,
         INVALID_ARGUMENT,
         WRONG_NUMBER_ARGUMENTS,
+        STACK_OVERFLOW,
     };
 
     Type ty;
@@ -86,27 +89,127 @@ struct RuntimeError {
     String message;
 };
 
+#define CHECK_ERR(err) do {\
+    RuntimeError err_binding = err;\
+    if (!err_binding.is_ok()) {\
+        return err_binding;\
+    }\
+} while(0)
+
 struct Value;
-struct Callable;
+struct Function;
+struct Object;
+struct Heap;
+
+// Where the fields of a class's instances live. Worked out once, when the class is declared.
+struct Shape {
+    HashMap<String, u32, StringHasher> slots;
+    u32 field_count = 0;
+};
+
 struct Class {
     Class() {}
 
-    bool contains_field(String field);
-    void set_field(String field, Value in_value);
-
-    Callable* get_method(String name);
-    bool get(String field, Value& in_value);
+    Function* get_method(String name);
 
     void print() const;
 
-    Map m_fields;
-    Map m_methods;
+    // NOTE: Superclass fields come first, in the same slots they have in the superclass,
+    // so methods inherited from it work on instances of this class too.
+    Shape m_shape;
+    // What every field of a new instance starts out as, by slot.
+    Array<Value> m_field_defaults;
+    HashMap<String, Function*, StringHasher> m_methods;
 
     String m_name = String{};
 
     Class* superclass = nullptr;
+
+    // Last collection that reached this class, see `Heap::mark_class`.
+    u32 gc_epoch = 0;
+    // Already in the heap's remembered set.
+    bool gc_remembered = false;
 };
 
+// An instance of a tree walker class. Its fields follow it in the same heap block,
+// laid out by the class's shape.
+struct Instance {
+    Class* klass;
+
+    Value* fields() {
+        return (Value*) (this + 1);
+    }
+};
+
+Instance* new_instance(Heap* heap, Class* klass);
+
+#define INLINE_CACHE_ENTRIES 4
+#define INLINE_CACHE_NO_SLOT UINT32_MAX
+
+// Counts every inline cache lookup, across all sites.
+struct InlineCacheCounters {
+    u64 hits;
+    u64 misses;
+    // Lookups at sites that saw more shapes than they can cache.
+    u64 megamorphic;
+};
+inline InlineCacheCounters inline_cache_counters = {};
+
+// Counts every binary node rewrite, across all nodes, see `Expr::Type::INT_BINARY`.
+struct QuickeningCounters {
+    u64 rewrites;
+    u64 despecializations;
+    // Evaluations of quickened nodes whose guard passed.
+    u64 hits;
+};
+inline QuickeningCounters quickening_counters = {};
+
+// What a property access site resolved its member to, for the last few shapes it saw.
+// With one entry the site is monomorphic, with up to `INLINE_CACHE_ENTRIES` polymorphic.
+// Past that it goes megamorphic, and shapes it hasn't cached are looked up every time.
+struct InlineCache {
+    struct Entry {
+        const Shape* shape;
+        // `INLINE_CACHE_NO_SLOT` when the member isn't a field.
+        u32 slot;
+        // Null when the member isn't a method.
+        Function* method;
+    };
+
+    Entry lookup(Class* klass, String name) {
+        const Shape* shape = &klass->m_shape;
+        for (u32 i = 0; i < count; ++i) {
+            if (entries[i].shape == shape) {
+                inline_cache_counters.hits += 1;
+                return entries[i];
+            }
+        }
+        return miss(klass, name);
+    }
+
+    Entry entries[INLINE_CACHE_ENTRIES];
+    u32 count;
+    bool megamorphic;
+
+private:
+    Entry miss(Class* klass, String name);
+};
+
+// Everything but doubles is a type tag in the bits above `VALUE_PAYLOAD_BITS` and a payload below them.
+// Doubles are stored as their own bits offset by `VALUE_DOUBLE_OFFSET`, which puts them above every tagged value.
+#define VALUE_PAYLOAD_BITS 47
+#define VALUE_PAYLOAD_MASK ((1ull << VALUE_PAYLOAD_BITS) - 1)
+#define VALUE_DOUBLE_OFFSET (1ull << 51)
+// Longs that don't fit the payload point to their 64 bits instead.
+#define VALUE_TAG_BOXED_LONG 13ull
+#define VALUE_INLINE_LONG_MIN (-(1ll << (VALUE_PAYLOAD_BITS - 1)))
+#define VALUE_INLINE_LONG_MAX ((1ll << (VALUE_PAYLOAD_BITS - 1)) - 1)
+
+// NaN-boxed, so values are 8 bytes and get passed around in a register. Strings are
+// boxed with their length, see `BoxedString`, and pointers have to fit in the payload,
+// which they do on every 64 bit platform we run on.
+//
+// NOTE: All zero bits is nil, so zeroed memory is full of nils.
 struct Value {
     enum class Type {
         NIL,
@@ -120,36 +223,196 @@ struct Value {
         CONTINUE,
         CLASS,
         CALLABLE,
+        OBJECT,
+        INSTANCE,
     };
 
-    Type ty;
-    union {
-        bool b;
-        int i;
-        long l;
+    u64 bits = 0;
+
+    Type type() const {
+        if (is_double()) {
+            return Type::DOUBLE;
+        }
+        const u64 tag = bits >> VALUE_PAYLOAD_BITS;
+        return tag == VALUE_TAG_BOXED_LONG ? Type::LONG : (Type) tag;
+    }
+    bool is_double() const {
+        return bits >= VALUE_DOUBLE_OFFSET;
+    }
+
+    bool as_bool() const {
+        return payload() != 0;
+    }
+    int as_int() const {
+        return (int) (u32) bits;
+    }
+    float as_float() const {
+        const u32 float_bits = (u32) bits;
         float f;
+        memcpy(&f, &float_bits, sizeof(f));
+        return f;
+    }
+    double as_double() const {
+        const u64 double_bits = bits - VALUE_DOUBLE_OFFSET;
         double d;
-        String str = {};
-        Class* m_class;
-        Callable* callable;
-    };
+        memcpy(&d, &double_bits, sizeof(d));
+        return d;
+    }
+    long as_long() const {
+        if ((bits >> VALUE_PAYLOAD_BITS) == VALUE_TAG_BOXED_LONG) {
+            return *(const long*) payload();
+        }
+        // NOTE: Sign extends the payload.
+        return ((i64) (bits << (64 - VALUE_PAYLOAD_BITS))) >> (64 - VALUE_PAYLOAD_BITS);
+    }
+    const BoxedString* as_boxed_string() const {
+        return (const BoxedString*) payload();
+    }
+    String as_string() const {
+        return as_boxed_string()->string();
+    }
+    Class* as_class() const {
+        return (Class*) payload();
+    }
+    Function* as_callable() const {
+        return (Function*) payload();
+    }
+    Object* as_object() const {
+        return (Object*) payload();
+    }
+    Instance* as_instance() const {
+        return (Instance*) payload();
+    }
+
+    // What the value points to, if it's something the heap could own: a string, a boxed long, an object or an instance.
+    void* heap_pointer() const {
+        if (is_double()) {
+            return nullptr;
+        }
+        switch (bits >> VALUE_PAYLOAD_BITS) {
+            case (u64) Type::STRING:
+            case (u64) Type::OBJECT:
+            case (u64) Type::INSTANCE:
+            case VALUE_TAG_BOXED_LONG: {
+                return (void*) payload();
+            }
+            default: {
+                return nullptr;
+            }
+        }
+    }
+    // For the heap, once what `heap_pointer` points to moved.
+    void replace_heap_pointer(void* ptr) {
+        bits = (bits & ~VALUE_PAYLOAD_MASK) | (u64) ptr;
+    }
 
     void print() const;
+
+    static Value tagged(u64 tag, u64 payload) {
+        assert(payload <= VALUE_PAYLOAD_MASK);
+        return Value{ (tag << VALUE_PAYLOAD_BITS) | payload };
+    }
+
+private:
+    u64 payload() const {
+        return bits & VALUE_PAYLOAD_MASK;
+    }
 };
+static_assert(sizeof(Value) == 8);
+
+inline Value bool_value(bool b) {
+    return Value::tagged((u64) Value::Type::BOOL, b ? 1 : 0);
+}
+
+inline Value int_value(int i) {
+    return Value::tagged((u64) Value::Type::INT, (u32) i);
+}
+
+inline Value float_value(float f) {
+    u32 float_bits;
+    memcpy(&float_bits, &f, sizeof(f));
+    return Value::tagged((u64) Value::Type::FLOAT, float_bits);
+}
+
+inline Value double_value(double d) {
+    u64 double_bits;
+    memcpy(&double_bits, &d, sizeof(d));
+    // NOTE: Every NaN is made the same quiet one, so none of them overflows the offset.
+    if (d != d) {
+        double_bits = 0x7ff8000000000000ull;
+    }
+    return Value{ double_bits + VALUE_DOUBLE_OFFSET };
+}
+
+Value boxed_long_value(Heap* heap, long l);
+Value boxed_long_value(Arena* arena, long l);
+
+// Only longs too big for the payload get boxed, in `heap`.
+inline Value long_value(long l, Heap* heap) {
+    if (l < VALUE_INLINE_LONG_MIN || l > VALUE_INLINE_LONG_MAX) {
+        return boxed_long_value(heap, l);
+    }
+    return Value::tagged((u64) Value::Type::LONG, (u64) l & VALUE_PAYLOAD_MASK);
+}
+
+// Same, for constants that live as long as `arena`.
+inline Value long_value(long l, Arena* arena) {
+    if (l < VALUE_INLINE_LONG_MIN || l > VALUE_INLINE_LONG_MAX) {
+        return boxed_long_value(arena, l);
+    }
+    return Value::tagged((u64) Value::Type::LONG, (u64) l & VALUE_PAYLOAD_MASK);
+}
+
+inline Value string_value(const BoxedString* str) {
+    return Value::tagged((u64) Value::Type::STRING, (u64) str);
+}
+
+inline Value class_value(Class* klass) {
+    return Value::tagged((u64) Value::Type::CLASS, (u64) klass);
+}
+
+inline Value callable_value(Function* callable) {
+    return Value::tagged((u64) Value::Type::CALLABLE, (u64) callable);
+}
+
+inline Value object_value(Object* object) {
+    return Value::tagged((u64) Value::Type::OBJECT, (u64) object);
+}
+
+inline Value instance_value(Instance* instance) {
+    return Value::tagged((u64) Value::Type::INSTANCE, (u64) instance);
+}
+
+inline Value break_value() {
+    return Value::tagged((u64) Value::Type::BREAK, 0);
+}
+
+inline Value continue_value() {
+    return Value::tagged((u64) Value::Type::CONTINUE, 0);
+}
+
+// Defined by the bytecode backend, which is the only producer of `Value::Type::OBJECT`.
+void print_object(const Object* object);
 
 struct ExprStmtPayload {
     Expr* expr;
 };
 
+// Filled in by the resolver: globals keep going through the global environment by name,
+// locals are stored in `slot` of the environment they're declared in.
 struct VarDeclPayload {
     Token* name;
     Expr* initializer;
+    bool is_local;
+    u64 slot;
 };
 
 struct BlockPayload {
     Token* start;
     Array<Stmt> stmts;
     Token* end;
+    // Number of variables the resolver declared directly in this block.
+    u64 slot_count;
 };
 
 struct IfPayload {
@@ -187,6 +450,14 @@ struct ReturnPayload {
     Expr* expr;
 };
 
+// Filled in by the resolver. Locals live `depth` environments up from the current one, at `slot`,
+// anything the resolver didn't find is a global and is looked up by name.
+struct VariableLocation {
+    bool is_local;
+    u64 depth;
+    u64 slot;
+};
+
 struct KauCompiler;
 struct Environment;
 struct Stmt {
@@ -237,6 +508,11 @@ struct Expr {
         SET,
         THIS,
         SUPER,
+        // What `BINARY` nodes rewrite themselves into once the tree walker ran them on two ints or
+        // two doubles. They guard on that instead of going through every type, and turn back into
+        // `BINARY` when the guard fails. Only ever made while running, so nothing but the tree walker sees them.
+        INT_BINARY,
+        DOUBLE_BINARY,
     };
 
     Type ty;
@@ -248,15 +524,18 @@ struct Expr {
 
 struct LiteralExpr {
     const Token* val;
+    VariableLocation location;
 };
 
 struct ThisExpr {
     const Token* val;
+    VariableLocation location;
 };
 
 struct SuperExpr {
     const Token* keyword;
     const Token* method;
+    VariableLocation location;
 };
 
 struct GroupingExpr {
@@ -274,6 +553,8 @@ struct BinaryExpr {
     Expr* left;
     const Token* op;
     Expr* right;
+    // Set once the node stops quickening, see `Expr::Type::INT_BINARY`.
+    bool generic;
 };
 
 struct CommaExpr {
@@ -293,6 +574,7 @@ struct TernaryExpr {
 struct AssignmentExpr {
     const Token* id;
     Expr* right;
+    VariableLocation location;
 };
 
 struct LogicalBinaryExpr {
@@ -305,21 +587,38 @@ struct FnCallExpr {
     Expr* callee;
     const Token* paren;
     Array<Expr*> arguments;
+    // Resolves the method for calls like `obj.method()`.
+    InlineCache cache;
 };
 
 struct StaticFnCallExpr {
     Expr* class_expr;
     Token* colons;
     Token* fn_name;
+    // `Class.fn`, the name the function is declared under. Interned by the resolver.
+    String callable_name;
 };
 
 struct GetExpr {
     Expr* class_expr;
     Token* member;
+    InlineCache cache;
 };
 
 struct SetExpr {
     Token* equals;
     Expr* get;
     Expr* right;
-};
\ No newline at end of file
+    InlineCache cache;
+};
+
+// NOTE: The parts of the tree walker the closure backend runs too, see closures.h.
+//
+// Pops every frame allocation made since `mark`, moving `value` out first if it lives there.
+Value pop_frame(KauCompiler* compiler, u64 mark, Arena* arena, Value value);
+// Moves strings in the current call's frame out of it if `target` outlives the call.
+Value promoted_for_store(KauCompiler* compiler, const void* target, Value value);
+// What static methods are bound to in the global environment, `Class.method`.
+String mangled_name(Arena* arena, String left, String right);
+RuntimeError call_function(KauCompiler* compiler, Function* function, Value* args, Arena* arena, Environment* caller, Value& in_value);
+RuntimeError binary_op(KauCompiler* compiler, Arena* arena, const Token* op, Value left_val, Value right_val, Value& in_value);
\ No newline at end of file
@@ -0,0 +1,664 @@
+#include "gc.h"
+
+#include "expr.h"
+#include "bytecode.h"
+#include "environment.h"
+
+#include <chrono>
+#include <string.h>
+
+#define GC_ARENA_RESERVE_SIZE (64ull * 1024 * 1024 * 1024)
+#define GC_SCRATCH_ARENA_RESERVE_SIZE (1024ull * 1024 * 1024)
+
+namespace {
+    u64 now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count();
+    }
+
+    u64 block_size_for(u64 size) {
+        const u64 total = sizeof(GcHeader) + size;
+        return (total + GC_BLOCK_ALIGNMENT - 1) & ~((u64) GC_BLOCK_ALIGNMENT - 1);
+    }
+
+    GcHeader* header_of(const void* ptr) {
+        return ((GcHeader*) ptr) - 1;
+    }
+
+    // How many blocks to mark or sweep between looking at the clock.
+    constexpr u64 SLICE_CHECK_INTERVAL = 32;
+
+    // Closures and instances keep their arrays in the same block, and closed upvalues
+    // point at themselves, so a copy has to be pointed at its own memory.
+    void fix_interior_pointers(Object* from, Object* to) {
+        switch (to->ty) {
+            case Object::Type::CLOSURE: {
+                ClosureObject* closure = (ClosureObject*) to;
+                closure->upvalues = (UpvalueObject**) (closure + 1);
+                break;
+            }
+            case Object::Type::INSTANCE: {
+                InstanceObject* instance = (InstanceObject*) to;
+                instance->fields = (Value*) (instance + 1);
+                break;
+            }
+            case Object::Type::UPVALUE: {
+                UpvalueObject* upvalue = (UpvalueObject*) to;
+                if (upvalue->location == &((UpvalueObject*) from)->closed) {
+                    upvalue->location = &upvalue->closed;
+                }
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    }
+};
+
+void Heap::init(GcConfig in_config) {
+    stats = {};
+
+    m_arena = alloc_arena(GC_ARENA_RESERVE_SIZE);
+    m_blocks = nullptr;
+    memset(m_free_blocks, 0, sizeof(m_free_blocks));
+    m_bytes_allocated = 0;
+
+    m_phase = GcPhase::IDLE;
+    m_sweep_blocks = nullptr;
+    m_bytes_since_slice = 0;
+
+    m_nursery = alloc_arena(GC_ARENA_RESERVE_SIZE);
+    m_minor = false;
+
+    configure(in_config);
+
+    m_roots_arena = alloc_arena(GC_SCRATCH_ARENA_RESERVE_SIZE);
+    m_roots.init(m_roots_arena);
+
+    m_remembered_arena = alloc_arena(GC_SCRATCH_ARENA_RESERVE_SIZE);
+    m_remembered_objects.init(m_remembered_arena);
+    m_remembered_classes.init(m_remembered_arena);
+    m_remembered_environments.init(m_remembered_arena);
+
+    m_gray_arena = alloc_arena(GC_SCRATCH_ARENA_RESERVE_SIZE);
+    m_gray.init(m_gray_arena);
+
+    m_promoted_arena = alloc_arena(GC_SCRATCH_ARENA_RESERVE_SIZE);
+    m_promoted.init(m_promoted_arena);
+
+    m_epoch = 0;
+}
+
+void Heap::configure(GcConfig in_config) {
+    config = in_config;
+    m_next_gc = (u64) (m_bytes_allocated * config.growth_factor);
+    if (m_next_gc < config.initial_threshold) {
+        m_next_gc = config.initial_threshold;
+    }
+
+    // NOTE: Collections wait for a safe point, so leave some room for what gets allocated until one comes up.
+    m_nursery_trigger = config.nursery_size > 0 ? config.nursery_size - config.nursery_size / 4 : UINT64_MAX;
+    m_nursery_block_max = config.nursery_size / 8;
+}
+
+void Heap::release() {
+    Arena* arenas[6] = {m_arena, m_nursery, m_roots_arena, m_remembered_arena, m_gray_arena, m_promoted_arena};
+    for (Arena* arena : arenas) {
+        arena->release();
+        free(arena);
+    }
+    m_arena = nullptr;
+    m_nursery = nullptr;
+    m_roots_arena = nullptr;
+    m_remembered_arena = nullptr;
+    m_gray_arena = nullptr;
+    m_promoted_arena = nullptr;
+    m_blocks = nullptr;
+    m_sweep_blocks = nullptr;
+}
+
+void* Heap::allocate(u64 size, GcKind kind) {
+    const u64 block_size = block_size_for(size);
+    if (block_size > m_nursery_block_max || m_nursery->offset + block_size > config.nursery_size) {
+        void* payload = allocate_old(size, kind);
+        // NOTE: Whatever it gets filled in with might be young, so it starts out remembered.
+        if (kind != GcKind::RAW && config.nursery_size > 0) {
+            remember_block(payload);
+        }
+        return payload;
+    }
+
+    GcHeader* block = (GcHeader*) m_nursery->push_no_zero(block_size);
+    m_bytes_since_slice += block_size;
+    block->next = nullptr;
+    block->size = (u32) block_size;
+    block->kind = kind;
+    block->marked = false;
+    block->remembered = false;
+
+    void* payload = block + 1;
+    if (kind != GcKind::RAW) {
+        memset(payload, 0, size);
+    }
+    return payload;
+}
+
+void* Heap::allocate_old(u64 size, GcKind kind) {
+    const u64 block_size = block_size_for(size);
+
+    GcHeader* block = nullptr;
+    if (block_size <= GC_SMALL_BLOCK_MAX) {
+        GcHeader** free_list = &m_free_blocks[block_size / GC_BLOCK_ALIGNMENT - 1];
+        if (*free_list != nullptr) {
+            block = *free_list;
+            *free_list = block->next;
+        }
+    }
+    if (block == nullptr) {
+        // NOTE: Also picks up the big blocks earlier sweeps gave back to the arena.
+        block = (GcHeader*) m_arena->push_no_zero(block_size);
+        stats.arena_bytes = m_arena->peak_offset;
+    }
+
+    block->next = m_blocks;
+    block->size = (u32) block_size;
+    block->kind = kind;
+    // NOTE: Nothing it can point to was unreachable when marking started, so it doesn't need scanning.
+    block->marked = m_phase == GcPhase::MARKING;
+    block->remembered = false;
+    m_blocks = block;
+
+    m_bytes_allocated += block_size;
+    m_bytes_since_slice += block_size;
+    if (m_bytes_allocated > stats.peak_bytes) {
+        stats.peak_bytes = m_bytes_allocated;
+    }
+
+    void* payload = block + 1;
+    if (kind != GcKind::RAW) {
+        memset(payload, 0, size);
+    }
+    return payload;
+}
+
+BoxedString* Heap::concatenated_string(String left, String right) {
+    const u64 len = left.len + right.len;
+    BoxedString* box = (BoxedString*) allocate(sizeof(BoxedString) + len * sizeof(char), GcKind::RAW);
+    box->len = len;
+    box->id = 0;
+    box->hash = 0;
+    memcpy((char*) box->chars(), left.chars, left.len * sizeof(char));
+    memcpy((char*) box->chars() + left.len, right.chars, right.len * sizeof(char));
+    return box;
+}
+
+BoxedString* Heap::copied_string(String str) {
+    BoxedString* box = (BoxedString*) allocate(sizeof(BoxedString) + str.len * sizeof(char), GcKind::RAW);
+    box->len = str.len;
+    box->id = str.id;
+    box->hash = str.hash;
+    memcpy((char*) box->chars(), str.chars, str.len * sizeof(char));
+    return box;
+}
+
+bool Heap::owns(const void* ptr) const {
+    const u8* mem = (const u8*) m_arena->mem;
+    return ptr >= mem && ptr < mem + m_arena->offset;
+}
+
+bool Heap::in_nursery(const void* ptr) const {
+    const u8* mem = (const u8*) m_nursery->mem;
+    return ptr >= mem && ptr < mem + m_nursery->offset;
+}
+
+bool Heap::is_young(const Value& value) const {
+    return in_nursery(value.heap_pointer());
+}
+
+void Heap::remember(Object* holder) {
+    remember_block(holder);
+}
+
+void Heap::remember_block(const void* payload) {
+    if (!owns(payload)) {
+        return;
+    }
+    GcHeader* block = header_of(payload);
+    if (!block->remembered) {
+        block->remembered = true;
+        m_remembered_objects.push(block);
+    }
+}
+
+void Heap::shade(const Value& value) {
+    if (m_phase == GcPhase::MARKING) {
+        mark_value(value);
+    }
+}
+
+void Heap::shade(Object* object) {
+    if (m_phase == GcPhase::MARKING) {
+        mark_pointer(object);
+    }
+}
+
+void Heap::write_barrier(Object* holder, const Value& old_value, const Value& value) {
+    shade(old_value);
+    if (is_young(value)) {
+        remember(holder);
+    }
+}
+
+void Heap::write_barrier(Object* holder, Object* old_value, Object* value) {
+    shade(old_value);
+    if (in_nursery(value)) {
+        remember(holder);
+    }
+}
+
+void Heap::write_barrier(Instance* holder, const Value& old_value, const Value& value) {
+    shade(old_value);
+    if (is_young(value)) {
+        remember_block(holder);
+    }
+}
+
+void Heap::write_barrier(Class* holder, const Value& old_value, const Value& value) {
+    shade(old_value);
+    if (is_young(value) && !holder->gc_remembered) {
+        holder->gc_remembered = true;
+        m_remembered_classes.push(holder);
+    }
+}
+
+void Heap::write_barrier(Environment* holder, const Value& old_value, const Value& value) {
+    shade(old_value);
+    if (is_young(value) && !holder->gc_remembered) {
+        holder->gc_remembered = true;
+        m_remembered_environments.push(holder);
+    }
+}
+
+void Heap::push_roots(Value* values, u64 count) {
+    m_roots.push(Roots {
+        .values = values,
+        .count = count
+    });
+}
+
+void Heap::pop_root() {
+    m_roots.pop();
+}
+
+void Heap::visit(Value& value) {
+    if (!m_minor) {
+        mark_value(value);
+        return;
+    }
+
+    void* ptr = value.heap_pointer();
+    if (in_nursery(ptr)) {
+        value.replace_heap_pointer(promote(ptr));
+    }
+}
+
+void Heap::visit_object(Object** object) {
+    if (!m_minor) {
+        mark_pointer(*object);
+        return;
+    }
+    visit_pointer((void**) object);
+}
+
+void Heap::visit_pointer(void** ptr) {
+    if (in_nursery(*ptr)) {
+        *ptr = promote(*ptr);
+    }
+}
+
+void Heap::visit_environment(Environment* env) {
+    // NOTE: Environments with a write barrier only matter to a minor collection when
+    // they were written to, and then they are in the remembered set.
+    if (m_minor && env->heap != nullptr) {
+        return;
+    }
+
+    // NOTE: Local slots live on the frame stack, which is visited on its own.
+    env->values.for_each([this](const String&, Value& value) {
+        visit(value);
+    });
+    if (!m_minor) {
+        env->classes.for_each([this](const String&, Class* const& klass) {
+            mark_class(klass);
+        });
+    }
+}
+
+void Heap::visit_pushed_roots() {
+    for (u64 i = 0; i < m_roots.size(); ++i) {
+        for (u64 j = 0; j < m_roots[i].count; ++j) {
+            visit(m_roots[i].values[j]);
+        }
+    }
+}
+
+void* Heap::promote(void* payload) {
+    GcHeader* block = header_of(payload);
+    if (block->marked) {
+        return block->next + 1;
+    }
+
+    const u64 size = block->size - sizeof(GcHeader);
+    void* copy = allocate_old(size, block->kind);
+    memcpy(copy, payload, size);
+    stats.bytes_promoted += block->size;
+
+    block->marked = true;
+    block->next = header_of(copy);
+    if (block->kind == GcKind::OBJECT) {
+        fix_interior_pointers((Object*) payload, (Object*) copy);
+    }
+    if (block->kind != GcKind::RAW) {
+        m_promoted.push(header_of(copy));
+    }
+    return copy;
+}
+
+void Heap::scan_block(GcHeader* block) {
+    switch (block->kind) {
+        case GcKind::OBJECT: {
+            scan_object((Object*) (block + 1));
+            break;
+        }
+        case GcKind::INSTANCE: {
+            scan_instance((Instance*) (block + 1));
+            break;
+        }
+        case GcKind::RAW: {
+            break;
+        }
+    }
+}
+
+void Heap::scan_instance(Instance* instance) {
+    // NOTE: Classes aren't heap blocks, a minor collection gets to their defaults through the remembered set.
+    if (!m_minor) {
+        mark_class(instance->klass);
+    }
+    Value* fields = instance->fields();
+    for (u32 i = 0; i < instance->klass->m_shape.field_count; ++i) {
+        visit(fields[i]);
+    }
+}
+
+void Heap::scan_object(Object* object) {
+    switch (object->ty) {
+        case Object::Type::CLOSURE: {
+            ClosureObject* closure = (ClosureObject*) object;
+            for (int i = 0; i < closure->upvalue_count; ++i) {
+                visit_object((Object**) &closure->upvalues[i]);
+            }
+            break;
+        }
+        case Object::Type::UPVALUE: {
+            UpvalueObject* upvalue = (UpvalueObject*) object;
+            visit(upvalue->closed);
+            visit_object((Object**) &upvalue->next);
+            break;
+        }
+        case Object::Type::CLASS: {
+            ClassObject* klass = (ClassObject*) object;
+            visit_object((Object**) &klass->superclass);
+            visit_object((Object**) &klass->initializer);
+            klass->methods.for_each([this](const String&, ClosureObject*& method) {
+                visit_object((Object**) &method);
+            });
+            klass->statics.for_each([this](const String&, ClosureObject*& method) {
+                visit_object((Object**) &method);
+            });
+            for (u64 i = 0; i < klass->field_defaults.size(); ++i) {
+                visit(klass->field_defaults[i]);
+            }
+            break;
+        }
+        case Object::Type::INSTANCE: {
+            InstanceObject* instance = (InstanceObject*) object;
+            visit_object((Object**) &instance->klass);
+            for (u64 i = 0; i < instance->klass->field_defaults.size(); ++i) {
+                visit(instance->fields[i]);
+            }
+            break;
+        }
+        case Object::Type::BOUND_METHOD: {
+            BoundMethodObject* bound = (BoundMethodObject*) object;
+            visit(bound->receiver);
+            visit_object((Object**) &bound->method);
+            break;
+        }
+        // NOTE: Functions and natives are made by the compiler and live as long as it does.
+        case Object::Type::FUNCTION:
+        case Object::Type::NATIVE: {
+            break;
+        }
+    }
+}
+
+void Heap::begin_pause() {
+    m_pause_start_ns = now_ns();
+}
+
+void Heap::end_pause() {
+    const u64 pause_ns = now_ns() - m_pause_start_ns;
+    u64 bucket = 0;
+    while (bucket + 1 < GC_PAUSE_BUCKETS && pause_ns > GcStats::pause_bucket_limit_ns(bucket)) {
+        bucket += 1;
+    }
+    stats.pauses[bucket] += 1;
+    if (pause_ns > stats.max_pause_ns) {
+        stats.max_pause_ns = pause_ns;
+    }
+    m_bytes_since_slice = 0;
+}
+
+bool Heap::minor_due() const {
+    if (m_nursery->offset == 0) {
+        return false;
+    }
+    return m_nursery->offset >= m_nursery_trigger
+        || (m_phase == GcPhase::IDLE && m_bytes_allocated >= m_next_gc);
+}
+
+void Heap::begin_minor() {
+    m_collection_start_ns = now_ns();
+    m_minor = true;
+    m_promoted_arena->clear();
+    m_promoted.init(m_promoted_arena);
+
+    visit_pushed_roots();
+}
+
+void Heap::finish_minor() {
+    for (u64 i = 0; i < m_remembered_objects.size(); ++i) {
+        GcHeader* block = m_remembered_objects[i];
+        block->remembered = false;
+        scan_block(block);
+    }
+    for (u64 i = 0; i < m_remembered_classes.size(); ++i) {
+        Class* klass = m_remembered_classes[i];
+        klass->gc_remembered = false;
+        for (u64 j = 0; j < klass->m_field_defaults.size(); ++j) {
+            visit(klass->m_field_defaults[j]);
+        }
+    }
+    for (u64 i = 0; i < m_remembered_environments.size(); ++i) {
+        Environment* env = m_remembered_environments[i];
+        env->gc_remembered = false;
+        env->values.for_each([this](const String&, Value& value) {
+            visit(value);
+        });
+    }
+    m_remembered_arena->clear();
+    m_remembered_objects.init(m_remembered_arena);
+    m_remembered_classes.init(m_remembered_arena);
+    m_remembered_environments.init(m_remembered_arena);
+
+    // Promoted objects can still point into the nursery, scanning them promotes that too.
+    while (!m_promoted.empty()) {
+        GcHeader* block = m_promoted.back();
+        m_promoted.pop();
+        scan_block(block);
+    }
+
+    m_nursery->pop_to(0);
+    m_minor = false;
+
+    stats.minor_collections += 1;
+    stats.minor_ns += now_ns() - m_collection_start_ns;
+}
+
+// Takes the snapshot: the roots visited right after this are all marked gray.
+void Heap::begin_major() {
+    m_phase = GcPhase::MARKING;
+    m_epoch += 1;
+    // NOTE: Zero is what every class starts out with.
+    if (m_epoch == 0) {
+        m_epoch = 1;
+    }
+    m_gray_arena->clear();
+    m_gray.init(m_gray_arena);
+
+    visit_pushed_roots();
+}
+
+void Heap::major_slice() {
+    const u64 start = now_ns();
+    const u64 deadline = config.pause_budget_ns > 0 ? m_pause_start_ns + config.pause_budget_ns : UINT64_MAX;
+
+    if (m_phase == GcPhase::MARKING && mark_slice(deadline)) {
+        m_phase = GcPhase::SWEEPING;
+        m_sweep_blocks = m_blocks;
+        m_blocks = nullptr;
+    }
+    if (m_phase == GcPhase::SWEEPING && sweep_slice(deadline)) {
+        m_phase = GcPhase::IDLE;
+        m_arena->coalesce_free_list();
+        configure(config);
+        stats.major_collections += 1;
+    }
+
+    stats.major_slices += 1;
+    stats.major_ns += now_ns() - start;
+}
+
+bool Heap::mark_slice(u64 deadline) {
+    u64 count = 0;
+    while (!m_gray.empty()) {
+        if (++count % SLICE_CHECK_INTERVAL == 0 && now_ns() >= deadline) {
+            return false;
+        }
+        GcHeader* block = m_gray.back();
+        m_gray.pop();
+        // NOTE: Marking doesn't move anything, so this is the same walk a minor collection does.
+        scan_block(block);
+    }
+    return true;
+}
+
+bool Heap::sweep_slice(u64 deadline) {
+    u64 count = 0;
+    while (m_sweep_blocks != nullptr) {
+        if (++count % SLICE_CHECK_INTERVAL == 0 && now_ns() >= deadline) {
+            return false;
+        }
+
+        GcHeader* block = m_sweep_blocks;
+        m_sweep_blocks = block->next;
+        if (block->marked) {
+            block->marked = false;
+            block->next = m_blocks;
+            m_blocks = block;
+            continue;
+        }
+
+        m_bytes_allocated -= block->size;
+        stats.bytes_freed += block->size;
+
+        if (block->size <= GC_SMALL_BLOCK_MAX) {
+            GcHeader** free_list = &m_free_blocks[block->size / GC_BLOCK_ALIGNMENT - 1];
+            block->next = *free_list;
+            *free_list = block;
+        } else {
+            m_arena->free_section(block, block->size);
+        }
+    }
+    return true;
+}
+
+void Heap::mark_pointer(const void* ptr) {
+    // Anything else lives in an arena, like functions, natives and interned strings.
+    if (ptr == nullptr || !owns(ptr)) {
+        return;
+    }
+
+    GcHeader* block = header_of(ptr);
+    if (block->marked) {
+        return;
+    }
+    block->marked = true;
+    if (block->kind != GcKind::RAW) {
+        m_gray.push(block);
+    }
+}
+
+void Heap::mark_value(const Value& value) {
+    if (value.type() == Value::Type::CLASS) {
+        mark_class(value.as_class());
+        return;
+    }
+    mark_pointer(value.heap_pointer());
+}
+
+void Heap::mark_class(Class* klass) {
+    while (klass != nullptr && klass->gc_epoch != m_epoch) {
+        klass->gc_epoch = m_epoch;
+        for (u64 i = 0; i < klass->m_field_defaults.size(); ++i) {
+            mark_value(klass->m_field_defaults[i]);
+        }
+        klass = klass->superclass;
+    }
+}
+
+u64 GcStats::pause_bucket_limit_ns(u64 bucket) {
+    return (1ull << bucket) * 1000;
+}
+
+u64 GcStats::pause_count() const {
+    u64 count = 0;
+    for (u64 i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+        count += pauses[i];
+    }
+    return count;
+}
+
+u64 GcStats::pause_percentile_ns(double p) const {
+    const u64 count = pause_count();
+    if (count == 0) {
+        return 0;
+    }
+
+    // NOTE: Nearest rank, like the benchmark runner.
+    u64 rank = (u64) (p / 100.0 * count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    u64 seen = 0;
+    for (u64 i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+        seen += pauses[i];
+        if (seen >= rank) {
+            return i + 1 < GC_PAUSE_BUCKETS ? pause_bucket_limit_ns(i) : max_pause_ns;
+        }
+    }
+    return max_pause_ns;
+}
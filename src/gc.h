@@ -0,0 +1,263 @@
+#pragma once
+
+#include "defs.h"
+#include "lib/arena.h"
+#include "lib/array.h"
+#include "lib/string.h"
+
+#define GC_DEFAULT_INITIAL_THRESHOLD (1024ull * 1024)
+#define GC_DEFAULT_GROWTH_FACTOR 2.0
+#define GC_DEFAULT_NURSERY_SIZE (1024ull * 1024)
+#define GC_DEFAULT_PAUSE_BUDGET_NS (500ull * 1000)
+#define GC_DEFAULT_SLICE_STEP (64ull * 1024)
+// Pause bucket `i` counts pauses up to 2^i microseconds, the last one everything longer.
+#define GC_PAUSE_BUCKETS 16
+#define GC_BLOCK_ALIGNMENT 16
+// Blocks up to this size are recycled through exact size free lists, bigger ones go back
+// to the arena's free list.
+#define GC_SMALL_BLOCK_MAX 512
+#define GC_SMALL_BLOCK_CLASSES (GC_SMALL_BLOCK_MAX / GC_BLOCK_ALIGNMENT)
+
+enum class GcKind : u8 {
+    // Raw bytes, like boxed strings and longs, nothing to trace.
+    RAW,
+    // A bytecode `Object`, traced through its type.
+    OBJECT,
+    // A tree walker `Instance`, traced through its class's shape.
+    INSTANCE,
+};
+
+// Sits right before every block the heap hands out.
+struct GcHeader {
+    // Next allocated block, or the next free block of the same size once swept.
+    // In the nursery, where the block was copied to once it got promoted.
+    GcHeader* next;
+    u32 size;
+    GcKind kind;
+    // Black or gray in the current major collection, or promoted by the current minor one.
+    bool marked;
+    // Already in the remembered set, see `write_barrier`.
+    bool remembered;
+};
+
+struct GcConfig {
+    // Bytes the old space can grow to before the first major collection.
+    u64 initial_threshold = GC_DEFAULT_INITIAL_THRESHOLD;
+    // After a major collection, the next one happens once the old space is this many times what survived.
+    double growth_factor = GC_DEFAULT_GROWTH_FACTOR;
+    // Zero allocates everything straight into the old space.
+    u64 nursery_size = GC_DEFAULT_NURSERY_SIZE;
+    // How long a single collection pause aims to take. Zero does each major collection in one go.
+    u64 pause_budget_ns = GC_DEFAULT_PAUSE_BUDGET_NS;
+    // While a major collection is in progress, bytes allocated between two of its slices.
+    u64 slice_step = GC_DEFAULT_SLICE_STEP;
+};
+
+struct GcStats {
+    u64 minor_collections = 0;
+    u64 major_collections = 0;
+    u64 bytes_promoted = 0;
+    u64 bytes_freed = 0;
+    u64 peak_bytes = 0;
+    // How far the old space's arena got, free blocks included. This is the heap's actual footprint.
+    u64 arena_bytes = 0;
+    u64 minor_ns = 0;
+    // Summed over every slice.
+    u64 major_ns = 0;
+    u64 major_slices = 0;
+
+    u64 pauses[GC_PAUSE_BUCKETS] = {};
+    u64 max_pause_ns = 0;
+
+    // Longest pause bucket `bucket` counts.
+    static u64 pause_bucket_limit_ns(u64 bucket);
+    u64 pause_count() const;
+    // Limit of the bucket the `p`th percentile pause falls in, `p` going from 0 to 100.
+    u64 pause_percentile_ns(double p) const;
+};
+
+enum class GcPhase {
+    IDLE,
+    MARKING,
+    SWEEPING,
+};
+
+struct Value;
+struct Object;
+struct Class;
+struct Instance;
+struct Environment;
+
+// Generational heap for everything the program creates while it runs: strings built at runtime,
+// tree walker instances, and the closures, classes, instances, bound methods and upvalues of the
+// bytecode VM.
+//
+// New blocks are bump allocated in a nursery. A minor collection copies whatever is still
+// reachable out of it into the old space and resets it, so blocks that die young cost nothing
+// to free. The old space is mark-sweep, and only collected once it outgrows its threshold.
+//
+// Major collections are incremental, so their pauses stay within `GcConfig::pause_budget_ns`.
+// They take a snapshot of the roots, then mark and sweep a slice at a time, paced by allocation.
+// Marking is tri-color: white blocks are unmarked, gray ones are marked and still in `m_gray`,
+// black ones are marked and were scanned. Everything allocated while marking starts out black.
+//
+// Every write of a reference into something that isn't a root goes through `write_barrier`.
+// While marking, it shades the value being overwritten, so nothing reachable when the
+// collection started goes unmarked. Then, if the holder is old and the new value young, the
+// holder goes in the remembered set the next minor collection starts from, since minor
+// collections don't look through the old space. Roots, like local environments and the VM
+// stack, don't need the barrier.
+//
+// Collections only happen at safe points, where every live value is reachable from the roots
+// the caller visits, plus whatever was pushed with `push_root`. Values move, so roots are
+// visited in place.
+struct Heap {
+    void init(GcConfig config);
+    void release();
+    // Swaps in new thresholds, the next collection is rescheduled against them.
+    void configure(GcConfig config);
+
+    // Returns zeroed memory for objects, raw blocks are left for the caller to fill in.
+    void* allocate(u64 size, GcKind kind);
+    BoxedString* concatenated_string(String left, String right);
+    BoxedString* copied_string(String str);
+
+    // Whether `ptr` is in the old space.
+    bool owns(const void* ptr) const;
+    bool in_nursery(const void* ptr) const;
+    bool is_young(const Value& value) const;
+
+    bool should_collect() const {
+        if (m_nursery->offset >= m_nursery_trigger) {
+            return true;
+        }
+        return m_phase == GcPhase::IDLE
+            ? m_bytes_allocated >= m_next_gc
+            : m_bytes_since_slice >= config.slice_step;
+    }
+    GcPhase phase() const {
+        return m_phase;
+    }
+    u64 bytes_allocated() const {
+        return m_bytes_allocated;
+    }
+
+    // Called before `holder` has `old_value` replaced with `value`.
+    void write_barrier(Object* holder, const Value& old_value, const Value& value);
+    void write_barrier(Object* holder, Object* old_value, Object* value);
+    void write_barrier(Instance* holder, const Value& old_value, const Value& value);
+    void write_barrier(Class* holder, const Value& old_value, const Value& value);
+    void write_barrier(Environment* holder, const Value& old_value, const Value& value);
+    // Adds `holder` to the remembered set whatever was written to it.
+    void remember(Object* holder);
+
+    // For values only C++ locals hold on to while something that can collect runs.
+    void push_roots(Value* values, u64 count);
+    void push_root(Value* value) {
+        push_roots(value, 1);
+    }
+    void pop_root();
+
+    // Runs a minor collection if the nursery is due, starts a major collection if the old space
+    // is, and moves the one in progress along by a slice. `visit_roots` calls the `visit_*`
+    // functions below on every root, once for a minor collection and once more to start a major one.
+    template<class F>
+    void collect(F visit_roots) {
+        begin_pause();
+        if (minor_due()) {
+            begin_minor();
+            visit_roots();
+            finish_minor();
+        }
+        // NOTE: A major collection being due makes a minor one due too, so the nursery is empty
+        // when the snapshot is taken, and everything young was allocated after it.
+        if (m_phase == GcPhase::IDLE && m_bytes_allocated >= m_next_gc) {
+            begin_major();
+            visit_roots();
+        }
+        if (m_phase != GcPhase::IDLE) {
+            major_slice();
+        }
+        end_pause();
+    }
+
+    void visit(Value& value);
+    void visit_object(Object** object);
+    void visit_environment(Environment* env);
+
+    GcConfig config = {};
+    GcStats stats = {};
+
+private:
+    void* allocate_old(u64 size, GcKind kind);
+    void* promote(void* payload);
+    void visit_pointer(void** ptr);
+    void visit_pushed_roots();
+    void remember_block(const void* payload);
+    // Visits every reference a block holds, in place.
+    void scan_block(GcHeader* block);
+    void scan_object(Object* object);
+    void scan_instance(Instance* instance);
+
+    void shade(const Value& value);
+    void shade(Object* object);
+
+    void begin_pause();
+    void end_pause();
+    bool minor_due() const;
+    void begin_minor();
+    void finish_minor();
+    void begin_major();
+    void major_slice();
+    // Both return whether they are done, and stop early once `deadline` passes.
+    bool mark_slice(u64 deadline);
+    bool sweep_slice(u64 deadline);
+
+    void mark_value(const Value& value);
+    void mark_pointer(const void* ptr);
+    void mark_class(Class* klass);
+
+    Arena* m_arena = nullptr;
+    // Every block currently handed out in the old space.
+    GcHeader* m_blocks = nullptr;
+    GcHeader* m_free_blocks[GC_SMALL_BLOCK_CLASSES] = {};
+
+    u64 m_bytes_allocated = 0;
+    u64 m_next_gc = 0;
+
+    GcPhase m_phase = GcPhase::IDLE;
+    // Blocks the sweep still has to look at. Anything allocated meanwhile goes in `m_blocks`.
+    GcHeader* m_sweep_blocks = nullptr;
+    u64 m_bytes_since_slice = 0;
+    u64 m_pause_start_ns = 0;
+
+    Arena* m_nursery = nullptr;
+    u64 m_nursery_trigger = 0;
+    // Bigger blocks skip the nursery, copying them out isn't worth it.
+    u64 m_nursery_block_max = 0;
+    bool m_minor = false;
+
+    struct Roots {
+        Value* values;
+        u64 count;
+    };
+    Arena* m_roots_arena = nullptr;
+    Array<Roots> m_roots;
+
+    Arena* m_remembered_arena = nullptr;
+    Array<GcHeader*> m_remembered_objects;
+    Array<Class*> m_remembered_classes;
+    Array<Environment*> m_remembered_environments;
+
+    // Gray blocks, kept across slices.
+    Arena* m_gray_arena = nullptr;
+    Array<GcHeader*> m_gray;
+
+    // Promoted objects a minor collection still has to scan.
+    Arena* m_promoted_arena = nullptr;
+    Array<GcHeader*> m_promoted;
+
+    // Tree walker classes aren't heap blocks, so they remember the last collection that reached them instead.
+    u32 m_epoch = 0;
+    u64 m_collection_start_ns = 0;
+};
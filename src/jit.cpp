@@ -0,0 +1,1278 @@
+#include "jit.h"
+
+#include "lib/array.h"
+
+#include "trace.h"
+#include "vm.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#if KAU_JIT_SUPPORTED
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if KAU_JIT_SUPPORTED
+
+#define INT_TAG ((u64) Value::Type::INT << VALUE_PAYLOAD_BITS)
+#define BOOL_TAG ((u64) Value::Type::BOOL << VALUE_PAYLOAD_BITS)
+#define CANONICAL_NAN 0x7ff8000000000000ull
+// Rough size of the code for one byte of bytecode, to reserve the assembler's buffer.
+#define JIT_BYTES_PER_CODE_BYTE 48
+
+namespace {
+    enum Reg : u8 {
+        RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+        R8, R9, R10, R11, R12, R13, R14, R15,
+    };
+
+    // NOTE: Kept in callee saved registers the whole time the code runs.
+    const Reg SLOTS = RBX;
+    const Reg TOP = R12;
+    const Reg CONTEXT = R13;
+    const Reg GLOBALS = R14;
+
+    enum Cond : u8 {
+        B = 0x2,
+        AE = 0x3,
+        E = 0x4,
+        NE = 0x5,
+        A = 0x7,
+        P = 0xA,
+        NP = 0xB,
+        L = 0xC,
+        GE = 0xD,
+        LE = 0xE,
+        G = 0xF,
+    };
+
+    enum Alu : u8 {
+        ADD = 0x01,
+        OR = 0x09,
+        AND = 0x21,
+        SUB = 0x29,
+        XOR = 0x31,
+        CMP = 0x39,
+    };
+
+    enum SseOp : u8 {
+        ADDSD = 0x58,
+        MULSD = 0x59,
+        SUBSD = 0x5C,
+        DIVSD = 0x5E,
+    };
+
+    // Just the handful of x86-64 instructions the templates below need. Memory operands
+    // are always a base register and a 32 bit displacement.
+    struct Assembler {
+        void init(Arena* arena, u64 reserve) {
+            bytes.init(arena, reserve);
+            bytes.m_len = 0;
+        }
+
+        u64 offset() const {
+            return bytes.size();
+        }
+
+        void byte(u8 b) {
+            bytes.push(b);
+        }
+        void u32le(u32 value) {
+            for (int i = 0; i < 4; ++i) {
+                byte((value >> (8 * i)) & 0xff);
+            }
+        }
+        void u64le(u64 value) {
+            for (int i = 0; i < 8; ++i) {
+                byte((value >> (8 * i)) & 0xff);
+            }
+        }
+
+        void rex(bool wide, u8 reg, u8 rm) {
+            const u8 prefix = 0x40 | (wide ? 0x08 : 0) | ((reg >> 3) << 2) | (rm >> 3);
+            if (prefix != 0x40) {
+                byte(prefix);
+            }
+        }
+        void modrm_reg(u8 reg, u8 rm) {
+            byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+        }
+        void modrm_mem(u8 reg, u8 base, i32 disp) {
+            byte(0x80 | ((reg & 7) << 3) | (base & 7));
+            // NOTE: RSP and R12 as a base need a SIB byte.
+            if ((base & 7) == RSP) {
+                byte(0x24);
+            }
+            u32le((u32) disp);
+        }
+
+        void load(Reg dst, Reg base, i32 disp) {
+            rex(true, dst, base);
+            byte(0x8B);
+            modrm_mem(dst, base, disp);
+        }
+        void store(Reg base, i32 disp, Reg src) {
+            rex(true, src, base);
+            byte(0x89);
+            modrm_mem(src, base, disp);
+        }
+        void lea(Reg dst, Reg base, i32 disp) {
+            rex(true, dst, base);
+            byte(0x8D);
+            modrm_mem(dst, base, disp);
+        }
+        void mov(Reg dst, Reg src) {
+            rex(true, src, dst);
+            byte(0x89);
+            modrm_reg(src, dst);
+        }
+        void mov_imm(Reg dst, u64 imm) {
+            rex(true, 0, dst);
+            byte(0xB8 + (dst & 7));
+            u64le(imm);
+        }
+
+        void alu(Alu op, Reg dst, Reg src) {
+            rex(true, src, dst);
+            byte(op);
+            modrm_reg(src, dst);
+        }
+        void alu32(Alu op, Reg dst, Reg src) {
+            rex(false, src, dst);
+            byte(op);
+            modrm_reg(src, dst);
+        }
+        // `ADD`, `OR`, `SUB`, `XOR` and `CMP` with an immediate, by their /digit.
+        void alu_imm(u8 digit, Reg dst, i32 imm) {
+            rex(true, 0, dst);
+            byte(0x81);
+            modrm_reg(digit, dst);
+            u32le((u32) imm);
+        }
+        void add_imm(Reg dst, i32 imm) {
+            alu_imm(0, dst, imm);
+        }
+        void sub_imm(Reg dst, i32 imm) {
+            alu_imm(5, dst, imm);
+        }
+        void xor_imm(Reg dst, i32 imm) {
+            alu_imm(6, dst, imm);
+        }
+        void cmp_imm(Reg dst, i32 imm) {
+            alu_imm(7, dst, imm);
+        }
+        void shr_imm(Reg dst, u8 count) {
+            rex(true, 0, dst);
+            byte(0xC1);
+            modrm_reg(5, dst);
+            byte(count);
+        }
+        void shl_imm(Reg dst, u8 count) {
+            rex(true, 0, dst);
+            byte(0xC1);
+            modrm_reg(4, dst);
+            byte(count);
+        }
+        void btc_imm(Reg dst, u8 bit) {
+            rex(true, 0, dst);
+            byte(0x0F);
+            byte(0xBA);
+            modrm_reg(7, dst);
+            byte(bit);
+        }
+        void test32(Reg a, Reg b) {
+            rex(false, b, a);
+            byte(0x85);
+            modrm_reg(b, a);
+        }
+        void imul32(Reg dst, Reg src) {
+            rex(false, dst, src);
+            byte(0x0F);
+            byte(0xAF);
+            modrm_reg(dst, src);
+        }
+        void neg32(Reg dst) {
+            rex(false, 0, dst);
+            byte(0xF7);
+            modrm_reg(3, dst);
+        }
+        // Signed `EDX:EAX / src`, after sign extending EAX into EDX.
+        void idiv32(Reg src) {
+            byte(0x99);
+            rex(false, 0, src);
+            byte(0xF7);
+            modrm_reg(7, src);
+        }
+        // Only for AL, CL, DL and BL, which need no REX prefix.
+        void setcc(Cond cond, Reg dst) {
+            byte(0x0F);
+            byte(0x90 + cond);
+            modrm_reg(0, dst);
+        }
+        void test8(Reg a, Reg b) {
+            byte(0x84);
+            modrm_reg(b, a);
+        }
+        void and8(Reg dst, Reg src) {
+            byte(0x20);
+            modrm_reg(src, dst);
+        }
+        void or8(Reg dst, Reg src) {
+            byte(0x08);
+            modrm_reg(src, dst);
+        }
+        void movzx8(Reg dst, Reg src) {
+            byte(0x0F);
+            byte(0xB6);
+            modrm_reg(dst, src);
+        }
+        void cmp_byte_imm(Reg base, i32 disp, u8 imm) {
+            rex(false, 0, base);
+            byte(0x80);
+            modrm_mem(7, base, disp);
+            byte(imm);
+        }
+        void cmp32_mem_imm(Reg base, i32 disp, u32 imm) {
+            rex(false, 0, base);
+            byte(0x81);
+            modrm_mem(7, base, disp);
+            u32le(imm);
+        }
+        void inc_mem(Reg base, i32 disp) {
+            rex(true, 0, base);
+            byte(0xFF);
+            modrm_mem(0, base, disp);
+        }
+
+        // Only XMM0 to XMM7, which need no REX prefix of their own.
+        void movq_to_xmm(u8 xmm, Reg src) {
+            byte(0x66);
+            rex(true, xmm, src);
+            byte(0x0F);
+            byte(0x6E);
+            modrm_reg(xmm, src);
+        }
+        void movq_from_xmm(Reg dst, u8 xmm) {
+            byte(0x66);
+            rex(true, xmm, dst);
+            byte(0x0F);
+            byte(0x7E);
+            modrm_reg(xmm, dst);
+        }
+        void sse(SseOp op, u8 dst, u8 src) {
+            byte(0xF2);
+            byte(0x0F);
+            byte(op);
+            modrm_reg(dst, src);
+        }
+        void ucomisd(u8 a, u8 b) {
+            byte(0x66);
+            byte(0x0F);
+            byte(0x2E);
+            modrm_reg(a, b);
+        }
+
+        void push(Reg reg) {
+            rex(false, 0, reg);
+            byte(0x50 + (reg & 7));
+        }
+        void pop(Reg reg) {
+            rex(false, 0, reg);
+            byte(0x58 + (reg & 7));
+        }
+        void call(Reg reg) {
+            rex(false, 0, reg);
+            byte(0xFF);
+            modrm_reg(2, reg);
+        }
+        void jmp_reg(Reg reg) {
+            rex(false, 0, reg);
+            byte(0xFF);
+            modrm_reg(4, reg);
+        }
+        void ret() {
+            byte(0xC3);
+        }
+
+        // Both return where their displacement goes, for `patch`.
+        u64 jcc(Cond cond) {
+            byte(0x0F);
+            byte(0x80 + cond);
+            u32le(0);
+            return offset() - 4;
+        }
+        u64 jmp() {
+            byte(0xE9);
+            u32le(0);
+            return offset() - 4;
+        }
+        void patch(u64 at, u64 target) {
+            const u32 rel = (u32) (i32) ((i64) target - (i64) (at + 4));
+            memcpy(&bytes[at], &rel, sizeof(rel));
+        }
+        void bind(u64 at) {
+            patch(at, offset());
+        }
+
+        Array<u8> bytes;
+    };
+
+    // Where a binary operator finds one of its operands: in a slot, or in the code itself.
+    struct Operand {
+        Reg base;
+        i32 disp;
+        const Value* constant;
+    };
+
+    struct Jump {
+        u64 at;
+        u64 target_word;
+    };
+
+    // A branch taken when the instruction at `word` has to be left to the interpreter.
+    struct Exit {
+        u64 at;
+        u64 word;
+        bool guard;
+    };
+
+    bool jit_should_collect(Heap* heap) {
+        return heap->should_collect();
+    }
+
+    // Entered with the context, the slots and the target, and saves the registers the code keeps its state in.
+    // NOTE: Five pushes on top of the return address keep the stack 16 byte aligned for calls.
+    void emit_entry(Assembler& a) {
+        a.push(RBP);
+        a.push(SLOTS);
+        a.push(TOP);
+        a.push(CONTEXT);
+        a.push(GLOBALS);
+        a.mov(CONTEXT, RDI);
+        a.mov(SLOTS, RSI);
+        a.load(TOP, CONTEXT, (i32) offsetof(JitContext, stack_top));
+        a.load(GLOBALS, CONTEXT, (i32) offsetof(JitContext, globals));
+        a.jmp_reg(RDX);
+    }
+
+    // Every exit jumps to one of these with the threaded word to resume from in RAX.
+    struct ExitStubs {
+        // Counts the exit in `JitContext::guard_exits` first.
+        u64 guard_exit;
+        u64 exit;
+    };
+
+    ExitStubs emit_exit_stubs(Assembler& a) {
+        ExitStubs stubs = {};
+        stubs.guard_exit = a.offset();
+        a.inc_mem(CONTEXT, (i32) offsetof(JitContext, guard_exits));
+        stubs.exit = a.offset();
+        a.store(CONTEXT, (i32) offsetof(JitContext, stack_top), TOP);
+        a.pop(GLOBALS);
+        a.pop(CONTEXT);
+        a.pop(TOP);
+        a.pop(SLOTS);
+        a.pop(RBP);
+        a.ret();
+        return stubs;
+    }
+
+    // Copies the assembled code to pages of its own for `jit`. Returns false if they couldn't be mapped.
+    bool map_code(JitCode* jit, const Assembler& a) {
+        const u64 page_size = (u64) sysconf(_SC_PAGESIZE);
+        const u64 mapped_size = (a.offset() + page_size - 1) & ~(page_size - 1);
+        void* mem = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return false;
+        }
+        memcpy(mem, a.bytes.m_head, a.offset());
+        // NOTE: Never writable and executable at the same time.
+        if (mprotect(mem, mapped_size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(mem, mapped_size);
+            return false;
+        }
+
+        jit->code = (u8*) mem;
+        jit->size = mapped_size;
+        jit->enter = (JitEntry) mem;
+        return true;
+    }
+
+    // Condition an int comparison is true on.
+    Cond int_condition(OpCode op) {
+        switch (op) {
+            case OpCode::EQUAL: {
+                return E;
+            }
+            case OpCode::NOT_EQUAL: {
+                return NE;
+            }
+            case OpCode::GREATER: {
+                return G;
+            }
+            case OpCode::GREATER_EQUAL: {
+                return GE;
+            }
+            case OpCode::LESSER: {
+                return L;
+            }
+            case OpCode::LESSER_EQUAL: {
+                return LE;
+            }
+            default: {
+                assert(false);
+                return E;
+            }
+        }
+    }
+
+    // The templates below work on the operands in RAX and RDX, leave the result in RAX and use
+    // RCX as scratch. They return the branch to take to exit, if they need one, or `UINT64_MAX`.
+    //
+    // Ints are the low 32 bits of the value, 32 bit instructions clear the payload above them.
+    u64 emit_int_binary(Assembler& a, OpCode op) {
+        u64 exit_branch = UINT64_MAX;
+        switch (op) {
+            case OpCode::ADD: {
+                a.alu32(ADD, RAX, RDX);
+                break;
+            }
+            case OpCode::SUBTRACT: {
+                a.alu32(SUB, RAX, RDX);
+                break;
+            }
+            case OpCode::MULTIPLY: {
+                a.imul32(RAX, RDX);
+                break;
+            }
+            case OpCode::DIVIDE: {
+                a.test32(RDX, RDX);
+                exit_branch = a.jcc(E);
+                a.mov(RCX, RDX);
+                // NOTE: `idiv` leaves the quotient in EAX, and clears the upper half of RAX.
+                a.idiv32(RCX);
+                break;
+            }
+            default: {
+                a.alu32(CMP, RAX, RDX);
+                a.setcc(int_condition(op), RCX);
+                a.movzx8(RCX, RCX);
+                a.mov_imm(RAX, BOOL_TAG);
+                a.alu(OR, RAX, RCX);
+                return UINT64_MAX;
+            }
+        }
+
+        a.mov_imm(RCX, INT_TAG);
+        a.alu(OR, RAX, RCX);
+        return exit_branch;
+    }
+
+    // Boxes the double in XMM0 into RAX, the same way `double_value` does.
+    void emit_box_double(Assembler& a) {
+        a.movq_from_xmm(RAX, 0);
+        a.ucomisd(0, 0);
+        // NOTE: Skips the 10 byte `mov` below unless the result is a NaN.
+        a.byte(0x70 + NP);
+        a.byte(10);
+        a.mov_imm(RAX, CANONICAL_NAN);
+        a.mov_imm(RCX, VALUE_DOUBLE_OFFSET);
+        a.alu(ADD, RAX, RCX);
+    }
+
+    // Here RAX and RDX hold the raw bits of both doubles, already unboxed.
+    u64 emit_double_binary(Assembler& a, OpCode op) {
+        u64 exit_branch = UINT64_MAX;
+        if (op == OpCode::DIVIDE) {
+            // NOTE: Both zeros are zero once the sign bit is shifted out.
+            a.mov(RCX, RDX);
+            a.shl_imm(RCX, 1);
+            exit_branch = a.jcc(E);
+        }
+        a.movq_to_xmm(0, RAX);
+        a.movq_to_xmm(1, RDX);
+
+        switch (op) {
+            case OpCode::ADD: {
+                a.sse(ADDSD, 0, 1);
+                emit_box_double(a);
+                return exit_branch;
+            }
+            case OpCode::SUBTRACT: {
+                a.sse(SUBSD, 0, 1);
+                emit_box_double(a);
+                return exit_branch;
+            }
+            case OpCode::MULTIPLY: {
+                a.sse(MULSD, 0, 1);
+                emit_box_double(a);
+                return exit_branch;
+            }
+            case OpCode::DIVIDE: {
+                a.sse(DIVSD, 0, 1);
+                emit_box_double(a);
+                return exit_branch;
+            }
+            // NOTE: Unordered compares set CF, ZF and PF, so anything with a NaN is false
+            // except for `!=`, like in C++.
+            case OpCode::EQUAL: {
+                a.ucomisd(0, 1);
+                a.setcc(E, RCX);
+                a.setcc(NP, RDX);
+                a.and8(RCX, RDX);
+                break;
+            }
+            case OpCode::NOT_EQUAL: {
+                a.ucomisd(0, 1);
+                a.setcc(NE, RCX);
+                a.setcc(P, RDX);
+                a.or8(RCX, RDX);
+                break;
+            }
+            case OpCode::GREATER: {
+                a.ucomisd(0, 1);
+                a.setcc(A, RCX);
+                break;
+            }
+            case OpCode::GREATER_EQUAL: {
+                a.ucomisd(0, 1);
+                a.setcc(AE, RCX);
+                break;
+            }
+            case OpCode::LESSER: {
+                a.ucomisd(1, 0);
+                a.setcc(A, RCX);
+                break;
+            }
+            case OpCode::LESSER_EQUAL: {
+                a.ucomisd(1, 0);
+                a.setcc(AE, RCX);
+                break;
+            }
+            default: {
+                assert(false);
+                break;
+            }
+        }
+
+        a.movzx8(RCX, RCX);
+        a.mov_imm(RAX, BOOL_TAG);
+        a.alu(OR, RAX, RCX);
+        return UINT64_MAX;
+    }
+
+    struct JitCompiler {
+        // Both return false when the code exits right away, and leave the instruction to the interpreter.
+        bool compile_instruction(u64 offset, u64 word);
+        bool compile_binary(OpCode op, Operand left, Operand right, u64 word);
+
+        void load_operand(Reg dst, const Operand& operand);
+        // Exits at `word` unless the type tag of `reg` is `type`. Uses RCX.
+        void guard_tag(Reg reg, Value::Type type, u64 word);
+        void exit_if(Cond cond, u64 word, bool guard);
+        // Guard exit for a template's branch, if it has one.
+        void exit_branch(u64 at, u64 word);
+        void exit_now(u64 word);
+        void push_value(Reg src);
+
+        u16 read_short(u64 offset) const {
+            return (u16) ((function->chunk.code[offset] << 8) | function->chunk.code[offset + 1]);
+        }
+
+        FunctionObject* function;
+        Assembler a;
+        // Threaded word of the instruction at each byte of the chunk.
+        u64* word_at;
+        // Where the instruction at each threaded word starts in the code, `UINT64_MAX` if it exits right away.
+        u64* native_at;
+        Array<Jump> jumps;
+        Array<Exit> exits;
+    };
+
+    void JitCompiler::load_operand(Reg dst, const Operand& operand) {
+        if (operand.constant != nullptr) {
+            a.mov_imm(dst, operand.constant->bits);
+        } else {
+            a.load(dst, operand.base, operand.disp);
+        }
+    }
+
+    void JitCompiler::guard_tag(Reg reg, Value::Type type, u64 word) {
+        a.mov(RCX, reg);
+        a.shr_imm(RCX, VALUE_PAYLOAD_BITS);
+        a.cmp_imm(RCX, (i32) type);
+        exit_if(NE, word, true);
+    }
+
+    void JitCompiler::exit_if(Cond cond, u64 word, bool guard) {
+        exits.push(Exit{ a.jcc(cond), word, guard });
+    }
+
+    void JitCompiler::exit_branch(u64 at, u64 word) {
+        if (at != UINT64_MAX) {
+            exits.push(Exit{ at, word, true });
+        }
+    }
+
+    void JitCompiler::exit_now(u64 word) {
+        exits.push(Exit{ a.jmp(), word, false });
+    }
+
+    void JitCompiler::push_value(Reg src) {
+        a.store(TOP, 0, src);
+        a.add_imm(TOP, sizeof(Value));
+    }
+
+    // Leaves the result in RAX. Operands of any other type exit, and so do ints divided by zero,
+    // for the interpreter to report.
+    bool JitCompiler::compile_binary(OpCode op, Operand left, Operand right, u64 word) {
+        // NOTE: A constant's type is known, so only its half of the template is compiled.
+        Value::Type constant_type = Value::Type::NIL;
+        if (right.constant != nullptr) {
+            constant_type = right.constant->type();
+            if (constant_type != Value::Type::INT && constant_type != Value::Type::DOUBLE) {
+                exit_now(word);
+                return false;
+            }
+        }
+
+        load_operand(RAX, left);
+        load_operand(RDX, right);
+
+        u64 not_int = UINT64_MAX;
+        u64 int_done = UINT64_MAX;
+        if (constant_type != Value::Type::DOUBLE) {
+            a.mov(RCX, RAX);
+            a.shr_imm(RCX, VALUE_PAYLOAD_BITS);
+            a.cmp_imm(RCX, (i32) Value::Type::INT);
+            if (constant_type == Value::Type::INT) {
+                exit_if(NE, word, true);
+            } else {
+                not_int = a.jcc(NE);
+                guard_tag(RDX, Value::Type::INT, word);
+            }
+            exit_branch(emit_int_binary(a, op), word);
+            if (constant_type == Value::Type::INT) {
+                return true;
+            }
+            int_done = a.jmp();
+            a.bind(not_int);
+        }
+
+        a.mov_imm(RCX, VALUE_DOUBLE_OFFSET);
+        a.alu(CMP, RAX, RCX);
+        exit_if(B, word, true);
+        if (constant_type != Value::Type::DOUBLE) {
+            a.alu(CMP, RDX, RCX);
+            exit_if(B, word, true);
+        }
+        a.alu(SUB, RAX, RCX);
+        a.alu(SUB, RDX, RCX);
+        exit_branch(emit_double_binary(a, op), word);
+
+        if (int_done != UINT64_MAX) {
+            a.bind(int_done);
+        }
+        return true;
+    }
+
+    bool JitCompiler::compile_instruction(u64 offset, u64 word) {
+        const Chunk& chunk = function->chunk;
+        const OpCode op = (OpCode) chunk.code[offset];
+        const u64 size = instruction_size(chunk, offset);
+
+        if (is_register_op(op)) {
+            const bool constant_right = size == 6;
+            const OpCode stack_op = (OpCode) ((u64) OpCode::EQUAL +
+                (u64) op - (u64) (constant_right ? OpCode::EQUAL_RK : OpCode::EQUAL_RR));
+            const u8 dst = chunk.code[offset + 1];
+            const u8 left = chunk.code[offset + 2];
+            Operand right = {};
+            if (constant_right) {
+                right.constant = &chunk.constants[read_short(offset + 3)];
+            } else {
+                right = Operand{ SLOTS, (i32) (chunk.code[offset + 3] * sizeof(Value)), nullptr };
+            }
+            const u8 top = chunk.code[offset + size - 1];
+
+            if (!compile_binary(stack_op, Operand{ SLOTS, (i32) (left * sizeof(Value)), nullptr }, right, word)) {
+                return false;
+            }
+            a.store(SLOTS, (i32) (dst * sizeof(Value)), RAX);
+            a.lea(TOP, SLOTS, (i32) (top * sizeof(Value)));
+            return true;
+        }
+
+        switch (op) {
+            case OpCode::CONSTANT: {
+                a.mov_imm(RAX, chunk.constants[read_short(offset + 1)].bits);
+                push_value(RAX);
+                break;
+            }
+            case OpCode::NIL: {
+                a.mov_imm(RAX, Value{}.bits);
+                push_value(RAX);
+                break;
+            }
+            case OpCode::TRUE:
+            case OpCode::FALSE: {
+                a.mov_imm(RAX, bool_value(op == OpCode::TRUE).bits);
+                push_value(RAX);
+                break;
+            }
+            case OpCode::POP: {
+                a.sub_imm(TOP, sizeof(Value));
+                break;
+            }
+            case OpCode::GET_LOCAL: {
+                a.load(RAX, SLOTS, (i32) (chunk.code[offset + 1] * sizeof(Value)));
+                push_value(RAX);
+                break;
+            }
+            case OpCode::SET_LOCAL: {
+                a.load(RAX, TOP, -(i32) sizeof(Value));
+                a.store(SLOTS, (i32) (chunk.code[offset + 1] * sizeof(Value)), RAX);
+                break;
+            }
+            // NOTE: Undefined globals exit, so the interpreter reports them.
+            case OpCode::GET_GLOBAL:
+            case OpCode::SET_GLOBAL: {
+                const i32 global = (i32) (read_short(offset + 1) * sizeof(GlobalSlot));
+                a.cmp_byte_imm(GLOBALS, global + (i32) offsetof(GlobalSlot, defined), 0);
+                exit_if(E, word, true);
+                if (op == OpCode::GET_GLOBAL) {
+                    a.load(RAX, GLOBALS, global + (i32) offsetof(GlobalSlot, value));
+                    push_value(RAX);
+                } else {
+                    a.load(RAX, TOP, -(i32) sizeof(Value));
+                    a.store(GLOBALS, global + (i32) offsetof(GlobalSlot, value), RAX);
+                }
+                break;
+            }
+            case OpCode::EQUAL:
+            case OpCode::NOT_EQUAL:
+            case OpCode::GREATER:
+            case OpCode::GREATER_EQUAL:
+            case OpCode::LESSER:
+            case OpCode::LESSER_EQUAL:
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE: {
+                const Operand left = { TOP, -2 * (i32) sizeof(Value), nullptr };
+                const Operand right = { TOP, -(i32) sizeof(Value), nullptr };
+                compile_binary(op, left, right, word);
+                a.store(TOP, -2 * (i32) sizeof(Value), RAX);
+                a.sub_imm(TOP, sizeof(Value));
+                break;
+            }
+            case OpCode::NOT: {
+                a.load(RAX, TOP, -(i32) sizeof(Value));
+                guard_tag(RAX, Value::Type::BOOL, word);
+                a.xor_imm(RAX, 1);
+                a.store(TOP, -(i32) sizeof(Value), RAX);
+                break;
+            }
+            case OpCode::NEGATE: {
+                a.load(RAX, TOP, -(i32) sizeof(Value));
+                a.mov(RCX, RAX);
+                a.shr_imm(RCX, VALUE_PAYLOAD_BITS);
+                a.cmp_imm(RCX, (i32) Value::Type::INT);
+                const u64 not_int = a.jcc(NE);
+                a.neg32(RAX);
+                a.mov_imm(RCX, INT_TAG);
+                a.alu(OR, RAX, RCX);
+                const u64 done = a.jmp();
+
+                a.bind(not_int);
+                a.mov_imm(RCX, VALUE_DOUBLE_OFFSET);
+                a.alu(CMP, RAX, RCX);
+                exit_if(B, word, true);
+                a.alu(SUB, RAX, RCX);
+                a.btc_imm(RAX, 63);
+                a.movq_to_xmm(0, RAX);
+                emit_box_double(a);
+
+                a.bind(done);
+                a.store(TOP, -(i32) sizeof(Value), RAX);
+                break;
+            }
+            case OpCode::JUMP: {
+                jumps.push(Jump{ a.jmp(), word_at[offset + size + read_short(offset + 1)] });
+                break;
+            }
+            case OpCode::JUMP_IF_FALSE: {
+                a.load(RAX, TOP, -(i32) sizeof(Value));
+                guard_tag(RAX, Value::Type::BOOL, word);
+                a.test32(RAX, RAX);
+                jumps.push(Jump{ a.jcc(E), word_at[offset + size + read_short(offset + 1)] });
+                break;
+            }
+            // NOTE: Loops are where the interpreter collects, so the code exits to it once
+            // a collection is due.
+            case OpCode::LOOP: {
+                a.load(RDI, CONTEXT, (i32) offsetof(JitContext, heap));
+                a.mov_imm(RAX, (u64) &jit_should_collect);
+                a.call(RAX);
+                a.test8(RAX, RAX);
+                exit_if(NE, word, false);
+                jumps.push(Jump{ a.jmp(), word_at[offset + size - read_short(offset + 1)] });
+                break;
+            }
+            default: {
+                exit_now(word);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // A branch off a trace to one of its exits, see `TraceExit`.
+    struct TraceBranch {
+        u64 at;
+        u32 exit;
+    };
+
+    // NOTE: `offsetof` is only for standard layout types, which ones with a base aren't.
+    const InstanceObject instance_layout = {};
+    const i32 INSTANCE_KLASS_OFFSET = (i32) ((const u8*) &instance_layout.klass - (const u8*) &instance_layout);
+    const i32 INSTANCE_FIELDS_OFFSET = (i32) ((const u8*) &instance_layout.fields - (const u8*) &instance_layout);
+
+    void trace_set_field(Heap* heap, InstanceObject* instance, u64 slot, u64 bits) {
+        const Value value = { bits };
+        heap->write_barrier(instance, instance->fields[slot], value);
+        instance->fields[slot] = value;
+    }
+
+    // Traces keep the stack in memory, and every slot sits at a fixed offset from SLOTS since
+    // the depth at each instruction is known, so the interpreter can pick up from any exit.
+    // Types are known too, past the guards, so arithmetic needs no type checks of its own.
+    struct TraceCompiler {
+        // Returns false for instructions traces can't compile.
+        bool compile_instruction(u64 index);
+        void compile_binary(const TraceInstruction& instruction, u64 left, u64 right, u64 dst);
+        // Leaves the instance at `slot` in RAX, exiting unless it is of the class the trace was recorded with.
+        void load_instance(const TraceInstruction& instruction, u64 slot, u32 exit);
+
+        // The exit resuming at `word` with `depth` values on the stack, added unless there already is one.
+        u32 exit_at(u64 word, u32 depth, bool materialize = false, Value condition = {});
+        void exit_if(Cond cond, u32 exit);
+        // Exits unless the value in `reg` is of `type`. Uses RCX.
+        void guard_type(Reg reg, Value::Type type, u32 exit);
+
+        // RAX caches the value of the slots in `rax_slots` and of `rax_global`, so loads of
+        // them are forwarded from it. Everything that writes RAX goes through these.
+        void load_slot(Reg dst, u64 slot);
+        void store_slot(u64 slot);
+        void load_global(u64 index);
+        void store_global(u64 index);
+        void forget();
+
+        Trace* trace;
+        Assembler a;
+        Array<TraceBranch> branches;
+        bool rax_slots[TRACE_MAX_SLOTS];
+        u64 rax_global;
+    };
+
+    u32 TraceCompiler::exit_at(u64 word, u32 depth, bool materialize, Value condition) {
+        for (u64 i = 0; i < trace->exits.size(); ++i) {
+            const TraceExit& exit = trace->exits[i];
+            if (exit.word == word && exit.depth == depth && exit.materialize == materialize && exit.condition.bits == condition.bits) {
+                return (u32) i;
+            }
+        }
+        trace->exits.push(TraceExit{ word, depth, materialize, condition, 0 });
+        return (u32) (trace->exits.size() - 1);
+    }
+
+    void TraceCompiler::exit_if(Cond cond, u32 exit) {
+        branches.push(TraceBranch{ a.jcc(cond), exit });
+    }
+
+    void TraceCompiler::guard_type(Reg reg, Value::Type type, u32 exit) {
+        if (type == Value::Type::DOUBLE) {
+            a.mov_imm(RCX, VALUE_DOUBLE_OFFSET);
+            a.alu(CMP, reg, RCX);
+            exit_if(B, exit);
+            return;
+        }
+        a.mov(RCX, reg);
+        a.shr_imm(RCX, VALUE_PAYLOAD_BITS);
+        a.cmp_imm(RCX, (i32) type);
+        exit_if(NE, exit);
+    }
+
+    void TraceCompiler::load_slot(Reg dst, u64 slot) {
+        if (rax_slots[slot]) {
+            trace->loads_forwarded += 1;
+            if (dst != RAX) {
+                a.mov(dst, RAX);
+            }
+            return;
+        }
+        if (dst == RAX) {
+            forget();
+            rax_slots[slot] = true;
+        }
+        a.load(dst, SLOTS, (i32) (slot * sizeof(Value)));
+    }
+
+    void TraceCompiler::store_slot(u64 slot) {
+        a.store(SLOTS, (i32) (slot * sizeof(Value)), RAX);
+        rax_slots[slot] = true;
+    }
+
+    void TraceCompiler::load_global(u64 index) {
+        if (rax_global == index) {
+            trace->loads_forwarded += 1;
+            return;
+        }
+        forget();
+        a.load(RAX, GLOBALS, (i32) (index * sizeof(GlobalSlot) + offsetof(GlobalSlot, value)));
+        rax_global = index;
+    }
+
+    void TraceCompiler::store_global(u64 index) {
+        a.store(GLOBALS, (i32) (index * sizeof(GlobalSlot) + offsetof(GlobalSlot, value)), RAX);
+        rax_global = index;
+    }
+
+    void TraceCompiler::forget() {
+        memset(rax_slots, 0, sizeof(rax_slots));
+        rax_global = UINT64_MAX;
+    }
+
+    void TraceCompiler::compile_binary(const TraceInstruction& instruction, u64 left, u64 right, u64 dst) {
+        const OpCode op = is_register_op(instruction.op)
+            ? (OpCode) ((u64) OpCode::EQUAL + (u64) instruction.op -
+                (u64) (instruction.op >= OpCode::EQUAL_RK ? OpCode::EQUAL_RK : OpCode::EQUAL_RR))
+            : instruction.op;
+
+        load_slot(RAX, left);
+        if (instruction.op >= OpCode::EQUAL_RK) {
+            a.mov_imm(RDX, instruction.constant.bits);
+        } else {
+            load_slot(RDX, right);
+        }
+
+        // NOTE: The comparison's result only gets written out if the branch goes the other way.
+        if (instruction.fused) {
+            const TraceInstruction& branch = (&instruction)[1];
+            a.alu32(CMP, RAX, RDX);
+            const Cond cond = int_condition(op);
+            const u32 exit = exit_at(branch.word, branch.depth, true, bool_value(branch.jumped));
+            exit_if(branch.jumped ? cond : (Cond) (cond ^ 1), exit);
+            return;
+        }
+
+        const u32 exit = exit_at(instruction.word, instruction.depth);
+        u64 exit_branch = UINT64_MAX;
+        if (instruction.types[0] == Value::Type::INT) {
+            exit_branch = emit_int_binary(a, op);
+        } else {
+            a.mov_imm(RCX, VALUE_DOUBLE_OFFSET);
+            a.alu(SUB, RAX, RCX);
+            a.alu(SUB, RDX, RCX);
+            exit_branch = emit_double_binary(a, op);
+        }
+        if (exit_branch != UINT64_MAX) {
+            branches.push(TraceBranch{ exit_branch, exit });
+        }
+        forget();
+        store_slot(dst);
+    }
+
+    void TraceCompiler::load_instance(const TraceInstruction& instruction, u64 slot, u32 exit) {
+        load_slot(RAX, slot);
+        forget();
+        a.mov_imm(RCX, VALUE_PAYLOAD_MASK);
+        a.alu(AND, RAX, RCX);
+        a.cmp32_mem_imm(RAX, (i32) offsetof(Object, ty), (u32) Object::Type::INSTANCE);
+        exit_if(NE, exit);
+        a.load(RDX, RAX, (i32) INSTANCE_KLASS_OFFSET);
+        a.mov_imm(RCX, (u64) &trace->classes[instruction.klass]);
+        a.load(RCX, RCX, 0);
+        a.alu(CMP, RDX, RCX);
+        exit_if(NE, exit);
+    }
+
+    bool TraceCompiler::compile_instruction(u64 index) {
+        const TraceInstruction& instruction = trace->instructions[index];
+        const u32 depth = instruction.depth;
+
+        if (is_register_op(instruction.op)) {
+            compile_binary(instruction, instruction.left, instruction.right, instruction.dst);
+            return true;
+        }
+
+        switch (instruction.op) {
+            case OpCode::CONSTANT:
+            case OpCode::NIL:
+            case OpCode::TRUE:
+            case OpCode::FALSE: {
+                Value value = instruction.constant;
+                if (instruction.op != OpCode::CONSTANT) {
+                    value = instruction.op == OpCode::NIL ? Value{} : bool_value(instruction.op == OpCode::TRUE);
+                }
+                forget();
+                a.mov_imm(RAX, value.bits);
+                store_slot(depth);
+                break;
+            }
+            // NOTE: The stack top is only worked out at exits, so these are free.
+            case OpCode::POP:
+            case OpCode::JUMP: {
+                break;
+            }
+            case OpCode::GET_LOCAL: {
+                load_slot(RAX, instruction.operand);
+                store_slot(depth);
+                break;
+            }
+            case OpCode::SET_LOCAL: {
+                load_slot(RAX, depth - 1);
+                store_slot(instruction.operand);
+                break;
+            }
+            case OpCode::GET_GLOBAL: {
+                load_global(instruction.operand);
+                store_slot(depth);
+                break;
+            }
+            case OpCode::SET_GLOBAL: {
+                load_slot(RAX, depth - 1);
+                store_global(instruction.operand);
+                break;
+            }
+            case OpCode::GET_PROPERTY: {
+                const u32 exit = exit_at(instruction.word, depth);
+                load_instance(instruction, depth - 1, exit);
+                a.load(RAX, RAX, (i32) INSTANCE_FIELDS_OFFSET);
+                a.load(RAX, RAX, (i32) (instruction.operand * sizeof(Value)));
+                guard_type(RAX, instruction.types[0], exit);
+                store_slot(depth - 1);
+                break;
+            }
+            case OpCode::SET_PROPERTY: {
+                load_instance(instruction, depth - 2, exit_at(instruction.word, depth));
+                a.mov(RSI, RAX);
+                a.load(RDI, CONTEXT, (i32) offsetof(JitContext, heap));
+                a.mov_imm(RDX, instruction.operand);
+                a.load(RCX, SLOTS, (i32) ((depth - 1) * sizeof(Value)));
+                a.mov_imm(RAX, (u64) &trace_set_field);
+                a.call(RAX);
+                forget();
+                load_slot(RAX, depth - 1);
+                store_slot(depth - 2);
+                break;
+            }
+            case OpCode::EQUAL:
+            case OpCode::NOT_EQUAL:
+            case OpCode::GREATER:
+            case OpCode::GREATER_EQUAL:
+            case OpCode::LESSER:
+            case OpCode::LESSER_EQUAL:
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE: {
+                compile_binary(instruction, depth - 2, depth - 1, depth - 2);
+                break;
+            }
+            case OpCode::NOT: {
+                load_slot(RAX, depth - 1);
+                forget();
+                a.xor_imm(RAX, 1);
+                store_slot(depth - 1);
+                break;
+            }
+            case OpCode::NEGATE: {
+                load_slot(RAX, depth - 1);
+                forget();
+                if (instruction.types[0] == Value::Type::INT) {
+                    a.neg32(RAX);
+                    a.mov_imm(RCX, INT_TAG);
+                    a.alu(OR, RAX, RCX);
+                } else {
+                    a.mov_imm(RCX, VALUE_DOUBLE_OFFSET);
+                    a.alu(SUB, RAX, RCX);
+                    a.btc_imm(RAX, 63);
+                    a.movq_to_xmm(0, RAX);
+                    emit_box_double(a);
+                }
+                store_slot(depth - 1);
+                break;
+            }
+            case OpCode::JUMP_IF_FALSE: {
+                if (index > 0 && trace->instructions[index - 1].fused) {
+                    break;
+                }
+                load_slot(RAX, depth - 1);
+                a.test32(RAX, RAX);
+                exit_if(instruction.jumped ? NE : E, exit_at(instruction.word, depth));
+                break;
+            }
+            default: {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif
+
+JitCode* jit_compile(Arena* arena, FunctionObject* function) {
+#if KAU_JIT_SUPPORTED
+    const Chunk& chunk = function->chunk;
+    const ThreadedCode& threaded = function->threaded;
+    const u64 word_count = threaded.code.size();
+    assert(word_count > 0);
+
+    const u64 start_mark = arena->get_pos();
+    JitCode* jit = (JitCode*) arena->push_struct<JitCode>();
+    jit->entries = (const void**) arena->push_array<const void*>(word_count);
+
+    const u64 scratch_mark = arena->get_pos();
+    JitCompiler compiler = {};
+    compiler.function = function;
+    compiler.a.init(arena, chunk.code.size() * JIT_BYTES_PER_CODE_BYTE + 256);
+    compiler.word_at = (u64*) arena->push_array_no_zero<u64>(chunk.code.size());
+    compiler.native_at = (u64*) arena->push_array_no_zero<u64>(word_count);
+    compiler.jumps.init(arena);
+    compiler.exits.init(arena);
+    Assembler& a = compiler.a;
+
+    u64 word = 0;
+    for (u64 offset = 0; offset < chunk.code.size(); offset += instruction_size(chunk, offset)) {
+        compiler.word_at[offset] = word;
+        word += instruction_words(chunk, offset);
+    }
+
+    emit_entry(a);
+    const ExitStubs stubs = emit_exit_stubs(a);
+
+    bool* compiled = (bool*) arena->push_array<bool>(word_count);
+    for (u64 offset = 0; offset < chunk.code.size(); offset += instruction_size(chunk, offset)) {
+        const u64 instruction = compiler.word_at[offset];
+        compiler.native_at[instruction] = a.offset();
+        compiled[instruction] = compiler.compile_instruction(offset, instruction);
+    }
+
+    for (u64 i = 0; i < compiler.jumps.size(); ++i) {
+        const Jump& jump = compiler.jumps[i];
+        a.patch(jump.at, compiler.native_at[jump.target_word]);
+    }
+    for (u64 i = 0; i < compiler.exits.size(); ++i) {
+        const Exit& exit_branch = compiler.exits[i];
+        a.bind(exit_branch.at);
+        a.mov_imm(RAX, (u64) (threaded.code.m_head + exit_branch.word));
+        a.patch(a.jmp(), exit_branch.guard ? stubs.guard_exit : stubs.exit);
+    }
+
+    if (!map_code(jit, a)) {
+        arena->pop_to(start_mark);
+        return nullptr;
+    }
+    for (u64 offset = 0; offset < chunk.code.size(); offset += instruction_size(chunk, offset)) {
+        const u64 instruction = compiler.word_at[offset];
+        if (compiled[instruction]) {
+            jit->entries[instruction] = jit->code + compiler.native_at[instruction];
+        }
+    }
+
+    arena->pop_to(scratch_mark);
+    return jit;
+#else
+    (void) arena;
+    (void) function;
+    return nullptr;
+#endif
+}
+
+void jit_release(JitCode* jit) {
+#if KAU_JIT_SUPPORTED
+    munmap(jit->code, jit->size);
+#else
+    (void) jit;
+#endif
+}
+
+JitCode* jit_compile_trace(Arena* arena, Trace* trace) {
+#if KAU_JIT_SUPPORTED
+    const ThreadedCode& threaded = trace->function->threaded;
+
+    const u64 start_mark = arena->get_pos();
+    JitCode* jit = (JitCode*) arena->push_struct<JitCode>();
+    jit->entries = (const void**) arena->push_array<const void*>(1);
+    // NOTE: Every instruction has at most one exit of its own, plus the one for the guards.
+    // Reserving them up front keeps their counts where the code increments them.
+    trace->exits.init(arena, trace->instructions.size() + 1);
+    trace->exits.m_len = 0;
+
+    const u64 scratch_mark = arena->get_pos();
+    TraceCompiler compiler = {};
+    compiler.trace = trace;
+    compiler.a.init(arena, trace->instructions.size() * JIT_BYTES_PER_CODE_BYTE + 256);
+    compiler.branches.init(arena);
+    Assembler& a = compiler.a;
+
+    emit_entry(a);
+    const ExitStubs stubs = emit_exit_stubs(a);
+
+    const u64 guards = a.offset();
+    const u32 guard_exit = compiler.exit_at(trace->anchor, trace->depth);
+    for (u64 i = 0; i < trace->guards.size(); ++i) {
+        const TraceGuard& guard = trace->guards[i];
+        if (guard.global) {
+            a.load(RAX, GLOBALS, (i32) (guard.index * sizeof(GlobalSlot) + offsetof(GlobalSlot, value)));
+        } else {
+            a.load(RAX, SLOTS, (i32) (guard.index * sizeof(Value)));
+        }
+        compiler.guard_type(RAX, guard.type, guard_exit);
+    }
+
+    const u64 loop_start = a.offset();
+    compiler.forget();
+    // NOTE: The last instruction is the jump back to the header.
+    for (u64 i = 0; i + 1 < trace->instructions.size(); ++i) {
+        if (!compiler.compile_instruction(i)) {
+            arena->pop_to(start_mark);
+            return nullptr;
+        }
+    }
+    // NOTE: Traces never allocate, so a collection can't come due while one runs and the
+    // back edge doesn't have to check for it like the interpreter's loops do.
+    a.patch(a.jmp(), trace->type_stable ? loop_start : guards);
+
+    for (u64 i = 0; i < compiler.branches.size(); ++i) {
+        const TraceBranch& branch = compiler.branches[i];
+        TraceExit& exit = trace->exits[branch.exit];
+        a.bind(branch.at);
+        if (exit.materialize) {
+            a.mov_imm(RAX, exit.condition.bits);
+            a.store(SLOTS, (i32) ((exit.depth - 1) * sizeof(Value)), RAX);
+        }
+        a.lea(TOP, SLOTS, (i32) (exit.depth * sizeof(Value)));
+        a.mov_imm(RCX, (u64) &exit.count);
+        a.inc_mem(RCX, 0);
+        a.mov_imm(RAX, (u64) (threaded.code.m_head + exit.word));
+        a.patch(a.jmp(), stubs.guard_exit);
+    }
+
+    if (!map_code(jit, a)) {
+        arena->pop_to(start_mark);
+        return nullptr;
+    }
+    jit->entries[0] = jit->code + guards;
+
+    arena->pop_to(scratch_mark);
+    return jit;
+#else
+    (void) arena;
+    (void) trace;
+    return nullptr;
+#endif
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "defs.h"
+#include "lib/arena.h"
+
+#include "bytecode.h"
+
+// Machine code is only generated for x86-64 Linux, `--jit` is ignored everywhere else.
+#if defined(__x86_64__) && defined(__linux__)
+#define KAU_JIT_SUPPORTED 1
+#else
+#define KAU_JIT_SUPPORTED 0
+#endif
+
+// Calls before a function gets compiled.
+#define JIT_CALL_THRESHOLD 100
+
+struct GlobalSlot;
+struct Trace;
+
+// What compiled code needs from the VM, passed in every time it is entered.
+struct JitContext {
+    // The VM's stack top going in, and where it is once the code exits.
+    Value* stack_top;
+    GlobalSlot* globals;
+    Heap* heap;
+    // Exits taken because an operand wasn't of a type the code was compiled for.
+    u64 guard_exits;
+};
+
+// Runs compiled code from `target` until it exits, and returns the threaded word the
+// interpreter picks up from.
+using JitEntry = ThreadedWord* (*)(JitContext* context, Value* slots, const void* target);
+
+// A function compiled to machine code by `jit_compile`.
+//
+// The code works on the same stack window the interpreter does, one instruction at a time,
+// so the two can hand over between any two instructions. Arithmetic and comparisons are
+// compiled for ints and doubles, behind guards on their operands' types. Whenever a guard
+// fails, or the code gets to an instruction it leaves to the interpreter, like calls and
+// returns, it exits at that instruction. The interpreter runs it and enters the code again
+// after calls, returns and loop jumps.
+struct JitCode {
+    JitEntry enter;
+    // Where the instruction at each threaded word starts in the code. Null for operand words,
+    // and for instructions that would exit right away. Traces only have the one they're entered at.
+    const void** entries;
+    // Executable, and mapped separately from everything else.
+    u8* code;
+    u64 size;
+};
+
+// Compiles `function`, which has to be threaded already. Returns null when machine code
+// isn't supported here or the code couldn't be mapped.
+JitCode* jit_compile(Arena* arena, FunctionObject* function);
+// Compiles a trace `optimize_trace` went over, and fills in its exits. Returns null under the
+// same conditions, or if the trace has an instruction only the recorder knew about.
+JitCode* jit_compile_trace(Arena* arena, Trace* trace);
+void jit_release(JitCode* jit);
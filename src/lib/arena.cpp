@@ -1,6 +1,14 @@
 #include "arena.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 namespace {
     u64 round_up_to_multiple(u64 multiple, u64 size) {
@@ -10,26 +18,89 @@ namespace {
             return multiple;
         } else {
             const u64 remainder = size % multiple;
+            if (remainder == 0) {
+                return size;
+            }
             return size + (multiple - remainder);
         }
     }
+
+#ifdef _WIN32
+    u64 os_page_size() {
+        SYSTEM_INFO sys_info;
+        GetSystemInfo(&sys_info);
+        return sys_info.dwPageSize;
+    }
+
+    void* os_reserve(u64 size) {
+        return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_READWRITE);
+    }
+
+    bool os_commit(void* start, u64 size) {
+        return VirtualAlloc(start, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+    }
+
+    // NOTE: Large pages on Windows need SeLockMemoryPrivilege and can't be committed
+    // incrementally, so huge page requests are ignored there.
+    void os_enable_huge_pages(void* start, u64 size) {
+    }
+
+    void os_release(void* start, u64 size) {
+        VirtualFree(start, 0, MEM_RELEASE);
+    }
+#else
+    u64 os_page_size() {
+        return (u64) sysconf(_SC_PAGESIZE);
+    }
+
+    void* os_reserve(u64 size) {
+        void* mem = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED) {
+            return nullptr;
+        }
+        return mem;
+    }
+
+    bool os_commit(void* start, u64 size) {
+        return mprotect(start, size, PROT_READ | PROT_WRITE) == 0;
+    }
+
+    void os_enable_huge_pages(void* start, u64 size) {
+#ifdef MADV_HUGEPAGE
+        madvise(start, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    void os_release(void* start, u64 size) {
+        munmap(start, size);
+    }
+#endif
 };
 
-Arena* alloc_arena() {
+Arena* alloc_arena(u64 reserve_size, bool huge_pages) {
     Arena* arena = (Arena*) malloc(sizeof(Arena));
     assert(arena);
 
-    SYSTEM_INFO sys_info;
-    GetSystemInfo(&sys_info);
+    arena->page_size = os_page_size();
+    arena->huge_pages = huge_pages;
+    // NOTE: With huge pages we commit in whole huge pages, otherwise the kernel
+    // can't back the committed range with them.
+    const u64 commit_granularity = huge_pages ? ARENA_HUGE_PAGE_SIZE : arena->page_size;
+
+    arena->reserve_size = round_up_to_multiple(commit_granularity, reserve_size);
+    arena->mem = os_reserve(arena->reserve_size);
+    assert(arena->mem != nullptr);
+    if (huge_pages) {
+        os_enable_huge_pages(arena->mem, arena->reserve_size);
+    }
 
-    arena->page_size = sys_info.dwPageSize;
-    arena->mem = VirtualAlloc(nullptr, round_up_to_multiple(arena->page_size, 64 * 1e9), MEM_RESERVE, PAGE_READWRITE);
-    const u64 initial_commit_size = arena->page_size * 5;
-    void* ret = VirtualAlloc(arena->mem, initial_commit_size, MEM_COMMIT, PAGE_READWRITE);
-    assert(ret != nullptr);
-    assert(ret == arena->mem);
+    const u64 initial_commit_size = huge_pages ? ARENA_HUGE_PAGE_SIZE : arena->page_size * 5;
+    const bool commited = os_commit(arena->mem, initial_commit_size);
+    assert(commited);
     arena->commited_size = initial_commit_size;
     arena->offset = 0;
+    arena->peak_offset = 0;
+    arena->child_arena = nullptr;
 
     // NOTE: Having a zero sized node at the start makes things easier
     FreeNode* zero_node = (FreeNode*) malloc(sizeof(FreeNode));
@@ -44,8 +115,10 @@ Arena* alloc_arena() {
 }
 
 void Arena::release() {
+    os_release(mem, reserve_size);
     page_size = 0;
-    VirtualFree(mem, 0, MEM_RELEASE);
+    commited_size = 0;
+    reserve_size = 0;
     offset = 0;
 }
 
@@ -60,20 +133,44 @@ void* Arena::push_no_zero(u64 size) {
     if (from_list != nullptr) {
         return from_list;
     }
-    
+
     if (offset + size > commited_size) {
-        u64 alloc_size = round_up_to_multiple(page_size, size);
-        void* ret = VirtualAlloc((u8*)mem + (offset + size), alloc_size, MEM_COMMIT, PAGE_READWRITE);
-        assert(ret);
-        commited_size += alloc_size;
+        grow_commit(offset + size);
     }
 
     void* start_address = (void*) (((u8*) mem) + offset);
     offset += size;
+    if (offset > peak_offset) {
+        peak_offset = offset;
+    }
 
     return start_address;
 }
 
+// Commits at least up to `required_size`, doubling what is already committed so a
+// long run of small pushes only pays for a logarithmic number of commit calls.
+void Arena::grow_commit(u64 required_size) {
+    if (required_size > reserve_size) {
+        fprintf(stderr, "Arena out of reserved memory: %llu bytes needed, %llu bytes reserved.\n",
+            (unsigned long long) required_size, (unsigned long long) reserve_size);
+        abort();
+    }
+
+    const u64 commit_granularity = huge_pages ? ARENA_HUGE_PAGE_SIZE : page_size;
+    u64 new_commited_size = commited_size * 2;
+    if (new_commited_size < required_size) {
+        new_commited_size = required_size;
+    }
+    new_commited_size = round_up_to_multiple(commit_granularity, new_commited_size);
+    if (new_commited_size > reserve_size) {
+        new_commited_size = reserve_size;
+    }
+
+    const bool commited = os_commit((u8*) mem + commited_size, new_commited_size - commited_size);
+    assert(commited);
+    commited_size = new_commited_size;
+}
+
 void Arena::pop(u64 size) {
     offset -= size;
 }
@@ -101,15 +198,61 @@ void Arena::free_section(void* start, u64 size) {
     *free_node = FreeNode {
         .head = start,
         .size = size,
-        .prev = nullptr,
+        .prev = free_list_tail,
         .next = nullptr,
     };
-    
+
     free_list_tail->next = free_node;
 
     free_list_tail = free_node;
 }
 
+void Arena::coalesce_free_list() {
+    u64 count = 0;
+    for (FreeNode* node = free_list_head->next; node != nullptr; node = node->next) {
+        ++count;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    FreeNode** nodes = (FreeNode**) malloc(count * sizeof(FreeNode*));
+    u64 i = 0;
+    for (FreeNode* node = free_list_head->next; node != nullptr; node = node->next) {
+        nodes[i++] = node;
+    }
+    qsort(nodes, count, sizeof(FreeNode*), [](const void* a, const void* b) {
+        const u8* left = (const u8*) (*(FreeNode* const*) a)->head;
+        const u8* right = (const u8*) (*(FreeNode* const*) b)->head;
+        return left < right ? -1 : (left > right ? 1 : 0);
+    });
+
+    FreeNode* tail = free_list_head;
+    tail->next = nullptr;
+    for (i = 0; i < count; ++i) {
+        FreeNode* node = nodes[i];
+        if (tail != free_list_head && (u8*) tail->head + tail->size == node->head) {
+            tail->size += node->size;
+            free(node);
+            continue;
+        }
+        node->prev = tail;
+        node->next = nullptr;
+        tail->next = node;
+        tail = node;
+    }
+    free(nodes);
+
+    if (tail != free_list_head && (u8*) tail->head + tail->size == (u8*) mem + offset) {
+        offset -= tail->size;
+        FreeNode* prev = tail->prev;
+        prev->next = nullptr;
+        free(tail);
+        tail = prev;
+    }
+    free_list_tail = tail;
+}
+
 void* Arena::get_from_list_with_size(u64 size) {
     if (size == 0) return nullptr;
 
@@ -125,6 +268,11 @@ void* Arena::get_from_list_with_size(u64 size) {
     const u64 remaining_size = test_node->size - size;
     if (remaining_size == 0) {
         test_node->prev->next = test_node->next;
+        if (test_node->next != nullptr) {
+            test_node->next->prev = test_node->prev;
+        } else {
+            free_list_tail = test_node->prev;
+        }
         ret = test_node->head;
 
         free(test_node);
@@ -134,4 +282,4 @@ void* Arena::get_from_list_with_size(u64 size) {
     }
 
     return ret;
-}
\ No newline at end of file
+}
@@ -2,6 +2,10 @@
 
 #include "../defs.h"
 
+// NOTE: Only address space is reserved up front, memory is committed as the arena grows.
+#define ARENA_DEFAULT_RESERVE_SIZE (64ull * 1024 * 1024 * 1024)
+#define ARENA_HUGE_PAGE_SIZE (2ull * 1024 * 1024)
+
 struct FreeNode {
     void* head;
     u64 size;
@@ -43,21 +47,32 @@ struct Arena {
     void clear();
 
     void free_section(void* start, u64 size);
+    // Merges free sections that touch, and gives a section at the top back to the arena,
+    // so memory freed piece by piece can be handed out again in bigger pieces.
+    void coalesce_free_list();
 
     void* get_from_list_with_size(u64 size);
 
+    void grow_commit(u64 required_size);
+
     // TODO: This is pretty sloppy and i need to handle multiple arenas better later,
     // This is here just to make vectors work
     Arena* child_arena;
 
     u64 page_size;
     u64 commited_size;
+    u64 reserve_size;
+    bool huge_pages;
 
     void* mem;
     u64 offset;
+    // Highest `offset` ever reached, `clear` and `pop` don't lower it.
+    u64 peak_offset;
 
     FreeNode* free_list_head = nullptr;
     FreeNode* free_list_tail = nullptr;
 };
 
-Arena* alloc_arena();
\ No newline at end of file
+// `huge_pages` asks the OS to back the arena with transparent huge pages,
+// which is worth it for arenas expected to grow large.
+Arena* alloc_arena(u64 reserve_size = ARENA_DEFAULT_RESERVE_SIZE, bool huge_pages = false);
\ No newline at end of file
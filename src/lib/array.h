@@ -3,20 +3,22 @@
 #include "../defs.h"
 #include "arena.h"
 
+#include <string.h>
+
 template<class T>
 struct Array {
     void init(Arena* arena, u64 len_to_reserve = 0) {
         m_arena = arena;
         m_head = (T*) arena->push_array_no_zero<T>(len_to_reserve);
         m_len = len_to_reserve;
+        m_capacity = len_to_reserve;
     }
 
     void push(T item) {
-        m_arena->push_struct_no_zero<T>();
+        reserve_one();
         m_head[m_len++] = item;
     }
     void pop() {
-        m_arena->pop(sizeof(T));
         --m_len;
     }
 
@@ -45,15 +47,38 @@ struct Array {
         return m_head[m_len - 1];
     }
 
-    T* curr_ptr() {
-        return &m_head[m_len];
-    }
     void advance() {
-        m_arena->push_struct_no_zero<T>();
+        reserve_one();
         m_len++;
     }
 
     Arena* m_arena;
     T* m_head;
     u64 m_len;
-};
\ No newline at end of file
+    u64 m_capacity;
+
+private:
+    // NOTE: Growing in place only works while this array is the last thing pushed
+    // to its arena. Once something else was allocated after it, we move the items
+    // to a bigger block at the top of the arena instead of writing over it.
+    void reserve_one() {
+        if (m_len < m_capacity) {
+            return;
+        }
+
+        const u8* arena_top = (u8*) m_arena->mem + m_arena->get_pos();
+        if ((u8*) (m_head + m_capacity) == arena_top) {
+            m_arena->push_struct_no_zero<T>();
+            m_capacity += 1;
+            return;
+        }
+
+        const u64 new_capacity = m_capacity < 4 ? 8 : m_capacity * 2;
+        T* new_head = (T*) m_arena->push_array_no_zero<T>(new_capacity);
+        if (m_len > 0) {
+            memcpy((void*) new_head, (void*) m_head, m_len * sizeof(T));
+        }
+        m_head = new_head;
+        m_capacity = new_capacity;
+    }
+};
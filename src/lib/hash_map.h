@@ -0,0 +1,217 @@
+#pragma once
+
+#include "../defs.h"
+#include "arena.h"
+
+#include <type_traits>
+
+#define HASH_MAP_DEFAULT_CAPACITY 16
+
+// Lookups are the hottest path in the tree walker, so they're only counted in builds
+// configured with `KAU_MAP_COUNTERS`, see CMakeLists.txt.
+#ifndef KAU_MAP_COUNTERS
+#define KAU_MAP_COUNTERS 0
+#endif
+
+// Counts every lookup and every slot it looked at, across all maps.
+struct HashMapCounters {
+    u64 lookups;
+    u64 probes;
+};
+inline HashMapCounters hash_map_counters = {};
+
+// Open addressing map with Robin Hood probing: on insert, an entry that is further
+// from its home slot takes the place of one that is closer, which keeps probe
+// sequences short and lets lookups stop as soon as they pass where the key would be.
+// Keys and values live inline in the entry array, which grows once it is 3/4 full.
+//
+// NOTE: Growing moves every entry, so pointers returned by `get`/`insert` are only valid
+// until the next insert. Store pointers as values when they need to outlive that.
+template<class K, class V, class Hasher>
+struct HashMap {
+    struct Entry {
+        K key;
+        V value;
+        u64 hash;
+        // Distance from the home slot plus one, zero means the entry is empty.
+        u32 probe;
+    };
+
+    // A capacity of zero defers allocating until the first insert.
+    void init(Arena* arena, u64 capacity = HASH_MAP_DEFAULT_CAPACITY) {
+        m_arena = arena;
+        m_entries = nullptr;
+        m_capacity = 0;
+        m_size = 0;
+        m_shift = 64;
+        if (capacity > 0) {
+            allocate(round_up_to_power_of_two(capacity));
+        }
+    }
+
+    V* get(const K& key) {
+        return (V*) find(key);
+    }
+    const V* get(const K& key) const {
+        return find(key);
+    }
+    bool contains(const K& key) const {
+        return find(key) != nullptr;
+    }
+
+    // Inserts `key`, or overwrites its value if it is already in the map.
+    V* insert(const K& key, const V& value) {
+        static_assert(std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V>,
+            "HashMap entries are moved around with plain copies and never destroyed");
+
+        if ((m_size + 1) * 4 > m_capacity * 3) {
+            grow();
+        }
+
+        const u64 hash = Hasher()(key);
+        Entry* existing = find_entry(key, hash);
+        if (existing != nullptr) {
+            existing->value = value;
+            return &existing->value;
+        }
+
+        ++m_size;
+        return &place(Entry {
+            .key = key,
+            .value = value,
+            .hash = hash,
+            .probe = 1,
+        })->value;
+    }
+
+    u64 size() const {
+        return m_size;
+    }
+    bool empty() const {
+        return m_size == 0;
+    }
+
+    template<class F>
+    void for_each(F fn) {
+        for (u64 i = 0; i < m_capacity; ++i) {
+            Entry& entry = m_entries[i];
+            if (entry.probe != 0) {
+                fn((const K&) entry.key, entry.value);
+            }
+        }
+    }
+    template<class F>
+    void for_each(F fn) const {
+        for (u64 i = 0; i < m_capacity; ++i) {
+            const Entry& entry = m_entries[i];
+            if (entry.probe != 0) {
+                fn(entry.key, entry.value);
+            }
+        }
+    }
+
+    Arena* m_arena = nullptr;
+    Entry* m_entries = nullptr;
+    u64 m_capacity = 0;
+    u64 m_size = 0;
+    u32 m_shift = 64;
+
+private:
+    // NOTE: Starts at 2 so `m_shift` never reaches 64.
+    static u64 round_up_to_power_of_two(u64 n) {
+        u64 power = 2;
+        while (power < n) {
+            power <<= 1;
+        }
+        return power;
+    }
+
+    // NOTE: Fibonacci hashing takes the top bits of the product, so every bit of a
+    // weak hash like DJB2 has a say in the slot, not just the low ones.
+    u64 home_slot(u64 hash) const {
+        return (hash * 11400714819323198485ull) >> m_shift;
+    }
+
+    void allocate(u64 capacity) {
+        m_entries = (Entry*) m_arena->push_array<Entry>(capacity);
+        m_capacity = capacity;
+        m_shift = 64;
+        for (u64 c = capacity; c > 1; c >>= 1) {
+            --m_shift;
+        }
+    }
+
+    const V* find(const K& key) const {
+        if (m_size == 0) {
+            return nullptr;
+        }
+        const Entry* entry = find_entry(key, Hasher()(key));
+        return entry != nullptr ? &entry->value : nullptr;
+    }
+
+    Entry* find_entry(const K& key, u64 hash) const {
+        if (m_capacity == 0) {
+            return nullptr;
+        }
+
+        if constexpr (KAU_MAP_COUNTERS) {
+            hash_map_counters.lookups += 1;
+        }
+
+        const u64 mask = m_capacity - 1;
+        u64 index = home_slot(hash);
+        for (u32 probe = 1; ; ++probe) {
+            if constexpr (KAU_MAP_COUNTERS) {
+                hash_map_counters.probes += 1;
+            }
+            Entry* entry = &m_entries[index];
+            // An entry closer to its home than we are to ours means the key would have taken its place.
+            if (entry->probe < probe) {
+                return nullptr;
+            }
+            if (entry->hash == hash && entry->key == key) {
+                return entry;
+            }
+            index = (index + 1) & mask;
+        }
+    }
+
+    // Places a new entry, returns where it ended up.
+    Entry* place(Entry entry) {
+        const u64 mask = m_capacity - 1;
+        u64 index = home_slot(entry.hash);
+        Entry* placed = nullptr;
+        while (true) {
+            Entry* slot = &m_entries[index];
+            if (slot->probe == 0) {
+                *slot = entry;
+                return placed != nullptr ? placed : slot;
+            }
+            if (slot->probe < entry.probe) {
+                const Entry displaced = *slot;
+                *slot = entry;
+                if (placed == nullptr) {
+                    placed = slot;
+                }
+                entry = displaced;
+            }
+            entry.probe += 1;
+            index = (index + 1) & mask;
+        }
+    }
+
+    // NOTE: The old entries are left in the arena, they go away with it.
+    void grow() {
+        Entry* old_entries = m_entries;
+        const u64 old_capacity = m_capacity;
+
+        allocate(old_capacity == 0 ? HASH_MAP_DEFAULT_CAPACITY : old_capacity * 2);
+        for (u64 i = 0; i < old_capacity; ++i) {
+            Entry entry = old_entries[i];
+            if (entry.probe != 0) {
+                entry.probe = 1;
+                place(entry);
+            }
+        }
+    }
+};
@@ -0,0 +1,32 @@
+#include "interner.h"
+
+#include <string.h>
+
+void StringInterner::init(Arena* arena) {
+    m_arena = arena;
+    m_strings.init(arena, 1024);
+    m_next_id = 1;
+}
+
+String StringInterner::intern(String str) {
+    if (str.id != 0) {
+        return str;
+    }
+
+    const String* existing = m_strings.get(str);
+    if (existing != nullptr) {
+        return *existing;
+    }
+
+    // NOTE: The characters are copied since sources, like REPL lines, don't outlive the strings.
+    assert(m_next_id != 0);
+    str.id = m_next_id++;
+    str.hash = hash_chars(str.chars, str.len);
+    const String interned = boxed_string(m_arena, str)->string();
+    m_strings.insert(interned, interned);
+    return interned;
+}
+
+u64 StringInterner::count() const {
+    return m_strings.size();
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "../defs.h"
+#include "arena.h"
+#include "hash_map.h"
+#include "string.h"
+
+// Keeps one canonical copy of every string it sees. Interned strings carry an ID that is
+// unique to their contents and their hash, so maps keyed on them never rehash the
+// characters and equality is a single compare. They're stored boxed, so values can
+// point to them directly, see `box_of`.
+struct StringInterner {
+    void init(Arena* arena);
+
+    // Returns the canonical copy of `str`. Strings built at runtime only need to go through
+    // here when they are about to be used as a key.
+    String intern(String str);
+
+    u64 count() const;
+
+private:
+    Arena* m_arena;
+    HashMap<String, String, StringHasher> m_strings;
+    u32 m_next_id = 1;
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "../defs.h"
+#include "arena.h"
+#include "hash_map.h"
+
+// Map for the handful of entries most scopes ever hold. The first `N` sit inline and are
+// searched linearly, which for a few interned keys beats hashing them. Past that everything
+// moves into a `HashMap` allocated from the arena, so nothing is allocated before then.
+//
+// NOTE: Like with `HashMap`, pointers returned by `get`/`insert` are only valid until the next insert.
+template<class K, class V, class Hasher, u32 N>
+struct SmallMap {
+    void init(Arena* arena) {
+        m_arena = arena;
+        m_count = 0;
+        m_spilled = false;
+        m_map = {};
+    }
+
+    V* get(const K& key) {
+        if (m_spilled) {
+            return m_map.get(key);
+        }
+        for (u32 i = 0; i < m_count; ++i) {
+            if (m_keys[i] == key) {
+                return &m_values[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // Inserts `key`, or overwrites its value if it is already in the map.
+    V* insert(const K& key, const V& value) {
+        if (m_spilled) {
+            return m_map.insert(key, value);
+        }
+
+        V* existing = get(key);
+        if (existing != nullptr) {
+            *existing = value;
+            return existing;
+        }
+        if (m_count < N) {
+            m_keys[m_count] = key;
+            m_values[m_count] = value;
+            return &m_values[m_count++];
+        }
+
+        m_map.init(m_arena, N * 2);
+        for (u32 i = 0; i < m_count; ++i) {
+            m_map.insert(m_keys[i], m_values[i]);
+        }
+        m_spilled = true;
+        return m_map.insert(key, value);
+    }
+
+    u64 size() const {
+        return m_spilled ? m_map.size() : m_count;
+    }
+
+    template<class F>
+    void for_each(F fn) {
+        if (m_spilled) {
+            m_map.for_each(fn);
+            return;
+        }
+        for (u32 i = 0; i < m_count; ++i) {
+            fn((const K&) m_keys[i], m_values[i]);
+        }
+    }
+
+private:
+    Arena* m_arena = nullptr;
+    K m_keys[N];
+    V m_values[N];
+    u32 m_count = 0;
+    bool m_spilled = false;
+    HashMap<K, V, Hasher> m_map;
+};
@@ -35,13 +35,14 @@ String concatenated_string(Arena* arena, String left, String right) {
 String concatenated_strings(Arena* arena, Span<const String*> strings) {
     size_t total_len = 0;
     for (u64 i = 0; i < strings.len; ++i) {
-        total_len += strings.len;
+        total_len += strings.items[i]->len;
     }
 
     char* string_chars = (char*) arena->push_array_no_zero<char>(total_len);
     u64 offset = 0;
     for (u64 i = 0; i < strings.len; ++i) {
         memcpy(string_chars + offset, strings.items[i]->chars, strings.items[i]->len * sizeof(char));
+        offset += strings.items[i]->len;
     }
 
     String ret;
@@ -52,4 +53,24 @@ String concatenated_strings(Arena* arena, Span<const String*> strings) {
         .chars = string_chars,
         .len = total_len
     };
+}
+
+BoxedString* boxed_string(Arena* arena, String str) {
+    BoxedString* box = (BoxedString*) arena->push_no_zero(sizeof(BoxedString) + str.len * sizeof(char));
+    box->len = str.len;
+    box->id = str.id;
+    box->hash = str.hash;
+    // NOTE: Can overlap when moving a string down an arena.
+    memmove((char*) box->chars(), str.chars, str.len * sizeof(char));
+    return box;
+}
+
+BoxedString* boxed_concatenated_string(Arena* arena, String left, String right) {
+    BoxedString* box = (BoxedString*) arena->push_no_zero(sizeof(BoxedString) + (left.len + right.len) * sizeof(char));
+    box->len = left.len + right.len;
+    box->id = 0;
+    box->hash = 0;
+    memcpy((char*) box->chars(), left.chars, left.len * sizeof(char));
+    memcpy((char*) box->chars() + left.len, right.chars, right.len * sizeof(char));
+    return box;
 }
\ No newline at end of file
@@ -8,12 +8,29 @@
 
 int str_cmp(const char* s1, size_t s1_len, const char* s2, size_t s2_len);
 
+// DJB2, truncated so it fits the cached hash in `String`.
+inline u32 hash_chars(const char* chars, size_t len) {
+    size_t hash = 5381;
+
+    for (size_t i = 0; i < len; ++i) {
+        char c = chars[i];
+        hash = ((hash << 5) + hash) + c;
+    }
+
+    return (u32) hash;
+}
+
 struct String {
     const char* chars = nullptr;
     size_t len = 0;
+    // Only set on strings that went through a `StringInterner`, zero otherwise.
+    u32 id = 0;
+    u32 hash = 0;
 
     bool operator==(const String& other) const
     {
+        // NOTE: Interned strings are unique per content, so comparing IDs is enough.
+        if (id != 0 && other.id != 0) return id == other.id;
         if (len != other.len) return false;
         return str_cmp(chars, len, other.chars, other.len) == 0;
     }
@@ -42,16 +59,40 @@ struct String {
 String concatenated_string(Arena* arena, String left, String right);
 String concatenated_strings(Arena* arena, Span<const String*> strings);
 
+// A string with its length, ID and hash stored right before the characters, so a single
+// pointer is enough to hold on to it. This is how values refer to strings.
+struct BoxedString {
+    u64 len;
+    u32 id;
+    u32 hash;
+
+    const char* chars() const {
+        return (const char*) (this + 1);
+    }
+    String string() const {
+        return String {
+            .chars = chars(),
+            .len = len,
+            .id = id,
+            .hash = hash
+        };
+    }
+};
+
+BoxedString* boxed_string(Arena* arena, String str);
+BoxedString* boxed_concatenated_string(Arena* arena, String left, String right);
+// Interned strings are always boxed, see `StringInterner`.
+inline BoxedString* box_of(String interned) {
+    assert(interned.id != 0);
+    return (BoxedString*) (interned.chars - sizeof(BoxedString));
+}
+
 struct StringHasher {
     size_t operator()(const String& p) const
     {
-        size_t hash = 5381;
-
-        for (size_t i = 0; i < p.len; ++i) {
-            char c = p.chars[i];
-            hash = ((hash << 5) + hash) + c;
+        if (p.id != 0) {
+            return p.hash;
         }
-
-        return hash;
+        return hash_chars(p.chars, p.len);
     }
 };
\ No newline at end of file
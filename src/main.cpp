@@ -1,25 +1,121 @@
 #include "defs.h"
 
 #include "compiler.h"
+#include "jit.h"
 #include "scanner.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_PROFILE_PATH "kau.folded"
+
+namespace {
+    int usage() {
+        fprintf(stderr, "Usage: kau [--vm | --vm-registers | --closures] [--jit] [--trace-jit] [--stats] [--profile[=<output-path>]] [--gc-threshold=<bytes>] [--gc-nursery=<bytes>] [--gc-growth=<factor>] [--gc-pause-budget=<microseconds>] <path-to-script>\n");
+        return -1;
+    }
+
+    void write_profile(KauCompiler& kau, const char* profile_path) {
+        kau.profiler.stop();
+
+        FILE* profile_file = fopen(profile_path, "w");
+        if (profile_file == NULL) {
+            fprintf(stderr, "Failed to open profile output at: %s\n", profile_path);
+        } else {
+            kau.profiler.write_collapsed(profile_file);
+            fclose(profile_file);
+            fprintf(stderr, "Wrote collapsed stacks to %s\n", profile_path);
+        }
+
+        kau.profiler.print_table(stderr);
+    }
+};
+
 int main(int argc, char **argv) {
     KauCompiler kau;
     init_keywords_map(kau.global_arena);
     //kau.run_file("../test.kau");
-    switch (argc) {
-        case 1: {
-            kau.run_prompt();
-            break;
-        }
-        case 2: {
-            kau.run_file(argv[1]);
-            break;
+
+    const char* script_path = nullptr;
+    const char* profile_path = nullptr;
+    bool print_stats = false;
+    bool jit = false;
+    bool trace_jit = false;
+    GcConfig gc_config = kau.heap.config;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--vm") == 0) {
+            kau.backend = Backend::BYTECODE_VM;
+        } else if (strcmp(argv[i], "--vm-registers") == 0) {
+            kau.backend = Backend::REGISTER_VM;
+        } else if (strcmp(argv[i], "--closures") == 0) {
+            kau.backend = Backend::CLOSURES;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            jit = true;
+        } else if (strcmp(argv[i], "--trace-jit") == 0) {
+            trace_jit = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            print_stats = true;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile_path = DEFAULT_PROFILE_PATH;
+        } else if (strncmp(argv[i], "--profile=", 10) == 0 && argv[i][10] != '\0') {
+            profile_path = argv[i] + 10;
+        } else if (strncmp(argv[i], "--gc-threshold=", 15) == 0 && argv[i][15] != '\0') {
+            gc_config.initial_threshold = strtoull(argv[i] + 15, nullptr, 10);
+        } else if (strncmp(argv[i], "--gc-nursery=", 13) == 0 && argv[i][13] != '\0') {
+            gc_config.nursery_size = strtoull(argv[i] + 13, nullptr, 10);
+        } else if (strncmp(argv[i], "--gc-pause-budget=", 18) == 0 && argv[i][18] != '\0') {
+            gc_config.pause_budget_ns = strtoull(argv[i] + 18, nullptr, 10) * 1000;
+        } else if (strncmp(argv[i], "--gc-growth=", 12) == 0 && argv[i][12] != '\0') {
+            gc_config.growth_factor = atof(argv[i] + 12);
+            if (gc_config.growth_factor < 1.0) {
+                return usage();
+            }
+        } else if (argv[i][0] == '-' || script_path != nullptr) {
+            return usage();
+        } else {
+            script_path = argv[i];
         }
-        default: {
-            fprintf(stderr, "Usage: kau <path-to-script>\n");
-            return -1;
+    }
+
+    // NOTE: Only the VM has anything to compile.
+    if ((jit || trace_jit) && (kau.backend == Backend::TREE_WALKER || kau.backend == Backend::CLOSURES)) {
+        return usage();
+    }
+    if (jit && !KAU_JIT_SUPPORTED) {
+        fprintf(stderr, "--jit is only supported on x86-64 Linux, ignoring it.\n");
+        jit = false;
+    }
+    if (trace_jit && !KAU_JIT_SUPPORTED) {
+        fprintf(stderr, "--trace-jit is only supported on x86-64 Linux, ignoring it.\n");
+        trace_jit = false;
+    }
+    kau.vm.jit_enabled = jit;
+    kau.vm.trace_enabled = trace_jit;
+
+    kau.heap.configure(gc_config);
+    kau.collect_stats = print_stats;
+
+    if (profile_path != nullptr) {
+        const char* root_name = script_path != nullptr ? script_path : "<prompt>";
+        if (!kau.profiler.start(String{root_name, strlen(root_name)})) {
+            profile_path = nullptr;
         }
     }
+
+    if (script_path == nullptr) {
+        kau.run_prompt();
+    } else {
+        kau.run_file(script_path);
+    }
+
+    if (profile_path != nullptr) {
+        write_profile(kau, profile_path);
+    }
+    if (trace_jit) {
+        kau.vm.print_traces(stderr);
+    }
+    if (print_stats) {
+        kau.stats.print(stderr);
+    }
     return 0;
-}
\ No newline at end of file
+}
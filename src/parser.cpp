@@ -2,6 +2,10 @@
 
 #include "defs.h"
 
+// NOTE: The parser opens an arena per block, class and argument list, they only
+// ever hold a handful of nodes, so there is no need to reserve the default size.
+#define PARSER_ARENA_RESERVE_SIZE (64ull * 1024 * 1024)
+
 const Token true_token = Token {
     TokenType::TRUE,
     String{},
@@ -22,6 +26,7 @@ namespace {
         binary->left = left;
         binary->op = op;
         binary->right = right;
+        binary->generic = false;
 
         Expr* expr = new_expr(
             Expr::Type::BINARY,
@@ -47,6 +52,7 @@ namespace {
     Expr* new_literal(const Token* val) {
         LiteralExpr* literal = (LiteralExpr*) malloc(sizeof(LiteralExpr));
         literal->val = val;
+        literal->location = VariableLocation{};
 
         Expr* expr = new_expr(
             Expr::Type::LITERAL,
@@ -59,6 +65,7 @@ namespace {
     Expr* new_this(const Token* val) {
         ThisExpr* this_expr = (ThisExpr*) malloc(sizeof(ThisExpr));
         this_expr->val = val;
+        this_expr->location = VariableLocation{};
         Expr* expr = new_expr(
             Expr::Type::THIS,
             ExprPayload{.this_expr = this_expr}
@@ -101,6 +108,7 @@ namespace {
         AssignmentExpr* assignment = (AssignmentExpr*) malloc(sizeof(AssignmentExpr));
         assignment->id = id;
         assignment->right = right;
+        assignment->location = VariableLocation{};
 
         Expr* expr = new_expr(
             Expr::Type::ASSIGNMENT,
@@ -146,6 +154,7 @@ namespace {
         fn_call->callee = callee;
         fn_call->paren = paren;
         fn_call->arguments = arguments;
+        fn_call->cache = {};
 
         Expr* expr = new_expr(
             Expr::Type::FN_CALL,
@@ -160,6 +169,7 @@ namespace {
         assert(get_expr != nullptr);
         get_expr->class_expr = class_expr;
         get_expr->member = member;
+        get_expr->cache = {};
 
         Expr* expr = new_expr(
             Expr::Type::GET,
@@ -174,6 +184,7 @@ namespace {
         set->equals = equals;
         set->get = get;
         set->right = right;
+        set->cache = {};
 
         Expr* expr = new_expr(
             Expr::Type::SET,
@@ -188,6 +199,7 @@ namespace {
         static_fn_call->class_expr = class_expr;
         static_fn_call->colons = colons;
         static_fn_call->fn_name = fn_name;
+        static_fn_call->callable_name = {};
 
         Expr* expr = new_expr(
             Expr::Type::STATIC_FN_CALL,
@@ -201,6 +213,7 @@ namespace {
         SuperExpr* super_expr = (SuperExpr*) malloc(sizeof(SuperExpr));
         super_expr->keyword = keyword;
         super_expr->method = method;
+        super_expr->location = VariableLocation{};
 
         Expr* expr = new_expr(
             Expr::Type::SUPER,
@@ -331,7 +344,7 @@ Array<Stmt> Parser::parse(Arena* arena) {
 }
 
 Array<Stmt> Parser::program(Arena* arena) {
-    arena->child_arena = alloc_arena();
+    arena->child_arena = alloc_arena(PARSER_ARENA_RESERVE_SIZE);
 
     Array<Stmt> statements;
     statements.init(arena);
@@ -380,7 +393,7 @@ Stmt Parser::fn_declaration(Arena* arena, bool is_static) {
 }
 
 Stmt Parser::class_declaration(Arena* arena) {
-    arena->child_arena = alloc_arena();
+    arena->child_arena = alloc_arena(PARSER_ARENA_RESERVE_SIZE);
 
     Token* name = consume(TokenType::IDENTIFIER, CREATE_STRING("Expected class name"));
 
@@ -466,7 +479,7 @@ Stmt Parser::expr_statement(Arena* arena) {
 Stmt Parser::block_statement(Arena* arena, Token* start) {
     int stmt_count = 0;
 
-    arena->child_arena = alloc_arena();
+    arena->child_arena = alloc_arena(PARSER_ARENA_RESERVE_SIZE);
 
     Array<Stmt> stmts;
     stmts.init(arena);
@@ -784,7 +797,7 @@ Expr* Parser::fn_call(Arena* arena) {
 }
 
 Expr* Parser::finish_call(Arena* arena, Expr* callee) {
-    arena->child_arena = alloc_arena();
+    arena->child_arena = alloc_arena(PARSER_ARENA_RESERVE_SIZE);
 
     Array<Expr*> arguments;
     arguments.init(arena);
@@ -0,0 +1,222 @@
+#include "profiler.h"
+
+#include "lib/array.h"
+#include "lib/hash_map.h"
+
+#include <algorithm>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+namespace {
+    Profiler* active_profiler = nullptr;
+
+#ifndef _WIN32
+    void on_sample_signal(int) {
+        if (active_profiler != nullptr) {
+            active_profiler->take_sample();
+        }
+    }
+#endif
+
+    ProfileNode* new_node(Arena* arena, String name, int line, ProfileNode* parent) {
+        ProfileNode* node = (ProfileNode*) arena->push_struct<ProfileNode>();
+        node->name = name;
+        node->line = line;
+        node->samples = 0;
+        node->parent = parent;
+        node->first_child = nullptr;
+        node->next_sibling = nullptr;
+        return node;
+    }
+
+    u64 subtree_samples(const ProfileNode* node) {
+        u64 samples = node->samples;
+        for (const ProfileNode* child = node->first_child; child != nullptr; child = child->next_sibling) {
+            samples += subtree_samples(child);
+        }
+        return samples;
+    }
+
+    void print_frame(FILE* file, const ProfileNode* node) {
+        if (node->parent == nullptr) {
+            fprintf(file, "%.*s", (u32) node->name.len, node->name.chars);
+        } else {
+            fprintf(file, "%.*s:%d", (u32) node->name.len, node->name.chars, node->line);
+        }
+    }
+
+    void write_path(FILE* file, const ProfileNode* node) {
+        if (node->parent != nullptr) {
+            write_path(file, node->parent);
+            fprintf(file, ";");
+        }
+        print_frame(file, node);
+    }
+
+    void write_collapsed_node(FILE* file, const ProfileNode* node) {
+        if (node->samples > 0) {
+            write_path(file, node);
+            fprintf(file, " %llu\n", (unsigned long long) node->samples);
+        }
+        for (const ProfileNode* child = node->first_child; child != nullptr; child = child->next_sibling) {
+            write_collapsed_node(file, child);
+        }
+    }
+
+    struct FunctionTime {
+        String name;
+        u64 self;
+        u64 total;
+    };
+
+    bool has_ancestor_named(const ProfileNode* node, String name) {
+        for (const ProfileNode* ancestor = node->parent; ancestor != nullptr; ancestor = ancestor->parent) {
+            if (ancestor->name == name) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // NOTE: A recursive function only adds its outermost subtree to its total,
+    // otherwise every recursive call would count the same samples again.
+    void accumulate_times(const ProfileNode* node, HashMap<String, FunctionTime, StringHasher>& functions) {
+        FunctionTime* time = functions.get(node->name);
+        if (time == nullptr) {
+            time = functions.insert(node->name, FunctionTime{ .name = node->name, .self = 0, .total = 0 });
+        }
+        time->self += node->samples;
+        if (!has_ancestor_named(node, node->name)) {
+            time->total += subtree_samples(node);
+        }
+
+        for (const ProfileNode* child = node->first_child; child != nullptr; child = child->next_sibling) {
+            accumulate_times(child, functions);
+        }
+    }
+
+    double samples_to_ms(u64 samples) {
+        return (double) samples * PROFILER_SAMPLE_INTERVAL_US / 1000.0;
+    }
+};
+
+bool Profiler::start(String root_name) {
+#ifdef _WIN32
+    fprintf(stderr, "Profiling is not supported on this platform.\n");
+    return false;
+#else
+    if (m_arena == nullptr) {
+        m_arena = alloc_arena(PROFILER_ARENA_RESERVE_SIZE);
+        m_root = new_node(m_arena, root_name, 0, nullptr);
+    }
+    m_current = m_root;
+    active_profiler = this;
+
+    struct sigaction action = {};
+    action.sa_handler = on_sample_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, nullptr) != 0) {
+        fprintf(stderr, "Could not install the profiler signal handler.\n");
+        active_profiler = nullptr;
+        return false;
+    }
+
+    struct itimerval timer = {};
+    timer.it_interval.tv_usec = PROFILER_SAMPLE_INTERVAL_US;
+    timer.it_value.tv_usec = PROFILER_SAMPLE_INTERVAL_US;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+        fprintf(stderr, "Could not start the profiler timer.\n");
+        active_profiler = nullptr;
+        return false;
+    }
+
+    m_running = true;
+    return true;
+#endif
+}
+
+void Profiler::stop() {
+    if (!m_running) {
+        return;
+    }
+#ifndef _WIN32
+    struct itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    signal(SIGPROF, SIG_DFL);
+#endif
+    active_profiler = nullptr;
+    m_running = false;
+}
+
+void Profiler::enter(String name, int line) {
+    ProfileNode* current = m_current;
+    ProfileNode* child = current->first_child;
+    while (child != nullptr && !(child->line == line && child->name == name)) {
+        child = child->next_sibling;
+    }
+
+    if (child == nullptr) {
+        child = new_node(m_arena, name, line, current);
+        child->next_sibling = current->first_child;
+        current->first_child = child;
+    }
+    m_current = child;
+}
+
+void Profiler::exit() {
+    if (m_current->parent != nullptr) {
+        m_current = m_current->parent;
+    }
+}
+
+void Profiler::unwind() {
+    m_current = m_root;
+}
+
+void Profiler::write_collapsed(FILE* file) const {
+    if (m_root != nullptr) {
+        write_collapsed_node(file, m_root);
+    }
+}
+
+void Profiler::print_table(FILE* file) const {
+    if (m_root == nullptr) {
+        return;
+    }
+
+    Arena* scratch = alloc_arena(PROFILER_ARENA_RESERVE_SIZE);
+
+    HashMap<String, FunctionTime, StringHasher> functions;
+    functions.init(scratch);
+    accumulate_times(m_root, functions);
+
+    Array<FunctionTime> rows;
+    rows.init(scratch);
+    functions.for_each([&rows](const String&, const FunctionTime& time) {
+        rows.push(time);
+    });
+    std::sort(rows.m_head, rows.m_head + rows.size(), [](const FunctionTime& a, const FunctionTime& b) {
+        return a.self > b.self;
+    });
+
+    const u64 total_samples = subtree_samples(m_root);
+    fprintf(file, "Profile: %llu samples every %d us\n", (unsigned long long) total_samples, PROFILER_SAMPLE_INTERVAL_US);
+    fprintf(file, "%12s %8s %12s %8s  %s\n", "self ms", "self %", "total ms", "total %", "function");
+    for (u64 i = 0; i < rows.size(); ++i) {
+        const FunctionTime& row = rows[i];
+        const double self_percent = total_samples > 0 ? 100.0 * row.self / total_samples : 0.0;
+        const double total_percent = total_samples > 0 ? 100.0 * row.total / total_samples : 0.0;
+        fprintf(file, "%12.1f %7.1f%% %12.1f %7.1f%%  %.*s\n",
+            samples_to_ms(row.self), self_percent,
+            samples_to_ms(row.total), total_percent,
+            (u32) row.name.len, row.name.chars
+        );
+    }
+
+    scratch->release();
+    free(scratch);
+}
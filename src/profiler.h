@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "lib/arena.h"
+#include "lib/string.h"
+
+#define PROFILER_SAMPLE_INTERVAL_US 1000
+#define PROFILER_ARENA_RESERVE_SIZE (256ull * 1024 * 1024)
+
+// One node per distinct call path. Kau frames are tagged with the callee name and the
+// line it was called from, so `fib:3` is `fib` called from line 3.
+struct ProfileNode {
+    String name;
+    int line;
+
+    // Bumped from the signal handler, for samples taken while this node was on top.
+    volatile u64 samples;
+
+    ProfileNode* parent;
+    ProfileNode* first_child;
+    ProfileNode* next_sibling;
+};
+
+// Sampling profiler for Kau code. The shadow stack is a path in a call tree, so taking
+// a sample from the timer signal is a single increment on the node currently on top,
+// with no allocation or locking.
+struct Profiler {
+    // `root_name` labels samples taken outside of any Kau function, usually the script name.
+    bool start(String root_name);
+    void stop();
+
+    bool is_running() const {
+        return m_running;
+    }
+
+    void enter(String name, int line);
+    void exit();
+    // Drops back to top-level code, for when a runtime error unwinds every frame at once.
+    void unwind();
+
+    // Called from the timer signal handler, so it must stay async-signal-safe.
+    void take_sample() {
+        ProfileNode* current = m_current;
+        current->samples = current->samples + 1;
+    }
+
+    // Writes one `frame;frame;frame count` line per sampled call path, the collapsed
+    // format flame graph tools like `flamegraph.pl` and speedscope read.
+    void write_collapsed(FILE* file) const;
+    // Prints sampled self and total time per function, hottest self time first.
+    void print_table(FILE* file) const;
+
+private:
+    Arena* m_arena = nullptr;
+    ProfileNode* m_root = nullptr;
+    ProfileNode* volatile m_current = nullptr;
+
+    bool m_running = false;
+};
@@ -3,6 +3,7 @@
 #include "compiler.h"
 
 void Resolver::init(Arena* arena) {
+    m_arena = arena;
     scopes.init(arena);
 }
 
@@ -71,7 +72,10 @@ void Resolver::resolve_expr(KauCompiler* compiler, Expr* expr) {
             visit_unary_expr(compiler, expr);
             break;
         }
-        case Expr::Type::BINARY: {
+        // NOTE: Quickened binary nodes keep their `BinaryExpr`.
+        case Expr::Type::BINARY:
+        case Expr::Type::INT_BINARY:
+        case Expr::Type::DOUBLE_BINARY: {
             visit_binary_expr(compiler, expr);
             break;
         }
@@ -133,11 +137,16 @@ void Resolver::visit_expr_stmt(KauCompiler* compiler, Stmt* stmt) {
 void Resolver::visit_block_stmt(KauCompiler* compiler, Stmt* stmt) {
     begin_scope(compiler);
     resolve(compiler, stmt->s_block.stmts);
+    stmt->s_block.slot_count = scopes.back().slot_count;
     end_scope();
 }
 
 void Resolver::visit_var_stmt(KauCompiler* compiler, Stmt* stmt) {
-    declare(compiler, stmt->s_var_decl.name);
+    VariableStatus* status = declare(compiler, stmt->s_var_decl.name);
+    if (status != nullptr) {
+        stmt->s_var_decl.is_local = true;
+        stmt->s_var_decl.slot = status->slot;
+    }
     if (stmt->s_var_decl.initializer != nullptr) {
         resolve_expr(compiler, stmt->s_var_decl.initializer);
     }
@@ -170,20 +179,10 @@ void Resolver::visit_class_stmt(KauCompiler* compiler, Stmt* stmt) {
 
         resolve_expr(compiler, stmt->s_class.superclass);
 
-        String super_str = CREATE_STRING("super");
-        const VariableStatus status = VariableStatus {
-            .defined = true,
-            .uses = 1
-        };
-        scopes.back().insert(compiler->global_arena, super_str, HASH_STR(super_str), status);
+        // NOTE: Methods build their class environment in this same order, `super` then `this`.
+        add_implicit(CREATE_STRING("super"));
     }
-    
-    String this_str = CREATE_STRING("this");
-    const VariableStatus status = VariableStatus {
-        .defined = true,
-        .uses = 1
-    };
-    scopes.back().insert(compiler->global_arena, this_str, HASH_STR(this_str), status); 
+    add_implicit(CREATE_STRING("this"));
 
     for (u64 i = 0; i < stmt->s_class.members.size(); ++i) {
         Stmt* class_stmt = &stmt->s_class.members[i];
@@ -238,10 +237,7 @@ void Resolver::visit_while_stmt(KauCompiler* compiler, Stmt* stmt) {
 void Resolver::visit_variable_expr(KauCompiler* compiler, Expr* expr) {
     const Token* token = expr->expr.literal->val;
     if (!scopes.empty()) {
-        u64 hashed_str = HASH_STR(token->m_lexeme);
-
-        Map& scope = scopes.back();
-        VariableStatus* get = (VariableStatus*) scope.get(hashed_str);
+        VariableStatus* get = scopes.back().variables.get(token->m_lexeme);
 
         if (get != nullptr && get->defined == false) {
             compiler->error(token->m_line, CREATE_STRING("Can't read local varaible in its own initializer"));
@@ -253,7 +249,7 @@ void Resolver::visit_variable_expr(KauCompiler* compiler, Expr* expr) {
 
 void Resolver::visit_assign_expr(KauCompiler* compiler, Expr* expr) {
     resolve_expr(compiler, expr->expr.assignment->right);
-    resolve_local(compiler, expr, expr->expr.literal->val);
+    resolve_local(compiler, expr, expr->expr.assignment->id);
 }
 
 void Resolver::visit_binary_expr(KauCompiler* compiler, Expr* expr) {
@@ -270,7 +266,15 @@ void Resolver::visit_fn_call_expr(KauCompiler* compiler, Expr* expr) {
 }
 
 void Resolver::visit_static_fn_call_expr(KauCompiler* compiler, Expr* expr) {
-    resolve_expr(compiler, expr->expr.static_fn_call->class_expr);
+    StaticFnCallExpr* static_fn = expr->expr.static_fn_call;
+    resolve_expr(compiler, static_fn->class_expr);
+
+    // NOTE: Mangled once here instead of on every call. The interner keeps its own copy.
+    if (static_fn->class_expr->ty != Expr::Type::LITERAL) {
+        return;
+    }
+    const String class_name = static_fn->class_expr->expr.literal->val->m_lexeme;
+    static_fn->callable_name = compiler->interner.intern(mangled_name(m_arena, class_name, static_fn->fn_name->m_lexeme));
 }
 
 void Resolver::visit_grouping_expr(KauCompiler* compiler, Expr* expr) {
@@ -325,10 +329,9 @@ void Resolver::visit_super_expr(KauCompiler* compiler, Expr* expr) {
 
 void Resolver::resolve_local(KauCompiler* compiler, Expr* expr, const Token* token) {
     for (i64 i = scopes.size() - 1; i >= 0; --i) {
-        u64 hashed_lexeme = HASH_STR(token->m_lexeme);
-        VariableStatus* get = (VariableStatus*) scopes[i].get(hashed_lexeme);
+        VariableStatus* get = scopes[i].variables.get(token->m_lexeme);
         if (get != nullptr) {
-            mark_resolved(compiler, expr, scopes.size() - 1 - i);
+            mark_resolved(expr, scopes.size() - 1 - i, get->slot);
             get->uses += 1;
             return;
         }
@@ -351,24 +354,24 @@ void Resolver::resolve_fn(KauCompiler* compiler, Stmt* stmt, FunctionType ty) {
     current_function = enclosing_function;
 }
 
-void Resolver::declare(KauCompiler* compiler, Token* name) {
+VariableStatus* Resolver::declare(KauCompiler* compiler, Token* name) {
     if (scopes.empty()) {
-        return;
+        return nullptr;
     }
 
-    Map& scope = scopes.back();
+    Scope& scope = scopes.back();
     String str = name->m_lexeme;
-    u64 hashed_lexeme = HASH_STR(str);
-    VariableStatus* get = (VariableStatus*) scope.get(hashed_lexeme);
+    VariableStatus* get = scope.variables.get(str);
     if (get != nullptr) {
         compiler->error(name->m_line, CREATE_STRING("Already a variable with this name in this scope"));
-        return;
+        return get;
     }
     const VariableStatus status = VariableStatus{
         .defined = false,
         .uses = 0,
+        .slot = scope.slot_count++,
     };
-    scope.insert(compiler->global_arena, str,hashed_lexeme, status);
+    return scope.variables.insert(str, status);
 }
 
 void Resolver::define(Token* name) {
@@ -376,36 +379,67 @@ void Resolver::define(Token* name) {
         return;
     }
 
-    Map& scope = scopes.back();
-    VariableStatus* status = (VariableStatus*) scope.get(HASH_STR(name->m_lexeme));
+    VariableStatus* status = scopes.back().variables.get(name->m_lexeme);
     status->defined = true;
 }
 
+// Declares a variable the user never writes a declaration for, like `this` and `super`.
+void Resolver::add_implicit(String name) {
+    Scope& scope = scopes.back();
+    const VariableStatus status = VariableStatus {
+        .defined = true,
+        .uses = 1,
+        .slot = scope.slot_count++,
+    };
+    scope.variables.insert(name, status);
+}
+
 void Resolver::begin_scope(KauCompiler* compiler) {
-    Map* curr = scopes.curr_ptr();
     scopes.advance();
 
-    *curr = Map();
-    curr->allocate(compiler->global_arena);
+    Scope& curr = scopes.back();
+    curr = Scope();
+    curr.variables.init(m_arena);
 }
 
 void Resolver::end_scope() {
-    Map& scope = scopes.back();
-    for (u64 i = 0; i < scope.num_buckets; ++i) {
-        MapNode* node = scope.buckets[i];
-        while (node != nullptr) {
-            VariableStatus* status = (VariableStatus*) node->value;
-            if (status->uses == 0) { 
-                String* fn_name = (String*) node->key;
-                fprintf(stdout, "Warn: unused variable %.*s\n", (u32) fn_name->len, fn_name->chars);
-            }
-            node = node->next;
+    scopes.back().variables.for_each([](const String& name, const VariableStatus& status) {
+        if (status.uses == 0) {
+            fprintf(stdout, "Warn: unused variable %.*s\n", (u32) name.len, name.chars);
         }
-    }
+    });
     
     scopes.pop();
 }
 
-void Resolver::mark_resolved(KauCompiler* compiler, Expr* expr, u64 depth) {
-    compiler->locals.insert(compiler->global_arena, expr, (u64) expr, depth);
+void Resolver::mark_resolved(Expr* expr, u64 depth, u64 slot) {
+    VariableLocation* location = nullptr;
+    switch (expr->ty) {
+        case Expr::Type::LITERAL: {
+            location = &expr->expr.literal->location;
+            break;
+        }
+        case Expr::Type::ASSIGNMENT: {
+            location = &expr->expr.assignment->location;
+            break;
+        }
+        case Expr::Type::THIS: {
+            location = &expr->expr.this_expr->location;
+            break;
+        }
+        case Expr::Type::SUPER: {
+            location = &expr->expr.super_expr->location;
+            break;
+        }
+        default: {
+            assert(false);
+            break;
+        }
+    }
+
+    *location = VariableLocation {
+        .is_local = true,
+        .depth = depth,
+        .slot = slot,
+    };
 }
\ No newline at end of file
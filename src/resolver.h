@@ -1,9 +1,7 @@
 #pragma once
 
 
-#include <unordered_map>
-
-#include "lib/map.h"
+#include "lib/hash_map.h"
 #include "lib/array.h"
 
 #include "parser.h"
@@ -11,6 +9,13 @@
 struct VariableStatus {
     bool defined = false;
     u64 uses = 0;
+    // Index of the variable in its scope's environment at runtime.
+    u64 slot = 0;
+};
+
+struct Scope {
+    HashMap<String, VariableStatus, StringHasher> variables;
+    u64 slot_count = 0;
 };
 
 enum class FunctionType {
@@ -55,8 +60,9 @@ private:
     void visit_this_expr(KauCompiler* compiler, Expr* expr);
     void visit_super_expr(KauCompiler* compiler, Expr* expr);
 
-    void declare(KauCompiler* compiler, Token* name);
+    VariableStatus* declare(KauCompiler* compiler, Token* name);
     void define(Token* name);
+    void add_implicit(String name);
 
     void begin_scope(KauCompiler* compiler);
     void end_scope();
@@ -67,9 +73,10 @@ private:
 
     void resolve_local(KauCompiler* compiler, Expr* expr, const Token* token);
 
-    void mark_resolved(KauCompiler* compiler, Expr* expr, u64 depth);
+    void mark_resolved(Expr* expr, u64 depth, u64 slot);
 
-    Array<Map> scopes;
+    Arena* m_arena;
+    Array<Scope> scopes;
 
     FunctionType current_function = FunctionType::NONE;
     ClassType current_class = ClassType::NONE;
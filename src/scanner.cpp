@@ -5,15 +5,15 @@
 #define ADD_TO_KEYWORDS(TYPE, STRING) do {\
     String str = CREATE_STRING(STRING);\
     const TokenType ty = TokenType::TYPE;\
-    keywords.insert(arena, str, HASH_STR(str), ty);\
+    keywords.insert(str, ty);\
 } while(0)
 
 namespace {
-    Map keywords;
+    HashMap<String, TokenType, StringHasher> keywords;
 };
 
 void init_keywords_map(Arena* arena) {
-    keywords.allocate(arena);
+    keywords.init(arena);
 
     ADD_TO_KEYWORDS(AND, "and");
     ADD_TO_KEYWORDS(CLASS, "class");
@@ -95,7 +95,7 @@ void Scanner::string(KauCompiler& compiler) {
     advance();
 
     const String substr = get_substring(m_start_char_offset + 1, m_current_char_offset - 1);
-    add_token(TokenType::STRING, substr);
+    add_token(TokenType::STRING, compiler.interner.intern(substr));
 }
 
 void Scanner::number(KauCompiler& compiler) {
@@ -144,19 +144,18 @@ void Scanner::number(KauCompiler& compiler) {
     }
 }
 
-void Scanner::identifier() {
+void Scanner::identifier(KauCompiler& compiler) {
     while (isalnum(peek()) || peek() == '_') {
         advance();
     }
 
-    const String id = get_substring(m_start_char_offset, m_current_char_offset);
+    const String id = compiler.interner.intern(get_substring(m_start_char_offset, m_current_char_offset));
 
-    TokenType* ty = (TokenType*)keywords.get(HASH_STR(id));
+    TokenType* ty = keywords.get(id);
     if (ty != nullptr) { 
         add_token(*ty, id);
     } else {
-        String substr = get_substring(m_start_char_offset, m_current_char_offset);
-        add_token(TokenType::IDENTIFIER, substr);
+        add_token(TokenType::IDENTIFIER, id);
     }
 }
 
@@ -283,7 +282,7 @@ void Scanner::scan_token(KauCompiler& compiler, Arena* arena) {
             if (isdigit(c)) {
                 number(compiler);
             } else if (isalpha(c) || c == '_') {
-                identifier();
+                identifier(compiler);
             } else {
                 compiler.error(m_current_line,  concatenated_string(arena, CREATE_STRING("unexpected character "), String{&c, 1}));
             }
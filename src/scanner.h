@@ -40,7 +40,7 @@ private:
 
     void string(KauCompiler& compiler);
     void number(KauCompiler& compiler);
-    void identifier();
+    void identifier(KauCompiler& compiler);
     void block_comment(KauCompiler& compiler);
     
     void add_token(TokenType token_type, String substr = {}, TokenData data = {});
@@ -0,0 +1,276 @@
+#include "stats.h"
+
+namespace {
+    const char* phase_to_string(Phase phase) {
+        switch (phase) {
+            case Phase::SCAN: return "scan";
+            case Phase::PARSE: return "parse";
+            case Phase::RESOLVE: return "resolve";
+            case Phase::EXECUTE: return "execute";
+            case Phase::COUNT: break;
+        }
+        return "unknown";
+    }
+
+    const char* expr_type_to_string(Expr::Type ty) {
+        switch (ty) {
+            case Expr::Type::ERR: return "ERR";
+            case Expr::Type::LITERAL: return "LITERAL";
+            case Expr::Type::UNARY: return "UNARY";
+            case Expr::Type::BINARY: return "BINARY";
+            case Expr::Type::GROUPING: return "GROUPING";
+            case Expr::Type::TERNARY: return "TERNARY";
+            case Expr::Type::ASSIGNMENT: return "ASSIGNMENT";
+            case Expr::Type::AND: return "AND";
+            case Expr::Type::OR: return "OR";
+            case Expr::Type::FN_CALL: return "FN_CALL";
+            case Expr::Type::STATIC_FN_CALL: return "STATIC_FN_CALL";
+            case Expr::Type::GET: return "GET";
+            case Expr::Type::SET: return "SET";
+            case Expr::Type::THIS: return "THIS";
+            case Expr::Type::SUPER: return "SUPER";
+            case Expr::Type::INT_BINARY: return "INT_BINARY";
+            case Expr::Type::DOUBLE_BINARY: return "DOUBLE_BINARY";
+        }
+        return "unknown";
+    }
+
+    const char* stmt_type_to_string(Stmt::Type ty) {
+        switch (ty) {
+            case Stmt::Type::ERR: return "ERR";
+            case Stmt::Type::EXPR: return "EXPR";
+            case Stmt::Type::VAR_DECL: return "VAR_DECL";
+            case Stmt::Type::BLOCK: return "BLOCK";
+            case Stmt::Type::IF: return "IF";
+            case Stmt::Type::WHILE: return "WHILE";
+            case Stmt::Type::BREAK: return "BREAK";
+            case Stmt::Type::CONTINUE: return "CONTINUE";
+            case Stmt::Type::FN_DECLARATION: return "FN_DECLARATION";
+            case Stmt::Type::CLASS_DECLARATION: return "CLASS_DECLARATION";
+            case Stmt::Type::RETURN: return "RETURN";
+        }
+        return "unknown";
+    }
+
+    void count_expr(Stats& stats, const Expr* expr) {
+        if (expr == nullptr) {
+            return;
+        }
+
+        stats.expr_nodes[(u64) expr->ty] += 1;
+        switch (expr->ty) {
+            case Expr::Type::UNARY: {
+                count_expr(stats, expr->expr.unary->right);
+                break;
+            }
+            case Expr::Type::BINARY:
+            case Expr::Type::INT_BINARY:
+            case Expr::Type::DOUBLE_BINARY: {
+                count_expr(stats, expr->expr.binary->left);
+                count_expr(stats, expr->expr.binary->right);
+                break;
+            }
+            case Expr::Type::GROUPING: {
+                count_expr(stats, expr->expr.grouping->expr);
+                break;
+            }
+            case Expr::Type::TERNARY: {
+                count_expr(stats, expr->expr.ternary->left);
+                count_expr(stats, expr->expr.ternary->middle);
+                count_expr(stats, expr->expr.ternary->right);
+                break;
+            }
+            case Expr::Type::ASSIGNMENT: {
+                count_expr(stats, expr->expr.assignment->right);
+                break;
+            }
+            case Expr::Type::AND:
+            case Expr::Type::OR: {
+                count_expr(stats, expr->expr.logical_binary->left);
+                count_expr(stats, expr->expr.logical_binary->right);
+                break;
+            }
+            case Expr::Type::FN_CALL: {
+                const FnCallExpr* fn_call = expr->expr.fn_call;
+                count_expr(stats, fn_call->callee);
+                for (u64 i = 0; i < fn_call->arguments.size(); ++i) {
+                    count_expr(stats, fn_call->arguments[i]);
+                }
+                break;
+            }
+            case Expr::Type::STATIC_FN_CALL: {
+                count_expr(stats, expr->expr.static_fn_call->class_expr);
+                break;
+            }
+            case Expr::Type::GET: {
+                count_expr(stats, expr->expr.get->class_expr);
+                break;
+            }
+            case Expr::Type::SET: {
+                count_expr(stats, expr->expr.set->get);
+                count_expr(stats, expr->expr.set->right);
+                break;
+            }
+            case Expr::Type::ERR:
+            case Expr::Type::LITERAL:
+            case Expr::Type::THIS:
+            case Expr::Type::SUPER: {
+                break;
+            }
+        }
+    }
+
+    void count_stmt(Stats& stats, const Stmt* stmt) {
+        if (stmt == nullptr) {
+            return;
+        }
+
+        stats.stmt_nodes[(u64) stmt->ty] += 1;
+        switch (stmt->ty) {
+            case Stmt::Type::EXPR: {
+                count_expr(stats, stmt->s_expr.expr);
+                break;
+            }
+            case Stmt::Type::VAR_DECL: {
+                count_expr(stats, stmt->s_var_decl.initializer);
+                break;
+            }
+            case Stmt::Type::BLOCK: {
+                stats.count_nodes(stmt->s_block.stmts);
+                break;
+            }
+            case Stmt::Type::IF: {
+                count_expr(stats, stmt->s_if.condition);
+                count_stmt(stats, stmt->s_if.if_stmt);
+                // NOTE: A missing else branch is an `ERR` statement, which isn't a real node.
+                if (stmt->s_if.else_stmt->ty != Stmt::Type::ERR) {
+                    count_stmt(stats, stmt->s_if.else_stmt);
+                }
+                break;
+            }
+            case Stmt::Type::WHILE: {
+                count_expr(stats, stmt->s_while.condition);
+                count_stmt(stats, stmt->s_while.body);
+                break;
+            }
+            case Stmt::Type::FN_DECLARATION: {
+                count_stmt(stats, stmt->fn_declaration.body);
+                break;
+            }
+            case Stmt::Type::CLASS_DECLARATION: {
+                count_expr(stats, stmt->s_class.superclass);
+                stats.count_nodes(stmt->s_class.members);
+                break;
+            }
+            case Stmt::Type::RETURN: {
+                count_expr(stats, stmt->s_return.expr);
+                break;
+            }
+            case Stmt::Type::ERR:
+            case Stmt::Type::BREAK:
+            case Stmt::Type::CONTINUE: {
+                break;
+            }
+        }
+    }
+};
+
+void Stats::count_nodes(const Array<Stmt>& stmts) {
+    for (u64 i = 0; i < stmts.size(); ++i) {
+        count_stmt(*this, &stmts[i]);
+    }
+}
+
+void Stats::reset() {
+    *this = Stats{};
+}
+
+void Stats::print(FILE* file) const {
+    fprintf(file, "Phases:\n");
+    for (u64 i = 0; i < (u64) Phase::COUNT; ++i) {
+        const PhaseStats& stats = phases[i];
+        fprintf(file, "  %-10s %10.3f ms %12llu bytes\n",
+            phase_to_string((Phase) i), (double) stats.ns / 1000000.0, (unsigned long long) stats.arena_bytes);
+    }
+
+    fprintf(file, "Tokens: %llu\n", (unsigned long long) tokens);
+
+    fprintf(file, "Expression nodes:\n");
+    for (u64 i = 0; i < EXPR_TYPE_COUNT; ++i) {
+        if (expr_nodes[i] > 0) {
+            fprintf(file, "  %-18s %llu\n", expr_type_to_string((Expr::Type) i), (unsigned long long) expr_nodes[i]);
+        }
+    }
+    fprintf(file, "Statement nodes:\n");
+    for (u64 i = 0; i < STMT_TYPE_COUNT; ++i) {
+        if (stmt_nodes[i] > 0) {
+            fprintf(file, "  %-18s %llu\n", stmt_type_to_string((Stmt::Type) i), (unsigned long long) stmt_nodes[i]);
+        }
+    }
+
+    fprintf(file, "Environments created: %llu\n", (unsigned long long) environments);
+    if (KAU_MAP_COUNTERS) {
+        fprintf(file, "Map lookups: %llu, probes: %llu", (unsigned long long) map_lookups, (unsigned long long) map_probes);
+        if (map_lookups > 0) {
+            fprintf(file, " (%.2f per lookup)", (double) map_probes / map_lookups);
+        }
+        fprintf(file, "\n");
+    } else {
+        fprintf(file, "Map lookups: not counted, configure with -DKAU_MAP_COUNTERS=ON\n");
+    }
+    const u64 cache_lookups = inline_cache_hits + inline_cache_misses + inline_cache_megamorphic;
+    fprintf(file, "Inline caches: %llu hits, %llu misses, %llu megamorphic",
+        (unsigned long long) inline_cache_hits, (unsigned long long) inline_cache_misses,
+        (unsigned long long) inline_cache_megamorphic);
+    if (cache_lookups > 0) {
+        fprintf(file, " (%.1f%% hit rate)", 100.0 * inline_cache_hits / cache_lookups);
+    }
+    fprintf(file, "\n");
+    fprintf(file, "Quickening: %llu nodes rewritten, %llu de-specialized, %llu quickened evaluations\n",
+        (unsigned long long) quickened_nodes, (unsigned long long) despecialized_nodes,
+        (unsigned long long) quickened_evaluations);
+    fprintf(file, "VM instructions: %llu in stack form, %llu in register form",
+        (unsigned long long) stack_instructions, (unsigned long long) register_instructions);
+    if (stack_instructions > 0) {
+        fprintf(file, " (%+.1f%%)", 100.0 * ((double) register_instructions - (double) stack_instructions) / stack_instructions);
+    }
+    fprintf(file, ", %llu executed\n", (unsigned long long) instructions_executed);
+    fprintf(file, "JIT: %llu functions compiled, %llu bytes of code, %llu entries, %llu guard exits\n",
+        (unsigned long long) jit_functions, (unsigned long long) jit_code_bytes,
+        (unsigned long long) jit_entries, (unsigned long long) jit_guard_exits);
+    fprintf(file, "Traces: %llu compiled, %llu aborted, %llu entries, %llu side exits\n",
+        (unsigned long long) traces_compiled, (unsigned long long) traces_aborted,
+        (unsigned long long) trace_entries, (unsigned long long) trace_side_exits);
+    fprintf(file, "Closures: %llu nodes compiled, %llu specialized\n",
+        (unsigned long long) closure_nodes, (unsigned long long) closure_specialized_nodes);
+    fprintf(file, "Peak arena offset: %llu bytes\n", (unsigned long long) peak_arena_bytes);
+    fprintf(file, "Peak frame arena offset: %llu bytes\n", (unsigned long long) peak_frame_arena_bytes);
+    fprintf(file, "Peak frame stack: %llu slots\n", (unsigned long long) peak_frame_stack_slots);
+    fprintf(file, "GC: %llu minor collections, %.3f ms, %llu bytes promoted\n",
+        (unsigned long long) gc.minor_collections, (double) gc.minor_ns / 1000000.0,
+        (unsigned long long) gc.bytes_promoted);
+    fprintf(file, "GC: %llu major collections in %llu slices, %.3f ms, %llu bytes freed, peak old space %llu bytes, heap arena %llu bytes\n",
+        (unsigned long long) gc.major_collections, (unsigned long long) gc.major_slices, (double) gc.major_ns / 1000000.0,
+        (unsigned long long) gc.bytes_freed, (unsigned long long) gc.peak_bytes,
+        (unsigned long long) gc.arena_bytes);
+
+    const u64 pause_count = gc.pause_count();
+    fprintf(file, "GC pauses: %llu", (unsigned long long) pause_count);
+    if (pause_count > 0) {
+        fprintf(file, ", p50 <= %llu us, p99 <= %llu us, max %.3f us",
+            (unsigned long long) (gc.pause_percentile_ns(50.0) / 1000),
+            (unsigned long long) (gc.pause_percentile_ns(99.0) / 1000),
+            (double) gc.max_pause_ns / 1000.0);
+    }
+    fprintf(file, "\n");
+    for (u64 i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+        if (gc.pauses[i] == 0) {
+            continue;
+        }
+        if (i + 1 < GC_PAUSE_BUCKETS) {
+            fprintf(file, "  <= %-8llu us %llu\n", (unsigned long long) (GcStats::pause_bucket_limit_ns(i) / 1000), (unsigned long long) gc.pauses[i]);
+        } else {
+            fprintf(file, "  >  %-8llu us %llu\n", (unsigned long long) (GcStats::pause_bucket_limit_ns(i - 1) / 1000), (unsigned long long) gc.pauses[i]);
+        }
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "defs.h"
+#include "expr.h"
+#include "gc.h"
+
+#define EXPR_TYPE_COUNT ((u64) Expr::Type::DOUBLE_BINARY + 1)
+#define STMT_TYPE_COUNT ((u64) Stmt::Type::RETURN + 1)
+
+// Bumped on every environment created, by any compiler. `KauCompiler::run` only adds
+// what changed while it ran to its own `Stats`.
+inline u64 environments_created = 0;
+
+enum class Phase {
+    SCAN,
+    PARSE,
+    RESOLVE,
+    EXECUTE,
+    COUNT,
+};
+
+struct PhaseStats {
+    u64 ns = 0;
+    // Bytes pushed on the arena the phase allocates from.
+    u64 arena_bytes = 0;
+};
+
+// Where time and memory went, summed over every `KauCompiler::run` since the compiler was
+// created or `reset` was last called. Print with `--stats`.
+struct Stats {
+    PhaseStats phases[(u64) Phase::COUNT] = {};
+
+    u64 tokens = 0;
+    u64 expr_nodes[EXPR_TYPE_COUNT] = {};
+    u64 stmt_nodes[STMT_TYPE_COUNT] = {};
+
+    u64 environments = 0;
+    u64 map_lookups = 0;
+    // Slots looked at across all lookups, `map_probes / map_lookups` is the average probe length.
+    u64 map_probes = 0;
+
+    // Tree walker property accesses, see `InlineCache`.
+    u64 inline_cache_hits = 0;
+    u64 inline_cache_misses = 0;
+    u64 inline_cache_megamorphic = 0;
+
+    // Tree walker binary nodes rewritten into quickened ones, turned back, and how often the quickened ones ran.
+    u64 quickened_nodes = 0;
+    u64 despecialized_nodes = 0;
+    u64 quickened_evaluations = 0;
+
+    // Bytecode instructions compiled in either form, whichever one ran, see `BytecodeForm`.
+    u64 stack_instructions = 0;
+    u64 register_instructions = 0;
+    // Instructions the VM dispatched, in the form that ran.
+    u64 instructions_executed = 0;
+
+    // Functions compiled to machine code with `--jit`, and how the VM got in and out of their code.
+    u64 jit_functions = 0;
+    u64 jit_code_bytes = 0;
+    u64 jit_entries = 0;
+    u64 jit_guard_exits = 0;
+    // Loops traced with `--trace-jit`, how often their traces ran, and how often they left them early.
+    u64 traces_compiled = 0;
+    u64 traces_aborted = 0;
+    u64 trace_entries = 0;
+    u64 trace_side_exits = 0;
+
+    // Closure nodes compiled with `--closures`, and how many of them were specialized on types or callees.
+    u64 closure_nodes = 0;
+    u64 closure_specialized_nodes = 0;
+
+    u64 peak_arena_bytes = 0;
+    // Deepest the tree walker's call frames got, see `KauCompiler::frame_arena`.
+    u64 peak_frame_arena_bytes = 0;
+    // Most tree walker slots live at once, see `FrameStack`.
+    u64 peak_frame_stack_slots = 0;
+
+    // Copied from `KauCompiler::heap`, which keeps counting across runs.
+    GcStats gc = {};
+
+    const PhaseStats& phase(Phase phase) const {
+        return phases[(u64) phase];
+    }
+
+    void count_nodes(const Array<Stmt>& stmts);
+    void reset();
+    void print(FILE* file) const;
+};
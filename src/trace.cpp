@@ -0,0 +1,443 @@
+#include "trace.h"
+
+#include "vm.h"
+
+#include <string.h>
+
+namespace {
+    bool is_comparison(OpCode op) {
+        return op >= OpCode::EQUAL && op <= OpCode::LESSER_EQUAL;
+    }
+
+    // Stack form of a binary operator, register ones included.
+    OpCode binary_operator(OpCode op) {
+        if (op >= OpCode::EQUAL_RK) {
+            return (OpCode) ((u64) OpCode::EQUAL + (u64) op - (u64) OpCode::EQUAL_RK);
+        }
+        if (op >= OpCode::EQUAL_RR) {
+            return (OpCode) ((u64) OpCode::EQUAL + (u64) op - (u64) OpCode::EQUAL_RR);
+        }
+        return op;
+    }
+
+    bool is_binary(OpCode op) {
+        return is_register_op(op) || (op >= OpCode::EQUAL && op <= OpCode::DIVIDE);
+    }
+
+    // Traces only do arithmetic on ints and doubles, both operands of the same type.
+    bool traceable_operands(Value::Type left, Value::Type right) {
+        return left == right && (left == Value::Type::INT || left == Value::Type::DOUBLE);
+    }
+
+    Value::Type binary_result(const TraceInstruction& instruction) {
+        return is_comparison(binary_operator(instruction.op)) ? Value::Type::BOOL : instruction.types[0];
+    }
+};
+
+void TraceRecorder::start(Arena* scratch, FunctionObject* function, u64 anchor, Value* slots, u32 depth, ThreadedWord record_word) {
+    ThreadedCode& threaded = function->threaded;
+    const Chunk& chunk = function->chunk;
+    const u64 word_count = threaded.code.size();
+
+    scratch->clear();
+    m_saved = (ThreadedWord*) scratch->push_array_no_zero<ThreadedWord>(word_count);
+    memcpy(m_saved, threaded.code.m_head, word_count * sizeof(ThreadedWord));
+    m_offsets = (u64*) scratch->push_array_no_zero<u64>(word_count);
+    m_recorded = (bool*) scratch->push_array<bool>(word_count);
+    m_instructions.init(scratch);
+    classes.init(scratch);
+
+    u64 word = 0;
+    for (u64 offset = 0; offset < chunk.code.size(); offset += instruction_size(chunk, offset)) {
+        m_offsets[word] = offset;
+        threaded.code[word] = record_word;
+        word += instruction_words(chunk, offset);
+    }
+
+    active = true;
+    this->function = function;
+    this->slots = slots;
+    this->anchor = anchor;
+    this->depth = depth;
+    abort_reason = String{};
+}
+
+TraceStep TraceRecorder::abort(String reason) {
+    abort_reason = reason;
+    return TraceStep::ABORTED;
+}
+
+TraceStep TraceRecorder::record(ThreadedWord* ip, const Value* stack_top, const GlobalSlot* globals) {
+    ThreadedCode& threaded = function->threaded;
+    const u64 word = ip - threaded.code.m_head;
+    const ThreadedWord* operands = m_saved + word + 1;
+    const OpCode op = (OpCode) function->chunk.code[m_offsets[word]];
+
+    if (m_instructions.size() == TRACE_MAX_INSTRUCTIONS) {
+        return abort(CREATE_STRING("path too long"));
+    }
+    if (stack_top - slots + 1 >= TRACE_MAX_SLOTS) {
+        return abort(CREATE_STRING("stack too deep"));
+    }
+
+    TraceInstruction instruction = {};
+    instruction.word = word;
+    instruction.op = op;
+    // Word the path goes on from, jumps change it below.
+    u64 next = word + instruction_words(function->chunk, m_offsets[word]);
+
+    if (is_register_op(op)) {
+        const bool constant_right = op >= OpCode::EQUAL_RK;
+        instruction.dst = (u8) operands[0].operand;
+        instruction.left = (u8) operands[1].operand;
+        if (constant_right) {
+            instruction.constant = *operands[2].constant;
+        } else {
+            instruction.right = (u8) operands[2].operand;
+        }
+        instruction.top = (u8) operands[3].operand;
+        instruction.types[0] = slots[instruction.left].type();
+        instruction.types[1] = constant_right ? instruction.constant.type() : slots[instruction.right].type();
+        if (!traceable_operands(instruction.types[0], instruction.types[1])) {
+            return abort(CREATE_STRING("operands aren't ints or doubles"));
+        }
+    } else {
+        switch (op) {
+            case OpCode::CONSTANT: {
+                instruction.constant = *operands[0].constant;
+                instruction.types[0] = instruction.constant.type();
+                break;
+            }
+            case OpCode::NIL:
+            case OpCode::TRUE:
+            case OpCode::FALSE:
+            case OpCode::POP: {
+                break;
+            }
+            case OpCode::GET_LOCAL:
+            case OpCode::SET_LOCAL: {
+                instruction.operand = operands[0].operand;
+                instruction.types[0] = op == OpCode::GET_LOCAL ? slots[instruction.operand].type() : stack_top[-1].type();
+                break;
+            }
+            case OpCode::GET_GLOBAL:
+            case OpCode::SET_GLOBAL: {
+                instruction.operand = operands[0].operand;
+                const GlobalSlot& global = globals[instruction.operand];
+                if (!global.defined) {
+                    return abort(CREATE_STRING("undefined global"));
+                }
+                instruction.types[0] = op == OpCode::GET_GLOBAL ? global.value.type() : stack_top[-1].type();
+                break;
+            }
+            case OpCode::GET_PROPERTY:
+            case OpCode::SET_PROPERTY: {
+                const Value& receiver = op == OpCode::GET_PROPERTY ? stack_top[-1] : stack_top[-2];
+                if (!is_object(receiver, Object::Type::INSTANCE)) {
+                    return abort(CREATE_STRING("property of something that isn't an instance"));
+                }
+                InstanceObject* instance = (InstanceObject*) receiver.as_object();
+                const u64* field_slot = instance->klass->field_slots.get(operands[0].constant->as_string());
+                if (field_slot == nullptr) {
+                    return abort(CREATE_STRING("method access"));
+                }
+                instruction.operand = *field_slot;
+                instruction.types[0] = op == OpCode::GET_PROPERTY ? instance->fields[*field_slot].type() : stack_top[-1].type();
+
+                u32 klass = 0;
+                while (klass < classes.size() && classes[klass] != instance->klass) {
+                    klass += 1;
+                }
+                if (klass == classes.size()) {
+                    classes.push(instance->klass);
+                }
+                instruction.klass = klass;
+                break;
+            }
+            case OpCode::EQUAL:
+            case OpCode::NOT_EQUAL:
+            case OpCode::GREATER:
+            case OpCode::GREATER_EQUAL:
+            case OpCode::LESSER:
+            case OpCode::LESSER_EQUAL:
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE: {
+                instruction.types[0] = stack_top[-2].type();
+                instruction.types[1] = stack_top[-1].type();
+                if (!traceable_operands(instruction.types[0], instruction.types[1])) {
+                    return abort(CREATE_STRING("operands aren't ints or doubles"));
+                }
+                break;
+            }
+            case OpCode::NOT: {
+                instruction.types[0] = stack_top[-1].type();
+                if (instruction.types[0] != Value::Type::BOOL) {
+                    return abort(CREATE_STRING("operand isn't a bool"));
+                }
+                break;
+            }
+            case OpCode::NEGATE: {
+                instruction.types[0] = stack_top[-1].type();
+                if (!traceable_operands(instruction.types[0], instruction.types[0])) {
+                    return abort(CREATE_STRING("operand isn't an int or a double"));
+                }
+                break;
+            }
+            case OpCode::JUMP: {
+                next = operands[0].target - threaded.code.m_head;
+                break;
+            }
+            case OpCode::JUMP_IF_FALSE: {
+                if (stack_top[-1].type() != Value::Type::BOOL) {
+                    return abort(CREATE_STRING("condition isn't a bool"));
+                }
+                instruction.types[0] = Value::Type::BOOL;
+                instruction.jumped = !stack_top[-1].as_bool();
+                if (instruction.jumped) {
+                    next = operands[0].target - threaded.code.m_head;
+                }
+                break;
+            }
+            case OpCode::LOOP: {
+                next = operands[0].target - threaded.code.m_head;
+                break;
+            }
+            default: {
+                return abort(CREATE_STRING("instruction isn't traced"));
+            }
+        }
+    }
+
+    // NOTE: Longs can be inline or boxed, which a single type check can't tell apart.
+    if (instruction.types[0] == Value::Type::LONG || instruction.types[1] == Value::Type::LONG) {
+        return abort(CREATE_STRING("long operand"));
+    }
+
+    const bool back_edge = op == OpCode::LOOP && next == anchor;
+    if (!back_edge && (next == anchor || m_recorded[next])) {
+        return abort(CREATE_STRING("inner loop"));
+    }
+
+    m_recorded[word] = true;
+    m_instructions.push(instruction);
+    threaded.code[word] = m_saved[word];
+    return back_edge ? TraceStep::DONE : TraceStep::RECORDED;
+}
+
+void TraceRecorder::stop() {
+    memcpy(function->threaded.code.m_head, m_saved, function->threaded.code.size() * sizeof(ThreadedWord));
+    active = false;
+}
+
+Trace* TraceRecorder::finish(Arena* arena, int line) {
+    Trace* trace = (Trace*) arena->push_struct<Trace>();
+    trace->function = function;
+    trace->anchor = anchor;
+    trace->depth = depth;
+    trace->line = line;
+
+    trace->instructions.init(arena, m_instructions.size());
+    memcpy(trace->instructions.m_head, m_instructions.m_head, m_instructions.size_bytes());
+    trace->classes.init(arena, classes.size());
+    memcpy(trace->classes.m_head, classes.m_head, classes.size_bytes());
+    trace->guards.init(arena);
+    trace->exits.init(arena);
+    return trace;
+}
+
+bool optimize_trace(Trace* trace) {
+    // Types every slot and global the trace touched has at this point, once guarded or written.
+    bool known[TRACE_MAX_SLOTS] = {};
+    Value::Type types[TRACE_MAX_SLOTS];
+    TraceGuard global_types[TRACE_MAX_INSTRUCTIONS];
+    u64 global_count = 0;
+
+    // NOTE: Reading a variable the trace hasn't written or read yet is what needs a guard. Nothing
+    // else writes to it while the trace runs, so that guard can move up to the trace's entry.
+    const auto read_slot = [&](u64 slot, Value::Type type) {
+        if (known[slot]) {
+            return types[slot] == type;
+        }
+        if (slot >= trace->depth) {
+            return false;
+        }
+        trace->guards.push(TraceGuard{ false, slot, type });
+        known[slot] = true;
+        types[slot] = type;
+        return true;
+    };
+    const auto write_slot = [&](u64 slot, Value::Type type) {
+        known[slot] = true;
+        types[slot] = type;
+    };
+    const auto find_global = [&](u64 index) -> TraceGuard* {
+        for (u64 i = 0; i < global_count; ++i) {
+            if (global_types[i].index == index) {
+                return &global_types[i];
+            }
+        }
+        return nullptr;
+    };
+    const auto read_global = [&](u64 index, Value::Type type) {
+        TraceGuard* global = find_global(index);
+        if (global != nullptr) {
+            return global->type == type;
+        }
+        trace->guards.push(TraceGuard{ true, index, type });
+        global_types[global_count++] = TraceGuard{ true, index, type };
+        return true;
+    };
+    const auto write_global = [&](u64 index, Value::Type type) {
+        TraceGuard* global = find_global(index);
+        if (global != nullptr) {
+            global->type = type;
+        } else {
+            global_types[global_count++] = TraceGuard{ true, index, type };
+        }
+    };
+
+    u32 depth = trace->depth;
+    for (u64 i = 0; i < trace->instructions.size(); ++i) {
+        TraceInstruction& instruction = trace->instructions[i];
+        instruction.depth = depth;
+        if (depth + 1 >= TRACE_MAX_SLOTS) {
+            return false;
+        }
+
+        if (is_register_op(instruction.op)) {
+            if (!read_slot(instruction.left, instruction.types[0])) {
+                return false;
+            }
+            if (instruction.op < OpCode::EQUAL_RK && !read_slot(instruction.right, instruction.types[1])) {
+                return false;
+            }
+            write_slot(instruction.dst, binary_result(instruction));
+            depth = instruction.top;
+            continue;
+        }
+
+        switch (instruction.op) {
+            case OpCode::CONSTANT: {
+                write_slot(depth++, instruction.types[0]);
+                break;
+            }
+            case OpCode::NIL: {
+                write_slot(depth++, Value::Type::NIL);
+                break;
+            }
+            case OpCode::TRUE:
+            case OpCode::FALSE: {
+                write_slot(depth++, Value::Type::BOOL);
+                break;
+            }
+            case OpCode::POP: {
+                depth -= 1;
+                break;
+            }
+            case OpCode::GET_LOCAL: {
+                if (!read_slot(instruction.operand, instruction.types[0])) {
+                    return false;
+                }
+                write_slot(depth++, instruction.types[0]);
+                break;
+            }
+            case OpCode::SET_LOCAL: {
+                write_slot(instruction.operand, instruction.types[0]);
+                break;
+            }
+            case OpCode::GET_GLOBAL: {
+                if (!read_global(instruction.operand, instruction.types[0])) {
+                    return false;
+                }
+                write_slot(depth++, instruction.types[0]);
+                break;
+            }
+            case OpCode::SET_GLOBAL: {
+                write_global(instruction.operand, instruction.types[0]);
+                break;
+            }
+            // NOTE: Fields are guarded where they're read, anything could have written them.
+            case OpCode::GET_PROPERTY: {
+                write_slot(depth - 1, instruction.types[0]);
+                break;
+            }
+            case OpCode::SET_PROPERTY: {
+                write_slot(depth - 2, instruction.types[0]);
+                depth -= 1;
+                break;
+            }
+            case OpCode::EQUAL:
+            case OpCode::NOT_EQUAL:
+            case OpCode::GREATER:
+            case OpCode::GREATER_EQUAL:
+            case OpCode::LESSER:
+            case OpCode::LESSER_EQUAL:
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE: {
+                write_slot(depth - 2, binary_result(instruction));
+                depth -= 1;
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    }
+    if (depth != trace->depth) {
+        return false;
+    }
+
+    trace->type_stable = true;
+    for (u64 i = 0; i < trace->guards.size(); ++i) {
+        const TraceGuard& guard = trace->guards[i];
+        if (guard.global) {
+            trace->type_stable = trace->type_stable && find_global(guard.index)->type == guard.type;
+        } else {
+            trace->type_stable = trace->type_stable && types[guard.index] == guard.type;
+        }
+    }
+
+    for (u64 i = 0; i + 2 < trace->instructions.size(); ++i) {
+        TraceInstruction& instruction = trace->instructions[i];
+        const TraceInstruction& branch = trace->instructions[i + 1];
+        if (!is_binary(instruction.op) || !is_comparison(binary_operator(instruction.op)) ||
+            instruction.types[0] != Value::Type::INT) {
+            continue;
+        }
+        if (branch.op != OpCode::JUMP_IF_FALSE || trace->instructions[i + 2].op != OpCode::POP) {
+            continue;
+        }
+        const u64 result_slot = is_register_op(instruction.op) ? instruction.dst : instruction.depth - 2;
+        instruction.fused = result_slot == branch.depth - 1;
+    }
+    return true;
+}
+
+void print_trace_report(FILE* file, const Array<TraceEvent>& events) {
+    fprintf(file, "Traces:\n");
+    for (u64 i = 0; i < events.size(); ++i) {
+        const TraceEvent& event = events[i];
+        fprintf(file, "  %.*s, line %d: ", (u32) event.function.len, event.function.chars, event.line);
+        if (event.trace == nullptr) {
+            fprintf(file, "aborted, %.*s\n", (u32) event.reason.len, event.reason.chars);
+            continue;
+        }
+
+        const Trace* trace = event.trace;
+        fprintf(file, "compiled, %llu instructions, %llu guards hoisted%s, %u loads forwarded, entered %llu times\n",
+            (unsigned long long) trace->instructions.size(), (unsigned long long) trace->guards.size(),
+            trace->type_stable ? " (type stable)" : "", trace->loads_forwarded, (unsigned long long) trace->entries);
+        for (u64 j = 0; j < trace->exits.size(); ++j) {
+            const TraceExit& exit = trace->exits[j];
+            if (exit.count == 0) {
+                continue;
+            }
+            fprintf(file, "    side exit at line %d: %llu\n", trace->function->threaded.lines[exit.word],
+                (unsigned long long) exit.count);
+        }
+    }
+}
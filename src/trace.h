@@ -0,0 +1,169 @@
+#pragma once
+
+#include "defs.h"
+#include "lib/arena.h"
+#include "lib/array.h"
+#include "lib/string.h"
+
+#include "bytecode.h"
+
+#include <stdio.h>
+
+// Times a loop jumps back to its header before the path through it gets recorded.
+#define TRACE_HOT_LOOP_THRESHOLD 50
+// Recordings that get longer than this are given up on.
+#define TRACE_MAX_INSTRUCTIONS 512
+// Slots of the frame a trace can touch, locals and temporaries.
+#define TRACE_MAX_SLOTS 256
+// A loop that failed to record this many times isn't recorded again.
+#define TRACE_MAX_ABORTS 3
+
+struct GlobalSlot;
+
+// One instruction on a recorded path, with what it was seen working on when it ran.
+struct TraceInstruction {
+    // Threaded word the instruction starts at. Exits taken at it resume from there.
+    u64 word;
+    OpCode op;
+    // The local's slot, the global's index, or the field's slot for property accesses.
+    u64 operand;
+    // Register instructions' slots, and where they leave the stack top.
+    u8 dst;
+    u8 left;
+    u8 right;
+    u8 top;
+    // Pushed by `CONSTANT`, and the right operand of `_RK` instructions.
+    Value constant;
+    // Types seen when recorded: binary operators' left and right operands, the value a load
+    // found or a store wrote, the operand of `NOT` and `NEGATE`, and the field a property read found.
+    Value::Type types[2];
+    // Whether `JUMP_IF_FALSE` jumped.
+    bool jumped;
+    // Property accesses: index of the instance's class in `Trace::classes`.
+    u32 klass;
+
+    // Filled in by `optimize_trace`.
+    //
+    // Stack depth before the instruction runs, counted from the frame's slots.
+    u32 depth;
+    // An int comparison only `JUMP_IF_FALSE` looks at, and popped right after. The comparison
+    // branches on its flags, and its result is only written out if the trace exits.
+    bool fused;
+};
+
+// A variable the trace reads before writing it. Its type is checked once, when the trace is
+// entered, instead of at every read.
+struct TraceGuard {
+    bool global;
+    // Slot or global index.
+    u64 index;
+    Value::Type type;
+};
+
+// Where a trace goes back to the interpreter: a type, branch or class guard failed, or an int
+// was divided by zero, which the interpreter reports.
+struct TraceExit {
+    u64 word;
+    // Stack depth the interpreter resumes with.
+    u32 depth;
+    // For fused comparisons, the result to write to the top of the stack before exiting.
+    bool materialize;
+    Value condition;
+    // Bumped by the trace's code every time it exits here.
+    u64 count;
+};
+
+// The path one iteration of a hot loop took, from its header back to it, compiled to machine
+// code specialized on the types the recording saw. Guards check that those types still hold,
+// and leave the trace through a side exit back into the interpreter when they don't.
+struct Trace {
+    FunctionObject* function;
+    // Threaded word of the loop header, where the trace is entered.
+    u64 anchor;
+    // Stack depth at the header.
+    u32 depth;
+    int line;
+
+    Array<TraceInstruction> instructions;
+    Array<TraceGuard> guards;
+    // Every guarded variable still has its type when the trace loops back, so the guards
+    // don't have to be checked again.
+    bool type_stable;
+    // Classes property accesses were specialized on. They are GC roots, the code reads them from here.
+    Array<ClassObject*> classes;
+    Array<TraceExit> exits;
+    // Loads the code generator got from a register instead of memory.
+    u32 loads_forwarded;
+
+    // Null if the trace couldn't be compiled.
+    JitCode* jit;
+    u64 entries;
+};
+
+// Per loop header of a function, see `FunctionObject::trace_anchors`.
+struct TraceAnchor {
+    u32 hotness;
+    u32 aborts;
+    Trace* trace;
+};
+
+// A trace compiled, or a recording given up on, for the report `--trace-jit` prints at exit.
+struct TraceEvent {
+    String function;
+    int line;
+    // Null for recordings that were given up on.
+    Trace* trace;
+    String reason;
+};
+
+enum class TraceStep {
+    RECORDED,
+    // The back edge to the header was recorded, the trace is ready to compile.
+    DONE,
+    ABORTED,
+};
+
+// Records the path a hot loop takes through its function.
+//
+// Every instruction of the function gets its handler swapped for the recorder's, which records
+// the instruction, puts its handler back and runs it, so the interpreter itself runs the
+// iteration being recorded and costs nothing once recording is done. Anything that leaves the
+// function, like calls and returns, or that the trace compiler doesn't handle, aborts.
+struct TraceRecorder {
+    void start(Arena* scratch, FunctionObject* function, u64 anchor, Value* slots, u32 depth, ThreadedWord record_word);
+    // Records the instruction at `ip`, before it runs. Puts its handler back unless the recording
+    // is aborted, then `stop` has to be called.
+    TraceStep record(ThreadedWord* ip, const Value* stack_top, const GlobalSlot* globals);
+    // Puts back every handler `start` swapped out.
+    void stop();
+    // Copies the recorded path into a trace allocated from `arena`.
+    Trace* finish(Arena* arena, int line);
+
+    bool active = false;
+    FunctionObject* function;
+    // Slots of the frame being recorded, anything else running the function aborts.
+    Value* slots;
+    u64 anchor;
+    u32 depth;
+    String abort_reason;
+
+    // Classes the recording specialized on so far, which have to be visited as roots while it runs.
+    Array<ClassObject*> classes;
+
+private:
+    TraceStep abort(String reason);
+
+    // The function's threaded code as it was before `start`.
+    ThreadedWord* m_saved;
+    // Offset in the chunk of the instruction at each word.
+    u64* m_offsets;
+    bool* m_recorded;
+    Array<TraceInstruction> m_instructions;
+};
+
+// Works out stack depths, which variables need guards and where, whether the trace is type
+// stable, and which comparisons can be fused with their branch. Returns false if the trace
+// can't be compiled after all.
+bool optimize_trace(Trace* trace);
+
+void print_trace_report(FILE* file, const Array<TraceEvent>& events);
@@ -0,0 +1,1005 @@
+#include "vm.h"
+
+#include "compiler.h"
+#include "jit.h"
+
+#include <ctime>
+
+#define BINARY_OP(VALUE_IN_TYPE, VALUE_IN_GETTER, VALUE_OUT_CONSTRUCTOR, OPERATOR) do {\
+    if (left.type() == Value::Type::VALUE_IN_TYPE) {\
+        out = VALUE_OUT_CONSTRUCTOR(left.VALUE_IN_GETTER() OPERATOR right.VALUE_IN_GETTER());\
+        return String{};\
+    }\
+} while(0)
+
+// NOTE: Same operand types as the tree walker's `binary_op`, where longs can only be divided.
+#define ARITHMETIC_OP(OPERATOR) do {\
+    BINARY_OP(INT, as_int, int_value, OPERATOR);\
+    BINARY_OP(FLOAT, as_float, float_value, OPERATOR);\
+    BINARY_OP(DOUBLE, as_double, double_value, OPERATOR);\
+} while(0)
+
+// Equality too, so nil, bools and objects can't be compared.
+#define COMPARISON_OP(OPERATOR) do {\
+    BINARY_OP(INT, as_int, bool_value, OPERATOR);\
+    BINARY_OP(FLOAT, as_float, bool_value, OPERATOR);\
+    BINARY_OP(DOUBLE, as_double, bool_value, OPERATOR);\
+    BINARY_OP(STRING, as_string, bool_value, OPERATOR);\
+} while(0)
+
+#define DIVIDE_OP(VALUE_TYPE, VALUE_GETTER, VALUE_CONSTRUCTOR) do {\
+    if (left.type() == Value::Type::VALUE_TYPE) {\
+        if (right.VALUE_GETTER() == 0) {\
+            return CREATE_STRING("Divide by zero");\
+        }\
+        out = VALUE_CONSTRUCTOR(left.VALUE_GETTER() / right.VALUE_GETTER());\
+        return String{};\
+    }\
+} while(0)
+
+namespace {
+    Value clock_native(Heap* heap, int, Value*) {
+        return long_value(clock(), heap);
+    }
+
+    Value print_native(Heap*, int, Value* args) {
+        args[0].print();
+        return args[0];
+    }
+
+    // Returns an empty string on success, and the runtime error message otherwise.
+    String binary_op(Heap* heap, OpCode op, const Value& left, const Value& right, Value& out) {
+        if (left.type() != right.type()) {
+            return CREATE_STRING("Operands must be equal");
+        }
+
+        // NOTE: Longs can need boxing, which the constructors in `DIVIDE_OP` can't do on their own.
+        const auto heap_long_value = [heap](long l) {
+            return long_value(l, heap);
+        };
+
+        switch (op)
+        {
+            case OpCode::EQUAL: {
+                COMPARISON_OP(==);
+                break;
+            }
+            case OpCode::NOT_EQUAL: {
+                COMPARISON_OP(!=);
+                break;
+            }
+            case OpCode::ADD: {
+                ARITHMETIC_OP(+);
+                if (left.type() == Value::Type::STRING) {
+                    out = string_value(heap->concatenated_string(left.as_string(), right.as_string()));
+                    return String{};
+                }
+                break;
+            }
+            case OpCode::SUBTRACT: {
+                ARITHMETIC_OP(-);
+                break;
+            }
+            case OpCode::MULTIPLY: {
+                ARITHMETIC_OP(*);
+                break;
+            }
+            case OpCode::DIVIDE: {
+                DIVIDE_OP(INT, as_int, int_value);
+                DIVIDE_OP(LONG, as_long, heap_long_value);
+                DIVIDE_OP(FLOAT, as_float, float_value);
+                DIVIDE_OP(DOUBLE, as_double, double_value);
+                break;
+            }
+            case OpCode::GREATER: {
+                COMPARISON_OP(>);
+                break;
+            }
+            case OpCode::GREATER_EQUAL: {
+                COMPARISON_OP(>=);
+                break;
+            }
+            case OpCode::LESSER: {
+                COMPARISON_OP(<);
+                break;
+            }
+            case OpCode::LESSER_EQUAL: {
+                COMPARISON_OP(<=);
+                break;
+            }
+            default: {
+                return CREATE_STRING("Unsupported binary operation");
+            }
+        }
+
+        return CREATE_STRING("Operands do not support operator");
+    }
+
+    template<class V>
+    void copy_map_entries(const HashMap<String, V, StringHasher>& from, HashMap<String, V, StringHasher>& to) {
+        from.for_each([&to](const String& key, const V& value) {
+            to.insert(key, value);
+        });
+    }
+};
+
+void VM::init(Arena* arena) {
+    m_arena = arena;
+
+    m_frames = (CallFrame*) arena->push_array_no_zero<CallFrame>(VM_FRAMES_MAX);
+    m_frame_count = 0;
+    m_stack = (Value*) arena->push_array_no_zero<Value>(VM_STACK_MAX);
+    m_stack_top = m_stack;
+    m_open_upvalues = nullptr;
+
+    m_globals.init(arena);
+    m_global_slots.init(arena);
+    m_jit_code.init(arena);
+    m_traces.init(arena);
+    m_trace_events.init(arena);
+
+    define_native(CREATE_STRING("clock"), 0, clock_native);
+    define_native(CREATE_STRING("print"), 1, print_native);
+}
+
+void VM::release() {
+    for (u64 i = 0; i < m_jit_code.size(); ++i) {
+        jit_release(m_jit_code[i]);
+    }
+    m_jit_code.m_len = 0;
+    if (m_trace_arena != nullptr) {
+        m_trace_arena->release();
+        free(m_trace_arena);
+        m_trace_arena = nullptr;
+    }
+}
+
+void VM::visit_roots(Heap* heap) {
+    for (Value* slot = m_stack; slot < m_stack_top; ++slot) {
+        heap->visit(*slot);
+    }
+    for (int i = 0; i < m_frame_count; ++i) {
+        heap->visit_object((Object**) &m_frames[i].closure);
+    }
+    // NOTE: The rest of the open upvalues are reached through `next`.
+    heap->visit_object((Object**) &m_open_upvalues);
+    for (u64 i = 0; i < m_globals.size(); ++i) {
+        heap->visit(m_globals[i].value);
+    }
+    for (u64 i = 0; i < m_traces.size(); ++i) {
+        Trace* trace = m_traces[i];
+        for (u64 j = 0; j < trace->classes.size(); ++j) {
+            heap->visit_object((Object**) &trace->classes[j]);
+        }
+    }
+    if (m_recorder.active) {
+        for (u64 i = 0; i < m_recorder.classes.size(); ++i) {
+            heap->visit_object((Object**) &m_recorder.classes[i]);
+        }
+    }
+}
+
+u16 VM::global_slot(String name) {
+    u16* slot = m_global_slots.get(name);
+    if (slot != nullptr) {
+        return *slot;
+    }
+
+    assert(m_globals.size() < UINT16_MAX);
+    const u16 new_slot = (u16) m_globals.size();
+    m_globals.push(GlobalSlot{
+        .name = name,
+        .value = Value{},
+        .defined = false
+    });
+    m_global_slots.insert(name, new_slot);
+    return new_slot;
+}
+
+void VM::define_native(String name, int arity, NativeFn function) {
+    GlobalSlot& global = m_globals[global_slot(name)];
+    global.value = object_value(new_native(m_arena, name, arity, function));
+    global.defined = true;
+}
+
+InterpretResult VM::interpret(KauCompiler* compiler, Array<Stmt> stmts, bool from_prompt, BytecodeForm form) {
+    m_compiler = compiler;
+    m_heap = &compiler->heap;
+
+    BytecodeCompiler bytecode_compiler = {};
+    FunctionObject* script = bytecode_compiler.compile(compiler, this, stmts, from_prompt, form);
+    if (script == nullptr) {
+        return InterpretResult::COMPILE_ERROR;
+    }
+
+    const u64 instructions = bytecode_compiler.instruction_count();
+    if (form == BytecodeForm::STACK) {
+        compiler->stats.stack_instructions += instructions;
+    } else {
+        compiler->stats.register_instructions += instructions;
+    }
+    // NOTE: With `--stats`, the other form is compiled too, only to count its instructions, so
+    // the two can be compared. It's never run, and isn't worth compiling otherwise.
+    if (compiler->collect_stats) {
+        const BytecodeForm other_form = form == BytecodeForm::STACK ? BytecodeForm::REGISTER : BytecodeForm::STACK;
+        BytecodeCompiler other_compiler = {};
+        other_compiler.compile(compiler, this, stmts, from_prompt, other_form);
+        if (other_form == BytecodeForm::STACK) {
+            compiler->stats.stack_instructions += other_compiler.instruction_count();
+        } else {
+            compiler->stats.register_instructions += other_compiler.instruction_count();
+        }
+    }
+
+    ClosureObject* closure = new_closure(m_heap, script);
+    push(object_value(closure));
+
+    if (trace_enabled && m_trace_arena == nullptr) {
+        m_trace_arena = alloc_arena();
+    }
+
+    const u64 executed_start = m_instructions_executed;
+    const InterpretResult result = run(closure);
+    // NOTE: A runtime error can stop the program in the middle of a recording.
+    if (m_recorder.active) {
+        m_recorder.stop();
+    }
+    compiler->stats.instructions_executed += m_instructions_executed - executed_start;
+    return result;
+}
+
+InterpretResult VM::run(ClosureObject* script) {
+#if KAU_COMPUTED_GOTO
+    // NOTE: In opcode order, see `thread_function`.
+    static const void* const handlers[] = {
+        &&op_CONSTANT, &&op_NIL, &&op_TRUE, &&op_FALSE, &&op_POP, &&op_ECHO,
+        &&op_GET_LOCAL, &&op_SET_LOCAL, &&op_GET_UPVALUE, &&op_SET_UPVALUE, &&op_CLOSE_UPVALUE,
+        &&op_DEFINE_GLOBAL, &&op_GET_GLOBAL, &&op_SET_GLOBAL,
+        &&op_GET_PROPERTY, &&op_SET_PROPERTY, &&op_GET_STATIC, &&op_GET_SUPER,
+        &&op_EQUAL, &&op_NOT_EQUAL, &&op_GREATER, &&op_GREATER_EQUAL, &&op_LESSER, &&op_LESSER_EQUAL,
+        &&op_ADD, &&op_SUBTRACT, &&op_MULTIPLY, &&op_DIVIDE, &&op_NOT, &&op_NEGATE,
+        &&op_JUMP, &&op_JUMP_IF_FALSE, &&op_LOOP,
+        &&op_CALL, &&op_CLOSURE, &&op_RETURN,
+        &&op_CLASS, &&op_INHERIT, &&op_METHOD, &&op_STATIC_METHOD, &&op_FIELD,
+        &&op_EQUAL_RR, &&op_NOT_EQUAL_RR, &&op_GREATER_RR, &&op_GREATER_EQUAL_RR, &&op_LESSER_RR, &&op_LESSER_EQUAL_RR,
+        &&op_ADD_RR, &&op_SUBTRACT_RR, &&op_MULTIPLY_RR, &&op_DIVIDE_RR,
+        &&op_EQUAL_RK, &&op_NOT_EQUAL_RK, &&op_GREATER_RK, &&op_GREATER_EQUAL_RK, &&op_LESSER_RK, &&op_LESSER_EQUAL_RK,
+        &&op_ADD_RK, &&op_SUBTRACT_RK, &&op_MULTIPLY_RK, &&op_DIVIDE_RK,
+    };
+    static_assert(sizeof(handlers) / sizeof(handlers[0]) == (u64) OpCode::DIVIDE_RK + 1);
+    m_handlers = handlers;
+    m_record_word.handler = &&op_RECORD;
+#else
+    m_record_word.op = OpCode::RECORD;
+#endif
+
+    if (!call(script, 0)) {
+        recover();
+        return InterpretResult::RUNTIME_ERROR;
+    }
+    CallFrame* frame = &m_frames[m_frame_count - 1];
+
+#define READ_OPERAND() ((frame->ip++)->operand)
+#define READ_CONSTANT() (*(frame->ip++)->constant)
+#define READ_STRING() (READ_CONSTANT().as_string())
+#define READ_TARGET() ((frame->ip++)->target)
+#define RUNTIME_ERROR(message) do {\
+    runtime_error(message);\
+    goto recover;\
+} while(0)
+// NOTE: With computed goto, every handler jumps straight to the next one, so each gets its own
+// indirect branch to predict instead of all of them sharing the switch's.
+#if KAU_COMPUTED_GOTO
+#define DISPATCH() do {\
+    m_instructions_executed += 1;\
+    goto *(frame->ip++)->handler;\
+} while(0)
+#define CASE(op) case OpCode::op: op_##op
+#else
+#define DISPATCH() continue
+#define CASE(op) case OpCode::op
+#endif
+#define BINARY_CASE(op) CASE(op): {\
+    const Value right = pop();\
+    const Value left = pop();\
+    Value result = {};\
+    const String err = binary_op(m_heap, OpCode::op, left, right, result);\
+    if (!err.empty()) {\
+        RUNTIME_ERROR(err);\
+    }\
+    push(result);\
+    DISPATCH();\
+}
+// NOTE: The result is written before the stack top moves, since it can go in the register of
+// an operand the instruction pops.
+#define REGISTER_BINARY_CASE(op, variant, READ_RIGHT) CASE(op##_##variant): {\
+    Value* dst = frame->slots + READ_OPERAND();\
+    const Value& left = frame->slots[READ_OPERAND()];\
+    const Value& right = READ_RIGHT;\
+    Value* top = frame->slots + READ_OPERAND();\
+    Value result = {};\
+    const String err = binary_op(m_heap, OpCode::op, left, right, result);\
+    if (!err.empty()) {\
+        RUNTIME_ERROR(err);\
+    }\
+    *dst = result;\
+    m_stack_top = top;\
+    DISPATCH();\
+}
+#define REGISTER_BINARY_CASES(op)\
+    REGISTER_BINARY_CASE(op, RR, frame->slots[READ_OPERAND()])\
+    REGISTER_BINARY_CASE(op, RK, READ_CONSTANT())
+// NOTE: Machine code is entered where control flow lands, after calls, returns and loop jumps,
+// and runs on until it gets to something it leaves to the interpreter.
+#define ENTER_JIT() do {\
+    if (frame->closure->function->jit != nullptr) {\
+        enter_jit(frame);\
+    }\
+} while(0)
+
+#if KAU_COMPUTED_GOTO
+    DISPATCH();
+#endif
+    while (true) {
+        m_instructions_executed += 1;
+        switch ((frame->ip++)->op)
+        {
+            CASE(CONSTANT): {
+                push(READ_CONSTANT());
+                DISPATCH();
+            }
+            CASE(NIL): {
+                push(Value{});
+                DISPATCH();
+            }
+            CASE(TRUE): {
+                push(bool_value(true));
+                DISPATCH();
+            }
+            CASE(FALSE): {
+                push(bool_value(false));
+                DISPATCH();
+            }
+            CASE(POP): {
+                pop();
+                DISPATCH();
+            }
+            CASE(ECHO): {
+                pop().print();
+                DISPATCH();
+            }
+            CASE(GET_LOCAL): {
+                const u64 slot = READ_OPERAND();
+                push(frame->slots[slot]);
+                DISPATCH();
+            }
+            CASE(SET_LOCAL): {
+                const u64 slot = READ_OPERAND();
+                frame->slots[slot] = peek(0);
+                DISPATCH();
+            }
+            CASE(GET_UPVALUE): {
+                const u64 slot = READ_OPERAND();
+                push(*frame->closure->upvalues[slot]->location);
+                DISPATCH();
+            }
+            CASE(SET_UPVALUE): {
+                const u64 slot = READ_OPERAND();
+                UpvalueObject* upvalue = frame->closure->upvalues[slot];
+                m_heap->write_barrier(upvalue, *upvalue->location, peek(0));
+                *upvalue->location = peek(0);
+                DISPATCH();
+            }
+            CASE(CLOSE_UPVALUE): {
+                close_upvalues(m_stack_top - 1);
+                pop();
+                DISPATCH();
+            }
+            CASE(DEFINE_GLOBAL): {
+                GlobalSlot& global = m_globals[READ_OPERAND()];
+                global.value = pop();
+                global.defined = true;
+                DISPATCH();
+            }
+            CASE(GET_GLOBAL): {
+                GlobalSlot& global = m_globals[READ_OPERAND()];
+                if (!global.defined) {
+                    RUNTIME_ERROR(CREATE_STRING("Undefined variable"));
+                }
+                push(global.value);
+                DISPATCH();
+            }
+            CASE(SET_GLOBAL): {
+                GlobalSlot& global = m_globals[READ_OPERAND()];
+                if (!global.defined) {
+                    RUNTIME_ERROR(CREATE_STRING("Undefined variable"));
+                }
+                global.value = peek(0);
+                DISPATCH();
+            }
+            CASE(GET_PROPERTY): {
+                const String name = READ_STRING();
+                if (!is_object(peek(0), Object::Type::INSTANCE)) {
+                    RUNTIME_ERROR(CREATE_STRING("object must be struct"));
+                }
+
+                InstanceObject* instance = (InstanceObject*) peek(0).as_object();
+                u64* field_slot = instance->klass->field_slots.get(name);
+                if (field_slot != nullptr) {
+                    pop();
+                    push(instance->fields[*field_slot]);
+                    DISPATCH();
+                }
+
+                if (!bind_method(instance->klass, name)) {
+                    RUNTIME_ERROR(CREATE_STRING("class does not have field"));
+                }
+                DISPATCH();
+            }
+            CASE(SET_PROPERTY): {
+                const String name = READ_STRING();
+                if (!is_object(peek(1), Object::Type::INSTANCE)) {
+                    RUNTIME_ERROR(CREATE_STRING("object must be struct"));
+                }
+
+                InstanceObject* instance = (InstanceObject*) peek(1).as_object();
+                u64* field_slot = instance->klass->field_slots.get(name);
+                if (field_slot == nullptr) {
+                    RUNTIME_ERROR(CREATE_STRING("class does not have field"));
+                }
+
+                const Value value = pop();
+                m_heap->write_barrier(instance, instance->fields[*field_slot], value);
+                instance->fields[*field_slot] = value;
+                pop();
+                push(value);
+                DISPATCH();
+            }
+            CASE(GET_STATIC): {
+                const String name = READ_STRING();
+                if (!is_object(peek(0), Object::Type::CLASS)) {
+                    RUNTIME_ERROR(CREATE_STRING("object must be struct"));
+                }
+
+                ClassObject* klass = (ClassObject*) peek(0).as_object();
+                ClosureObject** static_fn = klass->statics.get(name);
+                if (static_fn == nullptr) {
+                    RUNTIME_ERROR(CREATE_STRING("Undeclared function"));
+                }
+                pop();
+                push(object_value(*static_fn));
+                DISPATCH();
+            }
+            CASE(GET_SUPER): {
+                const String name = READ_STRING();
+                // NOTE: `super` is nil if the superclass wasn't a class, see `compile_class_declaration`.
+                if (!is_object(peek(0), Object::Type::CLASS)) {
+                    RUNTIME_ERROR(CREATE_STRING("Undeclared function"));
+                }
+                ClassObject* superclass = (ClassObject*) pop().as_object();
+                if (!bind_method(superclass, name)) {
+                    RUNTIME_ERROR(CREATE_STRING("Undeclared function"));
+                }
+                DISPATCH();
+            }
+            BINARY_CASE(EQUAL)
+            BINARY_CASE(NOT_EQUAL)
+            BINARY_CASE(GREATER)
+            BINARY_CASE(GREATER_EQUAL)
+            BINARY_CASE(LESSER)
+            BINARY_CASE(LESSER_EQUAL)
+            BINARY_CASE(ADD)
+            BINARY_CASE(SUBTRACT)
+            BINARY_CASE(MULTIPLY)
+            BINARY_CASE(DIVIDE)
+            CASE(NOT): {
+                if (peek(0).type() != Value::Type::BOOL) {
+                    RUNTIME_ERROR(CREATE_STRING("Operand must be bool"));
+                }
+                m_stack_top[-1] = bool_value(!m_stack_top[-1].as_bool());
+                DISPATCH();
+            }
+            CASE(NEGATE): {
+                Value& value = m_stack_top[-1];
+                switch (value.type())
+                {
+                    case Value::Type::INT: {
+                        value = int_value(-value.as_int());
+                        break;
+                    }
+                    case Value::Type::LONG: {
+                        value = long_value(-value.as_long(), m_heap);
+                        break;
+                    }
+                    case Value::Type::FLOAT: {
+                        value = float_value(-value.as_float());
+                        break;
+                    }
+                    case Value::Type::DOUBLE: {
+                        value = double_value(-value.as_double());
+                        break;
+                    }
+                    default: {
+                        RUNTIME_ERROR(CREATE_STRING("Operand must be a number"));
+                    }
+                }
+                DISPATCH();
+            }
+            CASE(JUMP): {
+                frame->ip = frame->ip->target;
+                DISPATCH();
+            }
+            CASE(JUMP_IF_FALSE): {
+                ThreadedWord* target = READ_TARGET();
+                const Value& condition = peek(0);
+                if (condition.type() != Value::Type::BOOL) {
+                    RUNTIME_ERROR(CREATE_STRING("Condition must evaluate to bool"));
+                }
+                if (!condition.as_bool()) {
+                    frame->ip = target;
+                }
+                DISPATCH();
+            }
+            // NOTE: Loops and calls are the safe points, everything live is on the stack by then.
+            CASE(LOOP): {
+                frame->ip = frame->ip->target;
+                if (m_heap->should_collect()) {
+                    m_compiler->collect_garbage(nullptr);
+                }
+                // NOTE: Nothing that skips the interpreter's handlers can run while a recording is.
+                if (trace_enabled && !m_recorder.active) {
+                    enter_trace(frame);
+                }
+                if (!m_recorder.active) {
+                    ENTER_JIT();
+                }
+                DISPATCH();
+            }
+            CASE(CALL): {
+                const int arg_count = (int) READ_OPERAND();
+                if (m_heap->should_collect()) {
+                    m_compiler->collect_garbage(nullptr);
+                }
+                if (!call_value(peek(arg_count), arg_count)) {
+                    goto recover;
+                }
+                frame = &m_frames[m_frame_count - 1];
+                ENTER_JIT();
+                DISPATCH();
+            }
+            CASE(CLOSURE): {
+                FunctionObject* function = (FunctionObject*) READ_CONSTANT().as_object();
+                ClosureObject* closure = new_closure(m_heap, function);
+                push(object_value(closure));
+                for (int i = 0; i < closure->upvalue_count; ++i) {
+                    const u64 is_local = READ_OPERAND();
+                    const u64 index = READ_OPERAND();
+                    if (is_local) {
+                        closure->upvalues[i] = capture_upvalue(frame->slots + index);
+                    } else {
+                        closure->upvalues[i] = frame->closure->upvalues[index];
+                    }
+                }
+                DISPATCH();
+            }
+            CASE(RETURN): {
+                const Value result = pop();
+                close_upvalues(frame->slots);
+                m_frame_count -= 1;
+                if (m_frame_count == 0) {
+                    pop();
+                    return InterpretResult::OK;
+                }
+                if (m_compiler->profiler.is_running()) {
+                    m_compiler->profiler.exit();
+                }
+
+                m_stack_top = frame->slots;
+                push(result);
+                frame = &m_frames[m_frame_count - 1];
+                ENTER_JIT();
+                DISPATCH();
+            }
+            CASE(CLASS): {
+                push(object_value(new_class(m_heap, m_arena, READ_STRING())));
+                DISPATCH();
+            }
+            CASE(INHERIT): {
+                if (!is_object(peek(1), Object::Type::CLASS)) {
+                    RUNTIME_ERROR(CREATE_STRING("superclass must be a class."));
+                }
+                ClassObject* superclass = (ClassObject*) peek(1).as_object();
+                ClassObject* subclass = (ClassObject*) peek(0).as_object();
+
+                // NOTE: Members are copied down, so lookups never have to walk the superclass chain.
+                copy_map_entries(superclass->methods, subclass->methods);
+                copy_map_entries(superclass->field_slots, subclass->field_slots);
+                for (u64 i = 0; i < superclass->field_defaults.size(); ++i) {
+                    subclass->field_defaults.push(superclass->field_defaults[i]);
+                }
+                subclass->superclass = superclass;
+                subclass->initializer = superclass->initializer;
+                m_heap->remember(subclass);
+
+                pop();
+                DISPATCH();
+            }
+            CASE(METHOD): {
+                const String name = READ_STRING();
+                define_method(name, false);
+                DISPATCH();
+            }
+            CASE(STATIC_METHOD): {
+                const String name = READ_STRING();
+                define_method(name, true);
+                DISPATCH();
+            }
+            CASE(FIELD): {
+                const String name = READ_STRING();
+                const Value value = peek(0);
+                ClassObject* klass = (ClassObject*) peek(1).as_object();
+
+                u64* field_slot = klass->field_slots.get(name);
+                if (field_slot != nullptr) {
+                    m_heap->write_barrier(klass, klass->field_defaults[*field_slot], value);
+                    klass->field_defaults[*field_slot] = value;
+                } else {
+                    m_heap->write_barrier(klass, Value{}, value);
+                    const u64 new_slot = klass->field_defaults.size();
+                    klass->field_defaults.push(value);
+                    klass->field_slots.insert(name, new_slot);
+                }
+
+                pop();
+                DISPATCH();
+            }
+            REGISTER_BINARY_CASES(EQUAL)
+            REGISTER_BINARY_CASES(NOT_EQUAL)
+            REGISTER_BINARY_CASES(GREATER)
+            REGISTER_BINARY_CASES(GREATER_EQUAL)
+            REGISTER_BINARY_CASES(LESSER)
+            REGISTER_BINARY_CASES(LESSER_EQUAL)
+            REGISTER_BINARY_CASES(ADD)
+            REGISTER_BINARY_CASES(SUBTRACT)
+            REGISTER_BINARY_CASES(MULTIPLY)
+            REGISTER_BINARY_CASES(DIVIDE)
+            // NOTE: Runs in place of the instruction being recorded, which is put back for the
+            // dispatch below to run it, so it isn't counted twice.
+            CASE(RECORD): {
+                frame->ip -= 1;
+                m_instructions_executed -= 1;
+                record_instruction(frame);
+                DISPATCH();
+            }
+        }
+
+        // NOTE: Only ever reached through `RUNTIME_ERROR`, every handler above dispatches.
+    recover:
+        if (!recover()) {
+            return InterpretResult::RUNTIME_ERROR;
+        }
+        frame = &m_frames[m_frame_count - 1];
+        DISPATCH();
+    }
+
+#undef READ_OPERAND
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_TARGET
+#undef RUNTIME_ERROR
+#undef DISPATCH
+#undef CASE
+#undef BINARY_CASE
+#undef REGISTER_BINARY_CASE
+#undef REGISTER_BINARY_CASES
+#undef ENTER_JIT
+}
+
+void VM::define_method(String name, bool is_static) {
+    ClosureObject* method = (ClosureObject*) peek(0).as_object();
+    ClassObject* klass = (ClassObject*) peek(1).as_object();
+
+    HashMap<String, ClosureObject*, StringHasher>& methods = is_static ? klass->statics : klass->methods;
+    ClosureObject** existing = methods.get(name);
+    m_heap->write_barrier(klass, existing != nullptr ? *existing : nullptr, method);
+    methods.insert(name, method);
+    if (!is_static && name == CREATE_STRING("init")) {
+        m_heap->write_barrier(klass, klass->initializer, method);
+        klass->initializer = method;
+    }
+
+    pop();
+}
+
+bool VM::call_value(Value callee, int arg_count) {
+    if (callee.type() == Value::Type::OBJECT) {
+        switch (callee.as_object()->ty)
+        {
+            case Object::Type::CLOSURE: {
+                return call((ClosureObject*) callee.as_object(), arg_count);
+            }
+            case Object::Type::NATIVE: {
+                NativeObject* native = (NativeObject*) callee.as_object();
+                if (arg_count != native->arity) {
+                    runtime_error(CREATE_STRING("wrong number of arguments"));
+                    return false;
+                }
+
+                const Value result = native->function(m_heap, arg_count, m_stack_top - arg_count);
+                m_stack_top -= arg_count + 1;
+                push(result);
+                return true;
+            }
+            case Object::Type::CLASS: {
+                ClassObject* klass = (ClassObject*) callee.as_object();
+                m_stack_top[-arg_count - 1] = object_value(new_instance(m_heap, klass));
+                if (klass->initializer != nullptr) {
+                    return call(klass->initializer, arg_count);
+                }
+                if (arg_count != 0) {
+                    runtime_error(CREATE_STRING("wrong number of arguments"));
+                    return false;
+                }
+                return true;
+            }
+            case Object::Type::BOUND_METHOD: {
+                BoundMethodObject* bound = (BoundMethodObject*) callee.as_object();
+                m_stack_top[-arg_count - 1] = bound->receiver;
+                return call(bound->method, arg_count);
+            }
+            default: {
+                break;
+            }
+        }
+    }
+
+    runtime_error(CREATE_STRING("invalid function identifier"));
+    return false;
+}
+
+bool VM::call(ClosureObject* closure, int arg_count) {
+    if (arg_count != closure->function->arity) {
+        runtime_error(CREATE_STRING("wrong number of arguments"));
+        return false;
+    }
+    if (m_frame_count == VM_FRAMES_MAX) {
+        runtime_error(CREATE_STRING("Stack overflow"));
+        // NOTE: Same as the tree walker, this stops the program, see `KauCompiler::stack_overflowed`.
+        m_compiler->stack_overflowed = true;
+        return false;
+    }
+
+    // NOTE: The script itself is the profiler's root, only calls made from it get a frame.
+    if (m_frame_count > 0 && m_compiler->profiler.is_running()) {
+        const CallFrame& caller = m_frames[m_frame_count - 1];
+        const ThreadedCode& code = caller.closure->function->threaded;
+        m_compiler->profiler.enter(closure->function->name, code.lines[caller.ip - code.code.m_head - 1]);
+    }
+
+    FunctionObject* function = closure->function;
+    if (function->threaded.code.size() == 0) {
+        thread_function(m_arena, function, m_handlers);
+    }
+    if (jit_enabled && ++function->call_count == JIT_CALL_THRESHOLD) {
+        function->jit = jit_compile(m_arena, function);
+        if (function->jit != nullptr) {
+            m_jit_code.push(function->jit);
+            m_compiler->stats.jit_functions += 1;
+            m_compiler->stats.jit_code_bytes += function->jit->size;
+        }
+    }
+
+    CallFrame* frame = &m_frames[m_frame_count++];
+    frame->closure = closure;
+    frame->ip = function->threaded.code.m_head;
+    frame->slots = m_stack_top - arg_count - 1;
+    return true;
+}
+
+void VM::enter_jit(CallFrame* frame) {
+    const JitCode* jit = frame->closure->function->jit;
+    const void* target = jit->entries[frame->ip - frame->closure->function->threaded.code.m_head];
+    if (target == nullptr) {
+        return;
+    }
+
+    JitContext context = {
+        .stack_top = m_stack_top,
+        .globals = m_globals.m_head,
+        .heap = m_heap,
+        .guard_exits = 0,
+    };
+    frame->ip = jit->enter(&context, frame->slots, target);
+    m_stack_top = context.stack_top;
+
+    m_compiler->stats.jit_entries += 1;
+    m_compiler->stats.jit_guard_exits += context.guard_exits;
+}
+
+void VM::enter_trace(CallFrame* frame) {
+    FunctionObject* function = frame->closure->function;
+    if (function->trace_anchors == nullptr) {
+        function->trace_anchors = (TraceAnchor*) m_arena->push_array<TraceAnchor>(function->threaded.code.size());
+    }
+    const u64 word = frame->ip - function->threaded.code.m_head;
+    TraceAnchor& anchor = function->trace_anchors[word];
+
+    Trace* trace = anchor.trace;
+    if (trace == nullptr) {
+        if (anchor.aborts < TRACE_MAX_ABORTS && ++anchor.hotness >= TRACE_HOT_LOOP_THRESHOLD) {
+            m_recorder.start(m_trace_arena, function, word, frame->slots, (u32) (m_stack_top - frame->slots), m_record_word);
+        }
+        return;
+    }
+
+    JitContext context = {
+        .stack_top = m_stack_top,
+        .globals = m_globals.m_head,
+        .heap = m_heap,
+        .guard_exits = 0,
+    };
+    frame->ip = trace->jit->enter(&context, frame->slots, trace->jit->entries[0]);
+    m_stack_top = context.stack_top;
+
+    trace->entries += 1;
+    m_compiler->stats.trace_entries += 1;
+    m_compiler->stats.trace_side_exits += context.guard_exits;
+}
+
+void VM::record_instruction(CallFrame* frame) {
+    // NOTE: Only calls and returns get to another frame, and both abort before they run.
+    assert(frame->slots == m_recorder.slots);
+    const TraceStep step = m_recorder.record(frame->ip, m_stack_top, m_globals.m_head);
+    if (step == TraceStep::RECORDED) {
+        return;
+    }
+
+    m_recorder.stop();
+    FunctionObject* function = m_recorder.function;
+    TraceAnchor& anchor = function->trace_anchors[m_recorder.anchor];
+    const int line = function->threaded.lines[m_recorder.anchor];
+    anchor.hotness = 0;
+
+    String reason = m_recorder.abort_reason;
+    Trace* trace = nullptr;
+    if (step == TraceStep::DONE) {
+        trace = m_recorder.finish(m_arena, line);
+        if (!optimize_trace(trace)) {
+            reason = CREATE_STRING("stack doesn't balance");
+            trace = nullptr;
+        } else {
+            trace->jit = jit_compile_trace(m_arena, trace);
+            if (trace->jit == nullptr) {
+                reason = CREATE_STRING("couldn't be compiled");
+                trace = nullptr;
+            }
+        }
+        // NOTE: Recording the same path again would go the same way.
+        if (trace == nullptr) {
+            anchor.aborts = TRACE_MAX_ABORTS;
+        }
+    }
+
+    if (trace == nullptr) {
+        anchor.aborts += 1;
+        m_compiler->stats.traces_aborted += 1;
+        m_trace_events.push(TraceEvent{ function->name, line, nullptr, reason });
+        return;
+    }
+
+    anchor.trace = trace;
+    m_traces.push(trace);
+    m_jit_code.push(trace->jit);
+    m_compiler->stats.traces_compiled += 1;
+    m_trace_events.push(TraceEvent{ function->name, line, trace, String{} });
+}
+
+void VM::print_traces(FILE* file) const {
+    print_trace_report(file, m_trace_events);
+}
+
+bool VM::bind_method(ClassObject* klass, String name) {
+    ClosureObject** method = klass->methods.get(name);
+    if (method == nullptr) {
+        return false;
+    }
+
+    BoundMethodObject* bound = new_bound_method(m_heap, peek(0), *method);
+    pop();
+    push(object_value(bound));
+    return true;
+}
+
+UpvalueObject* VM::capture_upvalue(Value* local) {
+    UpvalueObject* prev = nullptr;
+    UpvalueObject* upvalue = m_open_upvalues;
+    while (upvalue != nullptr && upvalue->location > local) {
+        prev = upvalue;
+        upvalue = upvalue->next;
+    }
+
+    if (upvalue != nullptr && upvalue->location == local) {
+        return upvalue;
+    }
+
+    UpvalueObject* created = new_upvalue(m_heap, local);
+    created->next = upvalue;
+    if (prev == nullptr) {
+        m_open_upvalues = created;
+    } else {
+        m_heap->write_barrier(prev, prev->next, created);
+        prev->next = created;
+    }
+    return created;
+}
+
+void VM::close_upvalues(Value* last) {
+    while (m_open_upvalues != nullptr && m_open_upvalues->location >= last) {
+        UpvalueObject* upvalue = m_open_upvalues;
+        m_heap->write_barrier(upvalue, Value{}, *upvalue->location);
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        m_open_upvalues = upvalue->next;
+        m_heap->write_barrier(upvalue, upvalue->next, nullptr);
+        upvalue->next = nullptr;
+    }
+}
+
+void VM::push(Value value) {
+    *m_stack_top = value;
+    ++m_stack_top;
+}
+
+Value VM::pop() {
+    --m_stack_top;
+    return *m_stack_top;
+}
+
+Value VM::peek(int distance) const {
+    return m_stack_top[-1 - distance];
+}
+
+void VM::runtime_error(String message) {
+    const CallFrame& frame = m_frames[m_frame_count - 1];
+    const ThreadedCode& code = frame.closure->function->threaded;
+    const u64 word = frame.ip - code.code.m_head - 1;
+    m_compiler->runtime_error(code.lines[word], message);
+}
+
+bool VM::recover() {
+    if (m_frame_count > 0 && !m_compiler->stack_overflowed) {
+        CallFrame* frame = &m_frames[m_frame_count - 1];
+        const ThreadedCode& code = frame->closure->function->threaded;
+        const u64 word = frame->ip - code.code.m_head - 1;
+        for (u64 i = 0; i < code.recoveries.size(); ++i) {
+            const Recovery& recovery = code.recoveries[i];
+            if (word < recovery.start || word >= recovery.end) {
+                continue;
+            }
+
+            Value* top = frame->slots + recovery.depth;
+            close_upvalues(top);
+            m_stack_top = top;
+            if (recovery.push_nil) {
+                push(Value{});
+            }
+            frame->ip = code.code.m_head + recovery.resume;
+            // NOTE: The recording would go on from somewhere else than the instruction it has last,
+            // so it starts over once the loop is hot again.
+            if (m_recorder.active) {
+                m_recorder.stop();
+                m_recorder.function->trace_anchors[m_recorder.anchor].hotness = 0;
+            }
+            return true;
+        }
+    }
+
+    m_stack_top = m_stack;
+    m_frame_count = 0;
+    m_open_upvalues = nullptr;
+
+    if (m_compiler->profiler.is_running()) {
+        m_compiler->profiler.unwind();
+    }
+    return false;
+}
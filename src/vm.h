@@ -0,0 +1,127 @@
+#pragma once
+
+#include "lib/arena.h"
+#include "lib/array.h"
+#include "lib/hash_map.h"
+#include "lib/string.h"
+
+#include "bytecode.h"
+#include "environment.h"
+#include "trace.h"
+
+#include <stdio.h>
+
+// NOTE: As deep as the tree walker's frame stack, so every backend runs the same programs.
+#define VM_FRAMES_MAX FRAME_STACK_FRAMES_MAX
+#define VM_STACK_MAX (VM_FRAMES_MAX * 256)
+
+// Labels as values are a GCC and Clang extension, elsewhere the VM dispatches with a switch.
+#ifndef KAU_COMPUTED_GOTO
+#define KAU_COMPUTED_GOTO 0
+#endif
+
+struct CallFrame {
+    ClosureObject* closure;
+    ThreadedWord* ip;
+    Value* slots;
+};
+
+struct GlobalSlot {
+    String name;
+    Value value;
+    bool defined;
+};
+
+enum class InterpretResult {
+    OK,
+    COMPILE_ERROR,
+    RUNTIME_ERROR,
+};
+
+struct KauCompiler;
+struct VM {
+    void init(Arena* arena);
+    // Unmaps every function's machine code.
+    void release();
+
+    InterpretResult interpret(KauCompiler* compiler, Array<Stmt> stmts, bool from_prompt, BytecodeForm form);
+
+    // Globals are bound to a slot at compile time, so the VM never looks them up by name.
+    u16 global_slot(String name);
+    void define_native(String name, int arity, NativeFn function);
+
+    // The stack, every frame's closure, open upvalues and globals.
+    void visit_roots(Heap* heap);
+
+    // Compiles functions called often enough to machine code, see `JitCode`.
+    bool jit_enabled = false;
+    // Records and compiles the paths hot loops take, see `Trace`.
+    bool trace_enabled = false;
+
+    // Every trace compiled and every recording given up on, with how often each trace exited where.
+    void print_traces(FILE* file) const;
+
+private:
+    // Runs `script`, which is already on the stack.
+    InterpretResult run(ClosureObject* script);
+
+    bool call_value(Value callee, int arg_count);
+    bool call(ClosureObject* closure, int arg_count);
+    bool bind_method(ClassObject* klass, String name);
+    // Pops the method on top of the stack into the class under it.
+    void define_method(String name, bool is_static);
+
+    // Runs `frame`'s machine code from its `ip`, if it has any there.
+    void enter_jit(CallFrame* frame);
+    // At a loop header `frame` just jumped back to: runs its trace if it has one, or starts
+    // recording one once the loop is hot enough.
+    void enter_trace(CallFrame* frame);
+    // Hands the instruction at `frame`'s `ip` to the recorder, before it runs, and compiles the
+    // trace once the recording is done.
+    void record_instruction(CallFrame* frame);
+
+    UpvalueObject* capture_upvalue(Value* local);
+    void close_upvalues(Value* last);
+
+    void push(Value value);
+    Value pop();
+    Value peek(int distance) const;
+
+    // Reports an error in the instruction the innermost frame is running.
+    void runtime_error(String message);
+    // Goes on after an error with the statement after the one it happened in, or wherever
+    // else its `Recovery` says, in the innermost frame. Returns false, with every frame and
+    // value dropped, if nothing recovers from it, like a stack overflow.
+    bool recover();
+
+    Arena* m_arena;
+    Heap* m_heap = nullptr;
+    // Every opcode's handler in `run`, for `thread_function`. Null with switch dispatch.
+    const void* const* m_handlers = nullptr;
+    KauCompiler* m_compiler;
+
+    CallFrame* m_frames;
+    int m_frame_count = 0;
+
+    Value* m_stack;
+    Value* m_stack_top;
+
+    UpvalueObject* m_open_upvalues = nullptr;
+
+    // Instructions dispatched, across every run.
+    u64 m_instructions_executed = 0;
+
+    Array<GlobalSlot> m_globals;
+    HashMap<String, u16, StringHasher> m_global_slots;
+
+    Array<JitCode*> m_jit_code;
+
+    // What the threaded words of a function being recorded are swapped for, see `OpCode::RECORD`.
+    ThreadedWord m_record_word;
+    TraceRecorder m_recorder;
+    // Cleared every time a recording starts. Traces themselves go in `m_arena`.
+    Arena* m_trace_arena = nullptr;
+    // Their classes are roots, see `Trace::classes`.
+    Array<Trace*> m_traces;
+    Array<TraceEvent> m_trace_events;
+};